@@ -0,0 +1,362 @@
+/* Arrow IPC streaming format. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "error.h"
+#include "buffered_file.h"
+#include "capture.h"
+#include "columnar.h"
+
+#include "arrow_ipc.h"
+
+
+/* Values taken from the Arrow Message.fbs and Schema.fbs definitions. */
+#define METADATA_VERSION_V5             4
+#define MESSAGE_HEADER_SCHEMA           1
+#define MESSAGE_HEADER_RECORD_BATCH     3
+#define ENDIANNESS_LITTLE               0
+#define TYPE_INT                        2
+#define TYPE_FLOATING_POINT             3
+#define PRECISION_DOUBLE                2
+
+/* Every message starts with a continuation marker and the metadata length. */
+#define MESSAGE_PREFIX_LENGTH           8
+#define CONTINUATION_MARKER             0xFFFFFFFFU
+
+/* Upper bound on the space taken by a table of up to 8 fields, including its
+ * vtable and any alignment padding. */
+#define TABLE_MAX_LENGTH                64
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Flatbuffer writing. */
+
+/* Unlike the reference flatbuffer builder, which builds the buffer backwards,
+ * here every object is written before the objects it refers to, and each
+ * reference is patched as soon as its target has been written.  As all
+ * flatbuffer offsets point forwards this produces a valid buffer in a single
+ * pass without any intermediate storage. */
+
+struct flatbuffer {
+    void *data;
+    size_t length;
+};
+
+
+/* A single table field: either absent, a scalar of the given size, or an
+ * offset to be patched once the target is written. */
+struct fb_slot {
+    unsigned int size;
+    uint64_t value;
+};
+
+#define FB_ABSENT           { 0, 0 }
+#define FB_UINT8(value)     { 1, (uint8_t) (value) }
+#define FB_INT16(value)     { 2, (uint16_t) (value) }
+#define FB_INT32(value)     { 4, (uint32_t) (value) }
+#define FB_INT64(value)     { 8, (uint64_t) (value) }
+#define FB_OFFSET           { 4, 0 }
+
+
+/* Pads with zeros until length + offset is a multiple of alignment. */
+static void fb_pad(struct flatbuffer *fb, size_t alignment, size_t offset)
+{
+    size_t padding = (alignment - (fb->length + offset) % alignment) % alignment;
+    memset(fb->data + fb->length, 0, padding);
+    fb->length += padding;
+}
+
+
+static size_t fb_write(struct flatbuffer *fb, const void *data, size_t length)
+{
+    size_t position = fb->length;
+    memcpy(fb->data + position, data, length);
+    fb->length += length;
+    return position;
+}
+
+
+/* Points the offset at slot to the object at target. */
+static void fb_patch(struct flatbuffer *fb, size_t slot, size_t target)
+{
+    uint32_t offset = (uint32_t) (target - slot);
+    memcpy(fb->data + slot, &offset, sizeof(offset));
+}
+
+
+/* Writes a table preceded by its vtable, returns the position of the table.
+ * The position of each field is returned in positions[] so that offsets can be
+ * patched later. */
+static size_t fb_table(
+    struct flatbuffer *fb, unsigned int count, const struct fb_slot slots[],
+    size_t positions[])
+{
+    /* Lay out the fields after the vtable offset, each aligned to its size. */
+    uint16_t vtable[2 + count];
+    size_t table_length = 4;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        vtable[2 + i] = 0;
+        if (slots[i].size > 0)
+        {
+            table_length = (table_length + slots[i].size - 1) &
+                ~(size_t) (slots[i].size - 1);
+            vtable[2 + i] = (uint16_t) table_length;
+            table_length += slots[i].size;
+        }
+    }
+    vtable[0] = (uint16_t) sizeof(vtable);
+    vtable[1] = (uint16_t) table_length;
+
+    fb_pad(fb, 2, 0);
+    size_t vtable_position = fb_write(fb, vtable, sizeof(vtable));
+    fb_pad(fb, 8, 0);
+    size_t table = fb->length;
+    int32_t vtable_offset = (int32_t) (table - vtable_position);
+    memset(fb->data + table, 0, table_length);
+    memcpy(fb->data + table, &vtable_offset, sizeof(vtable_offset));
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        positions[i] = table + vtable[2 + i];
+        memcpy(fb->data + positions[i], &slots[i].value, slots[i].size);
+    }
+    fb->length += table_length;
+    return table;
+}
+
+
+static size_t fb_string(struct flatbuffer *fb, const char *string)
+{
+    uint32_t length = (uint32_t) strlen(string);
+    fb_pad(fb, 4, 0);
+    size_t position = fb_write(fb, &length, sizeof(length));
+    fb_write(fb, string, length + 1);
+    return position;
+}
+
+
+/* Writes a vector of count offsets, all to be patched.  Entry i is at
+ * position + 4 + 4*i. */
+static size_t fb_offset_vector(struct flatbuffer *fb, unsigned int count)
+{
+    fb_pad(fb, 4, 0);
+    size_t position = fb_write(fb, &count, sizeof(count));
+    memset(fb->data + fb->length, 0, 4 * count);
+    fb->length += 4 * count;
+    return position;
+}
+
+
+/* Writes a vector of structures, each of which is 8 byte aligned. */
+static size_t fb_struct_vector(
+    struct flatbuffer *fb, unsigned int count, const void *data, size_t size)
+{
+    fb_pad(fb, 8, 4);
+    size_t position = fb_write(fb, &count, sizeof(count));
+    fb_write(fb, data, count * size);
+    return position;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Messages. */
+
+
+/* Writes the root Message table and returns the position of its header offset
+ * to be patched. */
+static size_t start_message(
+    struct flatbuffer *fb, unsigned int header_type, size_t body_length)
+{
+    uint32_t root = 0;
+    size_t root_position = fb_write(fb, &root, sizeof(root));
+    struct fb_slot slots[] = {
+        FB_INT16(METADATA_VERSION_V5),
+        FB_UINT8(header_type),
+        FB_OFFSET,
+        FB_INT64(body_length),
+    };
+    size_t positions[ARRAY_SIZE(slots)];
+    fb_patch(fb, root_position,
+        fb_table(fb, ARRAY_SIZE(slots), slots, positions));
+    return positions[2];
+}
+
+
+/* Pads the metadata and writes the message prefix in front of it, returns the
+ * length of the message so far. */
+static size_t finish_message(void *output, struct flatbuffer *fb)
+{
+    fb_pad(fb, 8, 0);
+    uint32_t prefix[2] = { CONTINUATION_MARKER, (uint32_t) fb->length, };
+    memcpy(output, prefix, sizeof(prefix));
+    return sizeof(prefix) + fb->length;
+}
+
+
+/* Writes a vector of KeyValue tables and points slot at it. */
+static void write_key_values(
+    struct flatbuffer *fb, size_t slot,
+    const struct arrow_key_value key_values[], unsigned int count)
+{
+    size_t vector = fb_offset_vector(fb, count);
+    fb_patch(fb, slot, vector);
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        struct fb_slot slots[] = { FB_OFFSET, FB_OFFSET, };
+        size_t positions[ARRAY_SIZE(slots)];
+        fb_patch(fb, vector + 4 + 4 * i,
+            fb_table(fb, ARRAY_SIZE(slots), slots, positions));
+        fb_patch(fb, positions[0], fb_string(fb, key_values[i].key));
+        fb_patch(fb, positions[1], fb_string(fb, key_values[i].value));
+    }
+}
+
+
+/* Writes the Int or FloatingPoint table describing the given type. */
+static size_t write_type(struct flatbuffer *fb, enum field_type type)
+{
+    size_t positions[2];
+    switch (type)
+    {
+        case FIELD_TYPE_DOUBLE:
+        {
+            struct fb_slot slots[] = { FB_INT16(PRECISION_DOUBLE), };
+            return fb_table(fb, ARRAY_SIZE(slots), slots, positions);
+        }
+        default:
+        {
+            struct fb_slot slots[] = {
+                FB_INT32(8 * FIELD_TYPE_WIDTH(type)),
+                FB_UINT8(type != FIELD_TYPE_UINT32),
+            };
+            return fb_table(fb, ARRAY_SIZE(slots), slots, positions);
+        }
+    }
+}
+
+
+static size_t write_field(struct flatbuffer *fb, const struct arrow_field *field)
+{
+    struct fb_slot slots[] = {
+        FB_OFFSET,              // name
+        FB_UINT8(false),        // nullable
+        FB_UINT8(field->type == FIELD_TYPE_DOUBLE ?
+            TYPE_FLOATING_POINT : TYPE_INT),    // type_type
+        FB_OFFSET,              // type
+        FB_ABSENT,              // dictionary
+        FB_OFFSET,              // children
+        FB_OFFSET,              // custom_metadata
+    };
+    size_t positions[ARRAY_SIZE(slots)];
+    size_t table = fb_table(fb, ARRAY_SIZE(slots), slots, positions);
+    fb_patch(fb, positions[0], fb_string(fb, field->name));
+    fb_patch(fb, positions[3], write_type(fb, field->type));
+    fb_patch(fb, positions[5], fb_offset_vector(fb, 0));
+    write_key_values(fb, positions[6], field->metadata, field->metadata_count);
+    return table;
+}
+
+
+static size_t key_values_max_length(
+    const struct arrow_key_value key_values[], unsigned int count)
+{
+    size_t length = 8 + 4 * count;
+    for (unsigned int i = 0; i < count; i ++)
+        length += TABLE_MAX_LENGTH +
+            strlen(key_values[i].key) + strlen(key_values[i].value) + 16;
+    return length;
+}
+
+
+size_t arrow_schema_max_length(
+    const struct arrow_field fields[], unsigned int field_count,
+    const struct arrow_key_value metadata[], unsigned int metadata_count)
+{
+    size_t length = MESSAGE_PREFIX_LENGTH + 4 + 2 * TABLE_MAX_LENGTH +
+        8 + 4 * field_count + key_values_max_length(metadata, metadata_count);
+    for (unsigned int i = 0; i < field_count; i ++)
+        length += 2 * TABLE_MAX_LENGTH + strlen(fields[i].name) + 8 + 8 +
+            key_values_max_length(
+                fields[i].metadata, fields[i].metadata_count);
+    return length + 8;
+}
+
+
+size_t arrow_encode_schema(
+    const struct arrow_field fields[], unsigned int field_count,
+    const struct arrow_key_value metadata[], unsigned int metadata_count,
+    void *output)
+{
+    struct flatbuffer fb = { .data = output + MESSAGE_PREFIX_LENGTH, };
+    size_t header = start_message(&fb, MESSAGE_HEADER_SCHEMA, 0);
+
+    struct fb_slot slots[] = {
+        FB_INT16(ENDIANNESS_LITTLE),    // endianness
+        FB_OFFSET,                      // fields
+        FB_OFFSET,                      // custom_metadata
+    };
+    size_t positions[ARRAY_SIZE(slots)];
+    fb_patch(&fb, header, fb_table(&fb, ARRAY_SIZE(slots), slots, positions));
+
+    size_t vector = fb_offset_vector(&fb, field_count);
+    fb_patch(&fb, positions[1], vector);
+    for (unsigned int i = 0; i < field_count; i ++)
+        fb_patch(&fb, vector + 4 + 4 * i, write_field(&fb, &fields[i]));
+    write_key_values(&fb, positions[2], metadata, metadata_count);
+
+    return finish_message(output, &fb);
+}
+
+
+size_t arrow_encode_record_batch(
+    const enum field_type types[], unsigned int field_count,
+    unsigned int sample_count, const void *input, void *output)
+{
+    /* Each column has an empty validity buffer followed by its values. */
+    struct field_node { int64_t length; int64_t null_count; };
+    struct buffer { int64_t offset; int64_t length; };
+    struct field_node nodes[field_count];
+    struct buffer buffers[2 * field_count];
+    size_t body_length = 0;
+    for (unsigned int i = 0; i < field_count; i ++)
+    {
+        nodes[i] = (struct field_node) { sample_count, 0 };
+        buffers[2*i] = (struct buffer) { (int64_t) body_length, 0 };
+        buffers[2*i + 1] = (struct buffer) {
+            (int64_t) body_length,
+            sample_count * FIELD_TYPE_WIDTH(types[i]) };
+        body_length += COLUMN_LENGTH(types[i], sample_count);
+    }
+
+    struct flatbuffer fb = { .data = output + MESSAGE_PREFIX_LENGTH, };
+    size_t header =
+        start_message(&fb, MESSAGE_HEADER_RECORD_BATCH, body_length);
+    struct fb_slot slots[] = {
+        FB_INT64(sample_count),     // length
+        FB_OFFSET,                  // nodes
+        FB_OFFSET,                  // buffers
+    };
+    size_t positions[ARRAY_SIZE(slots)];
+    fb_patch(&fb, header, fb_table(&fb, ARRAY_SIZE(slots), slots, positions));
+    fb_patch(&fb, positions[1], fb_struct_vector(
+        &fb, field_count, nodes, sizeof(struct field_node)));
+    fb_patch(&fb, positions[2], fb_struct_vector(
+        &fb, 2 * field_count, buffers, sizeof(struct buffer)));
+
+    size_t length = finish_message(output, &fb);
+    return length + transpose_samples(
+        types, field_count, sample_count, input, output + length);
+}
+
+
+size_t arrow_encode_end_of_stream(void *output)
+{
+    uint32_t marker[2] = { CONTINUATION_MARKER, 0, };
+    memcpy(output, marker, sizeof(marker));
+    return sizeof(marker);
+}
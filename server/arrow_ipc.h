@@ -0,0 +1,65 @@
+/* Arrow IPC streaming format.
+ *
+ * A stream consists of a schema message followed by any number of record batch
+ * messages and terminated by an end of stream marker.  Each message is written
+ * as a continuation marker (0xFFFFFFFF), the length of the message metadata,
+ * the metadata as a flatbuffer, and finally the message body.  The metadata
+ * and body are both padded to a multiple of 8 bytes.
+ *
+ * Every field is written as a non nullable column with no validity bitmap, so
+ * each record batch body is just the transposed columns, see columnar.h. */
+
+/* A single key value metadata pair. */
+struct arrow_key_value {
+    const char *key;
+    const char *value;
+};
+
+/* Description of a single column of the schema. */
+struct arrow_field {
+    const char *name;
+    enum field_type type;
+    unsigned int metadata_count;
+    const struct arrow_key_value *metadata;
+};
+
+
+/* Returns an upper bound on the length of the schema message for the given
+ * fields and schema metadata. */
+size_t arrow_schema_max_length(
+    const struct arrow_field fields[], unsigned int field_count,
+    const struct arrow_key_value metadata[], unsigned int metadata_count);
+
+/* Writes the schema message for the given fields to output, which must be 8
+ * byte aligned, returning the number of bytes written. */
+size_t arrow_encode_schema(
+    const struct arrow_field fields[], unsigned int field_count,
+    const struct arrow_key_value metadata[], unsigned int metadata_count,
+    void *output);
+
+
+/* Upper bound on the metadata length of a record batch message. */
+#define ARROW_BATCH_METADATA_MAX_LENGTH(field_count) \
+    (256 + 48 * (field_count))
+
+/* Maximum length of a record batch message of sample_count samples, each
+ * sample_length bytes long and made of field_count fields. */
+#define ARROW_BATCH_MAX_LENGTH(field_count, sample_count, sample_length) \
+    (ARROW_BATCH_METADATA_MAX_LENGTH(field_count) + \
+     8 * (field_count) + (sample_count) * (sample_length))
+
+/* Writes a record batch message containing sample_count samples, each made of
+ * field_count fields of the given types, to output, which must be 8 byte
+ * aligned and have room for ARROW_BATCH_MAX_LENGTH bytes.  Returns the number
+ * of bytes written. */
+size_t arrow_encode_record_batch(
+    const enum field_type types[], unsigned int field_count,
+    unsigned int sample_count, const void *input, void *output);
+
+
+/* Length of the end of stream marker. */
+#define ARROW_END_OF_STREAM_LENGTH  8
+
+/* Writes the end of stream marker to output, returns number of bytes
+ * written. */
+size_t arrow_encode_end_of_stream(void *output);
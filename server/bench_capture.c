@@ -0,0 +1,719 @@
+/* Capture pipeline benchmark.
+ *
+ * Runs the complete data capture path of the server, from the capture buffer
+ * through data conversion to the data socket, against synthetic hardware which
+ * generates data as fast as it can be taken.  The configuration and data
+ * interfaces are driven over socket pairs, so no network or simulation server
+ * is involved.
+ *
+ * Each requested data mode is run in turn with the given number of readers, and
+ * one line of results is printed for each mode. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "error.h"
+#include "hardware.h"
+#include "parse.h"
+#include "buffered_file.h"
+#include "config_server.h"
+#include "data_server.h"
+#include "database.h"
+#include "system_command.h"
+#include "attributes.h"
+#include "fields.h"
+#include "output.h"
+#include "time.h"
+#include "base64.h"
+#include "metadata.h"
+#include "extension.h"
+#include "capture.h"
+#include "worker_pool.h"
+#include "locking.h"
+
+#include "sim_hardware.h"
+
+
+#define MAX_READERS         64
+#define MAX_MODES           64
+#define MAX_CAPTURES        64
+
+/* Receive buffer for each data reader. */
+#define READ_BUFFER_SIZE    (1U << 20)
+
+/* How long to wait for the server to become ready between runs. */
+#define READY_POLL_US       1000
+#define READY_POLL_COUNT    10000
+
+/* Data is withheld for this long after arming so that all readers have opened
+ * the capture buffer before data starts to arrive. */
+#define ARM_SETTLE_NS       20000000
+
+
+/* Benchmark settings. */
+static const char *config_dir;
+static unsigned int buffer_block_size = 1U << 20;
+static unsigned int buffer_block_count = 64;
+static uint64_t sample_count = 1000000;
+static unsigned int reader_count = 1;
+static unsigned int read_size = 0;          // Defaults to block size
+static unsigned int conversion_workers = 0;
+static unsigned int extension_port = 0;
+
+static unsigned int mode_count = 0;
+static const char *modes[MAX_MODES];
+static unsigned int capture_count = 0;
+static const char *captures[MAX_CAPTURES];
+
+
+/* Default field layout: a selection of the common capture modes. */
+static const char *default_captures[] = {
+    "PCAP.TS_CAPTURE.CAPTURE=Value",
+    "PCAP.SAMPLES.CAPTURE=Value",
+    "PCAP.BITS0.CAPTURE=Value",
+    "INENC1.VAL.CAPTURE=Value",
+    "INENC2.VAL.CAPTURE=Mean",
+    "COUNTER1.OUT.CAPTURE=Diff",
+    "ADC1.OUT.CAPTURE=Min Max Mean",
+};
+
+/* By default every data format is run with every data process. */
+static const char *default_formats[] = {
+    "UNFRAMED", "FRAMED", "BASE64", "ASCII", "COMPRESSED", "COLUMNAR", "ARROW",
+};
+static const char *default_processes[] = { "RAW", "UNSCALED", "SCALED", };
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Synthetic hardware. */
+
+/* The data stream is made from repeated copies of a block of whole samples,
+ * each 32-bit word slowly changing from sample to sample. */
+static void *pattern;
+static size_t pattern_length;
+static uint64_t stream_remaining;
+
+/* Time of arming and of the first data returned, the benchmark is timed from
+ * the arrival of the first data. */
+static uint64_t arm_time_ns;
+static uint64_t first_data_ns;
+
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1000000000 * (uint64_t) now.tv_sec + (uint64_t) now.tv_nsec;
+}
+
+
+void hw_write_register(
+    unsigned int block_base, unsigned int block_number, unsigned int reg,
+    uint32_t value)
+{
+}
+
+
+uint32_t hw_read_register(
+    unsigned int block_base, unsigned int block_number, unsigned int reg)
+{
+    return 0;
+}
+
+
+void hw_read_registers(
+    const struct hw_register registers[], unsigned int count,
+    uint32_t values[])
+{
+    memset(values, 0, sizeof(uint32_t) * count);
+}
+
+
+void hw_write_registers(
+    const struct hw_register registers[], unsigned int count,
+    const uint32_t values[])
+{
+}
+
+
+/* Called on arm once the capture has been prepared, so we can size the data
+ * stream for the capture. */
+void sim_write_arm_streamed_data(void)
+{
+    const struct captured_fields *fields;
+    const struct data_capture *capture;
+    get_capture_description(&fields, &capture);
+    size_t sample_length = get_raw_sample_length(capture);
+
+    size_t samples = MAX(read_size / sample_length, (size_t) 1);
+    pattern_length = samples * sample_length;
+    free(pattern);
+    pattern = malloc(pattern_length);
+    uint32_t *words = pattern;
+    size_t sample_words = sample_length / sizeof(uint32_t);
+    for (size_t i = 0; i < samples; i ++)
+        for (size_t j = 0; j < sample_words; j ++)
+            words[i * sample_words + j] = (uint32_t) (i * (j + 1));
+
+    stream_remaining = sample_count * sample_length;
+    __atomic_store_n(&first_data_ns, 0, __ATOMIC_RELAXED);
+    arm_time_ns = get_time_ns();
+}
+
+
+size_t sim_read_streamed_data(void *buffer, size_t length, bool *data_end)
+{
+    *data_end = false;
+    if (__atomic_load_n(&first_data_ns, __ATOMIC_RELAXED) == 0)
+    {
+        uint64_t now = get_time_ns();
+        if (now - arm_time_ns < ARM_SETTLE_NS)
+        {
+            usleep(READY_POLL_US);
+            return 0;
+        }
+        __atomic_store_n(&first_data_ns, now, __ATOMIC_RELAXED);
+    }
+
+    size_t count = (size_t) MIN(MIN(length, pattern_length), stream_remaining);
+    memcpy(buffer, pattern, count);
+    stream_remaining -= count;
+    *data_end = count == 0;
+    return count;
+}
+
+
+unsigned int sim_read_streamed_completion(void)
+{
+    return 0;
+}
+
+
+error__t hw_long_table_allocate(
+    unsigned int block_base, unsigned int number,
+    unsigned int base_reg, unsigned int length_reg,
+    unsigned int order,
+    size_t *block_size, uint32_t **data, int *block_id)
+{
+    *block_size = 4096U << order;
+    *data = malloc(*block_size);
+    *block_id = 0;
+    return ERROR_OK;
+}
+
+
+void hw_long_table_release(int block_id)
+{
+}
+
+
+void hw_long_table_write(
+    int block_id, const void *data, size_t length, size_t offset)
+{
+}
+
+
+error__t initialise_hardware(void)
+{
+    return ERROR_OK;
+}
+
+
+void terminate_hardware(void)
+{
+    free(pattern);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Server connections. */
+
+/* Server side of a connection: runs the given server process on its socket
+ * until the client end closes. */
+struct server_session {
+    pthread_t thread;
+    int sock;
+    error__t (*process)(int sock);
+};
+
+/* Data connections are handed over to the data server, which tells us as each
+ * one closes. */
+static pthread_mutex_t closed_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t closed_signal = PTHREAD_COND_INITIALIZER;
+static unsigned int closed_count;
+
+/* Client side of a data connection. */
+struct data_reader {
+    pthread_t thread;
+    int sock;
+    uint64_t bytes;
+    bool ok;
+};
+
+static struct buffered_file *config_file;
+
+
+static void *server_thread(void *context)
+{
+    struct server_session *session = context;
+    ERROR_REPORT(session->process(session->sock), "Server session failed");
+    close(session->sock);
+    return NULL;
+}
+
+
+static void data_session_closed(void *context, error__t error)
+{
+    int *sock = context;
+    ERROR_REPORT(error, "Server session failed");
+    close(*sock);
+    LOCK(closed_mutex);
+    closed_count += 1;
+    SIGNAL(closed_signal);
+    UNLOCK(closed_mutex);
+}
+
+
+/* Opens a data connection to the server, returning our end of the connection.
+ * The server end is closed by data_session_closed(). */
+static error__t open_data_session(int *server_sock, int *sock)
+{
+    int pair[2];
+    return
+        TEST_IO(socketpair(AF_UNIX, SOCK_STREAM, 0, pair))  ?:
+        DO(*server_sock = pair[1]; *sock = pair[0])  ?:
+        TRY_CATCH(
+            add_data_connection(pair[1], data_session_closed, server_sock),
+        //catch
+            close(pair[1]));
+}
+
+
+/* Opens a connection to the server, returning our end of the connection. */
+static error__t open_session(
+    struct server_session *session, error__t (*process)(int sock), int *sock)
+{
+    int pair[2];
+    session->process = process;
+    return
+        TEST_IO(socketpair(AF_UNIX, SOCK_STREAM, 0, pair))  ?:
+        DO(session->sock = pair[1]; *sock = pair[0])  ?:
+        TEST_PTHREAD(pthread_create(
+            &session->thread, NULL, server_thread, session));
+}
+
+
+static void copy_line(char response[], size_t length, const char *line)
+{
+    size_t line_length = MIN(strlen(line), length - 1);
+    memcpy(response, line, line_length);
+    response[line_length] = '\0';
+}
+
+
+/* Sends a configuration command and returns the first line of the response.
+ * For a multi-line response the line starting with select is returned instead,
+ * if given, and all other lines are discarded. */
+static error__t config_command(
+    const char *select, char response[], size_t length,
+    const char *format, ...)
+{
+    char command[MAX_LINE_LENGTH];
+    va_list args;
+    va_start(args, format);
+    size_t command_length =
+        (size_t) vsnprintf(command, sizeof(command), format, args);
+    va_end(args);
+
+    char line[MAX_LINE_LENGTH];
+    error__t error =
+        TEST_OK_(write_string(config_file, command, command_length)  &&
+            write_string(config_file, "\n", 1)  &&
+            read_line(config_file, line, sizeof(line), true),
+            "Server configuration connection failed")  ?:
+        TEST_OK_(strncmp(line, "ERR", 3) != 0, "%s: %s", command, line);
+    if (!error)
+        copy_line(response, length, line);
+    while (!error  &&  line[0] == '!')
+    {
+        error = TEST_OK_(read_line(config_file, line, sizeof(line), false),
+            "Server configuration connection failed");
+        if (!error  &&  select  &&
+                strncmp(line + 1, select, strlen(select)) == 0)
+            copy_line(response, length, line + 1);
+    }
+    return error;
+}
+
+
+/* Returns the count of data streams overrun so far. */
+static error__t read_overrun_count(uint64_t *count)
+{
+    char errors[MAX_RESULT_LENGTH];
+    return
+        config_command("ERRORS ", errors, sizeof(errors), "*PCAP.STATS?")  ?:
+        TEST_OK_(sscanf(errors, "ERRORS %"SCNu64, count) == 1,
+            "Malformed statistics");
+}
+
+
+/* Polls *PCAP.STATUS? until the given number of readers are connected and the
+ * previous capture is complete. */
+static error__t wait_for_server_ready(unsigned int readers)
+{
+    error__t error = ERROR_OK;
+    for (unsigned int i = 0; !error  &&  i < READY_POLL_COUNT; i ++)
+    {
+        char status[MAX_RESULT_LENGTH], completion[MAX_RESULT_LENGTH];
+        char expected[MAX_RESULT_LENGTH];
+        /* The status ends with the capture generation, which we ignore. */
+        int length = snprintf(
+            expected, sizeof(expected), "OK =Idle %u 0 ", readers);
+        error =
+            config_command(NULL, status, sizeof(status), "*PCAP.STATUS?")  ?:
+            config_command(NULL, completion, sizeof(completion),
+                "*PCAP.COMPLETION?");
+        if (!error  &&  strncmp(status, expected, (size_t) length) == 0  &&
+                strcmp(completion, "OK =Busy") != 0)
+            return ERROR_OK;
+        usleep(READY_POLL_US);
+    }
+    return error  ?:  FAIL_("Timed out waiting for server");
+}
+
+
+static void *reader_thread(void *context)
+{
+    struct data_reader *reader = context;
+    char *buffer = malloc(READ_BUFFER_SIZE);
+    ssize_t received;
+    while (received = read(reader->sock, buffer, READ_BUFFER_SIZE),
+           received > 0)
+        reader->bytes += (uint64_t) received;
+    reader->ok = received == 0;
+    free(buffer);
+    return NULL;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Benchmark runs. */
+
+
+static double get_cpu_time(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return
+        (double) usage.ru_utime.tv_sec + 1e-6 * (double) usage.ru_utime.tv_usec +
+        (double) usage.ru_stime.tv_sec + 1e-6 * (double) usage.ru_stime.tv_usec;
+}
+
+
+/* Runs a single capture with all readers requesting the given mode and prints
+ * the results. */
+static error__t run_mode(const char *mode)
+{
+    int server_socks[reader_count];
+    struct data_reader readers[reader_count];
+    char response[MAX_RESULT_LENGTH];
+    unsigned int started = 0;
+    unsigned int added = 0;
+    error__t error = ERROR_OK;
+    for (; !error  &&  started < reader_count; started ++)
+    {
+        struct data_reader *reader = &readers[started];
+        *reader = (struct data_reader) { };
+        char request[MAX_LINE_LENGTH];
+        int length = snprintf(request, sizeof(request), "%s ONE_SHOT\n", mode);
+        error =
+            open_data_session(&server_socks[started], &reader->sock)  ?:
+            DO(added += 1)  ?:
+            TEST_IO(write(reader->sock, request, (size_t) length))  ?:
+            TEST_PTHREAD(pthread_create(
+                &reader->thread, NULL, reader_thread, reader));
+    }
+
+    double cpu_start = 0;
+    uint64_t overruns_start = 0;
+    error = error  ?:
+        wait_for_server_ready(reader_count)  ?:
+        read_overrun_count(&overruns_start)  ?:
+        DO(cpu_start = get_cpu_time())  ?:
+        config_command(NULL, response, sizeof(response), "*PCAP.ARM=");
+
+    /* Whatever happened we need to wait for all the readers.  If arming failed
+     * we close the reader sockets to release them. */
+    uint64_t bytes = 0;
+    bool ok = !error;
+    for (unsigned int i = 0; i < started; i ++)
+    {
+        if (error)
+            shutdown(readers[i].sock, SHUT_RDWR);
+        pthread_join(readers[i].thread, NULL);
+        close(readers[i].sock);
+        bytes += readers[i].bytes;
+        ok = ok  &&  readers[i].ok;
+    }
+    LOCK(closed_mutex);
+    while (closed_count < added)
+        WAIT(closed_mutex, closed_signal);
+    closed_count = 0;
+    UNLOCK(closed_mutex);
+    double wall_time = 1e-9 * (double) (
+        get_time_ns() - __atomic_load_n(&first_data_ns, __ATOMIC_RELAXED));
+    double cpu_time = get_cpu_time() - cpu_start;
+
+    char captured[MAX_RESULT_LENGTH];
+    uint64_t samples = 0;
+    uint64_t overruns = 0;
+    error = error  ?:
+        TEST_OK_(ok, "Data connection failed")  ?:
+        config_command(NULL, captured, sizeof(captured), "*PCAP.CAPTURED?")  ?:
+        DO(samples = strtoull(captured + 4, NULL, 10))  ?:
+        read_overrun_count(&overruns);
+    if (!error)
+    {
+        const struct captured_fields *fields;
+        const struct data_capture *capture;
+        get_capture_description(&fields, &capture);
+        double captured_bytes =
+            (double) samples * (double) get_raw_sample_length(capture);
+        printf("%u %"PRIu64" %.4f %.1f %.1f %.0f %.1f %"PRIu64" %s\n",
+            reader_count, samples, wall_time,
+            1e-6 * captured_bytes / wall_time,
+            1e-6 * (double) bytes / wall_time,
+            (double) samples / wall_time,
+            100 * cpu_time / wall_time, overruns - overruns_start, mode);
+        fflush(stdout);
+    }
+    return error;
+}
+
+
+static error__t configure_capture(void)
+{
+    char response[MAX_RESULT_LENGTH];
+    error__t error =
+        config_command(NULL, response, sizeof(response), "*PCAP.BUFFER=%u:%u",
+            buffer_block_size, buffer_block_count)  ?:
+        config_command(NULL, response, sizeof(response), "*CAPTURE=");
+    for (unsigned int i = 0; !error  &&  i < capture_count; i ++)
+        error = config_command(
+            NULL, response, sizeof(response), "%s", captures[i]);
+    return error;
+}
+
+
+static error__t run_benchmark(void)
+{
+    struct server_session config_session;
+    int config_sock = -1;
+    error__t error =
+        open_session(&config_session, process_config_socket, &config_sock)  ?:
+        DO(config_file = create_buffered_file(
+            config_sock, MAX_LINE_LENGTH, MAX_LINE_LENGTH))  ?:
+        configure_capture();
+
+    if (!error)
+    {
+        printf("# readers samples seconds MB/s out_MB/s samples/s cpu%% overruns mode\n");
+        for (unsigned int i = 0; !error  &&  i < mode_count; i ++)
+            error = run_mode(modes[i]);
+    }
+
+    if (config_sock >= 0)
+    {
+        if (config_file)
+            error_discard(destroy_buffered_file(config_file));
+        shutdown(config_sock, SHUT_RDWR);
+        pthread_join(config_session.thread, NULL);
+        close(config_sock);
+    }
+    return error;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Startup. */
+
+
+static void usage(const char *argv0)
+{
+    printf(
+"Usage: %s [options] -c config_dir\n"
+"Measures throughput of the data capture path with synthetic data\n"
+"\n"
+"options:\n"
+"   -h  Show this usage\n"
+"   -c: Specify configuration directory\n"
+"   -b: Specify capture buffer as block_size:block_count (default %u:%u)\n"
+"   -n: Number of samples captured for each mode (default %"PRIu64")\n"
+"   -r: Number of data readers for each mode (default %u)\n"
+"   -s: Bytes returned by each hardware read (default block size)\n"
+"   -f: Add field capture, eg -f 'INENC1.VAL.CAPTURE=Value'.  The default\n"
+"       is a mixture of capture modes\n"
+"   -m: Add data mode, eg -m 'ASCII SCALED'.  The default is to run every\n"
+"       data format with every data process\n"
+"   -W: Specify count of data conversion workers\n"
+"   -X: Specify extension server port, needed if the configuration has\n"
+"       extension registers\n"
+"\n"
+"One line is printed for each mode with the number of readers and samples,\n"
+"the elapsed time, captured and total output data rates in MB/s, sample rate,\n"
+"CPU load in %% of one CPU, number of readers overrun, and finally the data\n"
+"mode.  Overrun readers have skipped data, so a non zero overrun count means\n"
+"that the capture buffer was too small for the mode.\n"
+        , argv0, buffer_block_size, buffer_block_count, sample_count,
+        reader_count);
+}
+
+
+static error__t parse_buffer_option(const char *arg)
+{
+    return
+        parse_buffer_size(&arg, &buffer_block_size, &buffer_block_count)  ?:
+        parse_eos(&arg);
+}
+
+static error__t parse_uint_option(const char *arg, unsigned int *result)
+{
+    return parse_uint(&arg, result)  ?:  parse_eos(&arg);
+}
+
+static error__t parse_uint64_option(const char *arg, uint64_t *result)
+{
+    return parse_uint64(&arg, result)  ?:  parse_eos(&arg);
+}
+
+static error__t add_option(
+    const char *arg, const char *list[], unsigned int *count, unsigned int max)
+{
+    return
+        TEST_OK_(*count < max, "Too many options")  ?:
+        DO(list[(*count)++] = arg);
+}
+
+
+static error__t process_options(int argc, char *const argv[])
+{
+    const char *argv0 = argv[0];
+    error__t error = ERROR_OK;
+    while (!error)
+    {
+        switch (getopt(argc, argv, "+hc:b:n:r:s:f:m:W:X:"))
+        {
+            case 'h':   usage(argv0);                                   exit(0);
+            case 'c':   config_dir = optarg;                            break;
+            case 'b':   error = parse_buffer_option(optarg);            break;
+            case 'n':
+                error = parse_uint64_option(optarg, &sample_count);     break;
+            case 'r':
+                error = parse_uint_option(optarg, &reader_count);       break;
+            case 's':
+                error = parse_uint_option(optarg, &read_size);          break;
+            case 'f':
+                error = add_option(
+                    optarg, captures, &capture_count, MAX_CAPTURES);    break;
+            case 'm':
+                error = add_option(optarg, modes, &mode_count, MAX_MODES);
+                break;
+            case 'W':
+                error = parse_uint_option(optarg, &conversion_workers); break;
+            case 'X':
+                error = parse_uint_option(optarg, &extension_port);     break;
+            default:
+                return FAIL_("Try `%s -h` for usage", argv0);
+            case -1:
+                return
+                    TEST_OK_(argc == optind, "Unexpected arguments")  ?:
+                    TEST_OK_(config_dir, "Must specify config directory")  ?:
+                    TEST_OK_(0 < reader_count  &&  reader_count <= MAX_READERS,
+                        "Invalid number of readers");
+        }
+    }
+    return error;
+}
+
+
+/* Fills in the default field layout and data modes if none given. */
+static void set_defaults(void)
+{
+    if (read_size == 0)
+        read_size = buffer_block_size;
+    if (capture_count == 0)
+        for (unsigned int i = 0; i < ARRAY_SIZE(default_captures); i ++)
+            captures[capture_count++] = default_captures[i];
+    if (mode_count == 0)
+    {
+        static char mode_names[ARRAY_SIZE(default_formats)]
+            [ARRAY_SIZE(default_processes)][MAX_NAME_LENGTH];
+        for (unsigned int i = 0; i < ARRAY_SIZE(default_formats); i ++)
+            for (unsigned int j = 0; j < ARRAY_SIZE(default_processes); j ++)
+            {
+                snprintf(mode_names[i][j], MAX_NAME_LENGTH, "%s %s",
+                    default_formats[i], default_processes[j]);
+                modes[mode_count++] = mode_names[i][j];
+            }
+    }
+}
+
+
+int main(int argc, char *const argv[])
+{
+    initialise_base64();
+
+    struct worker_pool *conversion_pool = NULL;
+    struct worker_pool *stream_pool = NULL;
+    error__t error =
+        process_options(argc, argv)  ?:
+        DO(set_defaults())  ?:
+
+        initialise_metadata()  ?:
+        initialise_fields()  ?:
+        initialise_output()  ?:
+        initialise_time()  ?:
+        initialise_system_command("bench")  ?:
+        initialise_hardware()  ?:
+        IF(extension_port,
+            initialise_extension_server(extension_port))  ?:
+        load_config_databases(config_dir)  ?:
+        initialise_data_server(buffer_block_size, buffer_block_count, false)  ?:
+
+        start_data_server()  ?:
+        create_worker_pool(reader_count, NULL, &stream_pool)  ?:
+        DO(set_stream_pool(stream_pool))  ?:
+        IF(conversion_workers > 0,
+            create_worker_pool(conversion_workers, NULL, &conversion_pool)  ?:
+            DO(set_conversion_pool(conversion_pool)))  ?:
+        run_benchmark();
+    ERROR_REPORT(error, "Benchmark failed");
+
+    terminate_data_server_early();
+    if (conversion_pool)
+        destroy_worker_pool(conversion_pool);
+    if (stream_pool)
+        destroy_worker_pool(stream_pool);
+    terminate_extension_server();
+    terminate_data_server();
+    terminate_hardware();
+    terminate_system_command();
+    terminate_time();
+    terminate_output();
+    terminate_fields();
+    terminate_metadata();
+
+    return error ? 1 : 0;
+}
@@ -7,111 +7,373 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 #include "error.h"
 #include "locking.h"
+#include "list.h"
+#include "latency.h"
 
 #include "buffer.h"
 
 
+/* The buffer is shared between a single writer, the data capture thread, and
+ * any number of independent readers.  The data path is lock free: the writer
+ * publishes each completed block by advancing the atomic sequence number
+ * write_seq, and readers check for overrun by comparing their own sequence
+ * number with an acquire load of write_seq.
+ *
+ * The mutex is only used for the slow control path: starting and ending
+ * capture and adding and removing readers.  Each reader owns a wait slot with
+ * an eventfd, and the writer wakes blocked readers by scanning the wait slots
+ * without taking the lock.  The writer only signals readers which have
+ * announced that they are waiting, and only scans the slots at all while some
+ * reader is waiting.
+ *
+ * Each capture written to the buffer is a separate generation.  A new capture
+ * can start as soon as the previous one has been written, and readers still
+ * draining earlier generations carry on behind the writer, reading every
+ * generation in turn.  Sequence numbers run on across generations, so overrun
+ * is detected in the same way for every reader. */
+
+/* A single capture written to the buffer, occupying the blocks with sequence
+ * numbers from first_seq up to end_seq.  Every reader connected when the
+ * capture starts takes part, and the slot for a generation can only be reused
+ * once all of these readers are done with it. */
+struct generation {
+    unsigned int cycle;         // Generation number of this capture
+    unsigned int first_seq;     // Sequence number of first block
+    unsigned int end_seq;       // Sequence number after last block
+    uint64_t length;            // Bytes written in this capture
+    bool complete;              // end_seq and length only valid once set
+    unsigned int active_count;  // Number of readers taking part
+    unsigned int history_count; // Number of open history readers
+    uint64_t start_ns;          // Time capture was started
+};
 
 struct capture_buffer {
     size_t block_size;      // Size of each block in bytes
     size_t block_count;     // Number of blocks in buffer
 
-    pthread_mutex_t mutex;  // Locks all access
-    pthread_cond_t signal;  // Used to trigger wakeup events
+    pthread_mutex_t mutex;  // Locks state changes and reader list
 
     void *buffer;           // Base of captured data buffer
-    /* Capture and buffer cycle counting are used to manage connections without
-     * having to keep track of clients.  If the client and buffer capture_cycle
-     * don't agree then the client has been reset, and the buffer_cycle is used
-     * to check whether the client's buffer has been overwritten. */
-
+    size_t mapped_size;     // Size of memory mapping for buffer
+    bool lock_memory;       // Set if buffer is to be locked into memory
+    /* Capture cycle counting is used to manage connections without having to
+     * keep track of clients.  This is the generation number of the current or
+     * most recent capture. */
     unsigned int capture_cycle; // Counts data capture cycles
-    unsigned int buffer_cycle;  // Counts buffer cycles, for overrun detection
+
+    /* Sequence number of the next block to be written.  The block index is
+     * write_seq % block_count, and the number of times the buffer has wrapped
+     * is write_seq / block_count.  This is only written by the writer and is
+     * published with release semantics after the block and its associated
+     * block_info are complete.  Wrapping of this counter is harmless as all
+     * comparisons are done by unsigned subtraction. */
+    unsigned int write_seq;
 
     bool shutdown;          // Set to true to force shutdown
+    /* State of the current capture, older generations are always complete. */
     enum buffer_state {
         STATE_IDLE,         // No data, no clients
         STATE_ACTIVE,       // Taking data
         STATE_CLEARING,     // Data capture complete, clients still taking data
     } state;
     unsigned int reader_count;  // Number of connected readers
-    unsigned int active_count;  // Number of connected active readers
 
-    size_t in_ptr;          // Index of next block to write
-    uint64_t lost_bytes;    // Length of overwritten data so far.
+    /* The most recent captures, indexed by capture_cycle. */
+    struct generation generations[BUFFER_GENERATIONS];
+
+    /* The data from the last completed capture remains in the buffer until the
+     * next capture starts or the buffer is resized, and can be read again by
+     * history readers.  These don't take part in the capture cycle. */
+    bool history_valid;         // Set while completed capture is resident
+
+    /* All readers are on this list, which is only used under the lock. */
+    struct list_head readers;
+
+    /* Each reader is allocated a wait slot under the lock, but the writer scans
+     * the slots without locking.  A slot's eventfd is kept until the buffer is
+     * destroyed, so a wakeup sent just as its reader goes away lands harmlessly
+     * on the slot's next owner. */
+    struct wait_slot {
+        bool waiting;           // Set while owning reader needs a wakeup
+        bool allocated;         // Set while slot is owned by a reader
+        int event;              // eventfd used to wake owning reader
+    } wait_slots[MAX_READERS];
+    /* Number of slots ever used, published after the slot's eventfd. */
+    unsigned int slot_count;
+    /* Number of readers currently blocked, or about to block, waiting for a
+     * wakeup.  The writer only needs to scan the wait slots when this is non
+     * zero. */
+    unsigned int waiting_count;
+    /* Largest number of blocks seen waiting for any reader in this capture,
+     * updated by readers without taking the lock. */
+    unsigned int max_occupancy;
+
+    /* Information about each block, valid while the corresponding block is
+     * valid. */
+    struct block_info {
+        size_t written;     // Bytes written into this block
+        uint64_t offset;    // Bytes written in this capture before this block
+        uint64_t publish_ns;    // Time block was published
+    } *blocks;
+};
+
+
+/* Returns the buffer index for the given block sequence number. */
+static size_t block_index(struct capture_buffer *buffer, unsigned int seq)
+{
+    return seq % buffer->block_count;
+}
+
+
+static void *get_buffer(struct capture_buffer *buffer, size_t ix)
+{
+    return buffer->buffer + ix * buffer->block_size;
+}
+
+
+/* Load of the write sequence number.  Once a reader has seen a block published
+ * it can safely inspect its contents and block_info until the block is
+ * overwritten, for which acquire ordering is enough.  However a waiting reader
+ * rechecks write_seq after announcing its wait, which needs sequentially
+ * consistent ordering (see notify_readers()).  On our targets this costs no
+ * more than an acquire load, so we use it throughout. */
+static unsigned int read_write_seq(struct capture_buffer *buffer)
+{
+    return __atomic_load_n(&buffer->write_seq, __ATOMIC_SEQ_CST);
+}
+
+
+/* Detect buffer overrun by checking how far the writer has advanced beyond the
+ * given block.  The writer overwrites block seq as soon as write_seq reaches
+ * seq + block_count, so the block remains intact while the difference is
+ * smaller than this.  Unsigned arithmetic keeps this safe across wrapping of
+ * the sequence numbers. */
+static bool check_overrun_ok(
+    struct capture_buffer *buffer, unsigned int write_seq, unsigned int seq)
+{
+    return write_seq - seq < buffer->block_count;
+}
+
+
+static struct generation *get_generation(
+    struct capture_buffer *buffer, unsigned int cycle)
+{
+    return &buffer->generations[cycle % BUFFER_GENERATIONS];
+}
+
+
+static struct generation *current_generation(struct capture_buffer *buffer)
+{
+    return get_generation(buffer, buffer->capture_cycle);
+}
+
+
+static bool generation_in_use(const struct generation *generation)
+{
+    return generation->active_count > 0  ||  generation->history_count > 0;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Reader wakeup. */
+
 
-    size_t written[];       // Bytes written into each block
+struct reader_state {
+    struct capture_buffer *buffer;      // Buffer we're reading from
+    struct list_head list;      // Entry on buffer reader list
+    struct wait_slot *slot;     // Used to wake this reader
+    bool armed;                 // Left waiting by a call which didn't block
+    /* We take part in every capture from next_cycle up to the current capture,
+     * reading them in turn. */
+    unsigned int next_cycle;
+    struct generation *source;  // Capture being read
+    unsigned int read_seq;      // Sequence number of our next block
+    enum reader_status status;  // Return code
+    bool history;               // Set while reading a completed capture
+    bool reading;               // Set between opening and closing reader
 };
 
 
+/* Wakes all waiting readers.  This is safe without the lock, as wait slots are
+ * never released. */
+static void wake_readers(struct capture_buffer *buffer)
+{
+    unsigned int slot_count =
+        __atomic_load_n(&buffer->slot_count, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < slot_count; i ++)
+    {
+        struct wait_slot *slot = &buffer->wait_slots[i];
+        /* Only write to the slot if it's waiting, so that we don't disturb the
+         * cache lines of readers which are busy. */
+        if (__atomic_load_n(&slot->waiting, __ATOMIC_SEQ_CST)  &&
+            __atomic_exchange_n(&slot->waiting, false, __ATOMIC_SEQ_CST))
+            ASSERT_IO(eventfd_write(slot->event, 1));
+    }
+}
+
+
+/* Called by the writer after publishing a block.  The reader sets its waiting
+ * flag and increments waiting_count before rechecking write_seq, and we update
+ * write_seq before checking waiting_count, so with sequentially consistent
+ * ordering on both sides at least one of us will see the other's update. */
+static void notify_readers(struct capture_buffer *buffer)
+{
+    if (__atomic_load_n(&buffer->waiting_count, __ATOMIC_SEQ_CST) > 0)
+        wake_readers(buffer);
+}
+
+
+/* Marks reader as waiting for a wakeup, first consuming any stale wakeup. */
+static void start_waiting(struct reader_state *reader)
+{
+    eventfd_t value;
+    IGNORE(eventfd_read(reader->slot->event, &value));
+    __atomic_store_n(&reader->slot->waiting, true, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&reader->buffer->waiting_count, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static void stop_waiting(struct reader_state *reader)
+{
+    __atomic_store_n(&reader->slot->waiting, false, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&reader->buffer->waiting_count, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* A reader which is not allowed to block is left waiting on return, so that
+ * the writer will signal its event when there is something new.  The reader
+ * stops waiting on its next call. */
+static void arm_wakeup(struct reader_state *reader)
+{
+    if (!reader->armed)
+        start_waiting(reader);
+    reader->armed = true;
+}
+
+
+static void disarm_wakeup(struct reader_state *reader)
+{
+    if (reader->armed)
+        stop_waiting(reader);
+    reader->armed = false;
+}
+
+
+/* Blocks until the reader is woken or the deadline expires, returns false on
+ * timeout.  start_waiting() must have been called first. */
+static bool wait_for_wakeup(
+    struct reader_state *reader, const struct timespec *deadline)
+{
+    struct timespec now;
+    ASSERT_IO(clock_gettime(CLOCK_MONOTONIC, &now));
+    int64_t timeout_ms =
+        (deadline->tv_sec - now.tv_sec) * 1000 +
+        (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    if (timeout_ms <= 0)
+        return false;
+
+    struct pollfd pollfd = { .fd = reader->slot->event, .events = POLLIN, };
+    int rc = poll(&pollfd, 1, (int) timeout_ms);
+    ASSERT_OK_IO(rc >= 0  ||  errno == EINTR);
+    return rc > 0;
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Buffer writer API. */
 
-void start_write(struct capture_buffer *buffer)
+bool check_write_ready(struct capture_buffer *buffer, unsigned int *generation)
 {
-    /* ASSERT: buffer->state == STATE_IDLE  &&  !buffer->active_count */
-
     LOCK(buffer->mutex);
-    buffer->buffer_cycle = 0;
-    buffer->active_count = buffer->reader_count;
-    buffer->state = STATE_ACTIVE;
-    buffer->in_ptr = 0;
-    buffer->lost_bytes = 0;
-    memset(buffer->written, 0, buffer->block_count * sizeof(size_t));
-    BROADCAST(buffer->signal);
+    *generation = buffer->capture_cycle + 1;
+    bool ready =
+        buffer->state != STATE_ACTIVE  &&
+        !generation_in_use(get_generation(buffer, *generation));
     UNLOCK(buffer->mutex);
+    return ready;
 }
 
 
-static void *get_buffer(struct capture_buffer *buffer, size_t ix)
+/* Returns true if the reader has a capture waiting to be read, in which case it
+ * is counted in all captures from next_cycle onwards. */
+static bool capture_waiting(
+    struct capture_buffer *buffer, struct reader_state *reader)
 {
-    return buffer->buffer + ix * buffer->block_size;
+    return reader->next_cycle != buffer->capture_cycle + 1;
+}
+
+
+void start_write(struct capture_buffer *buffer)
+{
+    /* ASSERT: check_write_ready(buffer) */
+
+    LOCK(buffer->mutex);
+    buffer->history_valid = false;
+    buffer->capture_cycle += 1;
+    struct generation *generation = current_generation(buffer);
+    /* Every reader takes part in this capture, including readers still
+     * draining earlier captures which will get to this one in turn. */
+    *generation = (struct generation) {
+        .cycle = buffer->capture_cycle,
+        .first_seq = buffer->write_seq,
+        .active_count = buffer->reader_count,
+        .start_ns = get_latency_time(),
+    };
+    __atomic_store_n(&buffer->max_occupancy, 0, __ATOMIC_RELAXED);
+    buffer->state = STATE_ACTIVE;
+    wake_readers(buffer);
+    UNLOCK(buffer->mutex);
 }
 
 
 void *get_write_block(struct capture_buffer *buffer)
 {
     /* ASSERT: buffer->state == STATE_ACTIVE */
-    return get_buffer(buffer, buffer->in_ptr);
+    return get_buffer(buffer, block_index(buffer, buffer->write_seq));
 }
 
 
-void release_write_block(struct capture_buffer *buffer, size_t written)
+/* Returns the number of bytes written in this capture before the given block,
+ * which must follow a block still in the buffer. */
+static uint64_t capture_offset(
+    struct capture_buffer *buffer, struct generation *generation,
+    unsigned int seq)
 {
-    /* ASSERT: buffer->state == STATE_ACTIVE  &&  written */
-
-    LOCK(buffer->mutex);
-    /* Keep track of the total number of bytes in recycled blocks: we'll need
-     * this so that late coming clients get to know how much data they've
-     * missed. */
-    buffer->lost_bytes += buffer->written[buffer->in_ptr];
-    buffer->written[buffer->in_ptr] = written;
-
-    /* Advance buffer and cycle count. */
-    buffer->in_ptr += 1;
-    if (buffer->in_ptr >= buffer->block_count)
+    if (seq == generation->first_seq)
+        return 0;
+    else
     {
-        buffer->in_ptr = 0;
-        buffer->buffer_cycle += 1;
+        struct block_info *last = &buffer->blocks[block_index(buffer, seq - 1)];
+        return last->offset + last->written;
     }
-
-    /* Let all clients know there's data to read. */
-    BROADCAST(buffer->signal);
-    UNLOCK(buffer->mutex);
 }
 
 
-/* Go idle and step on to the next capture cycle.  Can only be called when there
- * are no active clients. */
-static void advance_capture(struct capture_buffer *buffer)
+void release_write_block(struct capture_buffer *buffer, size_t written)
 {
-    /* ASSERT: buffer->active_count == 0 */
-    buffer->state = STATE_IDLE;
-    buffer->capture_cycle += 1;
+    /* ASSERT: buffer->state == STATE_ACTIVE  &&  written */
+
+    /* Only the writer updates write_seq and block_info, so we can read them
+     * freely here.  Record the offset of this block in the capture stream:
+     * we'll need this so that late coming clients get to know how much data
+     * they've missed. */
+    unsigned int seq = buffer->write_seq;
+    buffer->blocks[block_index(buffer, seq)] = (struct block_info) {
+        .written = written,
+        .offset = capture_offset(buffer, current_generation(buffer), seq),
+        .publish_ns = get_latency_time(),
+    };
+
+    /* Publish the block and let any waiting clients know there's data. */
+    __atomic_store_n(&buffer->write_seq, seq + 1, __ATOMIC_SEQ_CST);
+    notify_readers(buffer);
 }
 
 
@@ -119,56 +381,106 @@ void end_write(struct capture_buffer *buffer)
 {
     /* ASSERT: buffer->state == STATE_ACTIVE */
     LOCK(buffer->mutex);
+    struct generation *generation = current_generation(buffer);
+    generation->end_seq = buffer->write_seq;
+    generation->length =
+        capture_offset(buffer, generation, generation->end_seq);
+    /* Readers pick up the end of their capture from this flag, so it must be
+     * set before the writer can move on to the next capture. */
+    __atomic_store_n(&generation->complete, true, __ATOMIC_SEQ_CST);
+    buffer->history_valid = true;
     /* If there are active readers we need to go into the clearing state, and
      * let them know that we've read the end of the capture. */
-    if (buffer->active_count > 0)
+    if (generation->active_count > 0)
     {
         buffer->state = STATE_CLEARING;
-        BROADCAST(buffer->signal);
+        wake_readers(buffer);
     }
     else
-        advance_capture(buffer);
+        buffer->state = STATE_IDLE;
     UNLOCK(buffer->mutex);
 }
 
 
 /* This is called when a reader completes a capture, either through normal
- * closing or by premature destruction. */
-static void complete_capture(struct capture_buffer *buffer)
+ * closing or by premature destruction.  Once the last reader of the current
+ * capture is done the buffer goes idle. */
+static void complete_capture(
+    struct capture_buffer *buffer, struct generation *generation)
+{
+    generation->active_count -= 1;
+    if (generation == current_generation(buffer)  &&
+        generation->active_count == 0  &&  buffer->state == STATE_CLEARING)
+        buffer->state = STATE_IDLE;
+}
+
+
+/* Allocates a free wait slot, creating its eventfd on first use.  Must be
+ * called under the lock, returns NULL if all slots are in use. */
+static struct wait_slot *allocate_wait_slot(struct capture_buffer *buffer)
 {
-    /* ASSERT: buffer->state != STATE_IDLE */
-    buffer->active_count -= 1;
-    if (buffer->active_count == 0  &&  buffer->state == STATE_CLEARING)
-        advance_capture(buffer);
+    for (unsigned int i = 0; i < buffer->slot_count; i ++)
+    {
+        struct wait_slot *slot = &buffer->wait_slots[i];
+        if (!slot->allocated)
+        {
+            slot->allocated = true;
+            return slot;
+        }
+    }
+
+    if (buffer->slot_count < MAX_READERS)
+    {
+        struct wait_slot *slot = &buffer->wait_slots[buffer->slot_count];
+        ASSERT_IO(slot->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+        slot->allocated = true;
+        __atomic_store_n(
+            &buffer->slot_count, buffer->slot_count + 1, __ATOMIC_RELEASE);
+        return slot;
+    }
+    else
+        return NULL;
 }
 
 
-/* Adds a new reader.  Because of the way we do connection and state management,
- * we need to treat this reader as active unless we're idle.  Returns the
- * current capture cycle so the reader can get started right away. */
-static unsigned int add_reader(struct capture_buffer *buffer)
+/* Adds a new reader.  Because of the way we do connection and state
+ * management, we need to treat this reader as taking part in the current
+ * capture unless we're idle, so that the reader can get started right away.
+ * Returns false if there are too many readers. */
+static bool add_reader(
+    struct capture_buffer *buffer, struct reader_state *reader)
 {
     LOCK(buffer->mutex);
-    unsigned int cycle = buffer->capture_cycle;
-    buffer->reader_count += 1;
-    if (buffer->state != STATE_IDLE)
-        buffer->active_count += 1;
+    reader->slot = allocate_wait_slot(buffer);
+    if (reader->slot)
+    {
+        buffer->reader_count += 1;
+        reader->next_cycle = buffer->capture_cycle + 1;
+        if (buffer->state != STATE_IDLE)
+        {
+            reader->next_cycle = buffer->capture_cycle;
+            current_generation(buffer)->active_count += 1;
+        }
+        list_add(&reader->list, &buffer->readers);
+    }
     UNLOCK(buffer->mutex);
-    return cycle;
+    return reader->slot;
 }
 
 
-/* Removes a reader.  Again, state management is a trifle involved.  We pass the
- * capture cycle of the disconnecting reader. */
-static void remove_reader(struct capture_buffer *buffer, unsigned int cycle)
+/* Removes a reader.  We need to count ourself off every capture we haven't yet
+ * completed, including one we are still reading if we weren't closed. */
+static void remove_reader(
+    struct capture_buffer *buffer, struct reader_state *reader)
 {
     LOCK(buffer->mutex);
+    list_del(&reader->list);
     buffer->reader_count -= 1;
-    /* If we are nominally in a capture cycle, but we haven't actually started
-     * it, then we need to count ourself off.  That we haven't started is
-     * evident because close_reader() would have advanced our capture cycle. */
-    if (buffer->state != STATE_IDLE  &&  buffer->capture_cycle == cycle)
-        complete_capture(buffer);
+    for (; capture_waiting(buffer, reader); reader->next_cycle += 1)
+        complete_capture(buffer, get_generation(buffer, reader->next_cycle));
+    if (reader->history)
+        reader->source->history_count -= 1;
+    reader->slot->allocated = false;
     UNLOCK(buffer->mutex);
 }
 
@@ -176,36 +488,60 @@ static void remove_reader(struct capture_buffer *buffer, unsigned int cycle)
 void shutdown_buffer(struct capture_buffer *buffer)
 {
     LOCK(buffer->mutex);
-    buffer->shutdown = true;
-    BROADCAST(buffer->signal);
+    __atomic_store_n(&buffer->shutdown, true, __ATOMIC_SEQ_CST);
+    wake_readers(buffer);
     UNLOCK(buffer->mutex);
 }
 
 
 bool read_buffer_status(
-    struct capture_buffer *buffer,
-    unsigned int *readers, unsigned int *active_readers)
+    struct capture_buffer *buffer, unsigned int *readers,
+    unsigned int *active_readers, unsigned int *generation)
 {
     LOCK(buffer->mutex);
     enum buffer_state state = buffer->state;
     *readers = buffer->reader_count;
-    *active_readers = buffer->active_count;
+    *active_readers = 0;
+    list_for_each_entry(struct reader_state, list, reader, &buffer->readers)
+        if (capture_waiting(buffer, reader)  ||  reader->history)
+            *active_readers += 1;
+    *generation = buffer->capture_cycle;
     UNLOCK(buffer->mutex);
     return state != STATE_IDLE;
 }
 
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-/* Reader API. */
+/* The reader's sequence number is only written by the reader itself, but is
+ * read without the reader's involvement by read_buffer_occupancy(). */
+static void set_read_seq(struct reader_state *reader, unsigned int read_seq)
+{
+    __atomic_store_n(&reader->read_seq, read_seq, __ATOMIC_RELAXED);
+}
 
 
-struct reader_state {
-    struct capture_buffer *buffer;      // Buffer we're reading from
-    unsigned int capture_cycle;
-    unsigned int buffer_cycle;
-    size_t out_ptr;             // Index of our current block
-    enum reader_status status;  // Return code
-};
+void read_buffer_occupancy(
+    struct capture_buffer *buffer,
+    unsigned int *occupancy, unsigned int *max_occupancy)
+{
+    LOCK(buffer->mutex);
+    /* Readers update their sequence numbers without the lock, but a stale
+     * value is good enough here.  Readers still draining earlier captures are
+     * included, as they are overrun by the writer in the same way. */
+    *occupancy = 0;
+    unsigned int write_seq = read_write_seq(buffer);
+    list_for_each_entry(struct reader_state, list, reader, &buffer->readers)
+        if (reader->reading  &&  !reader->history)
+            *occupancy = MAX(*occupancy, write_seq -
+                __atomic_load_n(&reader->read_seq, __ATOMIC_RELAXED));
+    *occupancy = MIN(*occupancy, (unsigned int) buffer->block_count);
+    *max_occupancy =
+        __atomic_load_n(&buffer->max_occupancy, __ATOMIC_RELAXED);
+    UNLOCK(buffer->mutex);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Reader API. */
 
 
 struct reader_state *create_reader(struct capture_buffer *buffer)
@@ -213,91 +549,129 @@ struct reader_state *create_reader(struct capture_buffer *buffer)
     struct reader_state *reader = malloc(sizeof(struct reader_state));
     *reader = (struct reader_state) {
         .buffer = buffer,
-        .capture_cycle = add_reader(buffer),
     };
+    if (!add_reader(buffer, reader))
+    {
+        free(reader);
+        reader = NULL;
+    }
     return reader;
 }
 
 
 void destroy_reader(struct reader_state *reader)
 {
-    remove_reader(reader->buffer, reader->capture_cycle);
+    disarm_wakeup(reader);
+    remove_reader(reader->buffer, reader);
     free(reader);
 }
 
 
-/* The counting of lost bytes interacts closely with the updating of the written
- * and lost counts in release_write_block.  We include the in_ptr block in our
- * count here because it doesn't get added to .lost_bytes until the write is
- * complete. */
-static uint64_t count_lost_bytes(struct capture_buffer *buffer, size_t out_ptr)
+/* Returns the sequence number after the last block of our capture published
+ * so far.  Once our capture is complete the writer can move on to the next, so
+ * completion must be checked again after reading write_seq. */
+static unsigned int read_end_seq(struct reader_state *reader)
 {
-    uint64_t lost_bytes = buffer->lost_bytes;
-    for (size_t ix = buffer->in_ptr; ix != out_ptr; )
+    struct generation *generation = reader->source;
+    if (__atomic_load_n(&generation->complete, __ATOMIC_SEQ_CST))
+        return generation->end_seq;
+    else
     {
-        lost_bytes += buffer->written[ix];
-        ix += 1;
-        if (ix >= buffer->block_count)
-            ix = 0;
+        unsigned int write_seq = read_write_seq(reader->buffer);
+        if (__atomic_load_n(&generation->complete, __ATOMIC_SEQ_CST))
+            return generation->end_seq;
+        else
+            return write_seq;
     }
-    return lost_bytes;
 }
 
 
 /* Computes a sensible starting point for the reader and compute the number of
- * missed bytes. */
+ * missed bytes.  This is done without reference to the writer, so we have to
+ * check that the block we start from wasn't overwritten while we read its
+ * offset.  Sequence numbers are measured from the start of our capture, as
+ * later captures may have overwritten all or part of it. */
 static void compute_reader_start(
     struct reader_state *reader, unsigned int read_margin, uint64_t *lost_bytes)
 {
     struct capture_buffer *buffer = reader->buffer;
-    /* If the buffer is not too full then we don't have to think. */
-    if (buffer->buffer_cycle == 0  &&
-        buffer->in_ptr + read_margin + 1 < buffer->block_count)
-    {
-        reader->buffer_cycle = 0;
-        reader->out_ptr = 0;
-        *lost_bytes = 0;
-    }
-    else
+    struct generation *generation = reader->source;
+    unsigned int first_seq = generation->first_seq;
+    unsigned int block_count = (unsigned int) buffer->block_count;
+    /* The margin may have been computed before the buffer was last resized. */
+    read_margin = MIN(read_margin, block_count - 1);
+    while (true)
     {
-        /* Hum.  Not enough margin.  Compute out_ptr, associated buffer_cycle,
-         * and lost bytes. */
-        size_t out_ptr = buffer->in_ptr + read_margin + 1;
-        if (out_ptr >= buffer->block_count)
+        unsigned int written = read_write_seq(buffer) - first_seq;
+        unsigned int length = read_end_seq(reader) - first_seq;
+        /* If the buffer is not too full then we don't have to think. */
+        if (written + read_margin + 1 < block_count)
         {
-            reader->buffer_cycle = buffer->buffer_cycle;
-            reader->out_ptr = out_ptr - buffer->block_count;
+            set_read_seq(reader, first_seq);
+            *lost_bytes = 0;
+            return;
         }
-        else
+
+        /* Hum.  Not enough margin.  Start read_margin blocks ahead of the
+         * writer, and count everything before our start as lost.  If a later
+         * capture has overwritten all of ours then everything is lost. */
+        unsigned int skip = written + read_margin + 1 - block_count;
+        if (skip >= length)
+        {
+            /* ASSERT: generation->complete */
+            set_read_seq(reader, first_seq + length);
+            *lost_bytes = generation->length;
+            return;
+        }
+        unsigned int read_seq = first_seq + skip;
+        *lost_bytes = buffer->blocks[block_index(buffer, read_seq)].offset;
+
+        /* Check that the block wasn't recycled while we were reading it. */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (check_overrun_ok(buffer, read_write_seq(buffer), read_seq))
         {
-            reader->buffer_cycle = buffer->buffer_cycle - 1;
-            reader->out_ptr = out_ptr;
+            set_read_seq(reader, read_seq);
+            return;
         }
-        *lost_bytes = count_lost_bytes(buffer, reader->out_ptr);
     }
 }
 
 
-/* Wait a new capture cycle to begin or for the timeout to expire. */
+/* Wait for a capture to begin or for the timeout to expire.  Must be called
+ * with the buffer lock held, and state changes are also made under the lock, so
+ * we can safely announce our wait under the lock.  With no timeout we don't
+ * wait at all, but leave the reader armed. */
 static bool wait_for_buffer_ready(
     struct reader_state *reader, const struct timespec *timeout)
 {
     struct timespec deadline;
-    compute_deadline(timeout, &deadline);
+    if (timeout)
+        compute_deadline(timeout, &deadline);
 
     struct capture_buffer *buffer = reader->buffer;
-    /* Wait until the buffer is ready and we have a fresh capture cycle to work
-     * with or until the deadline expires. */
+    /* Wait until the next capture for us has started or until the deadline
+     * expires.  This capture may already have been overtaken by newer ones,
+     * in which case we drain it behind the writer. */
     while (true)
     {
         if (buffer->shutdown)
             /* Shutdown forced. */
             return false;
-        if (buffer->state != STATE_IDLE  &&
-            buffer->capture_cycle == reader->capture_cycle)
-            /* New capture cycle ready for us. */
+        if (capture_waiting(buffer, reader))
+            /* Capture ready for us. */
             return true;
-        if (!pwait_deadline(&buffer->mutex, &buffer->signal, &deadline))
+        if (!timeout)
+        {
+            arm_wakeup(reader);
+            return false;
+        }
+
+        start_waiting(reader);
+        UNLOCK(buffer->mutex);
+        bool woken = wait_for_wakeup(reader, &deadline);
+        LOCK(buffer->mutex);
+        stop_waiting(reader);
+        if (!woken)
             /* Timeout detected. */
             return false;
     }
@@ -310,15 +684,17 @@ bool open_reader(
 {
     struct capture_buffer *buffer = reader->buffer;
     LOCK(buffer->mutex);
+    disarm_wakeup(reader);
 
-    /* Wait for buffer to become active with a newer capture. */
+    /* Wait for a capture we haven't yet read. */
     bool active = wait_for_buffer_ready(reader, timeout);
     if (active)
     {
         /* Start taking data. */
-        reader->capture_cycle = buffer->capture_cycle;
+        reader->source = get_generation(buffer, reader->next_cycle);
         compute_reader_start(reader, read_margin, lost_bytes);
         reader->status = READER_STATUS_CLOSED;  // Default, not true yet!
+        reader->reading = true;
     }
 
     UNLOCK(buffer->mutex);
@@ -330,107 +706,293 @@ enum reader_status close_reader(struct reader_state *reader)
 {
     struct capture_buffer *buffer = reader->buffer;
     LOCK(buffer->mutex);
-    complete_capture(buffer);
+    disarm_wakeup(reader);
+    if (reader->history)
+        /* History readers stay out of the capture cycle. */
+        reader->source->history_count -= 1;
+    else
+    {
+        /* Move on to the next capture, which may already have started. */
+        complete_capture(buffer, reader->source);
+        reader->next_cycle += 1;
+    }
+    reader->source = NULL;
+    reader->history = false;
+    reader->reading = false;
     UNLOCK(buffer->mutex);
-
-    reader->capture_cycle += 1;
     return reader->status;
 }
 
 
-/* Detect buffer underflow by inspecting the in and out pointers and checking
- * the buffer cycle count.  We can only be deceived if a full 2^32 cycles have
- * ocurred since the last time we looked, but the pacing of reading and writing
- * eliminates that risk. */
-static bool check_overrun_ok(
-    unsigned int buffer_cycle, unsigned int reader_buffer_cycle,
-    size_t in_ptr, size_t out_ptr)
+int get_reader_event(struct reader_state *reader)
 {
-    if (in_ptr == out_ptr)
-        /* Unmistakable collision! */
-        return false;
-    else if (in_ptr > out_ptr)
-        /* Out pointer ahead of in pointer.  We're ok if we're both on the same
-         * cycle. */
-        return buffer_cycle == reader_buffer_cycle;
-    else
-        /* Out pointer behind in pointer.  In this case the buffer should be one
-         * step ahead of us. */
-        return buffer_cycle == reader_buffer_cycle + 1;
+    return reader->slot->event;
 }
 
 
-/* Checks status of indicated out_ptr block and updates the status result
- * accordingly if there's any failure. */
-static bool check_block_status(
-    struct reader_state *reader,
-    unsigned int reader_buffer_cycle, size_t out_ptr)
+unsigned int read_capture_generation(struct reader_state *reader)
 {
-    /* ASSERT: reader->status == READER_STATUS_CLOSED */
+    return reader->source->cycle;
+}
+
+
+bool get_history_length(
+    struct capture_buffer *buffer, uint64_t *length, unsigned int *generation)
+{
+    LOCK(buffer->mutex);
+    bool valid = buffer->history_valid;
+    if (valid)
+    {
+        *length = current_generation(buffer)->length;
+        *generation = buffer->capture_cycle;
+    }
+    UNLOCK(buffer->mutex);
+    return valid;
+}
 
+
+/* Returns the sequence number of the resident block containing offset, or of
+ * the oldest resident block if offset has already been overwritten.  The block
+ * offsets are an index into the capture stream in increasing order, so we can
+ * use a binary search.  Only valid while the writer is idle. */
+static unsigned int find_history_block(
+    struct capture_buffer *buffer, struct generation *generation,
+    uint64_t offset)
+{
+    unsigned int length = generation->end_seq - generation->first_seq;
+    unsigned int block_count = (unsigned int) buffer->block_count;
+    unsigned int first = generation->first_seq +
+        (length >= block_count ? length - block_count + 1 : 0);
+
+    /* The block we want is at first + low, with low in the range [low,high).
+     * Unsigned differences keep this safe across sequence number wrapping. */
+    unsigned int low = 0;
+    unsigned int high = generation->end_seq - first;
+    while (high - low > 1)
+    {
+        unsigned int mid = low + (high - low) / 2;
+        if (buffer->blocks[block_index(buffer, first + mid)].offset <= offset)
+            low = mid;
+        else
+            high = mid;
+    }
+    return first + low;
+}
+
+
+bool open_history_reader(
+    struct reader_state *reader, unsigned int generation,
+    uint64_t offset, uint64_t *block_offset)
+{
     struct capture_buffer *buffer = reader->buffer;
     LOCK(buffer->mutex);
-    unsigned int buffer_cycle = buffer->buffer_cycle;
-    size_t in_ptr = buffer->in_ptr;
+    bool valid =
+        buffer->history_valid  &&  !buffer->shutdown  &&
+        buffer->capture_cycle == generation;
+    if (valid)
+    {
+        struct generation *source = current_generation(buffer);
+        unsigned int read_seq = find_history_block(buffer, source, offset);
+        *block_offset = read_seq == source->end_seq ?
+            source->length :
+            buffer->blocks[block_index(buffer, read_seq)].offset;
+        set_read_seq(reader, read_seq);
+        reader->source = source;
+        reader->status = READER_STATUS_CLOSED;
+        reader->history = true;
+        reader->reading = true;
+        source->history_count += 1;
+    }
     UNLOCK(buffer->mutex);
+    return valid;
+}
 
+
+/* Checks status of indicated block and updates the status result accordingly
+ * if there's any failure.  No locking is needed for this. */
+static bool check_block_status(struct reader_state *reader, unsigned int seq)
+{
+    /* ASSERT: reader->status == READER_STATUS_CLOSED */
     bool ok = check_overrun_ok(
-        buffer_cycle, reader_buffer_cycle, in_ptr, out_ptr);
+        reader->buffer, read_write_seq(reader->buffer), seq);
     if (!ok)
         reader->status = READER_STATUS_OVERRUN;
     return ok;
 }
 
 
+unsigned int read_block_sequence(struct reader_state *reader)
+{
+    return reader->read_seq - 1;
+}
+
+
+unsigned int read_block_backlog(struct reader_state *reader)
+{
+    return read_end_seq(reader) - reader->read_seq;
+}
+
+
+uint64_t read_byte_backlog(struct reader_state *reader)
+{
+    struct capture_buffer *buffer = reader->buffer;
+    unsigned int end_seq = read_end_seq(reader);
+    unsigned int seq = reader->read_seq;
+    if (end_seq == seq)
+        return 0;
+    /* If we've been overrun count from the oldest intact block, unless a later
+     * capture has overwritten everything we had left to read. */
+    unsigned int write_seq = read_write_seq(buffer);
+    if (!check_overrun_ok(buffer, write_seq, seq))
+    {
+        unsigned int oldest = write_seq + 1 - (unsigned int) buffer->block_count;
+        if (oldest - seq >= end_seq - seq)
+            return 0;
+        seq = oldest;
+    }
+    uint64_t start = buffer->blocks[block_index(buffer, seq)].offset;
+    struct block_info *last =
+        &buffer->blocks[block_index(buffer, end_seq - 1)];
+    uint64_t end = last->offset + last->written;
+    /* The first block can be overwritten while we look at it, in which case
+     * we'll just report nothing this time round. */
+    return end > start ? end - start : 0;
+}
+
+
+uint64_t read_block_time(struct reader_state *reader)
+{
+    struct capture_buffer *buffer = reader->buffer;
+    return buffer->blocks[block_index(buffer, reader->read_seq - 1)].publish_ns;
+}
+
+
+uint64_t read_block_end_offset(struct reader_state *reader)
+{
+    struct capture_buffer *buffer = reader->buffer;
+    struct block_info *block =
+        &buffer->blocks[block_index(buffer, reader->read_seq - 1)];
+    return block->offset + block->written;
+}
+
+
+uint64_t read_capture_start_time(struct reader_state *reader)
+{
+    return reader->source->start_ns;
+}
+
+
 bool check_read_block(struct reader_state *reader)
 {
-    /* Because out_ptr is the *next* block we're going to read, we need to
-     * compute the out_ptr and buffer_cycle of the current block. */
-    size_t out_ptr = reader->out_ptr;
-    unsigned int buffer_cycle = reader->buffer_cycle;
-    if (out_ptr > 0)
-        out_ptr -= 1;
+    /* Because read_seq is the *next* block we're going to read, we need to
+     * check the block before. */
+    return check_block_status(reader, reader->read_seq - 1);
+}
+
+
+bool check_read_block_sequence(struct reader_state *reader, unsigned int seq)
+{
+    return check_block_status(reader, seq);
+}
+
+
+unsigned int read_block_headroom(struct reader_state *reader, unsigned int seq)
+{
+    struct capture_buffer *buffer = reader->buffer;
+    unsigned int write_seq = read_write_seq(buffer);
+    if (check_overrun_ok(buffer, write_seq, seq))
+        return (unsigned int) buffer->block_count - (write_seq - seq);
     else
+        return 0;
+}
+
+
+bool resync_reader(
+    struct reader_state *reader, unsigned int read_margin, uint64_t *offset)
+{
+    if (reader->status == READER_STATUS_OVERRUN)
     {
-        out_ptr = reader->buffer->block_count - 1;
-        buffer_cycle -= 1;
+        /* We're still part of the capture cycle, so we can restart in the same
+         * way as a late arriving reader. */
+        compute_reader_start(reader, read_margin, offset);
+        reader->status = READER_STATUS_CLOSED;
+        return true;
     }
-    return check_block_status(reader, buffer_cycle, out_ptr);
+    else
+        return false;
 }
 
 
+/* Records the number of blocks waiting for a reader, including the block it
+ * is about to read. */
+static void update_max_occupancy(
+    struct capture_buffer *buffer, unsigned int occupancy)
+{
+    occupancy = MIN(occupancy, (unsigned int) buffer->block_count);
+    unsigned int max_occupancy =
+        __atomic_load_n(&buffer->max_occupancy, __ATOMIC_RELAXED);
+    while (occupancy > max_occupancy  &&
+        !__atomic_compare_exchange_n(
+            &buffer->max_occupancy, &max_occupancy, occupancy,
+            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+/* Returns true if there is a block available for us to read. */
+static bool block_ready(struct reader_state *reader)
+{
+    return read_end_seq(reader) != reader->read_seq;
+}
+
+
+/* Waits for the next block to be published.  Normally no locking is required,
+ * we only need to block when we've caught up with the writer. */
 static void wait_for_block_ready(
     struct reader_state *reader, const struct timespec *timeout,
     bool *all_read, bool *timeout_occurred)
 {
     struct timespec deadline;
-    compute_deadline(timeout, &deadline);
+    if (timeout)
+        compute_deadline(timeout, &deadline);
 
     *all_read = false;
     *timeout_occurred = false;
     struct capture_buffer *buffer = reader->buffer;
-    while (!buffer->shutdown)
+    while (!__atomic_load_n(&buffer->shutdown, __ATOMIC_SEQ_CST))
     {
-        /* ASSERT:
-         *  buffer->capture_cycle == reader->capture_cycle  &&
-         *  buffer->state != STATE_IDLE */
-
-        bool waiting =
-            buffer->buffer_cycle == reader->buffer_cycle  &&
-            buffer->in_ptr == reader->out_ptr;
-        if (!waiting)
+        /* We need to check for completion before checking for data: the
+         * writer publishes its last block before completing the capture. */
+        bool complete =
+            __atomic_load_n(&reader->source->complete, __ATOMIC_SEQ_CST);
+        if (block_ready(reader))
             /* No longer waiting, things have moved on. */
             return;
 
-        if (buffer->state == STATE_CLEARING)
+        if (complete)
         {
-            /* Still in waiting condition but no longer active.  This is the
-             * data completion state. */
+            /* Still in waiting condition but our capture is complete.  This is
+             * the data completion state, and is where history readers and
+             * readers of earlier captures finish. */
             *all_read = true;
             return;
         }
 
-        if (!pwait_deadline(&buffer->mutex, &buffer->signal, &deadline))
+        /* Announce that we're waiting and check once more before blocking.
+         * With no timeout we return at once, leaving the reader armed. */
+        start_waiting(reader);
+        bool ready =
+            block_ready(reader)  ||
+            __atomic_load_n(&reader->source->complete, __ATOMIC_SEQ_CST);
+        if (!ready  &&  !timeout)
+        {
+            reader->armed = true;
+            *timeout_occurred = true;
+            return;
+        }
+        bool woken = ready  ||  wait_for_wakeup(reader, &deadline);
+        stop_waiting(reader);
+        if (!woken)
         {
             /* Timeout detected. */
             *timeout_occurred = true;
@@ -449,11 +1011,9 @@ const void *get_read_block(
     if (reader->status != READER_STATUS_CLOSED)
         return NULL;
 
-    struct capture_buffer *buffer = reader->buffer;
-    LOCK(buffer->mutex);
+    disarm_wakeup(reader);
     bool all_read, timeout_occurred;
     wait_for_block_ready(reader, timeout, &all_read, &timeout_occurred);
-    UNLOCK(buffer->mutex);
 
     if (timeout_occurred)
     {
@@ -468,21 +1028,19 @@ const void *get_read_block(
     else
     {
         /* Advance to next block and return the current one, if we can. */
-        size_t out_ptr = reader->out_ptr;
-        unsigned int buffer_cycle = reader->buffer_cycle;
-        reader->out_ptr += 1;
-        if (reader->out_ptr >= buffer->block_count)
-        {
-            reader->out_ptr = 0;
-            reader->buffer_cycle += 1;
-        }
-
-        /* Check the status of the block we're about to return. */
-        if (check_block_status(reader, buffer_cycle, out_ptr))
-        {
-            *length = buffer->written[out_ptr];
-            return get_buffer(buffer, out_ptr);
-        }
+        struct capture_buffer *buffer = reader->buffer;
+        unsigned int seq = reader->read_seq;
+        size_t ix = block_index(buffer, seq);
+        set_read_seq(reader, seq + 1);
+        if (!reader->history)
+            update_max_occupancy(buffer, read_write_seq(buffer) - seq);
+
+        /* Check the status of the block we're about to return after picking up
+         * its length. */
+        *length = buffer->blocks[ix].written;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (check_block_status(reader, seq))
+            return get_buffer(buffer, ix);
         else
             return NULL;
     }
@@ -493,23 +1051,158 @@ const void *get_read_block(
 /* Buffer creation and destruction. */
 
 
-struct capture_buffer *create_buffer(size_t block_size, size_t block_count)
+/* Memory mappings with MAP_HUGETLB must be a multiple of the huge page size.
+ * We assume 2MB pages, which is also a multiple of the smaller sizes. */
+#define HUGE_PAGE_SIZE      (1U << 21)
+
+
+/* Touches every page of the buffer so that the data capture thread never
+ * takes a page fault. */
+static void prefault_memory(void *memory, size_t size)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < size; offset += page_size)
+        *(volatile char *) (memory + offset) = 0;
+}
+
+
+/* Maps memory for the buffer, preferring explicit huge pages, then falling back
+ * to transparent huge pages. */
+static error__t map_memory(
+    size_t size, bool lock_memory, void **memory, size_t *mapped_size)
+{
+    size_t length =
+        (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    *memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    bool huge_pages = *memory != MAP_FAILED;
+    error__t error =
+        IF(!huge_pages,
+            TEST_OK_IO_(
+                (*memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED,
+                "Unable to map capture buffer")  ?:
+#ifdef MADV_HUGEPAGE
+            /* Not all kernels support transparent huge pages, so failure
+             * here is not an error. */
+            DO(IGNORE(madvise(*memory, length, MADV_HUGEPAGE)))  ?:
+#endif
+            DO(log_message("Huge pages not available for capture buffer")));
+
+    if (!error)
+    {
+        *mapped_size = length;
+        error = IF(lock_memory,
+            TEST_IO_(mlock(*memory, length), "Unable to lock capture buffer"));
+        if (error)
+            munmap(*memory, length);
+        else
+            prefault_memory(*memory, length);
+    }
+    return error;
+}
+
+
+/* Allocates buffer memory and block information for the given geometry,
+ * updating the buffer only on success. */
+static error__t allocate_buffer(
+    struct capture_buffer *buffer, size_t block_size, size_t block_count)
 {
-    struct capture_buffer *buffer = malloc(
-        sizeof(struct capture_buffer) + block_count * sizeof(size_t));
-    *buffer = (struct capture_buffer) {
-        .block_size = block_size,
-        .block_count = block_count,
+    void *memory;
+    size_t mapped_size;
+    struct block_info *blocks;
+    return
+        TEST_OK_(block_size > 0  &&  block_count > 1,
+            "Invalid buffer size")  ?:
+        TEST_OK_(block_size <= SIZE_MAX / block_count,
+            "Buffer size too large")  ?:
+        map_memory(
+            block_size * block_count, buffer->lock_memory,
+            &memory, &mapped_size)  ?:
+        DO(
+            blocks = calloc(block_count, sizeof(struct block_info));
+            buffer->buffer = memory;
+            buffer->mapped_size = mapped_size;
+            buffer->blocks = blocks;
+            buffer->block_size = block_size;
+            buffer->block_count = block_count);
+}
+
+
+static void release_buffer(struct capture_buffer *buffer)
+{
+    if (buffer->buffer)
+        munmap(buffer->buffer, buffer->mapped_size);
+    free(buffer->blocks);
+}
+
+
+error__t create_buffer(
+    size_t block_size, size_t block_count, bool lock_memory,
+    struct capture_buffer **buffer)
+{
+    *buffer = malloc(sizeof(struct capture_buffer));
+    **buffer = (struct capture_buffer) {
         .mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER,
-        .buffer = malloc(block_count * block_size),
+        .lock_memory = lock_memory,
     };
-    pwait_initialise(&buffer->signal);
-    return buffer;
+    init_list_head(&(*buffer)->readers);
+
+    error__t error = allocate_buffer(*buffer, block_size, block_count);
+    if (error)
+    {
+        free(*buffer);
+        *buffer = NULL;
+    }
+    return error;
+}
+
+
+/* Returns true if any reader is still using any capture in the buffer. */
+static bool buffer_in_use(struct capture_buffer *buffer)
+{
+    for (unsigned int i = 0; i < BUFFER_GENERATIONS; i ++)
+        if (generation_in_use(&buffer->generations[i]))
+            return true;
+    return false;
+}
+
+
+error__t resize_buffer(
+    struct capture_buffer *buffer, size_t block_size, size_t block_count)
+{
+    /* We allocate the new buffer before releasing the old one so that the
+     * buffer remains usable if allocation fails. */
+    LOCK(buffer->mutex);
+    void *memory = buffer->buffer;
+    size_t mapped_size = buffer->mapped_size;
+    struct block_info *blocks = buffer->blocks;
+    error__t error =
+        TEST_OK_(buffer->state == STATE_IDLE  &&  !buffer_in_use(buffer),
+            "Capture buffer busy")  ?:
+        allocate_buffer(buffer, block_size, block_count)  ?:
+        DO(munmap(memory, mapped_size);
+           free(blocks);
+           buffer->history_valid = false);
+    UNLOCK(buffer->mutex);
+    return error;
+}
+
+
+void get_buffer_size(
+    struct capture_buffer *buffer, size_t *block_size, size_t *block_count)
+{
+    LOCK(buffer->mutex);
+    *block_size = buffer->block_size;
+    *block_count = buffer->block_count;
+    UNLOCK(buffer->mutex);
 }
 
 
 void destroy_buffer(struct capture_buffer *buffer)
 {
-    free(buffer->buffer);
+    for (unsigned int i = 0; i < buffer->slot_count; i ++)
+        close(buffer->wait_slots[i].event);
+    release_buffer(buffer);
     free(buffer);
 }
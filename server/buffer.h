@@ -3,9 +3,31 @@
 /* The buffer. */
 struct capture_buffer;
 
+/* Number of captures the buffer keeps track of at once.  A new capture can
+ * start while readers are still draining up to BUFFER_GENERATIONS - 1 earlier
+ * captures, though of course these will be overrun if they fall too far behind
+ * the writer. */
+#define BUFFER_GENERATIONS  4
 
-/* Prepares central memory buffer. */
-struct capture_buffer *create_buffer(size_t block_size, size_t block_count);
+/* Maximum number of readers which can be connected to a buffer at once. */
+#define MAX_READERS         256
+
+
+/* Prepares central memory buffer.  The buffer memory is mapped with huge pages
+ * where possible and is pre-faulted so that no page faults occur during data
+ * capture.  If lock_memory is set the buffer is also locked into memory. */
+error__t create_buffer(
+    size_t block_size, size_t block_count, bool lock_memory,
+    struct capture_buffer **buffer);
+
+/* Changes the geometry of the buffer.  This is only possible while the buffer
+ * is idle, and on failure the buffer is left unchanged. */
+error__t resize_buffer(
+    struct capture_buffer *buffer, size_t block_size, size_t block_count);
+
+/* Returns the current geometry of the buffer. */
+void get_buffer_size(
+    struct capture_buffer *buffer, size_t *block_size, size_t *block_count);
 
 /* Destroys memory buffer. */
 void destroy_buffer(struct capture_buffer *buffer);
@@ -17,11 +39,18 @@ void shutdown_buffer(struct capture_buffer *buffer);
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Writing to the buffer. */
 
-/* Initiates a write cycle. */
+/* Returns true if a new write cycle can be started, together with the
+ * generation number the new capture will have.  A write cycle can start once
+ * the previous cycle has ended, unless readers are still using the oldest
+ * capture the buffer keeps track of. */
+bool check_write_ready(struct capture_buffer *buffer, unsigned int *generation);
+
+/* Initiates a write cycle for a new capture, which must only be called after
+ * check_write_ready() has succeeded. */
 void start_write(struct capture_buffer *buffer);
 
-/* Completes a write cycle.  The buffer will remain busy until all readers have
- * completed or disconnected. */
+/* Completes a write cycle.  The buffer will remain busy until all readers of
+ * this capture have completed or disconnected. */
 void end_write(struct capture_buffer *buffer);
 
 /* Reserves the next slot in the buffer for writing. An entire contiguous
@@ -32,10 +61,18 @@ void *get_write_block(struct capture_buffer *buffer);
 /* Releases the write block, specifies number of bytes written. */
 void release_write_block(struct capture_buffer *buffer, size_t written);
 
-/* Returns true if buffer is taking data, and count of active clients. */
+/* Returns true if buffer is taking data or clients are still reading the
+ * current capture, the count of clients reading any capture, and the generation
+ * number of the current or most recent capture. */
 bool read_buffer_status(
+    struct capture_buffer *buffer, unsigned int *readers,
+    unsigned int *active_readers, unsigned int *generation);
+
+/* Returns the number of blocks waiting for the slowest reader, and the largest
+ * number seen waiting by any reader during the current capture. */
+void read_buffer_occupancy(
     struct capture_buffer *buffer,
-    unsigned int *readers, unsigned int *active_readers);
+    unsigned int *occupancy, unsigned int *max_occupancy);
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -51,7 +88,8 @@ enum reader_status {
     READER_STATUS_OVERRUN,  // Input data overrun
 };
 
-/* Creates a reader connected to the buffer. */
+/* Creates a reader connected to the buffer.  Returns NULL if MAX_READERS
+ * readers are already connected. */
 struct reader_state *create_reader(struct capture_buffer *buffer);
 
 /* Releases resources used by a reader. */
@@ -59,11 +97,43 @@ void destroy_reader(struct reader_state *reader);
 
 /* Blocks until the buffer is ready for a new read session or times out,
  * returning false on timeout.  If the connection is too late to receive all
- * data then the number of missed bytes is returned. */
+ * data then the number of missed bytes is returned.  Each reader reads every
+ * capture started while it is connected in turn, so if the reader has fallen
+ * behind then the oldest capture it has not yet read is opened.
+ *    If timeout is NULL this returns at once, and if no capture is ready the
+ * reader's event will be signalled when one is, see get_reader_event(). */
 bool open_reader(
     struct reader_state *reader, unsigned int read_margin,
     const struct timespec *timeout, uint64_t *lost_bytes);
 
+/* Returns an eventfd which is signalled when a reader which found nothing ready
+ * in open_reader() or get_read_block() without a timeout should try again.
+ * The event can be signalled spuriously, so the caller should read the event
+ * before trying again.  The event belongs to the reader and must not be used
+ * once the reader is destroyed. */
+int get_reader_event(struct reader_state *reader);
+
+/* Returns the generation number of the capture the reader has opened, which
+ * identifies the capture until the reader is closed. */
+unsigned int read_capture_generation(struct reader_state *reader);
+
+/* Returns the length in bytes of the last completed capture if its data is
+ * still in the buffer, together with its generation number, which identifies
+ * this capture for open_history_reader().  Returns false if there is no completed
+ * capture. */
+bool get_history_length(
+    struct capture_buffer *buffer, uint64_t *length, unsigned int *generation);
+
+/* Opens the reader on the data of the given completed capture, starting with
+ * the block containing the given byte offset, or with the oldest block still
+ * in the buffer if this data has been overwritten.  The offset of the first
+ * block returned is returned.  Returns false if the capture is no longer
+ * available.  A new capture can start while the reader is open, in which case
+ * the reader is overrun if the new capture overwrites data not yet read. */
+bool open_history_reader(
+    struct reader_state *reader, unsigned int generation,
+    uint64_t offset, uint64_t *block_offset);
+
 /* Closes a previously opened reader connection, returns status.  The reader can
  * now be recycled by calling open_reader() again. */
 enum reader_status close_reader(struct reader_state *reader);
@@ -71,13 +141,60 @@ enum reader_status close_reader(struct reader_state *reader);
 
 /* Blocks until an entire block_size block is available to be read out, returns
  * pointer to data to be read.  Call this repeatedly to advance through the
- * buffer, returns NULL once no more data available. */
+ * buffer, returns NULL once no more data available.  On timeout a zero length
+ * block is returned.  As for open_reader(), if timeout is NULL this returns
+ * at once, and the reader's event will be signalled when there is more to
+ * read. */
 const void *get_read_block(
     struct reader_state *reader,
     const struct timespec *timeout, size_t *length);
 
+/* Returns the sequence number of the block most recently returned by
+ * get_read_block().  All readers see the same sequence number for the same
+ * block, and sequence numbers are not reused by later captures until the
+ * counter wraps. */
+unsigned int read_block_sequence(struct reader_state *reader);
+
+/* Returns the number of blocks of this reader's capture published by the
+ * writer but not yet returned to this reader by get_read_block(). */
+unsigned int read_block_backlog(struct reader_state *reader);
+
+/* Returns the number of bytes published by the writer but not yet returned to
+ * this reader.  Only approximate if the reader has been overrun. */
+uint64_t read_byte_backlog(struct reader_state *reader);
+
+/* Returns the time the block most recently returned by get_read_block() was
+ * published by the writer, as returned by get_latency_time().  Only valid if
+ * check_read_block() succeeds. */
+uint64_t read_block_time(struct reader_state *reader);
+
+/* Returns the number of bytes written to this reader's capture up to the end of
+ * the block most recently returned by get_read_block().  Only valid if
+ * check_read_block() succeeds. */
+uint64_t read_block_end_offset(struct reader_state *reader);
+
+/* Returns the time this reader's capture was started by the writer. */
+uint64_t read_capture_start_time(struct reader_state *reader);
+
 /* Returns true if the current read block remains valid, returns false if the
  * buffer has been reset or if the current read block has been overwritten.
  * This MUST be called after consuming the contents of the block returned by
  * get_read_block. */
 bool check_read_block(struct reader_state *reader);
+
+/* As for check_read_block(), but checks an earlier block given by the sequence
+ * number returned by read_block_sequence() when it was read.  This is for
+ * blocks still being read asynchronously after later blocks have been
+ * returned. */
+bool check_read_block_sequence(struct reader_state *reader, unsigned int seq);
+
+/* Returns the number of blocks the writer can publish before the block with the
+ * given sequence number is overwritten, or zero if it already has been. */
+unsigned int read_block_headroom(struct reader_state *reader, unsigned int seq);
+
+/* If the reader has been overrun this moves it on to read_margin blocks behind
+ * the writer so that reading can continue, and returns the capture stream
+ * offset of the next block to be read.  Returns false if the reader has not
+ * been overrun. */
+bool resync_reader(
+    struct reader_state *reader, unsigned int read_margin, uint64_t *offset);
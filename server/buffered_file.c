@@ -5,6 +5,13 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 
 #include "error.h"
 
@@ -41,13 +48,201 @@ struct buffered_file {
     size_t out_buf_size;        // Length of output buffer
     char *in_buf;               // Input buffer
     char *out_buf;              // Output buffer
+
+    /* On a non-blocking socket any output the socket won't take straight away
+     * is copied here, and is sent by send_out_queue() once the socket can take
+     * more.  Nothing is sent directly while anything is queued. */
+    bool nonblocking;           // Set once socket is non-blocking
+    char *queue;                // Output waiting for the socket
+    size_t queue_start;         // Start of unsent data in queue
+    size_t queue_length;        // Length of unsent data in queue
+    size_t queue_size;          // Allocated size of queue
+
+    /* Zero copy transmission state.  Every successful MSG_ZEROCOPY send is
+     * numbered by the kernel, and completions are reported on the socket error
+     * queue as ranges of these numbers. */
+    bool zero_copy;             // Set if MSG_ZEROCOPY enabled on socket
+    uint32_t zero_copy_sent;    // Number of zero copy sends issued
+    uint32_t zero_copy_done;    // Number of zero copy sends completed
+
+    /* Transmission statistics. */
+    uint64_t bytes_sent;        // Total bytes written to socket
+    uint64_t send_ns;           // Total time spent in writing
 };
 
 
-/* Does what is necessary to send the entire given buffer to the socket. */
+/* These definitions are missing from older C library headers.  If the kernel
+ * doesn't support zero copy then enabling it will simply fail. */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY                 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY                0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY       5
+#define SO_EE_CODE_ZEROCOPY_COPIED  1
+#endif
+
+/* Zero copy is only worth using for large transfers: for small transfers the
+ * cost of page pinning and completion handling outweighs the copy. */
+#define ZERO_COPY_THRESHOLD     16384
+
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1000000000 * (uint64_t) now.tv_sec + (uint64_t) now.tv_nsec;
+}
+
+
+/* Accounts for a completed send started at the given time. */
+static void update_send_stats(
+    struct buffered_file *file, uint64_t start, size_t length)
+{
+    file->bytes_sent += length;
+    file->send_ns += get_time_ns() - start;
+}
+
+
+/* Copies the given buffers onto the end of the output queue, making room as
+ * necessary. */
+static void queue_iovec(
+    struct buffered_file *file, const struct iovec iov[], size_t count)
+{
+    size_t length = 0;
+    for (size_t i = 0; i < count; i ++)
+        length += iov[i].iov_len;
+
+    if (file->queue_start + file->queue_length + length > file->queue_size)
+    {
+        /* Move the queued data to the start of the queue, and grow the queue
+         * if that doesn't leave enough room. */
+        memmove(file->queue, file->queue + file->queue_start,
+            file->queue_length);
+        file->queue_start = 0;
+        if (file->queue_length + length > file->queue_size)
+        {
+            file->queue_size = MAX(
+                2 * file->queue_size, file->queue_length + length);
+            file->queue = realloc(file->queue, file->queue_size);
+        }
+    }
+
+    char *tail = file->queue + file->queue_start + file->queue_length;
+    for (size_t i = 0; i < count; i ++)
+    {
+        memcpy(tail, iov[i].iov_base, iov[i].iov_len);
+        tail += iov[i].iov_len;
+    }
+    file->queue_length += length;
+}
+
+
+/* Sends as much of the output queue as the socket will take. */
+static void send_queue(struct buffered_file *file)
+{
+    uint64_t start = get_time_ns();
+    size_t queued = file->queue_length;
+    while (!file->error  &&  file->queue_length > 0)
+    {
+        ssize_t written = send(file->sock,
+            file->queue + file->queue_start, file->queue_length, 0);
+        if (written < 0  &&  errno == EAGAIN)
+            break;
+        file->error =
+            TEST_IO_(written, "Error writing to socket")  ?:
+            DO( file->queue_start += (size_t) written;
+                file->queue_length -= (size_t) written);
+    }
+    if (file->queue_length == 0)
+        file->queue_start = 0;
+    update_send_stats(file, start, queued - file->queue_length);
+}
+
+
+/* Sends the entire given array of buffers with as few calls to sendmsg() as
+ * possible.  The iovec array is updated as data is sent.  On a non-blocking
+ * socket whatever the socket won't take is queued instead, and nothing is sent
+ * until the queue is empty. */
+static void send_entire_iovec(
+    struct buffered_file *file, struct iovec iov[], size_t count, int flags)
+{
+    uint64_t start = get_time_ns();
+    size_t sent = 0;
+    if (file->queue_length > 0)
+        send_queue(file);
+    while (!file->error  &&  count > 0)
+    {
+        if (file->queue_length > 0)
+        {
+            queue_iovec(file, iov, count);
+            break;
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count, };
+        ssize_t written = sendmsg(file->sock, &msg, flags);
+        if (file->nonblocking  &&  written < 0  &&  errno == EAGAIN)
+        {
+            queue_iovec(file, iov, count);
+            break;
+        }
+        else if (written < 0  &&  errno == ENOBUFS  &&  (flags & MSG_ZEROCOPY))
+        {
+            /* The kernel refuses zero copy sends when we have too many pages
+             * pinned by sends still in flight (the optmem and locked memory
+             * limits).  This is transient, so just send this block by copying
+             * instead.  As zero_copy_sent doesn't move the caller will see
+             * that this block was copied. */
+            flags &= ~MSG_ZEROCOPY;
+            continue;
+        }
+        file->error = TEST_IO_(written, "Error writing to socket");
+        if (!file->error)
+        {
+            if (flags & MSG_ZEROCOPY)
+                file->zero_copy_sent += 1;
+
+            /* Step over the buffers we've sent and trim the next one. */
+            size_t length = (size_t) written;
+            sent += length;
+            while (count > 0  &&  length >= iov->iov_len)
+            {
+                length -= iov->iov_len;
+                iov += 1;
+                count -= 1;
+            }
+            if (count > 0)
+            {
+                iov->iov_base += length;
+                iov->iov_len -= length;
+            }
+        }
+    }
+    update_send_stats(file, start, sent);
+}
+
+
+/* Does what is necessary to send the entire given buffer to the socket.  This
+ * is also used for files which aren't sockets, so unless the socket has been
+ * made non-blocking we write directly. */
 static void send_entire_buffer(
     struct buffered_file *file, const void *buffer, size_t length)
 {
+    if (length == 0)
+        return;
+    else if (file->nonblocking)
+    {
+        struct iovec iov = {
+            .iov_base = CAST_FROM_TO(const void *, void *, buffer),
+            .iov_len = length, };
+        send_entire_iovec(file, &iov, 1, 0);
+        return;
+    }
+
+    uint64_t start = get_time_ns();
+    size_t to_send = length;
     while (!file->error  &&  length > 0)
     {
         ssize_t written;
@@ -57,6 +252,58 @@ static void send_entire_buffer(
             DO( length -= (size_t) written;
                 buffer += (size_t) written);
     }
+    update_send_stats(file, start, to_send - length);
+}
+
+
+/* Reads zero copy completions from the socket error queue.  If the kernel
+ * reports that it had to copy the data anyway (this happens on loopback, for
+ * instance) then we stop using zero copy on this socket. */
+static void read_zero_copy_completions(struct buffered_file *file)
+{
+    char control[128];
+    struct msghdr msg = {
+        .msg_control = control, .msg_controllen = sizeof(control), };
+    while (recvmsg(file->sock, &msg, MSG_ERRQUEUE) >= 0)
+    {
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            struct sock_extended_err *error =
+                CAST_FROM_TO(unsigned char *, struct sock_extended_err *,
+                    CMSG_DATA(cmsg));
+            if (error->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+            {
+                /* ee_data is the number of the last completed send. */
+                file->zero_copy_done = error->ee_data + 1;
+                if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                    file->zero_copy = false;
+            }
+        }
+        msg.msg_controllen = sizeof(control);
+    }
+}
+
+
+/* Send numbers wrap, so mark has completed if zero_copy_done has reached or
+ * passed it. */
+static bool zero_copy_complete(struct buffered_file *file, uint32_t mark)
+{
+    return (int32_t) (file->zero_copy_done - mark) >= 0;
+}
+
+
+uint32_t get_zero_copy_mark(struct buffered_file *file)
+{
+    return file->zero_copy_sent;
+}
+
+
+bool poll_zero_copy(struct buffered_file *file, uint32_t mark)
+{
+    if (!zero_copy_complete(file, mark))
+        read_zero_copy_completions(file);
+    return zero_copy_complete(file, mark);
 }
 
 
@@ -133,6 +380,56 @@ bool read_line(
 }
 
 
+/* As for read_line(), but on a non-blocking socket, and any partial line is
+ * kept in the input buffer until the rest arrives. */
+bool try_read_line(
+    struct buffered_file *file, char line[], size_t line_size, bool *complete)
+{
+    *complete = false;
+    while (!file->eof  &&  !file->error)
+    {
+        size_t data_avail = file->in_length - file->read_ptr;
+        char *data_start = file->in_buf + file->read_ptr;
+        char *newline = memchr(data_start, '\n', data_avail);
+        if (newline)
+        {
+            size_t line_length = (size_t) (newline - data_start);
+            file->error = TEST_OK_(line_length + 1 < line_size, "Line overrun");
+            if (file->error)
+                return false;
+            else
+            {
+                memcpy(line, data_start, line_length);
+                file->read_ptr += line_length + 1;
+                line[line_length] = '\0';
+                *complete = true;
+                return true;
+            }
+        }
+
+        /* Move the partial line to the start of the buffer and read more. */
+        file->error = TEST_OK_(
+            data_avail + 1 < line_size  &&  data_avail < file->in_buf_size,
+            "Line overrun");
+        if (file->error)
+            return false;
+        memmove(file->in_buf, data_start, data_avail);
+        file->read_ptr = 0;
+        file->in_length = data_avail;
+
+        ssize_t seen = read(file->sock,
+            file->in_buf + data_avail, file->in_buf_size - data_avail);
+        if (seen < 0  &&  errno == EAGAIN)
+            return true;
+        file->error =
+            TEST_IO_(seen, "Error reading from socket")  ?:
+            DO( file->eof = seen == 0;
+                file->in_length += (size_t) seen);
+    }
+    return false;
+}
+
+
 /* This reads a fixed size block of data, returns false if the entire block
  * cannot be read for any reason. */
 bool read_block(struct buffered_file *file, char data[], size_t length)
@@ -221,6 +518,29 @@ bool write_block(struct buffered_file *file, const void *buffer, size_t length)
 }
 
 
+/* Flushes first if the requested space isn't free, so the whole buffer is
+ * available for a single reservation. */
+char *reserve_out_buf(struct buffered_file *file, size_t length)
+{
+    if (file->out_length + length > file->out_buf_size)
+        flush_out_buf(file);
+    if (file->error  ||  length > file->out_buf_size)
+        return NULL;
+    else
+        return file->out_buf + file->out_length;
+}
+
+
+/* As for write_char() we keep room for one more character by flushing when the
+ * buffer is full. */
+void commit_out_buf(struct buffered_file *file, size_t length)
+{
+    file->out_length += length;
+    if (file->out_length >= file->out_buf_size)
+        flush_out_buf(file);
+}
+
+
 /* As we guarantee that there's always room for one character in the output
  * buffer (we always flush when full) this function can be quite simple. */
 bool write_char(struct buffered_file *file, char ch)
@@ -235,6 +555,82 @@ bool write_char(struct buffered_file *file, char ch)
 }
 
 
+/* With zero copy the last block is sent on its own, as everything before it is
+ * in buffers which our callers reuse as soon as we return. */
+bool write_blocks(
+    struct buffered_file *file, const struct iovec *iov, size_t count)
+{
+    /* Gather any pending output and all the given blocks into one send. */
+    struct iovec blocks[count + 1];
+    blocks[0] = (struct iovec) {
+        .iov_base = file->out_buf, .iov_len = file->out_length, };
+    for (size_t i = 0; i < count; i ++)
+        blocks[i + 1] = iov[i];
+
+    bool zero_copy = file->zero_copy  &&  count > 0  &&
+        iov[count - 1].iov_len >= ZERO_COPY_THRESHOLD;
+    if (zero_copy)
+    {
+        send_entire_iovec(file, blocks, count, MSG_MORE);
+        send_entire_iovec(file, &blocks[count], 1, MSG_ZEROCOPY);
+    }
+    else
+        send_entire_iovec(file, blocks, count + 1, 0);
+    file->out_length = 0;
+    return !file->error;
+}
+
+
+error__t set_nonblocking(struct buffered_file *file)
+{
+    int flags;
+    return
+        TEST_IO(flags = fcntl(file->sock, F_GETFL))  ?:
+        TEST_IO(fcntl(file->sock, F_SETFL, flags | O_NONBLOCK))  ?:
+        DO(file->nonblocking = true);
+}
+
+
+bool send_out_queue(struct buffered_file *file)
+{
+    send_queue(file);
+    return !file->error;
+}
+
+
+size_t get_out_queue_length(struct buffered_file *file)
+{
+    return file->queue_length;
+}
+
+
+/* Zero copy completions are reported as errors on the socket, so this has to be
+ * called whenever the socket reports an error, or the error condition will
+ * persist. */
+bool check_socket_error(struct buffered_file *file)
+{
+    read_zero_copy_completions(file);
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (!file->error)
+        file->error =
+            TEST_IO(getsockopt(
+                file->sock, SOL_SOCKET, SO_ERROR, &error, &length))  ?:
+            TEST_OK_(error == 0, "Socket error: %s", strerror(error));
+    return !file->error;
+}
+
+
+bool enable_zero_copy(struct buffered_file *file)
+{
+    int enable = 1;
+    file->zero_copy = file->zero_copy  ||
+        setsockopt(file->sock, SOL_SOCKET, SO_ZEROCOPY,
+            &enable, sizeof(enable)) == 0;
+    return file->zero_copy;
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 
@@ -257,6 +653,7 @@ error__t destroy_buffered_file(struct buffered_file *file)
     error__t error = file->error;
     free(file->in_buf);
     free(file->out_buf);
+    free(file->queue);
     free(file);
     return error;
 }
@@ -265,3 +662,19 @@ bool check_buffered_file(struct buffered_file *file)
 {
     return !file->error;
 }
+
+void fail_buffered_file(struct buffered_file *file, error__t error)
+{
+    if (file->error)
+        error_discard(error);
+    else
+        file->error = error;
+}
+
+
+void get_send_stats(
+    struct buffered_file *file, uint64_t *bytes_sent, uint64_t *send_ns)
+{
+    *bytes_sent = file->bytes_sent;
+    *send_ns = file->send_ns;
+}
@@ -4,6 +4,7 @@
  * use than dup(2)ing the socket and using fdopen anyway. */
 
 struct buffered_file;
+struct iovec;
 
 /* Reads one newline terminated line from file.  Returns false if EOF is
  * encountered, or if the line buffer overruns.  If flush is requested then any
@@ -11,6 +12,13 @@ struct buffered_file;
 bool read_line(
     struct buffered_file *file, char line[], size_t line_size, bool flush);
 
+/* Reads one line from a non-blocking socket without waiting.  Returns false if
+ * EOF or an error is encountered or if the line buffer overruns, otherwise
+ * complete is set if a line has been returned.  Any partial line is kept until
+ * the rest of the line arrives. */
+bool try_read_line(
+    struct buffered_file *file, char line[], size_t line_size, bool *complete);
+
 /* Reads fixed size block of data, returns false if EOF or error encountered
  * before block filled. */
 bool read_block(struct buffered_file *file, char data[], size_t length);
@@ -28,6 +36,55 @@ bool __attribute__((format(printf, 2, 3))) write_formatted_string(
  * flushed if necessary. */
 bool write_block(struct buffered_file *file, const void *buffer, size_t length);
 
+/* Writes any pending output followed by the given array of blocks with a single
+ * gathered send where possible.  If zero copy has been enabled and the last
+ * block is large it is sent without copying, and this returns before the
+ * kernel has released it: the sent data must then remain unchanged until
+ * poll_zero_copy() reports completion of the mark returned by
+ * get_zero_copy_mark() after this call.  Data which has to be queued is always
+ * copied, as is a block the kernel has no room to send without copying. */
+bool write_blocks(
+    struct buffered_file *file, const struct iovec *iov, size_t count);
+
+/* Enables zero copy transmission with MSG_ZEROCOPY for subsequent calls to
+ * write_blocks(), returns false if not supported. */
+bool enable_zero_copy(struct buffered_file *file);
+
+/* Returns a mark identifying the most recent zero copy send.  The mark only
+ * changes when write_blocks() sends without copying. */
+uint32_t get_zero_copy_mark(struct buffered_file *file);
+
+/* Collects any zero copy completions without blocking and returns true if all
+ * sends up to and including mark have completed. */
+bool poll_zero_copy(struct buffered_file *file, uint32_t mark);
+
+/* Switches the socket to non-blocking mode.  From now on output is never
+ * blocked: anything the socket can't take at once is queued, to be sent by
+ * send_out_queue() once the socket can take more data.  Input should now be
+ * read with try_read_line(). */
+error__t set_nonblocking(struct buffered_file *file);
+
+/* Sends as much queued output as the socket will take, returns false if unable
+ * to write for any reason. */
+bool send_out_queue(struct buffered_file *file);
+
+/* Returns the number of bytes of output queued waiting for the socket. */
+size_t get_out_queue_length(struct buffered_file *file);
+
+/* Collects any zero copy completions and any pending socket error.  Must be
+ * called when an error condition is reported on the socket, returns false if
+ * the socket has failed. */
+bool check_socket_error(struct buffered_file *file);
+
+/* Returns space for length characters in the output buffer, flushing it first
+ * if necessary, so that output can be formatted in place.  NULL is returned if
+ * the buffer is too small or on error.  Must be followed by a call to
+ * commit_out_buf() with the number of characters actually written. */
+char *reserve_out_buf(struct buffered_file *file, size_t length);
+
+/* Completes a write started with reserve_out_buf(). */
+void commit_out_buf(struct buffered_file *file, size_t length);
+
 /* Writes a single character to output. */
 bool write_char(struct buffered_file *file, char ch);
 
@@ -46,3 +103,12 @@ error__t destroy_buffered_file(struct buffered_file *file);
 /* Returns the error status of the buffered file.  If false is returned then an
  * error condition has been detected. */
 bool check_buffered_file(struct buffered_file *file);
+
+/* Records an error detected by the caller, after which all IO fails.  If an
+ * error has already been recorded the new error is discarded. */
+void fail_buffered_file(struct buffered_file *file, error__t error);
+
+/* Returns the number of bytes written to the socket so far and the total time
+ * in nanoseconds spent writing them, including any time blocked. */
+void get_send_stats(
+    struct buffered_file *file, uint64_t *bytes_sent, uint64_t *send_ns);
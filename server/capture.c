@@ -3,7 +3,6 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <inttypes.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
@@ -17,6 +16,8 @@
 #include "output.h"
 #include "hardware.h"
 #include "prepare.h"
+#include "scaling.h"
+#include "number_format.h"
 
 #include "capture.h"
 
@@ -28,11 +29,68 @@ struct field_group {
     size_t scaling;     // Index of first scaling entry for this group
 };
 
-struct scaling {
-    double scale;
-    double offset;
+
+/* A conversion plan is compiled for each data process when capture is prepared.
+ * It consists of a short list of copy and averaging operations applied to each
+ * sample, with adjacent copies coalesced, followed by a single vectorised pass
+ * over the block for any scaled fields.  The convert function is chosen to suit
+ * the plan, so common layouts reduce to a simple copy. */
+#define MAX_CONVERSION_OPS  2
+
+struct conversion_plan {
+    void (*convert)(
+        const struct data_capture *capture, const struct conversion_plan *plan,
+        unsigned int sample_count, const uint32_t input[], void *output);
+    size_t output_length;       // Bytes per converted sample
+    bool scaled;                // Set if scaled fields need converting
+    unsigned int op_count;
+    struct conversion_op {
+        enum conversion_opcode {
+            OP_COPY,            // Copy count bytes unchanged
+            OP_AVERAGE,         // Average count 64-bit sums to 32-bit values
+        } opcode;
+        size_t input;           // Word index of first input field
+        size_t output;          // Byte offset of first output value
+        size_t count;
+    } ops[MAX_CONVERSION_OPS];
+};
+
+
+/* Similarly, ASCII formatting is compiled into runs of values of the same type
+ * for each data process. */
+#define MAX_FORMAT_RUNS     4
+
+struct format_plan {
+    unsigned int run_count;
+    struct format_run {
+        enum ascii_format {
+            ASCII_UINT32,
+            ASCII_INT32,
+            ASCII_INT64,
+            ASCII_DOUBLE,
+        } format;
+        size_t count;
+    } runs[MAX_FORMAT_RUNS];
 };
 
+
+/* When the data rate is reduced by averaging, each bucket of samples is
+ * combined according to what the field captures.  Fields without a rule, such
+ * as bit fields and timestamps, take their value from the first sample. */
+struct reduction_rule {
+    enum reduction_op {
+        REDUCE_SUM32,           // Modulo 32-bit sum: sample count and Diff
+        REDUCE_SUM64,           // 64-bit sum: Sum and the Mean accumulators
+        REDUCE_MIN,             // Signed 32-bit minimum
+        REDUCE_MAX,             // Signed 32-bit maximum
+        REDUCE_MEAN,            // Signed 32-bit mean of Value fields
+    } op;
+    size_t index;               // Word index of field in raw sample
+};
+
+
+#define DATA_PROCESS_COUNT  (DATA_PROCESS_SCALED + 1)
+
 /* This structure defines the process for generating data capture. */
 struct data_capture {
     /* Number words in a single sample. */
@@ -50,7 +108,32 @@ struct data_capture {
     struct field_group averaged;    // 64-bit accumulated sums
 
     /* Arrays of constants for scaling. */
-    struct scaling scaling[MAX_CAPTURE_COUNT];
+    double scale[MAX_CAPTURE_COUNT];
+    double offset[MAX_CAPTURE_COUNT];
+
+    /* Layout of scaled fields for vectorised conversion. */
+    struct scaled_layout scaled_layout;
+
+    /* Compiled conversion and formatting for each data process. */
+    struct conversion_plan conversion[DATA_PROCESS_COUNT];
+    struct format_plan format[DATA_PROCESS_COUNT];
+
+    /* Rules for averaging buckets of raw samples. */
+    unsigned int reduction_rule_count;
+    struct reduction_rule reduction_rules[MAX_CAPTURE_COUNT];
+
+    /* Hardware capture index of each raw word. */
+    unsigned int capture_index[MAX_CAPTURE_COUNT];
+
+    /* A projected capture is built from words taken from each sample of the
+     * full capture, copied in coalesced runs. */
+    size_t source_sample_words;     // Words in full sample, 0 if not projected
+    unsigned int projection_run_count;
+    struct projection_run {
+        size_t input;               // Word index in full sample
+        size_t output;              // Word index in projected sample
+        size_t count;               // Number of words to copy
+    } projection_runs[MAX_CAPTURE_COUNT];
 };
 
 
@@ -95,131 +178,98 @@ struct data_capture {
  * */
 
 
-/* Copies given fields unprocessed to output. */
-static size_t copy_unscaled_fields(
-    const struct field_group *fields, const uint32_t input[],
-    void *output, size_t field_size)
-{
-    memcpy(output, &input[fields->index], field_size * fields->count);
-    return field_size * fields->count;
-}
-
-
-
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Unscaled conversion. */
-
-
 /* Averaging of unscaled data. */
-static size_t average_unscaled_data(
-    const struct data_capture *capture,
-    const uint32_t input[], uint32_t output[])
+static void average_unscaled_data(
+    const struct data_capture *capture, const struct conversion_op *op,
+    const uint32_t input[], void *output)
 {
-    const int64_t *averages = (const void *) &input[capture->averaged.index];
+    const int64_t *averages = (const void *) &input[op->input];
+    uint32_t *values = output + op->output;
     uint32_t sample_count = input[capture->sample_count_index];
     if (sample_count == 0)
         sample_count = 1;
-    for (size_t i = 0; i < capture->averaged.count; i ++)
-        output[i] = (uint32_t) (averages[i] / sample_count);
-    return sizeof(uint32_t) * capture->averaged.count;
+    for (size_t i = 0; i < op->count; i ++)
+        values[i] = (uint32_t) (averages[i] / sample_count);
 }
 
 
-/* For unscaled data the only conversion we do is averaging.  The remaining
- * values are copied unchanged. */
-static void convert_unscaled_data(
-    const struct data_capture *capture,
+/* Runs the compiled operations over each sample, followed by scaling. */
+static void convert_generic(
+    const struct data_capture *capture, const struct conversion_plan *plan,
     unsigned int sample_count, const uint32_t input[], void *output)
 {
+    const uint32_t *sample_input = input;
+    void *sample_output = output;
     for (unsigned int i = 0; i < sample_count; i ++)
     {
-        /* Copy over the unscaled and scaled values. */
-        output += copy_unscaled_fields(
-            &capture->unscaled, input, output, sizeof(uint32_t));
-        output += copy_unscaled_fields(
-            &capture->scaled32, input, output, sizeof(uint32_t));
-        output += copy_unscaled_fields(
-            &capture->scaled64, input, output, sizeof(uint64_t));
-
-        /* Process the averaged values. */
-        output += average_unscaled_data(capture, input, output);
-
-        input += capture->raw_sample_words;
+        for (unsigned int j = 0; j < plan->op_count; j ++)
+        {
+            const struct conversion_op *op = &plan->ops[j];
+            switch (op->opcode)
+            {
+                case OP_COPY:
+                    memcpy(sample_output + op->output,
+                        &sample_input[op->input], op->count);
+                    break;
+                case OP_AVERAGE:
+                    average_unscaled_data(
+                        capture, op, sample_input, sample_output);
+                    break;
+            }
+        }
+        sample_input += capture->raw_sample_words;
+        sample_output += plan->output_length;
     }
-}
-
-
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Scaled conversion. */
 
-static size_t convert_scaled32(
-    const struct data_capture *capture, const uint32_t input[], double output[])
-{
-    const int32_t *input_32 = (const void *) &input[capture->scaled32.index];
-    const struct scaling *scaling =
-        &capture->scaling[capture->scaled32.scaling];
-    for (size_t i = 0; i < capture->scaled32.count; i ++)
-        output[i] = scaling[i].scale * input_32[i] + scaling[i].offset;
-    return sizeof(double) * capture->scaled32.count;
+    if (plan->scaled)
+        convert_scaled_samples(
+            &capture->scaled_layout, sample_count, input, output);
 }
 
 
-static size_t convert_scaled64(
-    const struct data_capture *capture, const uint32_t input[], double output[])
-{
-    const int64_t *input_64 = (const void *) &input[capture->scaled64.index];
-    const struct scaling *scaling =
-        &capture->scaling[capture->scaled64.scaling];
-    for (size_t i = 0; i < capture->scaled64.count; i ++)
-        output[i] = scaling[i].scale * (double) input_64[i] + scaling[i].offset;
-    return sizeof(double) * capture->scaled64.count;
-}
-
-
-static size_t average_scaled_data(
-    const struct data_capture *capture, const uint32_t input[], double output[])
+/* Output is identical to input, so the whole block is copied at once. */
+static void convert_block_copy(
+    const struct data_capture *capture, const struct conversion_plan *plan,
+    unsigned int sample_count, const uint32_t input[], void *output)
 {
-    const int64_t *input_64 = (const void *) &input[capture->averaged.index];
-    const struct scaling *scaling =
-        &capture->scaling[capture->averaged.scaling];
-    uint32_t sample_count = input[capture->sample_count_index];
-    if (sample_count == 0)
-        sample_count = 1;
-    for (size_t i = 0; i < capture->averaged.count; i ++)
-        output[i] =
-            scaling[i].scale * (double) input_64[i] / sample_count +
-            scaling[i].offset;
-    return sizeof(double) * capture->averaged.count;
+    memcpy(output, input, sample_count * plan->output_length);
 }
 
 
-static void convert_scaled_data(
-    const struct data_capture *capture,
+/* Output is a single contiguous part of each input sample. */
+static void convert_strided_copy(
+    const struct data_capture *capture, const struct conversion_plan *plan,
     unsigned int sample_count, const uint32_t input[], void *output)
 {
+    const struct conversion_op *op = &plan->ops[0];
     for (unsigned int i = 0; i < sample_count; i ++)
     {
-        /* Capture the unscaled values. */
-        output += copy_unscaled_fields(
-            &capture->unscaled, input, output, sizeof(uint32_t));
-
-        /* Perform all the scaling. */
-        output += convert_scaled32(capture, input, output);
-        output += convert_scaled64(capture, input, output);
-        output += average_scaled_data(capture, input, output);
-
+        memcpy(output, &input[op->input], op->count);
         input += capture->raw_sample_words;
+        output += plan->output_length;
     }
 }
 
 
+/* Output consists only of scaled fields. */
+static void convert_scaled_only(
+    const struct data_capture *capture, const struct conversion_plan *plan,
+    unsigned int sample_count, const uint32_t input[], void *output)
+{
+    convert_scaled_samples(
+        &capture->scaled_layout, sample_count, input, output);
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 /* Conversion. */
 
 
 size_t get_raw_sample_length(const struct data_capture *capture)
 {
-    ASSERT_OK(capture->raw_sample_words > 0);
+    /* Only a projection can be empty. */
+    ASSERT_OK(
+        capture->raw_sample_words > 0  ||  capture->source_sample_words > 0);
     return sizeof(uint32_t) * capture->raw_sample_words;
 }
 
@@ -227,28 +277,7 @@ size_t get_raw_sample_length(const struct data_capture *capture)
 size_t get_binary_sample_length(
     const struct data_capture *capture, const struct data_options *options)
 {
-    size_t length = 0;
-    switch (options->data_process)
-    {
-        case DATA_PROCESS_RAW:
-            length = sizeof(uint32_t) * capture->raw_sample_words;
-            break;
-        case DATA_PROCESS_UNSCALED:
-            length =
-                sizeof(uint32_t) * (
-                    capture->unscaled.count + capture->scaled32.count +
-                    capture->averaged.count) +
-                sizeof(uint64_t) * capture->scaled64.count;
-            break;
-        case DATA_PROCESS_SCALED:
-            length =
-                sizeof(uint32_t) * capture->unscaled.count +
-                sizeof(double) * (
-                    capture->scaled32.count + capture->scaled64.count +
-                    capture->averaged.count);
-            break;
-    }
-    return length;
+    return capture->conversion[options->data_process].output_length;
 }
 
 
@@ -256,19 +285,9 @@ void convert_raw_data_to_binary(
     const struct data_capture *capture, struct data_options *options,
     unsigned int sample_count, const void *input, void *output)
 {
-    switch (options->data_process)
-    {
-        case DATA_PROCESS_RAW:
-            memcpy(output, input,
-                sample_count * get_raw_sample_length(capture));
-            break;
-        case DATA_PROCESS_UNSCALED:
-            convert_unscaled_data(capture, sample_count, input, output);
-            break;
-        case DATA_PROCESS_SCALED:
-            convert_scaled_data(capture, sample_count, input, output);
-            break;
-    }
+    const struct conversion_plan *plan =
+        &capture->conversion[options->data_process];
+    plan->convert(capture, plan, sample_count, input, output);
 }
 
 
@@ -276,92 +295,281 @@ void convert_raw_data_to_binary(
 /* Output in ASCII. */
 
 
+/* Every field is formatted with a leading space into at most this many
+ * characters. */
+#define MAX_ASCII_FIELD_LENGTH  (MAX_NUMBER_LENGTH + 1)
+
 /* Helper routine for printing in ASCII format. */
 #define FORMAT_ASCII(count, data, format, type) \
     ( { \
         const type *values = data; \
         for (size_t i = 0; i < (count); i ++) \
-            write_formatted_string(file, format, values[i]); \
+        { \
+            *output++ = ' '; \
+            output = format(output, values[i]); \
+        } \
         (count) * sizeof(type); \
     } )
 
-#define PRIdouble   " %.10g"
+
+/* Formats a single run of values, returns updated output pointer. */
+static char *format_ascii_run(
+    const struct format_run *run, const void **data, char *output)
+{
+    switch (run->format)
+    {
+        case ASCII_UINT32:
+            *data += FORMAT_ASCII(run->count, *data, format_uint32, uint32_t);
+            break;
+        case ASCII_INT32:
+            *data += FORMAT_ASCII(run->count, *data, format_int32, int32_t);
+            break;
+        case ASCII_INT64:
+            *data += FORMAT_ASCII(run->count, *data, format_int64, int64_t);
+            break;
+        case ASCII_DOUBLE:
+            *data += FORMAT_ASCII(
+                run->count, *data, format_double_g10, double);
+            break;
+    }
+    return output;
+}
+
+
+unsigned int get_binary_field_types(
+    const struct data_capture *capture, const struct data_options *options,
+    enum field_type types[])
+{
+    static const enum field_type field_types[] = {
+        [ASCII_UINT32] = FIELD_TYPE_UINT32,
+        [ASCII_INT32]  = FIELD_TYPE_INT32,
+        [ASCII_INT64]  = FIELD_TYPE_INT64,
+        [ASCII_DOUBLE] = FIELD_TYPE_DOUBLE,
+    };
+    const struct format_plan *plan = &capture->format[options->data_process];
+    unsigned int field_count = 0;
+    for (unsigned int i = 0; i < plan->run_count; i ++)
+    {
+        const struct format_run *run = &plan->runs[i];
+        for (size_t j = 0; j < run->count; j ++)
+            types[field_count++] = field_types[run->format];
+    }
+    return field_count;
+}
+
+
+size_t get_max_ascii_sample_length(const struct data_capture *capture)
+{
+    /* Every output field occupies at least one raw word, so this is a safe
+     * bound for all conversions. */
+    return MAX_ASCII_FIELD_LENGTH * capture->raw_sample_words + 1;
+}
 
 
-/* Sends a single row of raw data formatted in ASCII. */
-static const void *send_raw_as_ascii(
-    const struct data_capture *capture,
-    struct buffered_file *file, const void *data)
+/* The data layout for each conversion is described by its format plan. */
+size_t format_binary_as_ascii(
+    const struct data_capture *capture, struct data_options *options,
+    unsigned int sample_count, const void *data, char *output)
 {
-    /* Note: unscaled.index here acts as a counter for the "hidden" fields. */
-    data += FORMAT_ASCII(
-        capture->unscaled.index + capture->unscaled.count, data,
-        " %"PRIu32, uint32_t);
-    data += FORMAT_ASCII(
-        capture->scaled32.count, data,
-        " %"PRIi32, int32_t);
-    data += FORMAT_ASCII(
-        capture->scaled64.count + capture->averaged.count, data,
-        " %"PRIi64, int64_t);
-    return data;
-}
-
-
-static const void *send_unscaled_as_ascii(
-    const struct data_capture *capture,
-    struct buffered_file *file, const void *data)
-{
-    data += FORMAT_ASCII(
-        capture->unscaled.count, data, " %"PRIu32, uint32_t);
-    data += FORMAT_ASCII(
-        capture->scaled32.count, data, " %"PRIi32, int32_t);
-    data += FORMAT_ASCII(
-        capture->scaled64.count, data, " %"PRIi64, int64_t);
-    data += FORMAT_ASCII(
-        capture->averaged.count, data, " %"PRIi32, int32_t);
-    return data;
-}
-
-
-static const void *send_scaled_as_ascii(
-    const struct data_capture *capture,
-    struct buffered_file *file, const void *data)
-{
-    data += FORMAT_ASCII(
-        capture->unscaled.count, data, " %"PRIu32, uint32_t);
-    data += FORMAT_ASCII(
-        capture->scaled32.count + capture->scaled64.count +
-        capture->averaged.count, data, PRIdouble, double);
-    return data;
+    const struct format_plan *plan = &capture->format[options->data_process];
+    char *start = output;
+    for (unsigned int i = 0; i < sample_count; i ++)
+    {
+        for (unsigned int j = 0; j < plan->run_count; j ++)
+            output = format_ascii_run(&plan->runs[j], &data, output);
+        *output++ = '\n';
+    }
+    return (size_t) (output - start);
 }
 
 
-/* We need to take the conversion into account to understand the data layout
- * when converting to ASCII numbers. */
 bool send_binary_as_ascii(
     const struct data_capture *capture, struct data_options *options,
     struct buffered_file *file, unsigned int sample_count, const void *data)
 {
+    size_t binary_sample_length = get_binary_sample_length(capture, options);
+    size_t max_line_length = get_max_ascii_sample_length(capture);
     for (unsigned int i = 0; i < sample_count; i ++)
     {
-        switch (options->data_process)
+        /* Format straight into the output buffer if there's room. */
+        char *line = reserve_out_buf(file, max_line_length);
+        if (line)
+            commit_out_buf(file,
+                format_binary_as_ascii(capture, options, 1, data, line));
+        else if (check_buffered_file(file))
         {
-            case DATA_PROCESS_RAW:
-                data = send_raw_as_ascii(capture, file, data);
-                break;
-            case DATA_PROCESS_UNSCALED:
-                data = send_unscaled_as_ascii(capture, file, data);
-                break;
-            case DATA_PROCESS_SCALED:
-                data = send_scaled_as_ascii(capture, file, data);
-                break;
+            char buffer[max_line_length];
+            size_t length =
+                format_binary_as_ascii(capture, options, 1, data, buffer);
+            write_string(file, buffer, length);
         }
-        write_char(file, '\n');
+        data += binary_sample_length;
     }
     return check_buffered_file(file);
 }
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Data rate reduction. */
+
+/* Samples are reduced in the raw domain so that the result can be converted
+ * and formatted exactly like captured data.  Because the sample count and the
+ * Mean sums are both added up over the bucket, the usual averaging on
+ * conversion gives the exact mean over all the samples in the bucket. */
+
+struct sample_reducer {
+    const struct data_capture *capture;
+    bool average;                   // Combine buckets, otherwise decimate
+    unsigned int bucket_size;       // Number of samples in each bucket
+    unsigned int count;             // Samples in current bucket so far
+    uint32_t first[MAX_CAPTURE_COUNT];      // First raw sample of bucket
+    int64_t totals[MAX_CAPTURE_COUNT];      // One accumulator for each rule
+};
+
+
+static int64_t read_rule_value(
+    const struct reduction_rule *rule, const uint32_t sample[])
+{
+    switch (rule->op)
+    {
+        case REDUCE_SUM32:
+            return sample[rule->index];
+        case REDUCE_SUM64:
+            return *(const int64_t *) (const void *) &sample[rule->index];
+        default:
+            return (int32_t) sample[rule->index];
+    }
+}
+
+
+static void start_bucket(
+    struct sample_reducer *reducer, const uint32_t sample[])
+{
+    const struct data_capture *capture = reducer->capture;
+    memcpy(reducer->first, sample, capture->raw_sample_words * sizeof(uint32_t));
+    if (reducer->average)
+        for (unsigned int i = 0; i < capture->reduction_rule_count; i ++)
+            reducer->totals[i] =
+                read_rule_value(&capture->reduction_rules[i], sample);
+}
+
+
+static void accumulate_bucket(
+    struct sample_reducer *reducer, const uint32_t sample[])
+{
+    const struct data_capture *capture = reducer->capture;
+    for (unsigned int i = 0; i < capture->reduction_rule_count; i ++)
+    {
+        const struct reduction_rule *rule = &capture->reduction_rules[i];
+        int64_t value = read_rule_value(rule, sample);
+        int64_t *total = &reducer->totals[i];
+        switch (rule->op)
+        {
+            case REDUCE_MIN:    *total = MIN(*total, value);    break;
+            case REDUCE_MAX:    *total = MAX(*total, value);    break;
+            default:
+                /* Wrap around like the hardware accumulators. */
+                *total = (int64_t) ((uint64_t) *total + (uint64_t) value);
+                break;
+        }
+    }
+}
+
+
+/* Writes the reduced bucket as a single raw sample. */
+static void emit_bucket(struct sample_reducer *reducer, uint32_t output[])
+{
+    const struct data_capture *capture = reducer->capture;
+    memcpy(output, reducer->first, capture->raw_sample_words * sizeof(uint32_t));
+    if (reducer->average)
+        for (unsigned int i = 0; i < capture->reduction_rule_count; i ++)
+        {
+            const struct reduction_rule *rule = &capture->reduction_rules[i];
+            int64_t total = reducer->totals[i];
+            switch (rule->op)
+            {
+                case REDUCE_SUM64:
+                    *(int64_t *) (void *) &output[rule->index] = total;
+                    break;
+                case REDUCE_MEAN:
+                    output[rule->index] =
+                        (uint32_t) (total / (int64_t) reducer->count);
+                    break;
+                default:
+                    output[rule->index] = (uint32_t) total;
+                    break;
+            }
+        }
+    reducer->count = 0;
+}
+
+
+struct sample_reducer *create_sample_reducer(
+    const struct data_capture *capture, const struct data_options *options)
+{
+    struct sample_reducer *reducer = malloc(sizeof(struct sample_reducer));
+    *reducer = (struct sample_reducer) {
+        .capture = capture,
+        .average = options->data_reduction == DATA_REDUCTION_AVERAGE,
+        .bucket_size = MAX(options->reduction_count, 1U),
+    };
+    return reducer;
+}
+
+
+void destroy_sample_reducer(struct sample_reducer *reducer)
+{
+    free(reducer);
+}
+
+
+void set_reducer_bucket_size(
+    struct sample_reducer *reducer, unsigned int bucket_size)
+{
+    reducer->bucket_size = MAX(bucket_size, 1U);
+}
+
+
+unsigned int reduce_samples(
+    struct sample_reducer *reducer, unsigned int sample_count,
+    const void *input, void *output)
+{
+    size_t sample_words = reducer->capture->raw_sample_words;
+    const uint32_t *sample = input;
+    uint32_t *reduced = output;
+    unsigned int reduced_count = 0;
+    for (unsigned int i = 0; i < sample_count; i ++)
+    {
+        if (reducer->count == 0)
+            start_bucket(reducer, sample);
+        else if (reducer->average)
+            accumulate_bucket(reducer, sample);
+        reducer->count += 1;
+
+        if (reducer->count >= reducer->bucket_size)
+        {
+            emit_bucket(reducer, reduced);
+            reduced += sample_words;
+            reduced_count += 1;
+        }
+        sample += sample_words;
+    }
+    return reduced_count;
+}
+
+
+unsigned int flush_sample_reducer(struct sample_reducer *reducer, void *output)
+{
+    if (reducer->count > 0)
+    {
+        emit_bucket(reducer, output);
+        return 1;
+    }
+    else
+        return 0;
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Data capture preparation. */
 
@@ -372,9 +580,46 @@ struct gather {
     unsigned int scaling_count;     // Number of entries written to scaling
     unsigned int capture_count;     // Number of entries to be captured
     unsigned int capture_index[MAX_CAPTURE_COUNT];   // List of capture indices
+    unsigned int sample_count_capture;  // Capture index of sample count
 };
 
 
+/* Works out how a field is combined when averaging a bucket of samples,
+ * returns false if the first sample in the bucket is used. */
+static bool get_reduction_op(
+    const struct gather *gather, const struct capture_info *field,
+    enum reduction_op *op)
+{
+    const char *capture = field->capture_string;
+    switch (field->capture_mode)
+    {
+        case CAPTURE_MODE_UNSCALED:
+            *op = REDUCE_SUM32;
+            return field->capture_index.index[0] == gather->sample_count_capture;
+        case CAPTURE_MODE_SCALED32:
+            if (strcmp(capture, "Value") == 0)
+                *op = REDUCE_MEAN;
+            else if (strcmp(capture, "Diff") == 0)
+                *op = REDUCE_SUM32;
+            else if (strcmp(capture, "Min") == 0)
+                *op = REDUCE_MIN;
+            else if (strcmp(capture, "Max") == 0)
+                *op = REDUCE_MAX;
+            else
+                return false;
+            return true;
+        case CAPTURE_MODE_SCALED64:
+            *op = REDUCE_SUM64;
+            return strcmp(capture, "Sum") == 0;
+        case CAPTURE_MODE_AVERAGE:
+            *op = REDUCE_SUM64;
+            return true;
+        default:
+            return false;
+    }
+}
+
+
 
 /* Emits a single output, returns index of captured value. */
 static unsigned int emit_capture(
@@ -388,12 +633,15 @@ static unsigned int emit_capture(
             field->capture_index.index[i];
     gather->capture_count += index_count;
 
+    enum reduction_op op;
+    if (get_reduction_op(gather, field, &op))
+        capture->reduction_rules[capture->reduction_rule_count++] =
+            (struct reduction_rule) { .op = op, .index = capture_index, };
+
     if (scaled)
     {
-        capture->scaling[gather->scaling_count] = (struct scaling) {
-            .scale = field->scale,
-            .offset = field->offset,
-        };
+        capture->scale[gather->scaling_count] = field->scale;
+        capture->offset[gather->scaling_count] = field->offset;
         gather->scaling_count += 1;
     }
 
@@ -468,30 +716,306 @@ static void gather_data_capture(
 }
 
 
-static struct data_capture data_capture_state;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Plan compilation. */
+
+
+/* Adds a copy of length bytes starting at the given input word, merging with
+ * the previous copy if both input and output are contiguous. */
+static void add_copy_op(
+    struct conversion_plan *plan, size_t input, size_t length)
+{
+    struct conversion_op *last =
+        plan->op_count > 0 ? &plan->ops[plan->op_count - 1] : NULL;
+    if (length == 0)
+        ;
+    else if (last  &&  last->opcode == OP_COPY  &&
+        sizeof(uint32_t) * last->input + last->count ==
+            sizeof(uint32_t) * input  &&
+        last->output + last->count == plan->output_length)
+        last->count += length;
+    else
+    {
+        ASSERT_OK(plan->op_count < MAX_CONVERSION_OPS);
+        plan->ops[plan->op_count++] = (struct conversion_op) {
+            .opcode = OP_COPY,
+            .input = input,
+            .output = plan->output_length,
+            .count = length,
+        };
+    }
+    plan->output_length += length;
+}
+
+
+static void add_average_op(
+    struct conversion_plan *plan, const struct field_group *fields)
+{
+    if (fields->count > 0)
+    {
+        ASSERT_OK(plan->op_count < MAX_CONVERSION_OPS);
+        plan->ops[plan->op_count++] = (struct conversion_op) {
+            .opcode = OP_AVERAGE,
+            .input = fields->index,
+            .output = plan->output_length,
+            .count = fields->count,
+        };
+        plan->output_length += sizeof(uint32_t) * fields->count;
+    }
+}
+
+
+static void add_scaled_fields(struct conversion_plan *plan, size_t count)
+{
+    plan->scaled = plan->scaled  ||  count > 0;
+    plan->output_length += sizeof(double) * count;
+}
+
+
+/* Picks the fastest convert function which can implement the plan. */
+static void choose_convert(
+    const struct data_capture *capture, struct conversion_plan *plan)
+{
+    const struct conversion_op *op = &plan->ops[0];
+    bool single_copy =
+        !plan->scaled  &&  plan->op_count == 1  &&  op->opcode == OP_COPY;
+    if (single_copy  &&
+        op->count == sizeof(uint32_t) * capture->raw_sample_words)
+        plan->convert = convert_block_copy;
+    else if (single_copy)
+        plan->convert = convert_strided_copy;
+    else if (plan->scaled  &&  plan->op_count == 0)
+        plan->convert = convert_scaled_only;
+    else
+        plan->convert = convert_generic;
+}
+
+
+static void add_format_run(
+    struct format_plan *plan, enum ascii_format format, size_t count)
+{
+    struct format_run *last =
+        plan->run_count > 0 ? &plan->runs[plan->run_count - 1] : NULL;
+    if (count == 0)
+        ;
+    else if (last  &&  last->format == format)
+        last->count += count;
+    else
+    {
+        ASSERT_OK(plan->run_count < MAX_FORMAT_RUNS);
+        plan->runs[plan->run_count++] = (struct format_run) {
+            .format = format,
+            .count = count,
+        };
+    }
+}
+
+
+static void compile_raw_plans(
+    struct data_capture *capture,
+    struct conversion_plan *conversion, struct format_plan *format)
+{
+    add_copy_op(conversion, 0,
+        sizeof(uint32_t) * capture->raw_sample_words);
+
+    /* Note: unscaled.index here acts as a counter for the "hidden" fields. */
+    add_format_run(format, ASCII_UINT32,
+        capture->unscaled.index + capture->unscaled.count);
+    add_format_run(format, ASCII_INT32, capture->scaled32.count);
+    add_format_run(format, ASCII_INT64,
+        capture->scaled64.count + capture->averaged.count);
+}
+
+
+/* For unscaled data the only conversion we do is averaging.  The remaining
+ * values are copied unchanged. */
+static void compile_unscaled_plans(
+    struct data_capture *capture,
+    struct conversion_plan *conversion, struct format_plan *format)
+{
+    add_copy_op(conversion, capture->unscaled.index,
+        sizeof(uint32_t) * capture->unscaled.count);
+    add_copy_op(conversion, capture->scaled32.index,
+        sizeof(uint32_t) * capture->scaled32.count);
+    add_copy_op(conversion, capture->scaled64.index,
+        sizeof(uint64_t) * capture->scaled64.count);
+    add_average_op(conversion, &capture->averaged);
+
+    add_format_run(format, ASCII_UINT32, capture->unscaled.count);
+    add_format_run(format, ASCII_INT32, capture->scaled32.count);
+    add_format_run(format, ASCII_INT64, capture->scaled64.count);
+    add_format_run(format, ASCII_INT32, capture->averaged.count);
+}
+
+
+static void compile_scaled_plans(
+    struct data_capture *capture,
+    struct conversion_plan *conversion, struct format_plan *format)
+{
+    size_t scaled_count =
+        capture->scaled32.count + capture->scaled64.count +
+        capture->averaged.count;
+    add_copy_op(conversion, capture->unscaled.index,
+        sizeof(uint32_t) * capture->unscaled.count);
+    add_scaled_fields(conversion, scaled_count);
+
+    add_format_run(format, ASCII_UINT32, capture->unscaled.count);
+    add_format_run(format, ASCII_DOUBLE, scaled_count);
+}
+
+
+static struct scaled_group prepare_scaled_group(
+    const struct data_capture *capture, const struct field_group *fields)
+{
+    return (struct scaled_group) {
+        .index = fields->index,
+        .count = fields->count,
+        .scale = &capture->scale[fields->scaling],
+        .offset = &capture->offset[fields->scaling],
+    };
+}
+
+
+/* Compiles the conversion and format plans for every data process together
+ * with the layout of the scaled fields. */
+static void compile_data_capture(struct data_capture *capture)
+{
+    for (unsigned int i = 0; i < DATA_PROCESS_COUNT; i ++)
+    {
+        capture->conversion[i] = (struct conversion_plan) { };
+        capture->format[i] = (struct format_plan) { };
+    }
+    compile_raw_plans(capture,
+        &capture->conversion[DATA_PROCESS_RAW],
+        &capture->format[DATA_PROCESS_RAW]);
+    compile_unscaled_plans(capture,
+        &capture->conversion[DATA_PROCESS_UNSCALED],
+        &capture->format[DATA_PROCESS_UNSCALED]);
+    compile_scaled_plans(capture,
+        &capture->conversion[DATA_PROCESS_SCALED],
+        &capture->format[DATA_PROCESS_SCALED]);
+    for (unsigned int i = 0; i < DATA_PROCESS_COUNT; i ++)
+        choose_convert(capture, &capture->conversion[i]);
+
+    capture->scaled_layout = (struct scaled_layout) {
+        .raw_sample_words = capture->raw_sample_words,
+        .output_length =
+            capture->conversion[DATA_PROCESS_SCALED].output_length,
+        .output_offset = sizeof(uint32_t) * capture->unscaled.count,
+        .sample_count_index = capture->sample_count_index,
+        .scaled32 = prepare_scaled_group(capture, &capture->scaled32),
+        .scaled64 = prepare_scaled_group(capture, &capture->scaled64),
+        .averaged = prepare_scaled_group(capture, &capture->averaged),
+    };
+}
+
+
+/* Gathers and compiles the capture for the given fields. */
+static void build_data_capture(
+    const struct captured_fields *fields, struct gather *gather)
+{
+    struct data_capture *capture = gather->capture;
+    capture->reduction_rule_count = 0;
+    gather->sample_count_capture = fields->sample_count->capture_index.index[0];
+
+    gather_data_capture(fields, gather);
+    compile_data_capture(capture);
+    memcpy(capture->capture_index, gather->capture_index,
+        sizeof(capture->capture_index));
+}
 
 
 error__t prepare_data_capture(
-    const struct captured_fields *fields,
-    const struct data_capture **capture)
+    const struct captured_fields *fields, struct data_capture **capture)
 {
     struct gather gather = {
-        .capture = &data_capture_state,
+        .capture = calloc(1, sizeof(struct data_capture)),
     };
-
-    gather_data_capture(fields, &gather);
+    build_data_capture(fields, &gather);
     error__t error =
         TEST_OK_(gather.capture_count > 0, "Nothing configured for capture");
-    if (!error)
+    if (error)
+        free(gather.capture);
+    else
     {
         /* Now we can let the hardware know. */
         hw_write_capture_set(gather.capture_index, gather.capture_count);
-        *capture = &data_capture_state;
+        *capture = gather.capture;
     }
     return error;
 }
 
 
+/* Adds one word to the projection, extending the last run if possible. */
+static void add_projection_word(
+    struct data_capture *projection, size_t input, size_t output)
+{
+    struct projection_run *last = projection->projection_run_count > 0 ?
+        &projection->projection_runs[projection->projection_run_count - 1] :
+        NULL;
+    if (last  &&  last->input + last->count == input)
+        last->count += 1;
+    else
+        projection->projection_runs[projection->projection_run_count++] =
+            (struct projection_run) {
+                .input = input, .output = output, .count = 1, };
+}
+
+
+struct data_capture *create_projected_capture(
+    const struct captured_fields *fields, const struct data_capture *capture)
+{
+    struct data_capture *projection = calloc(1, sizeof(struct data_capture));
+    struct gather gather = {
+        .capture = projection,
+    };
+    build_data_capture(fields, &gather);
+
+    /* Every projected field is also captured, so we just need to find where
+     * each projected word appears in the full sample. */
+    projection->source_sample_words = capture->raw_sample_words;
+    for (size_t i = 0; i < projection->raw_sample_words; i ++)
+    {
+        size_t input = 0;
+        while (input < capture->raw_sample_words  &&
+               capture->capture_index[input] != projection->capture_index[i])
+            input += 1;
+        ASSERT_OK(input < capture->raw_sample_words);
+        add_projection_word(projection, input, i);
+    }
+    return projection;
+}
+
+
+bool projection_is_identity(const struct data_capture *projection)
+{
+    return
+        projection->raw_sample_words == projection->source_sample_words  &&
+        projection->projection_run_count == 1  &&
+        projection->projection_runs[0].input == 0;
+}
+
+
+void project_samples(
+    const struct data_capture *projection, unsigned int sample_count,
+    const void *input, void *output)
+{
+    const uint32_t *source = input;
+    uint32_t *target = output;
+    for (unsigned int i = 0; i < sample_count; i ++)
+    {
+        for (unsigned int j = 0; j < projection->projection_run_count; j ++)
+        {
+            const struct projection_run *run = &projection->projection_runs[j];
+            memcpy(&target[run->output], &source[run->input],
+                run->count * sizeof(uint32_t));
+        }
+        source += projection->source_sample_words;
+        target += projection->raw_sample_words;
+    }
+}
+
+
 bool sample_count_is_anonymous(const struct data_capture *capture) {
     return capture->sample_count_anonymous;
 }
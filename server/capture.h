@@ -9,12 +9,11 @@ struct data_options;
 /* Data capture readout. */
 
 
-/* Called just before arming hardware to prepare system for data capture.  The
- * data capture state will remain valid while lock_capture_disable() returns
- * success. */
+/* Called just before arming hardware to prepare system for data capture.  On
+ * success the data capture state is returned, which must be released with
+ * free() once no longer needed. */
 error__t prepare_data_capture(
-    const struct captured_fields *fields,
-    const struct data_capture **capture);
+    const struct captured_fields *fields, struct data_capture **capture);
 
 /* Returns size of single raw data capture length in bytes. */
 size_t get_raw_sample_length(const struct data_capture *capture);
@@ -30,6 +29,37 @@ void convert_raw_data_to_binary(
     const struct data_capture *capture, struct data_options *options,
     unsigned int sample_count, const void *input, void *output);
 
+/* Types of the fields in a converted binary sample. */
+enum field_type {
+    FIELD_TYPE_UINT32,
+    FIELD_TYPE_INT32,
+    FIELD_TYPE_INT64,
+    FIELD_TYPE_DOUBLE,
+};
+
+/* Size of field type in bytes. */
+#define FIELD_TYPE_WIDTH(type) \
+    ((type) == FIELD_TYPE_UINT32  ||  (type) == FIELD_TYPE_INT32 ? 4U : 8U)
+
+/* Writes the type of each field of a converted binary sample to types[], which
+ * must have room for MAX_CAPTURE_COUNT entries, and returns the number of
+ * fields. */
+unsigned int get_binary_field_types(
+    const struct data_capture *capture, const struct data_options *options,
+    enum field_type types[]);
+
+/* Returns the maximum length of a single sample formatted in ASCII, including
+ * the trailing newline. */
+size_t get_max_ascii_sample_length(const struct data_capture *capture);
+
+/* Formats the given number of binary samples in ASCII, one line per sample.
+ * The output buffer must be large enough for sample_count samples of the
+ * maximum ASCII sample length, and the number of characters written is
+ * returned. */
+size_t format_binary_as_ascii(
+    const struct data_capture *capture, struct data_options *options,
+    unsigned int sample_count, const void *data, char *output);
+
 /* Binary and raw format data need no further processing, but ASCII data needs
  * to be converted according to the appropriate settings.  This function
  * transmits using the appropriate file buffer, returning false if there's a
@@ -41,3 +71,51 @@ bool send_binary_as_ascii(
 /* If averaged fields are present, but sample count is not requested, it
  * will be captured, but not added to any group. This returns true if so */
 bool sample_count_is_anonymous(const struct data_capture *capture);
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Data rate reduction. */
+
+struct sample_reducer;
+
+/* Creates a reducer for the reduction selected in options.  Each bucket of
+ * samples is reduced to a single raw sample, either by taking the first sample
+ * or by combining the fields according to what they capture. */
+struct sample_reducer *create_sample_reducer(
+    const struct data_capture *capture, const struct data_options *options);
+void destroy_sample_reducer(struct sample_reducer *reducer);
+
+/* Changes the number of samples in each bucket, takes effect immediately. */
+void set_reducer_bucket_size(
+    struct sample_reducer *reducer, unsigned int bucket_size);
+
+/* Reduces sample_count raw samples, writing completed buckets to output as raw
+ * samples and returning the number written.  A partial bucket is carried over
+ * to the next call.  The output must have room for sample_count samples. */
+unsigned int reduce_samples(
+    struct sample_reducer *reducer, unsigned int sample_count,
+    const void *input, void *output);
+
+/* Writes any partial bucket as a single raw sample at the end of the data
+ * stream, returning the number of samples written. */
+unsigned int flush_sample_reducer(struct sample_reducer *reducer, void *output);
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Field projection. */
+
+/* Creates a capture for a subset of the captured fields, as returned by
+ * project_captured_fields().  Samples are projected from the full capture and
+ * can then be processed like captured samples.  The result must be released
+ * with free(). */
+struct data_capture *create_projected_capture(
+    const struct captured_fields *fields, const struct data_capture *capture);
+
+/* Returns true if the projection selects every word of the full capture in
+ * order, in which case the full capture can be used instead. */
+bool projection_is_identity(const struct data_capture *projection);
+
+/* Copies the projected words of sample_count full samples to output. */
+void project_samples(
+    const struct data_capture *projection, unsigned int sample_count,
+    const void *input, void *output);
@@ -0,0 +1,111 @@
+/* Columnar framing of binary sample data. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "error.h"
+#include "buffered_file.h"
+#include "capture.h"
+
+#include "columnar.h"
+
+
+/* Samples are transposed in blocks small enough for the block of input samples
+ * to stay in the cache while each column is written in turn. */
+#define TRANSPOSE_BLOCK     64U
+
+
+static void transpose_column32(
+    uint32_t column[], const void *input, size_t stride, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        memcpy(&column[i], input, sizeof(uint32_t));
+        input += stride;
+    }
+}
+
+
+static void transpose_column64(
+    uint64_t column[], const void *input, size_t stride, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        memcpy(&column[i], input, sizeof(uint64_t));
+        input += stride;
+    }
+}
+
+
+size_t transpose_samples(
+    const enum field_type types[], unsigned int field_count,
+    unsigned int sample_count, const void *input, void *output)
+{
+    /* Lay out the columns, clearing the padding at the end of each column so
+     * that nothing stale is sent. */
+    size_t field_offsets[field_count];
+    void *columns[field_count];
+    size_t stride = 0;
+    size_t length = 0;
+    for (unsigned int i = 0; i < field_count; i ++)
+    {
+        size_t column_length = sample_count * FIELD_TYPE_WIDTH(types[i]);
+        field_offsets[i] = stride;
+        columns[i] = output + length;
+        memset(columns[i] + column_length, 0,
+            COLUMN_LENGTH(types[i], sample_count) - column_length);
+        stride += FIELD_TYPE_WIDTH(types[i]);
+        length += COLUMN_LENGTH(types[i], sample_count);
+    }
+
+    /* Transpose the data a block of samples at a time. */
+    for (unsigned int first = 0; first < sample_count; first += TRANSPOSE_BLOCK)
+    {
+        unsigned int count = MIN(sample_count - first, TRANSPOSE_BLOCK);
+        const void *block = input + first * stride;
+        for (unsigned int i = 0; i < field_count; i ++)
+        {
+            if (FIELD_TYPE_WIDTH(types[i]) == 4)
+                transpose_column32(
+                    (uint32_t *) columns[i] + first,
+                    block + field_offsets[i], stride, count);
+            else
+                transpose_column64(
+                    (uint64_t *) columns[i] + first,
+                    block + field_offsets[i], stride, count);
+        }
+    }
+    return length;
+}
+
+
+size_t columnar_encode_frame(
+    const enum field_type types[], unsigned int field_count,
+    unsigned int sample_count, const void *input, void *output)
+{
+    /* Write the directory of columns. */
+    size_t directory_length =
+        COLUMNAR_HEADER_LENGTH + field_count * COLUMNAR_ENTRY_LENGTH;
+    size_t column_offset = directory_length;
+    for (unsigned int i = 0; i < field_count; i ++)
+    {
+        uint32_t entry[4] = {
+            i, types[i], sample_count, (uint32_t) column_offset, };
+        memcpy(output + COLUMNAR_HEADER_LENGTH + i * COLUMNAR_ENTRY_LENGTH,
+            entry, sizeof(entry));
+        column_offset += COLUMN_LENGTH(types[i], sample_count);
+    }
+
+    size_t frame_length = directory_length + transpose_samples(
+        types, field_count, sample_count, input, output + directory_length);
+
+    uint32_t header[4] = {
+        0, (uint32_t) frame_length, sample_count, field_count, };
+    memcpy(header, "COL ", 4);
+    memcpy(output, header, sizeof(header));
+    return frame_length;
+}
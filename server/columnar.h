@@ -0,0 +1,48 @@
+/* Columnar framing of binary sample data.
+ *
+ * A block of samples is transposed into a single frame with one contiguous
+ * column for each field, preceded by a directory of the columns:
+ *
+ *  +-------+-------+-------+-------+-----------+-----+----------+-----+
+ *  | "COL "| frame | sample| field | directory | ... | column 0 | ... |
+ *  |       | length| count | count | entry 0   |     |          |     |
+ *  +-------+-------+-------+-------+-----------+-----+----------+-----+
+ *
+ * Each directory entry is four 32-bit values: the field index, the field type
+ * as enum field_type, the number of values in the column, and the byte offset
+ * of the column from the start of the frame.  All values are little endian,
+ * every column starts on an 8 byte boundary, and the frame length includes the
+ * header and any padding. */
+
+#define COLUMNAR_HEADER_LENGTH      16
+#define COLUMNAR_ENTRY_LENGTH       16
+
+/* Maximum length of a frame of sample_count samples, each sample_length bytes
+ * long and made of field_count fields. */
+#define COLUMNAR_FRAME_MAX_LENGTH(field_count, sample_count, sample_length) \
+    (COLUMNAR_HEADER_LENGTH + \
+     (field_count) * (COLUMNAR_ENTRY_LENGTH + 4) + \
+     (sample_count) * (sample_length))
+
+
+/* Length of one column of sample_count values of the given type, padded to a
+ * multiple of 8 bytes. */
+#define COLUMN_LENGTH(type, sample_count) \
+    (((sample_count) * FIELD_TYPE_WIDTH(type) + 7) & ~(size_t) 7)
+
+
+/* Transposes sample_count samples, each consisting of field_count fields of
+ * the given types, into consecutive columns, one for each field, each padded
+ * with zeros to COLUMN_LENGTH.  Returns the number of bytes written to output,
+ * which must be 8 byte aligned. */
+size_t transpose_samples(
+    const enum field_type types[], unsigned int field_count,
+    unsigned int sample_count, const void *input, void *output);
+
+/* Transposes sample_count samples, each consisting of field_count fields of
+ * the given types, into a columnar frame.  Returns the length of the frame
+ * written to output, which must be 8 byte aligned and have room for
+ * COLUMNAR_FRAME_MAX_LENGTH bytes. */
+size_t columnar_encode_frame(
+    const enum field_type types[], unsigned int field_count,
+    unsigned int sample_count, const void *input, void *output);
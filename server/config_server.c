@@ -14,6 +14,7 @@
 #include "config_command.h"
 #include "system_command.h"
 #include "base64.h"
+#include "number_format.h"
 
 #include "config_server.h"
 
@@ -44,23 +45,20 @@ error__t __attribute__((format(printf, 3, 4))) format_string(
 }
 
 
-/* Alas the double formatting rules are ill mannered, in particular I don't want
- * to allow leading spaces.  I'd also love to prune trailing zeros, but we'll
- * see. */
+/* Formats value with "%.10g".  This is used for every scaled value, so the fast
+ * formatter is used. */
 error__t format_double(char result[], size_t length, double value)
 {
-    error__t error = format_string(result, length, "%.10g", value);
-    if (!error)
-    {
-        const char *skip = skip_whitespace(result);
-        if (skip > result)
-            memmove(result, skip, strlen(skip) + 1);
-    }
-    return error;
+    char buffer[MAX_NUMBER_LENGTH];
+    size_t written = (size_t) (format_double_g10(buffer, value) - buffer);
+    return
+        TEST_OK_(written < length, "Result too long")  ?:
+        DO(
+            memcpy(result, buffer, written);
+            result[written] = '\0');
 }
 
 
-
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Change set management. */
 
@@ -0,0 +1,229 @@
+/* Cache of converted capture blocks shared between data clients. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "locking.h"
+
+#include "conversion_cache.h"
+
+
+struct cache_entry {
+    enum entry_state {
+        ENTRY_EMPTY,        // Entry not in use
+        ENTRY_FILLING,      // Being filled by first client
+        ENTRY_READY,        // Valid converted data available
+    } state;
+    unsigned int block;     // Block sequence number
+    size_t position;        // Position of converted samples in block
+    unsigned int ref_count; // Number of clients using this entry
+    uint64_t last_used;     // Used to choose entry to recycle
+
+    void *buffer;           // Converted data
+    size_t buffer_size;     // Allocated size of buffer
+    size_t length;          // Bytes of converted data in buffer
+    unsigned int samples;   // Number of samples converted
+};
+
+
+struct conversion_cache {
+    pthread_mutex_t mutex;
+    pthread_cond_t signal;  // Signalled when an entry is published
+
+    unsigned int key_count;
+    unsigned int slot_count;
+    uint64_t use_count;     // Counts lookups for last_used
+
+    uint64_t hits;          // Lookups satisfied from the cache
+    uint64_t misses;        // Lookups which filled a cache entry
+    uint64_t uncached;      // Lookups with no cache entry available
+
+    struct cache_entry entries[];   // slot_count entries for each key
+};
+
+
+/* Searches the slots for this key for the given block, or failing that for the
+ * least recently used slot that is free to be recycled.  Called with the cache
+ * lock held. */
+static struct cache_entry *find_entry(
+    struct conversion_cache *cache, unsigned int key, unsigned int block,
+    bool *found)
+{
+    struct cache_entry *entries = &cache->entries[key * cache->slot_count];
+    struct cache_entry *victim = NULL;
+    for (unsigned int i = 0; i < cache->slot_count; i ++)
+    {
+        struct cache_entry *entry = &entries[i];
+        if (entry->state != ENTRY_EMPTY  &&  entry->block == block)
+        {
+            *found = true;
+            return entry;
+        }
+        else if (entry->ref_count == 0  &&
+            (victim == NULL  ||  entry->last_used < victim->last_used))
+            victim = entry;
+    }
+    *found = false;
+    return victim;
+}
+
+
+struct cache_entry *lookup_cache_entry(
+    struct conversion_cache *cache, unsigned int key,
+    unsigned int block, size_t position, bool *fill)
+{
+    ASSERT_OK(key < cache->key_count);
+
+    LOCK(cache->mutex);
+    bool found;
+    struct cache_entry *entry = find_entry(cache, key, block, &found);
+    if (found  &&  entry->position != position)
+        /* Don't expect this, but we can't share this entry. */
+        entry = NULL;
+
+    if (entry == NULL)
+        cache->uncached += 1;
+    else
+    {
+        entry->ref_count += 1;
+        entry->last_used = ++cache->use_count;
+        *fill = !found;
+        if (found)
+        {
+            cache->hits += 1;
+            while (entry->state == ENTRY_FILLING)
+                WAIT(cache->mutex, cache->signal);
+        }
+        else
+        {
+            cache->misses += 1;
+            entry->state = ENTRY_FILLING;
+            entry->block = block;
+            entry->position = position;
+        }
+    }
+    UNLOCK(cache->mutex);
+    return entry;
+}
+
+
+void *get_cache_buffer(struct cache_entry *entry, size_t size)
+{
+    /* ASSERT: entry->state == ENTRY_FILLING */
+    if (size > entry->buffer_size)
+    {
+        free(entry->buffer);
+        entry->buffer = malloc(size);
+        entry->buffer_size = size;
+    }
+    return entry->buffer;
+}
+
+
+void publish_cache_entry(
+    struct conversion_cache *cache, struct cache_entry *entry,
+    size_t length, unsigned int samples, bool valid)
+{
+    LOCK(cache->mutex);
+    entry->state = valid ? ENTRY_READY : ENTRY_EMPTY;
+    entry->length = length;
+    entry->samples = samples;
+    BROADCAST(cache->signal);
+    UNLOCK(cache->mutex);
+}
+
+
+const void *read_cache_entry(
+    const struct cache_entry *entry, size_t *length, unsigned int *samples)
+{
+    /* Once published the entry can't change until it is released. */
+    if (entry->state == ENTRY_READY)
+    {
+        *length = entry->length;
+        *samples = entry->samples;
+        return entry->buffer;
+    }
+    else
+        return NULL;
+}
+
+
+void release_cache_entry(
+    struct conversion_cache *cache, struct cache_entry *entry)
+{
+    LOCK(cache->mutex);
+    entry->ref_count -= 1;
+    UNLOCK(cache->mutex);
+}
+
+
+void get_cache_counts(
+    struct conversion_cache *cache,
+    uint64_t *hits, uint64_t *misses, uint64_t *uncached)
+{
+    LOCK(cache->mutex);
+    *hits = cache->hits;
+    *misses = cache->misses;
+    *uncached = cache->uncached;
+    UNLOCK(cache->mutex);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+struct conversion_cache *create_conversion_cache(
+    unsigned int key_count, unsigned int slot_count)
+{
+    size_t entry_count = key_count * slot_count;
+    struct conversion_cache *cache = calloc(1,
+        sizeof(struct conversion_cache) +
+        entry_count * sizeof(struct cache_entry));
+    cache->mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    pwait_initialise(&cache->signal);
+    cache->key_count = key_count;
+    cache->slot_count = slot_count;
+    return cache;
+}
+
+
+/* Releases the memory held by all entries not in use, which is potentially
+ * quite large. */
+static void free_entries(struct conversion_cache *cache)
+{
+    for (unsigned int i = 0; i < cache->key_count * cache->slot_count; i ++)
+    {
+        struct cache_entry *entry = &cache->entries[i];
+        if (entry->ref_count == 0)
+        {
+            free(entry->buffer);
+            *entry = (struct cache_entry) { .state = ENTRY_EMPTY, };
+        }
+    }
+}
+
+
+void reset_conversion_cache(struct conversion_cache *cache)
+{
+    LOCK(cache->mutex);
+    free_entries(cache);
+    cache->use_count = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->uncached = 0;
+    UNLOCK(cache->mutex);
+}
+
+
+void destroy_conversion_cache(struct conversion_cache *cache)
+{
+    free_entries(cache);
+    pthread_cond_destroy(&cache->signal);
+    free(cache);
+}
@@ -0,0 +1,62 @@
+/* Cache of converted capture blocks shared between data clients. */
+
+/* Data clients which ask for the same conversion of the same capture buffer
+ * block can share a single conversion.  The cache holds a small ring of
+ * converted blocks for each conversion key, and each entry is filled by the
+ * first client to ask for it. */
+struct conversion_cache;
+
+/* A single converted block. */
+struct cache_entry;
+
+
+/* Creates cache with slot_count entries for each of key_count keys. */
+struct conversion_cache *create_conversion_cache(
+    unsigned int key_count, unsigned int slot_count);
+
+/* Releases all resources used by the cache. */
+void destroy_conversion_cache(struct conversion_cache *cache);
+
+/* Discards all cache entries not in use and resets the hit counters, normally
+ * called at the start of a new capture.  Entries in use by clients still
+ * draining an earlier capture are left to be recycled in the normal way. */
+void reset_conversion_cache(struct conversion_cache *cache);
+
+
+/* Looks up the converted block identified by key and block sequence number.
+ * The given position in the block is also checked so that an entry is only
+ * shared between clients converting exactly the same samples.  If the block is
+ * already converted or being converted by another client then we wait for it,
+ * and *fill is set to false.  Otherwise *fill is set and the caller must fill
+ * the entry and call publish_cache_entry().  NULL is returned if no cache entry
+ * is available, in which case the caller must do its own conversion.  Every
+ * entry returned must be released after use. */
+struct cache_entry *lookup_cache_entry(
+    struct conversion_cache *cache, unsigned int key,
+    unsigned int block, size_t position, bool *fill);
+
+/* Returns buffer of at least the given size to be filled with converted data.
+ * Only to be called by the client filling the entry. */
+void *get_cache_buffer(struct cache_entry *entry, size_t size);
+
+/* Marks the entry as complete so that other clients can use it.  If valid is
+ * false then the conversion failed and the entry will be discarded. */
+void publish_cache_entry(
+    struct conversion_cache *cache, struct cache_entry *entry,
+    size_t length, unsigned int samples, bool valid);
+
+/* Returns the converted data for a published entry, or NULL if the conversion
+ * failed. */
+const void *read_cache_entry(
+    const struct cache_entry *entry, size_t *length, unsigned int *samples);
+
+/* Releases entry returned by lookup_cache_entry(). */
+void release_cache_entry(
+    struct conversion_cache *cache, struct cache_entry *entry);
+
+
+/* Returns counts of cache hits, misses, and uncached conversions since the
+ * cache was last reset. */
+void get_cache_counts(
+    struct conversion_cache *cache,
+    uint64_t *hits, uint64_t *misses, uint64_t *uncached);
@@ -1,6 +1,7 @@
 /* Socket server for data streaming interface. */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdarg.h>
@@ -9,13 +10,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
 #include <pthread.h>
 
 #include "error.h"
 #include "hardware.h"
 #include "buffered_file.h"
+#include "parse.h"
 #include "config_server.h"
 #include "buffer.h"
 #include "prepare.h"
@@ -23,15 +30,20 @@
 #include "locking.h"
 #include "base64.h"
 #include "ext_out.h"
+#include "conversion_cache.h"
+#include "scaling.h"
+#include "worker_pool.h"
+#include "delta_codec.h"
+#include "columnar.h"
+#include "arrow_ipc.h"
+#include "recorder.h"
+#include "list.h"
+#include "socket_server.h"
+#include "latency.h"
 
 #include "data_server.h"
 
 
-/* Central circular data buffer.  The block size is chosen to match the driver
- * block size, and we choose a reasonably large number of 2MB blocks. */
-#define DATA_BLOCK_SIZE         (1U << 21)
-#define DATA_BLOCK_COUNT        128
-
 /* File buffers.  These are only used for text buffered text communication on
  * the data channel. */
 #define IN_BUF_SIZE             4096
@@ -42,20 +54,41 @@
 /* Should be large enough for the largest single raw sample. */
 #define MAX_RAW_SAMPLE_LENGTH   256
 
+/* Parallel conversion.  Blocks are only split between workers if each job gets
+ * at least MIN_JOB_SAMPLES samples, and each job converts ASCII data through a
+ * working buffer of JOB_BUFFER_SIZE bytes on its own stack. */
+#define MIN_JOB_SAMPLES         1024
+#define MAX_CONVERSION_JOBS     16U
+#define JOB_BUFFER_SIZE         16384
+
+/* Shared conversion cache.  We have a separate set of entries for binary and
+ * ASCII output of each data process, and a handful of entries for each to allow
+ * for clients which are not quite in step. */
+#define CACHE_KEY_COUNT         (2 * (DATA_PROCESS_SCALED + 1))
+#define CACHE_SLOT_COUNT        4
+
 /* Length of one base64 line. */
 #define BASE64_CONVERT_COUNT    57U
 
+/* Weight given to each new block when estimating the input sample rate for the
+ * RATE option. */
+#define RATE_SMOOTHING          0.25
+
 
-/* Connection and read block polling intervals.  These determine how long it
- * takes for a socket disconnect to be detected. */
-#define CONNECTION_POLL_SECS    0
-#define CONNECTION_POLL_NSECS   ((unsigned long) (0.2 * NSECS))  // 200 ms
+/* A data client which has taken nothing we've sent it for this long is
+ * disconnected.  This matches the transmit timeout for configuration
+ * clients. */
+#define TRANSMIT_TIMEOUT_SECS   10
 
-#define READ_BLOCK_POLL_SECS    0
-#define READ_BLOCK_POLL_NSECS   ((unsigned long) (0.2 * NSECS))  // 200 ms
+/* Maximum number of events handled by each call to epoll_wait(). */
+#define REACTOR_EVENTS          64
 
-/* Allow this many data blocks between the reader and the writer on startup. */
-#define BUFFER_READ_MARGIN      (DATA_BLOCK_COUNT / 4)
+/* Allow this fraction of the data blocks between the reader and the writer on
+ * startup. */
+#define BUFFER_READ_MARGIN(count)   ((unsigned int) (count) / 4)
+
+/* Maximum number of passthrough blocks in flight with zero copy. */
+#define ZERO_COPY_BLOCKS        8
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -91,44 +124,124 @@ static volatile bool data_thread_running = true;
 
 /* Data capture buffer. */
 static struct capture_buffer *data_buffer;
-/* Structures used to define data capture in progress.  This are valid while
- * data capture is enabled, invalid otherwise. */
-static const struct captured_fields *captured_fields;
-static const struct data_capture *data_capture;
+/* Conversion results shared between data clients. */
+static struct conversion_cache *conversion_cache;
+/* Optional workers for parallel conversion. */
+static struct worker_pool *conversion_pool;
+/* Optional workers for processing data streams, see the reactor below. */
+static struct worker_pool *stream_pool;
+/* Each capture held in the buffer has its own description, indexed by capture
+ * generation, so that clients still draining an earlier capture continue to use
+ * the fields it was captured with and see its completion.  A description is
+ * only replaced when its generation is reused by the buffer, by which time no
+ * client can be using it. */
+static struct capture_description {
+    struct captured_fields *fields;
+    struct data_capture *capture;
+    unsigned int completion;    // Completion code once capture complete
+} capture_descriptions[BUFFER_GENERATIONS];
+
+/* Description of the data capture in progress.  This is valid while data
+ * capture is enabled, and remains valid until the next capture is armed. */
+static struct capture_description *current_capture;
 
 /* Data completion code at end of experiment. */
 static unsigned int completion_code;
 /* Sample count at end of experiment. */
 static uint64_t experiment_sample_count;
 
+/* Hardware read statistics for the current or most recent experiment.  These
+ * are only written by the data capture thread and are read without locking. */
+static struct hardware_stats {
+    uint64_t reads;         // Number of calls to hw_read_streamed_data()
+    uint64_t bytes;         // Bytes read from hardware
+    uint64_t start_ns;      // Start of capture
+    uint64_t end_ns;        // End of capture, zero while capture in progress
+} hardware_stats;
+
+
+#ifdef LATENCY_STATS
+/* Latencies recorded by the data capture thread, and times of the most recent
+ * arm and disarm commands. */
+static struct latency_stats capture_latency;
+static uint64_t arm_ns;
+static uint64_t disarm_ns;
+#endif
+
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return NSECS * (uint64_t) now.tv_sec + (uint64_t) now.tv_nsec;
+}
+
+
+/* Statistics are updated by a single thread, so don't need an atomic read
+ * modify write, but are read by other threads. */
+static void set_stat(uint64_t *stat, uint64_t value)
+{
+    __atomic_store_n(stat, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t get_stat(const uint64_t *stat)
+{
+    return __atomic_load_n(stat, __ATOMIC_RELAXED);
+}
+
 
 /* Performs a complete experiment capture: start data buffer, process the data
  * stream until hardware is complete, stop data buffer. */
 static void capture_experiment(void)
 {
+    /* The buffer can't be resized while we're busy. */
+    size_t block_size, block_count;
+    get_buffer_size(data_buffer, &block_size, &block_count);
+
     start_write(data_buffer);
-    size_t sample_length = get_raw_sample_length(data_capture);
+    size_t sample_length = get_raw_sample_length(current_capture->capture);
     log_message("Starting capture: %zu bytes/sample", sample_length);
 
     uint64_t total_bytes = 0;
+    uint64_t reads = 0;
     experiment_sample_count = 0;
     completion_code = 0;
+    set_stat(&hardware_stats.reads, 0);
+    set_stat(&hardware_stats.bytes, 0);
+    set_stat(&hardware_stats.end_ns, 0);
+    set_stat(&hardware_stats.start_ns, get_time_ns());
 
     bool at_eof = false;
     while (data_thread_running  &&  !at_eof)
     {
         void *block = get_write_block(data_buffer);
         size_t count;
+        LATENCY(uint64_t read_ns);
         do
-            count = hw_read_streamed_data(block, DATA_BLOCK_SIZE, &at_eof);
-        while (data_thread_running  &&  count == 0  &&  !at_eof);
+        {
+            LATENCY(uint64_t start_ns = get_latency_time());
+            count = hw_read_streamed_data(block, block_size, &at_eof);
+            reads += 1;
+            LATENCY(
+                read_ns = get_latency_time();
+                record_latency(
+                    &capture_latency, LATENCY_HW_READ, start_ns, read_ns));
+        } while (data_thread_running  &&  count == 0  &&  !at_eof);
         if (count > 0)
+        {
             release_write_block(data_buffer, count);
+            LATENCY(record_latency(&capture_latency,
+                LATENCY_PUBLISH, read_ns, get_latency_time()));
+        }
 
         total_bytes += count;
         experiment_sample_count = total_bytes / sample_length;
+        set_stat(&hardware_stats.reads, reads);
+        set_stat(&hardware_stats.bytes, total_bytes);
     }
     completion_code = hw_read_streamed_completion();
+    current_capture->completion = completion_code;
+    set_stat(&hardware_stats.end_ns, get_time_ns());
 
     end_write(data_buffer);
     log_message("Captured %"PRIu64" samples: %s",
@@ -173,12 +286,35 @@ static void stop_data_thread(void)
 /* User interface and control. */
 
 
-static error__t start_data_capture(void)
+static const struct capture_description *get_description(
+    unsigned int generation)
 {
-    captured_fields = prepare_captured_fields();
-    error__t error = prepare_data_capture(captured_fields, &data_capture);
-    if (!error)
+    return &capture_descriptions[generation % BUFFER_GENERATIONS];
+}
+
+
+static error__t start_data_capture(unsigned int generation)
+{
+    struct captured_fields *fields = prepare_captured_fields();
+    struct data_capture *capture;
+    error__t error = prepare_data_capture(fields, &capture);
+    if (error)
+        free(fields);
+    else
     {
+        current_capture =
+            &capture_descriptions[generation % BUFFER_GENERATIONS];
+        free(current_capture->fields);
+        free(current_capture->capture);
+        *current_capture = (struct capture_description) {
+            .fields = fields,
+            .capture = capture,
+        };
+
+        /* Clients may still be draining earlier captures, so only cache
+         * entries not in use can be discarded. */
+        reset_conversion_cache(conversion_cache);
+        LATENCY(set_stat(&arm_ns, get_latency_time()));
         hw_write_arm_streamed_data();
         hw_write_arm(true);
         data_capture_enabled = true;
@@ -190,23 +326,24 @@ static error__t start_data_capture(void)
 
 error__t arm_capture(void)
 {
-    unsigned int readers, active;
+    unsigned int generation;
     return
         TEST_OK_(check_pcap_valid(),
             "PCAP not supported with this configuration")  ?:
         WITH_LOCK(data_thread_mutex,
             TEST_OK_(!data_capture_enabled,
                 "Data capture already in progress")  ?:
-            /* If data capture is not enabled then we can safely expect the
-             * buffer status to be idle. */
-            TEST_OK(!read_buffer_status(data_buffer, &readers, &active))  ?:
-            TEST_OK_(active == 0, "Data clients still taking data")  ?:
-            start_data_capture());
+            /* Clients can still be taking data from earlier captures, so long
+             * as the buffer can keep track of them. */
+            TEST_OK_(check_write_ready(data_buffer, &generation),
+                "Data clients still taking data")  ?:
+            start_data_capture(generation));
 }
 
 
 error__t disarm_capture(void)
 {
+    LATENCY(set_stat(&disarm_ns, get_latency_time()));
     hw_write_arm(false);
     return ERROR_OK;
 }
@@ -214,10 +351,11 @@ error__t disarm_capture(void)
 
 error__t get_capture_status(struct connection_result *result)
 {
-    unsigned int readers, active;
-    bool status = read_buffer_status(data_buffer, &readers, &active);
-    return format_one_result(
-        result, "%s %u %u", status ? "Busy" : "Idle", readers, active);
+    unsigned int readers, active, generation;
+    bool status = read_buffer_status(
+        data_buffer, &readers, &active, &generation);
+    return format_one_result(result, "%s %u %u %u",
+        status ? "Busy" : "Idle", readers, active, generation);
 }
 
 
@@ -235,40 +373,366 @@ error__t get_capture_completion(struct connection_result *result)
 }
 
 
+void get_capture_description(
+    const struct captured_fields **fields,
+    const struct data_capture **capture)
+{
+    *fields = current_capture->fields;
+    *capture = current_capture->capture;
+}
+
+
+void get_reader_description(
+    struct reader_state *reader,
+    const struct captured_fields **fields,
+    const struct data_capture **capture)
+{
+    const struct capture_description *description =
+        get_description(read_capture_generation(reader));
+    *fields = description->fields;
+    *capture = description->capture;
+}
+
+
+unsigned int get_reader_completion_code(struct reader_state *reader)
+{
+    return get_description(read_capture_generation(reader))->completion;
+}
+
+
+error__t get_capture_cache(struct connection_result *result)
+{
+    uint64_t hits, misses, uncached;
+    get_cache_counts(conversion_cache, &hits, &misses, &uncached);
+    return format_one_result(result,
+        "%"PRIu64" %"PRIu64" %"PRIu64, hits, misses, uncached);
+}
+
+
+error__t parse_buffer_size(
+    const char **string, unsigned int *block_size, unsigned int *block_count)
+{
+    return
+        parse_uint(string, block_size)  ?:
+        parse_char(string, ':')  ?:
+        parse_uint(string, block_count)  ?:
+        /* Blocks must be whole pages so that the hardware driver can transfer
+         * directly into them. */
+        TEST_OK_(*block_size > 0  &&
+            *block_size % (unsigned int) sysconf(_SC_PAGESIZE) == 0,
+            "Block size must be a multiple of the page size")  ?:
+        TEST_OK_(*block_count >= 2, "Must have at least two blocks");
+}
+
+
+error__t set_capture_buffer(const char *value)
+{
+    unsigned int block_size, block_count;
+    unsigned int readers, active, generation;
+    return
+        parse_buffer_size(&value, &block_size, &block_count)  ?:
+        parse_eos(&value)  ?:
+        WITH_LOCK(data_thread_mutex,
+            TEST_OK_(!data_capture_enabled,
+                "Data capture in progress")  ?:
+            TEST_OK_(!read_buffer_status(
+                    data_buffer, &readers, &active, &generation),
+                "Data clients still taking data")  ?:
+            resize_buffer(data_buffer, block_size, block_count))  ?:
+        DO(log_message("Capture buffer resized to %ux %u byte blocks",
+            block_count, block_size));
+}
+
+
+error__t get_capture_buffer(struct connection_result *result)
+{
+    size_t block_size, block_count;
+    get_buffer_size(data_buffer, &block_size, &block_count);
+    return format_one_result(result, "%zu:%zu", block_size, block_count);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Capture pipeline statistics. */
+
+
+/* Statistics for the current or most recent data stream of each connected data
+ * client.  The list is only locked when clients connect and disconnect, the
+ * counters are updated by the client thread without locking. */
+struct client_stats {
+    struct list_head list;
+    char name[CLIENT_NAME_LENGTH];
+    uint64_t lag_blocks;        // Blocks waiting for this client
+    uint64_t lag_bytes;         // Bytes waiting for this client
+    uint64_t samples;           // Samples sent
+    uint64_t input_bytes;       // Captured bytes processed
+    uint64_t convert_ns;        // Time spent processing data, excluding send
+    uint64_t sent_bytes;        // Bytes written to socket
+    uint64_t send_ns;           // Time spent writing to socket
+    uint64_t start_ns;          // Start of data stream
+    uint64_t end_ns;            // End of data stream, zero while streaming
+#ifdef LATENCY_STATS
+    /* Latencies for all data streams sent to this client. */
+    struct latency_stats latency;
+#endif
+};
+
+static pthread_mutex_t client_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(client_stats_list);
+
+/* Counts of data streams which ended in overrun, including overruns recovered
+ * with the RESYNC option, and of clients which disconnected early. */
+static uint64_t overrun_count;
+static uint64_t disconnect_count;
+
+
+static void add_client_stats(struct client_stats *stats, int scon)
+{
+    if (error_report(get_client_name(scon, stats->name)))
+        strcpy(stats->name, "unknown");
+    LOCK(client_stats_mutex);
+    list_add_tail(&stats->list, &client_stats_list);
+    UNLOCK(client_stats_mutex);
+}
+
+
+static void remove_client_stats(struct client_stats *stats)
+{
+    LOCK(client_stats_mutex);
+    list_del(&stats->list);
+    UNLOCK(client_stats_mutex);
+}
+
+
+static void count_stream_error(uint64_t *count)
+{
+    __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+}
+
+
+/* Returns rate in MB/s for the given number of bytes processed over the given
+ * interval. */
+static double stats_rate(uint64_t bytes, uint64_t interval_ns)
+{
+    return interval_ns > 0 ? 1e3 * (double) bytes / (double) interval_ns : 0;
+}
+
+
+/* Returns the length of the interval from start to end, or to now if end is
+ * zero, used for intervals which may still be running. */
+static uint64_t stats_interval(uint64_t start_ns, uint64_t end_ns)
+{
+    if (start_ns == 0)
+        return 0;
+    else
+        return (end_ns ?: get_time_ns()) - start_ns;
+}
+
+
+static void report_client_stats(
+    struct connection_result *result, struct client_stats *stats)
+{
+    format_many_result(result,
+        "CLIENT %s %"PRIu64" %"PRIu64" %"PRIu64" %.1f %.1f %.3f",
+        stats->name, get_stat(&stats->lag_blocks), get_stat(&stats->lag_bytes),
+        get_stat(&stats->samples),
+        stats_rate(get_stat(&stats->input_bytes), get_stat(&stats->convert_ns)),
+        stats_rate(get_stat(&stats->sent_bytes),
+            stats_interval(
+                get_stat(&stats->start_ns), get_stat(&stats->end_ns))),
+        1e-9 * (double) get_stat(&stats->send_ns));
+}
+
+
+error__t get_capture_stats(struct connection_result *result)
+{
+    result->response = RESPONSE_MANY;
+
+    uint64_t reads = get_stat(&hardware_stats.reads);
+    uint64_t bytes = get_stat(&hardware_stats.bytes);
+    format_many_result(result, "HW %"PRIu64" %"PRIu64" %"PRIu64" %.1f",
+        reads, bytes, reads > 0 ? bytes / reads : 0,
+        stats_rate(bytes, stats_interval(
+            get_stat(&hardware_stats.start_ns),
+            get_stat(&hardware_stats.end_ns))));
+
+    size_t block_size, block_count;
+    unsigned int occupancy, max_occupancy;
+    get_buffer_size(data_buffer, &block_size, &block_count);
+    read_buffer_occupancy(data_buffer, &occupancy, &max_occupancy);
+    format_many_result(result, "BUFFER %u %u %zu",
+        occupancy, max_occupancy, block_count);
+
+    format_many_result(result, "ERRORS %"PRIu64" %"PRIu64,
+        __atomic_load_n(&overrun_count, __ATOMIC_RELAXED),
+        __atomic_load_n(&disconnect_count, __ATOMIC_RELAXED));
+
+    LOCK(client_stats_mutex);
+    list_for_each_entry(struct client_stats, list, stats, &client_stats_list)
+        report_client_stats(result, stats);
+    UNLOCK(client_stats_mutex);
+    return ERROR_OK;
+}
+
+
+error__t get_capture_latency(struct connection_result *result)
+{
+#ifdef LATENCY_STATS
+    result->response = RESPONSE_MANY;
+    report_latency_stats(result, "CAPTURE", &capture_latency);
+    LOCK(client_stats_mutex);
+    list_for_each_entry(struct client_stats, list, stats, &client_stats_list)
+        report_latency_stats(result, stats->name, &stats->latency);
+    UNLOCK(client_stats_mutex);
+    return ERROR_OK;
+#else
+    return FAIL_("Latency statistics not enabled in this build");
+#endif
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Data delivery to client. */
 
+/* All data connections are served by the reactor thread, see below, which waits
+ * for events on this epoll file.  Each connection registers both its socket and
+ * its capture buffer reader's wakeup event, and this identifies which one an
+ * event came from. */
+static int reactor_epoll = -1;
+
+struct reactor_source {
+    struct data_connection *connection;
+    bool reader;                // Set for reader event, otherwise socket
+};
+
+/* After each step a connection either runs again or waits for an event. */
+enum connection_wait {
+    WAIT_NONE,                  // Ready to run again
+    WAIT_INPUT,                 // Waiting for client or capture buffer
+    WAIT_OUTPUT,                // Waiting for socket to take more data
+};
+
 
 struct data_connection {
     int scon;
     struct buffered_file *file;
     struct reader_state *reader;
     struct data_options options;
+    struct client_stats stats;
+
+    /* Description of the experiment being read.  The fields and capture sent
+     * are projected from this if the FIELDS option was given. */
+    const struct capture_description *description;
+    const struct captured_fields *fields;
+    const struct data_capture *capture;
+    struct captured_fields *projected_fields;
+    struct data_capture *projection;
+
+    /* Each connection is a state machine advanced by the reactor. */
+    enum connection_state {
+        CONNECTION_REQUEST,     // Waiting for data request
+        CONNECTION_CAPTURE,     // Waiting for the next capture to start
+        CONNECTION_STREAM,      // Sending captured data
+        CONNECTION_CLOSING,     // Sending final output before closing
+    } state;
+    struct data_capture_state *stream;  // Data stream while streaming
+    bool disconnected;          // Set once client has gone away
+
+    /* Reactor bookkeeping, only used by the reactor thread. */
+    struct list_head list;      // Entry on list of all connections
+    struct list_head run_list;  // Entry on run queue while runnable
+    bool runnable;              // Set while on the run queue
+    struct reactor_source socket_source;
+    struct reactor_source reader_source;
+    uint32_t socket_events;     // Events currently requested for socket
+    uint64_t stall_ns;          // Start of wait for socket, zero if none
+    uint64_t stall_bytes;       // Bytes sent when wait for socket started
+
+    /* While a step runs on a stream worker the connection belongs to the
+     * worker, and the reactor only notes any events for it. */
+    bool busy;                  // Set while step running on stream worker
+    bool pending;               // Set if event arrived while busy
+    enum connection_wait step_wait; // Result of step run on worker
+
+    /* Called once the connection has closed. */
+    void (*closed)(void *context, error__t error);
+    void *context;
 };
 
 
-/* Every data request must start with a newline terminated format request. */
-static bool process_data_request(struct data_connection *connection)
+/* A request for a range of the last experiment can only be served if there is
+ * a completed experiment in the buffer. */
+static error__t check_data_range(const struct data_options *options)
+{
+    uint64_t length;
+    unsigned int generation;
+    return IF(options->data_range != DATA_RANGE_NONE,
+        TEST_OK_(get_history_length(data_buffer, &length, &generation),
+            "No completed capture available"));
+}
+
+
+/* The reactor needs to know when the reader has something new for us. */
+static error__t watch_reader(struct data_connection *connection)
+{
+    connection->reader_source = (struct reactor_source) {
+        .connection = connection, .reader = true, };
+    struct epoll_event event = {
+        .events = EPOLLIN, .data.ptr = &connection->reader_source, };
+    return TEST_IO(epoll_ctl(reactor_epoll, EPOLL_CTL_ADD,
+        get_reader_event(connection->reader), &event));
+}
+
+
+/* Every data request must start with a newline terminated format request.  The
+ * reader is created here so that we can refuse the request if there are too
+ * many clients. */
+static enum connection_wait read_data_request(
+    struct data_connection *connection)
 {
     char line[MAX_LINE_LENGTH];
-    if (read_line(connection->file, line, sizeof(line), false))
+    bool complete;
+    if (connection->disconnected  ||
+        !try_read_line(connection->file, line, sizeof(line), &complete))
     {
-        error__t error = parse_data_options(line, &connection->options);
-        if (!error  &&  connection->options.omit_status)
-            return true;
-        else
+        connection->state = CONNECTION_CLOSING;
+        return WAIT_NONE;
+    }
+    else if (!complete)
+        return WAIT_INPUT;
+
+    error__t error =
+        parse_data_options(line, &connection->options)  ?:
+        check_data_range(&connection->options)  ?:
+        TEST_OK_(connection->reader = create_reader(data_buffer),
+            "Too many data clients")  ?:
+        watch_reader(connection);
+    if (error  ||  !connection->options.omit_status)
+    {
+        int length = error ?
+            snprintf(line, sizeof(line), "ERR %s\n", error_format(error))
+        :
+            snprintf(line, sizeof(line), "OK\n");
+        write_string(connection->file, line, (size_t) length);
+        flush_out_buf(connection->file);
+    }
+
+    if (error)
+    {
+        error_discard(error);
+        if (connection->reader)
         {
-            int length = error ?
-                snprintf(line, sizeof(line), "ERR %s\n", error_format(error))
-            :
-                snprintf(line, sizeof(line), "OK\n");
-            error_discard(error);
-            write_string(connection->file, line, (size_t) length);
-            return flush_out_buf(connection->file)  &&  !error;
+            destroy_reader(connection->reader);
+            connection->reader = NULL;
         }
+        connection->state = CONNECTION_CLOSING;
     }
     else
-        return false;
+    {
+        add_client_stats(&connection->stats, connection->scon);
+        connection->state = CONNECTION_CAPTURE;
+    }
+    return WAIT_NONE;
 }
 
 
@@ -282,29 +746,27 @@ static bool check_connection(struct data_connection *connection)
 }
 
 
-/* Block until capture begins or the socket is closed. */
-static bool wait_for_capture(
+/* Opens the reader on the next capture if it has started, otherwise the reactor
+ * will be woken through the reader when it does. */
+static bool open_capture(
     struct data_connection *connection,
     uint64_t *lost_samples, size_t *skip_bytes)
 {
-    /* Block here waiting for data capture to begin or for the client to
-     * disconnect.  Alas, detecting disconnection is a bit of a pain: we either
-     * have to poll or use file handles (eventfd(2)) for wakeup, and using a
-     * file handle is a pain because we'd need one per client.  So we poll. */
-    const struct timespec timeout = {
-        .tv_sec  = CONNECTION_POLL_SECS,
-        .tv_nsec = CONNECTION_POLL_NSECS, };
-    bool opened = false;
+    size_t block_size, block_count;
+    get_buffer_size(data_buffer, &block_size, &block_count);
     uint64_t lost_bytes;
-    while (check_connection(connection)  &&  !opened)
-        opened = open_reader(
-            connection->reader, BUFFER_READ_MARGIN, &timeout, &lost_bytes);
+    bool opened = open_reader(
+        connection->reader, BUFFER_READ_MARGIN(block_count),
+        NULL, &lost_bytes);
 
     if (opened)
     {
         /* Convert lost bytes into lost samples and byte count we need to skip
          * to get back into line. */
-        size_t sample_size = get_raw_sample_length(data_capture);
+        connection->description =
+            get_description(read_capture_generation(connection->reader));
+        size_t sample_size =
+            get_raw_sample_length(connection->description->capture);
         *lost_samples = (lost_bytes + sample_size - 1) / sample_size;
         uint64_t extra_bytes = lost_bytes % sample_size;
         *skip_bytes = extra_bytes > 0 ? sample_size - (size_t) extra_bytes : 0;
@@ -313,6 +775,53 @@ static bool wait_for_capture(
 }
 
 
+/* Opens the reader on the requested range of samples from the last completed
+ * experiment.  Any samples in the range which have already been overwritten are
+ * counted as lost, and the number of bytes to send is returned. */
+static bool open_data_range(
+    struct data_connection *connection,
+    uint64_t *lost_samples, size_t *skip_bytes, uint64_t *send_bytes)
+{
+    const struct data_options *options = &connection->options;
+    uint64_t length, block_offset;
+    unsigned int generation;
+    if (!get_history_length(data_buffer, &length, &generation))
+        return false;
+
+    /* Convert the requested range into samples actually captured. */
+    connection->description = get_description(generation);
+    size_t sample_size =
+        get_raw_sample_length(connection->description->capture);
+    uint64_t sample_count = length / sample_size;
+    uint64_t start = options->data_range == DATA_RANGE_LAST ?
+        sample_count - MIN(options->range_count, sample_count) :
+        MIN(options->range_start, sample_count);
+    uint64_t count = MIN(options->range_count, sample_count - start);
+
+    uint64_t offset = start * sample_size;
+    if (!open_history_reader(
+            connection->reader, generation, offset, &block_offset))
+        return false;
+
+    if (block_offset <= offset)
+    {
+        *lost_samples = 0;
+        *skip_bytes = (size_t) (offset - block_offset);
+    }
+    else
+    {
+        /* The start of the range has been overwritten, skip to the first
+         * complete sample still in the buffer. */
+        uint64_t lost_bytes = block_offset - offset;
+        *lost_samples = MIN(
+            (lost_bytes + sample_size - 1) / sample_size, count);
+        *skip_bytes = (size_t) (*lost_samples * sample_size - lost_bytes);
+    }
+    *send_bytes = (count - *lost_samples) * sample_size;
+    return true;
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Data processing and transmission. */
 
@@ -322,15 +831,76 @@ struct data_capture_state {
     /* Underlying connection with socket connection and selected options. */
     struct data_connection *connection;
     /* Computed raw and binary converted single sample sizes, needed for buffer
-     * processing and preparation. */
+     * processing and preparation.  The raw sample length in the capture buffer
+     * differs from the length we convert if the samples are projected. */
+    size_t input_sample_length;
     size_t raw_sample_length;
     size_t binary_sample_length;
 
+    /* Index in the capture of the next input sample to be processed, used to
+     * count the samples lost when resynchronising after overrun. */
+    uint64_t next_sample;
+
+    /* Progress of the stream, which is sent a block at a time. */
+    bool ok;                        // Cleared if the connection fails
+    bool data_ok;                   // Cleared on buffer overrun
+    bool resyncing;                 // Set while waiting to resynchronise
+    bool ending;                    // Set once the stream is over
+    bool passthrough;               // Set if blocks are sent unconverted
+    size_t skip_bytes;              // Bytes to skip before sending data
+    uint64_t send_bytes;            // Limit on captured bytes still to send
+    uint64_t sent_samples;          // Samples sent so far
+    uint64_t lost_samples;          // Samples lost, including before start
+
     /* Number of bytes currently in sample buffer. */
     size_t sample_buffer_count;
     /* Number of bytes currently in output buffer. */
     size_t output_buffer_count;
 
+    /* Buffer for converted data when the conversion cache can't be used. */
+    void *private_buffer;
+    size_t private_buffer_size;
+
+    /* Raw samples from one block after projection and reduction. */
+    void *raw_buffer;
+    size_t raw_buffer_size;
+
+    /* Data rate reduction, only present if requested in the options.  With
+     * the ADAPTIVE option the reducer is only used while reducing is set. */
+    struct sample_reducer *reducer;
+    bool reducing;
+    unsigned int bucket_size;       // Current number of samples per bucket
+    uint64_t last_publish_ns;       // Publish time of the previous block
+    uint64_t last_offset;           // Capture offset at end of previous block
+    double input_rate;              // Smoothed input sample rate for RATE
+
+    /* Compressed and columnar data formats: field layout, frame buffer and
+     * compression statistics. */
+    unsigned int field_count;
+    enum field_type field_types[MAX_CAPTURE_COUNT];
+    unsigned int field_widths[MAX_CAPTURE_COUNT];
+    void *frame_buffer;
+    size_t frame_buffer_size;
+    uint64_t compression_input;     // Bytes of binary data compressed
+    uint64_t compression_output;    // Bytes of compressed frames
+    double compression_time;        // Seconds spent compressing
+
+    /* Passthrough blocks sent with zero copy which the kernel may still be
+     * reading, oldest first.  A block can only be checked for overrun once its
+     * send has completed. */
+    struct zero_copy_block {
+        uint32_t mark;              // Zero copy mark of send
+        unsigned int seq;           // Sequence number of block sent
+    } zero_copy_blocks[ZERO_COPY_BLOCKS];
+    unsigned int zero_copy_count;
+
+    /* Socket send statistics at the start of the stream. */
+    uint64_t base_sent_bytes;
+    uint64_t base_send_ns;
+#ifdef LATENCY_STATS
+    bool data_sent;                 // Set once arm latency recorded
+#endif
+
     /* Buffer for storing a single raw sample. */
     char sample_buffer[MAX_RAW_SAMPLE_LENGTH];
     /* Binary processed data. */
@@ -347,44 +917,56 @@ static unsigned int process_samples(
     size_t free_space =
         sizeof(state->output_buffer) - state->output_buffer_count;
     unsigned int sample_count = (unsigned int) MIN(
-        *length / state->raw_sample_length,
+        *length / state->input_sample_length,
         free_space / state->binary_sample_length);
 
     convert_raw_data_to_binary(
-        data_capture, &state->connection->options, sample_count,
+        state->connection->capture, &state->connection->options, sample_count,
         *buffer, state->output_buffer + state->output_buffer_count);
     state->output_buffer_count += sample_count * state->binary_sample_length;
 
-    size_t consumed = sample_count * state->raw_sample_length;
+    size_t consumed = sample_count * state->input_sample_length;
     *buffer += consumed;
     *length -= consumed;
     return sample_count;
 }
 
 
-/* Update and handle the single sample buffer.  This is needed to cope with
- * alignment errors on the data stream. */
-static unsigned int process_single_sample(
+/* Tops up a partially filled single sample buffer from the start of the
+ * block, returns true if this completes the sample. */
+static bool fill_single_sample(
     struct data_capture_state *state, const void **buffer, size_t *length)
 {
     if (state->sample_buffer_count > 0)
     {
         size_t to_copy = MIN(
-            *length, state->raw_sample_length - state->sample_buffer_count);
+            *length, state->input_sample_length - state->sample_buffer_count);
         memcpy(
             state->sample_buffer + state->sample_buffer_count,
             *buffer, to_copy);
         *buffer += to_copy;
         *length -= to_copy;
         state->sample_buffer_count += to_copy;
-        if (state->sample_buffer_count >= state->raw_sample_length)
-        {
-            const void *sample_buffer = state->sample_buffer;
-            return process_samples(
-                state, &sample_buffer, &state->sample_buffer_count);
-        }
+        return state->sample_buffer_count >= state->input_sample_length;
+    }
+    else
+        return false;
+}
+
+
+/* Update and handle the single sample buffer.  This is needed to cope with
+ * alignment errors on the data stream. */
+static unsigned int process_single_sample(
+    struct data_capture_state *state, const void **buffer, size_t *length)
+{
+    if (fill_single_sample(state, buffer, length))
+    {
+        const void *sample_buffer = state->sample_buffer;
+        return process_samples(
+            state, &sample_buffer, &state->sample_buffer_count);
     }
-    return 0;       // Buffer not processed
+    else
+        return 0;       // Buffer not processed
 }
 
 
@@ -434,6 +1016,74 @@ static bool write_block_base64(
 }
 
 
+/* Returns the interval in seconds from start to end. */
+static double timespec_interval(
+    const struct timespec *start, const struct timespec *end)
+{
+    return
+        (double) (end->tv_sec - start->tv_sec) +
+        1e-9 * (double) (end->tv_nsec - start->tv_nsec);
+}
+
+
+/* Returns a buffer of at least the given size for building a frame. */
+static void *get_frame_buffer(struct data_capture_state *state, size_t size)
+{
+    if (size > state->frame_buffer_size)
+    {
+        free(state->frame_buffer);
+        state->frame_buffer = malloc(size);
+        state->frame_buffer_size = size;
+    }
+    return state->frame_buffer;
+}
+
+
+/* Compresses the given samples into a single frame and transmits it. */
+static bool write_block_compressed(
+    struct data_capture_state *state, const void *data, unsigned int samples)
+{
+    void *frame = get_frame_buffer(state, DELTA_FRAME_MAX_LENGTH(
+        state->field_count, samples, state->binary_sample_length));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t length = delta_encode_frame(
+        state->field_widths, state->field_count, samples, data, frame);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    state->compression_input += samples * state->binary_sample_length;
+    state->compression_output += length;
+    state->compression_time += timespec_interval(&start, &end);
+    return write_block(state->connection->file, frame, length);
+}
+
+
+/* Transposes the given samples into a single columnar frame and transmits
+ * it. */
+static bool write_block_columnar(
+    struct data_capture_state *state, const void *data, unsigned int samples)
+{
+    void *frame = get_frame_buffer(state, COLUMNAR_FRAME_MAX_LENGTH(
+        state->field_count, samples, state->binary_sample_length));
+    size_t length = columnar_encode_frame(
+        state->field_types, state->field_count, samples, data, frame);
+    return write_block(state->connection->file, frame, length);
+}
+
+
+/* Sends the given samples as a single Arrow record batch. */
+static bool write_block_arrow(
+    struct data_capture_state *state, const void *data, unsigned int samples)
+{
+    void *message = get_frame_buffer(state, ARROW_BATCH_MAX_LENGTH(
+        state->field_count, samples, state->binary_sample_length));
+    size_t length = arrow_encode_record_batch(
+        state->field_types, state->field_count, samples, data, message);
+    return write_block(state->connection->file, message, length);
+}
+
+
 static void set_frame_header(void *buffer, uint32_t frame_length) {
     /* Update the first four bytes of the buffer with a header followed by a
      * frame byte count. */
@@ -453,12 +1103,20 @@ static bool send_output_buffer(
     {
         case DATA_FORMAT_ASCII:
             return send_binary_as_ascii(
-                data_capture, &state->connection->options,
+                state->connection->capture, &state->connection->options,
                 state->connection->file, samples, state->output_buffer);
         case DATA_FORMAT_BASE64:
             return write_block_base64(
                 state->connection->file,
                 state->output_buffer, state->output_buffer_count);
+        case DATA_FORMAT_COMPRESSED:
+            return write_block_compressed(
+                state, state->output_buffer, samples);
+        case DATA_FORMAT_COLUMNAR:
+            return write_block_columnar(
+                state, state->output_buffer, samples);
+        case DATA_FORMAT_ARROW:
+            return write_block_arrow(state, state->output_buffer, samples);
         default:
             return write_block(
                 state->connection->file,
@@ -467,152 +1125,958 @@ static bool send_output_buffer(
 }
 
 
-/* Returns false if unable to send data, returns true otherwise.  *data_ok is
- * set to false and data processing is abandoned if buffer overrun is seen. */
-static bool process_capture_block(
-    struct data_capture_state *state, const void *buffer, size_t length,
-    uint64_t *sent_samples, bool *data_ok)
+/* Returns the conversion cache key for this connection.  All binary formats
+ * share the same conversion. */
+static unsigned int conversion_key(const struct data_options *options)
 {
-    /* Ensure output buffer is ready for a fresh transmission. */
-    prepare_output_buffer(state);
+    return 2 * options->data_process +
+        (options->data_format == DATA_FORMAT_ASCII);
+}
 
-    /* Ensure the buffer is aligned to a multiple of samples. */
-    unsigned int samples = process_single_sample(state, &buffer, &length);
 
-    /* Now loop until we've consumed the input buffer. */
-    do {
-        /* Process as much of the input buffer as will fit into the output
-         * buffer, and if there's anything to send, transmit it. */
-        samples += process_samples(state, &buffer, &length);
-        if (samples > 0)
-        {
-            /* Check for buffer overrun while preparing this block.  On failure
-             * just bail out early, but don't report communication error. */
-            *data_ok = check_read_block(state->connection->reader);
-            if (!*data_ok)
-                return true;
-
-            /* Transmit the output buffer, if we can.  If this fails, just
-             * bail out. */
-            if (!send_output_buffer(state, samples))
-                return false;
-
-            /* In case there's more to come, reinitialise the output. */
-            prepare_output_buffer(state);
-            *sent_samples += samples;
-            samples = 0;
-        }
-    } while (length >= state->raw_sample_length);
+/* Returns the space needed to convert the given number of samples. */
+static size_t converted_length(
+    struct data_capture_state *state, unsigned int samples)
+{
+    if (state->connection->options.data_format == DATA_FORMAT_ASCII)
+        return samples *
+            get_max_ascii_sample_length(state->connection->capture);
+    else
+        return samples * state->binary_sample_length;
+}
 
-    /* Add any residue to the single sample buffer. */
-    update_single_sample_buffer(state, buffer, length);
-    return true;
+
+/* Converts samples to binary a buffer at a time using the given working buffer
+ * and formats the result as ASCII.  Returns number of characters written. */
+static size_t convert_ascii_samples(
+    struct data_capture_state *state, const void *buffer, unsigned int samples,
+    void *binary, size_t binary_size, char *output)
+{
+    struct data_options *options = &state->connection->options;
+    char *text = output;
+    unsigned int chunk =
+        (unsigned int) (binary_size / state->binary_sample_length);
+    while (samples > 0)
+    {
+        unsigned int count = MIN(samples, chunk);
+        convert_raw_data_to_binary(
+            state->connection->capture, options, count, buffer, binary);
+        text += format_binary_as_ascii(
+            state->connection->capture, options, count, binary, text);
+        buffer += count * state->raw_sample_length;
+        samples -= count;
+    }
+    return (size_t) (text - output);
 }
 
 
-/* If in RAW and FRAMED mode, we avoid extra memcpys by taking the input
- * buffer and writing blocks directly from it. We always send a integer
- * number of samples to the user, copying the residual to the output_buffer
- * to hold onto it until the next buffer. The contents of output_buffer
- * is an 8 byte header (which is filled in just before it is sent) plus
- * any residual from the last buffer.
- * Returns false if unable to send data, returns true otherwise.  *data_ok is
- * set to false and data processing is abandoned if buffer overrun is seen. */
-static bool passthrough_capture_block(
-    struct data_capture_state *state, const void *buffer, size_t length,
-    uint64_t *sent_samples, bool *data_ok)
+/* Converts samples in the calling thread, returns number of bytes written. */
+static size_t convert_serial_samples(
+    struct data_capture_state *state,
+    const void *buffer, unsigned int samples, void *output)
 {
-    /* The number of samples of residual + buffer we will send */
-    unsigned int samples =
-        (state->output_buffer_count + length) / state->raw_sample_length;
-    /* The bytes of the buffer to send this time */
-    unsigned int buffer_to_send =
-        samples * state->raw_sample_length - state->output_buffer_count;
-    /* The length of the residual including header */
-    unsigned int residual = 8 + state->output_buffer_count;
+    struct data_options *options = &state->connection->options;
+    if (options->data_format == DATA_FORMAT_ASCII)
+        return convert_ascii_samples(
+            state, buffer, samples,
+            state->output_buffer, sizeof(state->output_buffer), output);
+    else
+    {
+        convert_raw_data_to_binary(
+            state->connection->capture, options, samples, buffer, output);
+        return samples * state->binary_sample_length;
+    }
+}
 
-    /* Put the frame length at the start of the residual output buffer */
-    set_frame_header(state->output_buffer, residual + buffer_to_send);
 
-    /* Send frame header and residual output buffer, then the current buffer */
-    bool sent_ok =
-        write_block(state->connection->file, state->output_buffer, residual) &&
-        write_block(state->connection->file, buffer, buffer_to_send);
-    /* Transmit the output buffer, if we can.  If this fails, just bail out. */
-    if (!sent_ok)
-        return false;
+/* A block being converted in parallel is split into sample aligned chunks, one
+ * for each job.  Each job writes its result where it would start if every
+ * sample had its maximum converted length, so for ASCII the results have to be
+ * gathered together afterwards. */
+struct parallel_conversion {
+    struct data_capture_state *state;
+    const void *buffer;
+    void *output;
+    unsigned int samples;
+    unsigned int job_count;
+    size_t lengths[MAX_CONVERSION_JOBS];    // Bytes written by each job
+};
 
-    /* Reset the buffer count to have space for "BIN <frame_length>" again
-     * and add any residue to the output buffer */
-    buffer += buffer_to_send;
-    length -= buffer_to_send;
-    memcpy(state->output_buffer + 8, buffer, length);
-    state->output_buffer_count = length;
 
-    *sent_samples += samples;
-    /* Check here if the reader has just stamped on our data. If it did, then
-     * we're too late to save the bad data we just sent, but signal that we
-     * overrun so the client can discard it */
-    *data_ok = check_read_block(state->connection->reader);
-    return true;
+/* Returns index of first sample converted by the given job. */
+static unsigned int job_first_sample(
+    const struct parallel_conversion *conversion, unsigned int job)
+{
+    return (unsigned int) (
+        (uint64_t) conversion->samples * job / conversion->job_count);
 }
 
 
-/* Sends the data stream until end of stream or there's a problem with the
- * client connection.  Any client connection problem is stored in the
- * connection, so is not returned. */
-static void send_data_stream(
-    struct data_connection *connection, size_t skip_bytes,
-    uint64_t *sent_samples)
+static void conversion_job(void *context, unsigned int job)
 {
-    struct data_capture_state state = {
-        .connection = connection,
-        .raw_sample_length = get_raw_sample_length(data_capture),
-        .binary_sample_length = get_binary_sample_length(
-            data_capture, &connection->options),
-    };
+    struct parallel_conversion *conversion = context;
+    struct data_capture_state *state = conversion->state;
+    unsigned int first = job_first_sample(conversion, job);
+    unsigned int samples = job_first_sample(conversion, job + 1) - first;
+    const void *buffer = conversion->buffer + first * state->raw_sample_length;
+    void *output = conversion->output + converted_length(state, first);
+
+    if (state->connection->options.data_format == DATA_FORMAT_ASCII)
+    {
+        char binary[JOB_BUFFER_SIZE];
+        conversion->lengths[job] = convert_ascii_samples(
+            state, buffer, samples, binary, sizeof(binary), output);
+    }
+    else
+    {
+        convert_raw_data_to_binary(
+            state->connection->capture, &state->connection->options,
+            samples, buffer, output);
+        conversion->lengths[job] = samples * state->binary_sample_length;
+    }
+}
 
-    const struct timespec timeout = {
-        .tv_sec  = READ_BLOCK_POLL_SECS,
-        .tv_nsec = READ_BLOCK_POLL_NSECS, };
 
-    /* Read and process buffers. */
-    bool ok = true;
-    bool data_ok = true;
-    bool passthrough =
-        state.connection->options.data_format == DATA_FORMAT_FRAMED &&
-        state.connection->options.data_process == DATA_PROCESS_RAW;
-    while (ok  &&  data_ok)
-    {
-        size_t in_length;
-        const void *buffer =
-            get_read_block(connection->reader, &timeout, &in_length);
-        if (buffer == NULL  ||  !check_connection(connection))
-            break;
+/* Converts samples using the conversion pool, returns number of bytes
+ * written. */
+static size_t convert_parallel_samples(
+    struct data_capture_state *state,
+    const void *buffer, unsigned int samples, void *output,
+    unsigned int job_count)
+{
+    struct parallel_conversion conversion = {
+        .state = state,
+        .buffer = buffer,
+        .output = output,
+        .samples = samples,
+        .job_count = job_count,
+    };
+    run_worker_jobs(conversion_pool, job_count, conversion_job, &conversion);
 
-        if (unlikely(skip_bytes > 0))
-        {
-            size_t skipped = MIN(skip_bytes, in_length);
-            skip_bytes -= skipped;
-            in_length -= skipped;
-            buffer += skipped;
-        }
+    /* Gather the results together in order. */
+    size_t length = conversion.lengths[0];
+    for (unsigned int job = 1; job < job_count; job ++)
+    {
+        unsigned int first = job_first_sample(&conversion, job);
+        memmove(output + length,
+            output + converted_length(state, first), conversion.lengths[job]);
+        length += conversion.lengths[job];
+    }
+    return length;
+}
 
-        if (in_length > 0)
+
+/* Returns the number of jobs to use to convert the given number of samples, or
+ * zero if they should not be converted in parallel.  Only ASCII and scaled
+ * conversions are expensive enough to be worth sharing. */
+static unsigned int parallel_job_count(
+    struct data_capture_state *state, unsigned int samples)
+{
+    struct data_options *options = &state->connection->options;
+    if (conversion_pool  &&
+        (options->data_format == DATA_FORMAT_ASCII  ||
+         options->data_process == DATA_PROCESS_SCALED)  &&
+        state->binary_sample_length <= JOB_BUFFER_SIZE)
+    {
+        unsigned int job_count = MIN(MIN(
+            get_pool_concurrency(conversion_pool), MAX_CONVERSION_JOBS),
+            samples / MIN_JOB_SAMPLES);
+        return job_count > 1 ? job_count : 0;
+    }
+    else
+        return 0;
+}
+
+
+/* Converts samples from the capture buffer into the given output, formatting
+ * as ASCII if required.  Returns the number of bytes written. */
+static size_t convert_samples(
+    struct data_capture_state *state,
+    const void *buffer, unsigned int samples, void *output)
+{
+    unsigned int job_count = parallel_job_count(state, samples);
+    if (job_count > 0)
+        return convert_parallel_samples(
+            state, buffer, samples, output, job_count);
+    else
+        return convert_serial_samples(state, buffer, samples, output);
+}
+
+
+/* Converts samples without using the cache. */
+static const void *convert_private_samples(
+    struct data_capture_state *state,
+    const void *buffer, unsigned int samples, size_t *length)
+{
+    size_t size = converted_length(state, samples);
+    if (size > state->private_buffer_size)
+    {
+        free(state->private_buffer);
+        state->private_buffer = malloc(size);
+        state->private_buffer_size = size;
+    }
+    *length = convert_samples(state, buffer, samples, state->private_buffer);
+    return state->private_buffer;
+}
+
+
+/* Returns the given samples converted as required for this connection.  If
+ * another client has already converted these samples we use their result,
+ * otherwise we convert them and share the result.  If *entry is returned non
+ * NULL it must be released after use. */
+static const void *get_converted_samples(
+    struct data_capture_state *state,
+    const void *buffer, unsigned int samples, size_t position,
+    struct cache_entry **entry, size_t *length)
+{
+    struct reader_state *reader = state->connection->reader;
+    bool fill;
+    *entry = lookup_cache_entry(
+        conversion_cache, conversion_key(&state->connection->options),
+        read_block_sequence(reader), position, &fill);
+
+    const void *result = NULL;
+    if (*entry  &&  fill)
+    {
+        /* We're first, convert the data for everybody.  The result is only
+         * shared if the capture block remained valid during conversion. */
+        void *output = get_cache_buffer(
+            *entry, converted_length(state, samples));
+        *length = convert_samples(state, buffer, samples, output);
+        bool valid = check_read_block(reader);
+        publish_cache_entry(conversion_cache, *entry, *length, samples, valid);
+        result = output;
+    }
+    else if (*entry)
+    {
+        unsigned int cached_samples;
+        result = read_cache_entry(*entry, length, &cached_samples);
+        if (result  &&  cached_samples != samples)
+            result = NULL;
+    }
+
+    if (result == NULL)
+        result = convert_private_samples(state, buffer, samples, length);
+    return result;
+}
+
+
+/* Sends converted samples in the selected format. */
+static bool send_converted_samples(
+    struct data_capture_state *state,
+    const void *data, size_t length, unsigned int samples,
+    uint64_t *sent_samples)
+{
+    struct data_options *options = &state->connection->options;
+    struct buffered_file *file = state->connection->file;
+    if (options->data_format == DATA_FORMAT_ASCII)
+    {
+        *sent_samples += samples;
+        return write_block(file, data, length);
+    }
+
+    /* Binary data is sent in buffer sized frames or lines. */
+    size_t header = options->data_format == DATA_FORMAT_FRAMED ? 8 : 0;
+    unsigned int chunk = (unsigned int) (
+        (sizeof(state->output_buffer) - header) /
+        state->binary_sample_length);
+    bool ok = true;
+    while (ok  &&  samples > 0)
+    {
+        unsigned int count = MIN(samples, chunk);
+        size_t to_send = count * state->binary_sample_length;
+        switch (options->data_format)
         {
-            if (passthrough)
-                ok = passthrough_capture_block(
-                    &state, buffer, in_length, sent_samples, &data_ok);
-            else
-                ok = process_capture_block(
-                    &state, buffer, in_length, sent_samples, &data_ok);
+            case DATA_FORMAT_FRAMED:
+            {
+                char frame_header[8];
+                set_frame_header(frame_header, (uint32_t) (to_send + header));
+                struct iovec iov[] = {
+                    { .iov_base = frame_header, .iov_len = header, },
+                    { .iov_base = CAST_FROM_TO(const void *, void *, data),
+                      .iov_len = to_send, },
+                };
+                ok = write_blocks(file, iov, ARRAY_SIZE(iov));
+                break;
+            }
+            case DATA_FORMAT_BASE64:
+                ok = write_block_base64(file, data, to_send);
+                break;
+            case DATA_FORMAT_COMPRESSED:
+                ok = write_block_compressed(state, data, count);
+                break;
+            case DATA_FORMAT_COLUMNAR:
+                ok = write_block_columnar(state, data, count);
+                break;
+            case DATA_FORMAT_ARROW:
+                ok = write_block_arrow(state, data, count);
+                break;
+            default:
+                ok = write_block(file, data, to_send);
+                break;
         }
-
-        /* We flush the output buffer at this stage in case we're running slowly
-         * so that the client will see progress. */
         if (ok)
-            ok = flush_out_buf(connection->file);
+            *sent_samples += count;
+        data += to_send;
+        samples -= count;
     }
+    return ok;
+}
+
+
+/* Returns false if unable to send data, returns true otherwise.  *data_ok is
+ * set to false and data processing is abandoned if buffer overrun is seen. */
+static bool process_capture_block(
+    struct data_capture_state *state, const void *buffer, size_t length,
+    uint64_t *sent_samples, bool *data_ok)
+{
+    /* Ensure output buffer is ready for a fresh transmission. */
+    prepare_output_buffer(state);
+
+    /* Ensure the buffer is aligned to a multiple of samples.  If this
+     * completes a sample then send it straight away. */
+    unsigned int samples = process_single_sample(state, &buffer, &length);
+    if (samples > 0)
+    {
+        /* Check for buffer overrun while preparing this block.  On failure
+         * just bail out early, but don't report communication error. */
+        *data_ok = check_read_block(state->connection->reader);
+        if (!*data_ok)
+            return true;
+        else if (!send_output_buffer(state, samples))
+            return false;
+        *sent_samples += samples;
+        state->next_sample += samples;
+    }
+
+    /* Now convert and send all the remaining whole samples in the block. */
+    samples = (unsigned int) (length / state->input_sample_length);
+    if (samples > 0)
+    {
+        struct cache_entry *entry;
+        size_t converted;
+        const void *data = get_converted_samples(
+            state, buffer, samples, length, &entry, &converted);
+
+        /* Even if another client converted this block for us, we still
+         * detect overrun of our own reader. */
+        *data_ok = check_read_block(state->connection->reader);
+        bool ok = !*data_ok  ||
+            send_converted_samples(
+                state, data, converted, samples, sent_samples);
+        if (entry)
+            release_cache_entry(conversion_cache, entry);
+        if (!*data_ok  ||  !ok)
+            return ok;
+        state->next_sample += samples;
+
+        buffer += samples * state->input_sample_length;
+        length -= samples * state->input_sample_length;
+    }
+
+    /* Add any residue to the single sample buffer. */
+    update_single_sample_buffer(state, buffer, length);
+    return true;
+}
+
+
+/* With the RATE option the bucket size is adjusted for each block to bring the
+ * output close to the requested rate.  The input rate is estimated from the
+ * times at which the writer published each block, not from when we read it, so
+ * that a client reading history or catching up on a backlog sees the rate at
+ * which the data was captured.  Blocks skipped on overrun are accounted for by
+ * working from capture offsets. */
+static void update_reduction_rate(struct data_capture_state *state)
+{
+    struct reader_state *reader = state->connection->reader;
+    uint64_t publish_ns = read_block_time(reader);
+    uint64_t offset = read_block_end_offset(reader);
+    /* If the block has just been overwritten these can go backwards, in which
+     * case the estimate is left alone. */
+    bool valid =
+        publish_ns > state->last_publish_ns  &&  offset > state->last_offset;
+    double interval = 1e-9 * (double) (publish_ns - state->last_publish_ns);
+    double samples =
+        (double) ((offset - state->last_offset) / state->input_sample_length);
+    state->last_publish_ns = publish_ns;
+    state->last_offset = offset;
+
+    if (valid)
+    {
+        double rate = samples / interval;
+        if (state->input_rate > 0)
+            state->input_rate += RATE_SMOOTHING * (rate - state->input_rate);
+        else
+            state->input_rate = rate;
+
+        double bucket_size = state->input_rate /
+            state->connection->options.reduction_rate + 0.5;
+        state->bucket_size =
+            (unsigned int) MIN(bucket_size, (double) UINT32_MAX);
+        set_reducer_bucket_size(state->reducer, state->bucket_size);
+    }
+}
+
+
+/* Converts and sends the given number of samples from the raw buffer. */
+static bool send_private_samples(
+    struct data_capture_state *state, unsigned int samples,
+    uint64_t *sent_samples)
+{
+    if (samples > 0)
+    {
+        size_t length;
+        const void *data = convert_private_samples(
+            state, state->raw_buffer, samples, &length);
+        return send_converted_samples(
+            state, data, length, samples, sent_samples);
+    }
+    else
+        return true;
+}
+
+
+/* Projects and reduces samples from the capture buffer into output, returning
+ * the number of samples written. */
+static unsigned int prepare_private_samples(
+    struct data_capture_state *state, unsigned int samples,
+    const void *input, void *output)
+{
+    if (state->connection->projection)
+    {
+        project_samples(state->connection->capture, samples, input, output);
+        input = output;
+    }
+    if (state->reducing)
+        samples = reduce_samples(state->reducer, samples, input, output);
+    return samples;
+}
+
+
+/* With field projection or data rate reduction the raw samples are copied out
+ * of the capture buffer and transformed before conversion.  The result belongs
+ * to this connection alone, so the conversion cache is not used.  Returns false
+ * if unable to send data, *data_ok is set to false if buffer overrun is
+ * seen. */
+static bool private_capture_block(
+    struct data_capture_state *state, const void *buffer, size_t length,
+    uint64_t *sent_samples, bool *data_ok)
+{
+    size_t input_sample_length = state->input_sample_length;
+    unsigned int samples = (unsigned int) (length / input_sample_length);
+
+    /* Allow for the straddling sample as well as whole samples. */
+    size_t size = (samples + 1) * state->raw_sample_length;
+    if (size > state->raw_buffer_size)
+    {
+        free(state->raw_buffer);
+        state->raw_buffer = malloc(size);
+        state->raw_buffer_size = size;
+    }
+
+    unsigned int count = 0;
+    unsigned int input_samples = 0;
+    if (fill_single_sample(state, &buffer, &length))
+    {
+        count = prepare_private_samples(
+            state, 1, state->sample_buffer, state->raw_buffer);
+        state->sample_buffer_count = 0;
+        input_samples = 1;
+    }
+
+    samples = (unsigned int) (length / input_sample_length);
+    input_samples += samples;
+    count += prepare_private_samples(
+        state, samples, buffer,
+        state->raw_buffer + count * state->raw_sample_length);
+    buffer += samples * input_sample_length;
+    length -= samples * input_sample_length;
+    update_single_sample_buffer(state, buffer, length);
+
+    /* The samples are now a private copy, so we can check for overrun. */
+    *data_ok = check_read_block(state->connection->reader);
+    if (*data_ok)
+        state->next_sample += input_samples;
+    return !*data_ok  ||  send_private_samples(state, count, sent_samples);
+}
+
+
+/* Checks each zero copy block whose send has completed, and sets *data_ok to
+ * false if any was overwritten while the kernel was still reading it.
+ * Completions are collected without blocking.  Returns false if the stream has
+ * to wait for more sends to complete before going on: while more than keep
+ * blocks remain in flight, or while the writer is getting close to overwriting
+ * a block still in flight. */
+static bool retire_zero_copy_blocks(
+    struct data_capture_state *state, unsigned int keep, bool *data_ok)
+{
+    struct data_connection *connection = state->connection;
+    unsigned int retired = 0;
+    while (retired < state->zero_copy_count)
+    {
+        struct zero_copy_block *block = &state->zero_copy_blocks[retired];
+        if (!poll_zero_copy(connection->file, block->mark))
+            break;
+        if (!check_read_block_sequence(connection->reader, block->seq))
+            *data_ok = false;
+        retired += 1;
+    }
+
+    state->zero_copy_count -= retired;
+    memmove(state->zero_copy_blocks, &state->zero_copy_blocks[retired],
+        state->zero_copy_count * sizeof(struct zero_copy_block));
+
+    size_t block_size, block_count;
+    get_buffer_size(data_buffer, &block_size, &block_count);
+    return
+        state->zero_copy_count == 0  ||
+        (state->zero_copy_count <= keep  &&
+         read_block_headroom(connection->reader,
+            state->zero_copy_blocks[0].seq) > BUFFER_READ_MARGIN(block_count));
+}
+
+
+/* In RAW mode, FRAMED or UNFRAMED, we avoid extra memcpys by taking the input
+ * buffer and writing blocks directly from it. We always send a integer
+ * number of samples to the user, copying the residual to the output_buffer
+ * to hold onto it until the next buffer. The contents of output_buffer
+ * is an 8 byte header (which is filled in just before it is sent, and only
+ * used in FRAMED mode) plus any residual from the last buffer.
+ *    Header, residual and block are sent together in a single gathered write,
+ * and where the socket supports it the block is sent directly from the capture
+ * buffer using MSG_ZEROCOPY.  In this case the kernel is still reading the
+ * block when write_blocks() returns, so the overrun check is deferred until the
+ * send has completed.
+ * Returns false if unable to send data, returns true otherwise.  *data_ok is
+ * set to false and data processing is abandoned if buffer overrun is seen. */
+static bool passthrough_capture_block(
+    struct data_capture_state *state, const void *buffer, size_t length,
+    uint64_t *sent_samples, bool *data_ok)
+{
+    size_t header =
+        state->connection->options.data_format == DATA_FORMAT_FRAMED ? 8 : 0;
+    /* The number of samples of residual + buffer we will send */
+    unsigned int samples =
+        (state->output_buffer_count + length) / state->input_sample_length;
+    /* The bytes of the buffer to send this time */
+    unsigned int buffer_to_send =
+        samples * state->input_sample_length - state->output_buffer_count;
+    /* The length of the residual including header */
+    unsigned int residual = header + state->output_buffer_count;
+
+    /* Put the frame length at the start of the residual output buffer */
+    if (header)
+        set_frame_header(state->output_buffer, residual + buffer_to_send);
+
+    /* Send frame header and residual output buffer with the current buffer */
+    struct iovec iov[] = {
+        { .iov_base = state->output_buffer + 8 - header,
+          .iov_len = residual, },
+        { .iov_base = CAST_FROM_TO(const void *, void *, buffer),
+          .iov_len = buffer_to_send, },
+    };
+    /* Transmit the output buffer, if we can.  If this fails, just bail out. */
+    struct buffered_file *file = state->connection->file;
+    uint32_t mark = get_zero_copy_mark(file);
+    if (!write_blocks(file, iov, ARRAY_SIZE(iov)))
+        return false;
+
+    /* Reset the buffer count to have space for "BIN <frame_length>" again
+     * and add any residue to the output buffer */
+    buffer += buffer_to_send;
+    length -= buffer_to_send;
+    memcpy(state->output_buffer + 8, buffer, length);
+    state->output_buffer_count = length;
+
+    *sent_samples += samples;
+    state->next_sample += samples;
+    /* Check here if the reader has just stamped on our data. If it did, then
+     * we're too late to save the bad data we just sent, but signal that we
+     * overrun so the client can discard it.  If the block went with zero copy
+     * the kernel is still reading it, so this check has to wait until the send
+     * completes. */
+    struct reader_state *reader = state->connection->reader;
+    if (get_zero_copy_mark(file) == mark)
+        *data_ok = check_read_block(reader);
+    else
+        state->zero_copy_blocks[state->zero_copy_count++] =
+            (struct zero_copy_block) {
+                .mark = get_zero_copy_mark(file),
+                .seq = read_block_sequence(reader),
+            };
+    return true;
+}
+
+
+/* Sends an in band marker with a three letter name and a value.  Only the
+ * FRAMED and ASCII formats have room for this. */
+static bool send_stream_marker(
+    struct data_capture_state *state, const char *name, uint64_t value)
+{
+    struct buffered_file *file = state->connection->file;
+    switch (state->connection->options.data_format)
+    {
+        case DATA_FORMAT_FRAMED:
+        {
+            /* A 16 byte frame: name, space, <frame_length> <value>. */
+            char frame[16];
+            memcpy(frame, name, 3);
+            frame[3] = ' ';
+            CAST_FROM_TO(void *, uint32_t *, frame)[1] = sizeof(frame);
+            memcpy(frame + 8, &value, sizeof(value));
+            return write_block(file, frame, sizeof(frame));
+        }
+        case DATA_FORMAT_ASCII:
+            return write_formatted_string(
+                file, "%s %"PRIu64"\n", name, value);
+        default:
+            return true;
+    }
+}
+
+
+/* With the RESYNC option overrun is not fatal.  The reader is moved on to a
+ * safe distance behind the writer, any partial sample is discarded, and the
+ * client is told how many samples were lost.  Returns false if the reader was
+ * not overrun, otherwise state->ok is updated with the status of the
+ * connection.  Any blocks still in flight with zero copy must have been retired
+ * first. */
+static bool resync_data_stream(struct data_capture_state *state)
+{
+    size_t block_size, block_count;
+    get_buffer_size(data_buffer, &block_size, &block_count);
+    uint64_t offset;
+    if (resync_reader(state->connection->reader,
+            BUFFER_READ_MARGIN(block_count), &offset))
+    {
+        size_t sample_size = state->input_sample_length;
+        uint64_t next_sample = (offset + sample_size - 1) / sample_size;
+        uint64_t lost = next_sample - state->next_sample;
+        state->skip_bytes = (size_t) (next_sample * sample_size - offset);
+        state->lost_samples += lost;
+        state->next_sample = next_sample;
+        state->sample_buffer_count = 0;
+        state->output_buffer_count = 0;
+
+        count_stream_error(&overrun_count);
+        log_message("Resynchronised data stream, %"PRIu64" samples lost",
+            lost);
+        state->ok = send_stream_marker(state, "GAP", lost)  &&
+            flush_out_buf(state->connection->file);
+        return true;
+    }
+    else
+        return false;
+}
+
+
+/* With the ADAPTIVE option the reduction is only applied while the client is
+ * lagging: it starts when the backlog of unread blocks reaches the high
+ * watermark and stops once the client has caught up to the low watermark.
+ * Each transition is reported in band with the bucket size now in effect. */
+static bool update_adaptive_reduction(
+    struct data_capture_state *state, uint64_t *sent_samples)
+{
+    const struct data_options *options = &state->connection->options;
+    size_t block_size, block_count;
+    get_buffer_size(data_buffer, &block_size, &block_count);
+    size_t lag =
+        100 * read_block_backlog(state->connection->reader) / block_count;
+
+    if (!state->reducing  &&  lag >= options->adaptive_high)
+    {
+        state->reducing = true;
+        log_message("Reducing lagging data stream");
+        return send_stream_marker(state, "RED", state->bucket_size);
+    }
+    else if (state->reducing  &&  lag <= options->adaptive_low)
+    {
+        /* Send the final partial bucket before going back to full rate. */
+        state->reducing = false;
+        log_message("Data stream caught up");
+        return
+            (!state->raw_buffer  ||
+             send_private_samples(state,
+                flush_sample_reducer(state->reducer, state->raw_buffer),
+                sent_samples))  &&
+            send_stream_marker(state, "RED", 1);
+    }
+    else
+        return true;
+}
+
+
+/* Resets the client statistics at the start of a data stream. */
+static void start_stream_stats(struct data_capture_state *state)
+{
+    struct client_stats *stats = &state->connection->stats;
+    get_send_stats(state->connection->file,
+        &state->base_sent_bytes, &state->base_send_ns);
+    set_stat(&stats->lag_blocks, 0);
+    set_stat(&stats->lag_bytes, 0);
+    set_stat(&stats->samples, 0);
+    set_stat(&stats->input_bytes, 0);
+    set_stat(&stats->convert_ns, 0);
+    set_stat(&stats->sent_bytes, 0);
+    set_stat(&stats->send_ns, 0);
+    set_stat(&stats->end_ns, 0);
+    set_stat(&stats->start_ns, get_time_ns());
+}
+
+
+#ifdef LATENCY_STATS
+/* Records the latencies for a block returned to the reader at start_ns and
+ * handed to the socket at end_ns after send_ns spent writing to the socket.
+ * The arm to first data latency is only recorded for live data. */
+static void update_stream_latency(
+    struct data_capture_state *state,
+    uint64_t start_ns, uint64_t end_ns, uint64_t send_ns)
+{
+    struct data_connection *connection = state->connection;
+    struct latency_stats *latency = &connection->stats.latency;
+    uint64_t publish_ns = read_block_time(connection->reader);
+    record_latency(latency, LATENCY_WAKEUP, publish_ns, start_ns);
+    record_latency(latency, LATENCY_CONVERT, start_ns + send_ns, end_ns);
+    record_latency(latency, LATENCY_SEND, 0, send_ns);
+    record_latency(latency, LATENCY_TOTAL, publish_ns, end_ns);
+    if (!state->data_sent  &&
+        connection->options.data_range == DATA_RANGE_NONE)
+        record_latency(latency, LATENCY_ARM, get_stat(&arm_ns), end_ns);
+    state->data_sent = true;
+}
+#endif
+
+
+/* Updates the client statistics after processing in_length bytes of captured
+ * data, starting at start_ns.  Time not spent writing to the socket is counted
+ * as conversion time. */
+static void update_stream_stats(
+    struct data_capture_state *state, uint64_t start_ns, size_t in_length,
+    uint64_t sent_samples)
+{
+    struct data_connection *connection = state->connection;
+    struct client_stats *stats = &connection->stats;
+    uint64_t sent_bytes, send_ns;
+    get_send_stats(connection->file, &sent_bytes, &send_ns);
+    sent_bytes -= state->base_sent_bytes;
+    send_ns -= state->base_send_ns;
+
+    uint64_t end_ns = get_time_ns();
+    uint64_t block_ns = end_ns - start_ns;
+    uint64_t block_send_ns = send_ns - get_stat(&stats->send_ns);
+    if (block_ns > block_send_ns)
+        set_stat(&stats->convert_ns,
+            get_stat(&stats->convert_ns) + block_ns - block_send_ns);
+    LATENCY(
+        if (in_length > 0)
+            update_stream_latency(state, start_ns, end_ns, block_send_ns));
+    set_stat(&stats->input_bytes, get_stat(&stats->input_bytes) + in_length);
+    set_stat(&stats->samples, sent_samples);
+    set_stat(&stats->sent_bytes, sent_bytes);
+    set_stat(&stats->send_ns, send_ns);
+    set_stat(&stats->lag_blocks, read_block_backlog(connection->reader));
+    set_stat(&stats->lag_bytes, read_byte_backlog(connection->reader));
+}
+
+
+/* Prepares to send the data stream for the capture just opened.  At most
+ * send_bytes of captured data are sent after skipping skip_bytes, and
+ * lost_samples is the number of samples already lost. */
+static struct data_capture_state *start_data_stream(
+    struct data_connection *connection, size_t skip_bytes,
+    uint64_t send_bytes, uint64_t lost_samples)
+{
+    struct data_capture_state *state =
+        malloc(sizeof(struct data_capture_state));
+    *state = (struct data_capture_state) {
+        .connection = connection,
+        .input_sample_length =
+            get_raw_sample_length(connection->description->capture),
+        .raw_sample_length = get_raw_sample_length(connection->capture),
+        .binary_sample_length = get_binary_sample_length(
+            connection->capture, &connection->options),
+        /* When following a capture we start after the missed samples. */
+        .next_sample = lost_samples,
+        .ok = true,
+        .data_ok = true,
+        .skip_bytes = skip_bytes,
+        .send_bytes = send_bytes,
+        .lost_samples = lost_samples,
+    };
+
+    state->passthrough =
+        (connection->options.data_format == DATA_FORMAT_FRAMED  ||
+         connection->options.data_format == DATA_FORMAT_UNFRAMED)  &&
+        connection->options.data_process == DATA_PROCESS_RAW  &&
+        connection->options.data_reduction == DATA_REDUCTION_NONE  &&
+        !connection->projection;
+    if (state->passthrough)
+        enable_zero_copy(connection->file);
+    if (connection->options.data_reduction != DATA_REDUCTION_NONE)
+    {
+        state->reducer = create_sample_reducer(
+            connection->capture, &connection->options);
+        state->reducing = !connection->options.adaptive;
+        state->bucket_size = connection->options.reduction_count;
+        state->last_publish_ns =
+            read_capture_start_time(connection->reader);
+    }
+    state->field_count = get_binary_field_types(
+        connection->capture, &connection->options, state->field_types);
+    for (unsigned int i = 0; i < state->field_count; i ++)
+        state->field_widths[i] = FIELD_TYPE_WIDTH(state->field_types[i]);
+    start_stream_stats(state);
+    return state;
+}
+
+
+/* Processes and sends a single block of captured data. */
+static void send_capture_block(
+    struct data_capture_state *state, const void *buffer, size_t in_length)
+{
+    struct data_connection *connection = state->connection;
+    if (unlikely(state->skip_bytes > 0))
+    {
+        size_t skipped = MIN(state->skip_bytes, in_length);
+        state->skip_bytes -= skipped;
+        in_length -= skipped;
+        buffer += skipped;
+    }
+    /* Once a limited range has been sent we run through the remaining blocks
+     * so that the reader sees the end of data. */
+    if (unlikely(in_length > state->send_bytes))
+        in_length = (size_t) state->send_bytes;
+    state->send_bytes -= in_length;
+    uint64_t start_ns = get_time_ns();
+
+    bool ok = true;
+    bool *data_ok = &state->data_ok;
+    uint64_t *sent_samples = &state->sent_samples;
+    if (in_length > 0)
+    {
+        if (state->reducer  &&  connection->options.reduction_rate > 0)
+            update_reduction_rate(state);
+        if (connection->options.adaptive)
+            ok = update_adaptive_reduction(state, sent_samples);
+
+        if (!ok)
+            ;
+        else if (state->raw_sample_length == 0)
+            /* None of the selected fields are captured. */
+            *data_ok = check_read_block(connection->reader);
+        else if (state->passthrough)
+            ok = passthrough_capture_block(
+                state, buffer, in_length, sent_samples, data_ok);
+        else if (state->reducing  ||  connection->projection)
+            ok = private_capture_block(
+                state, buffer, in_length, sent_samples, data_ok);
+        else
+            ok = process_capture_block(
+                state, buffer, in_length, sent_samples, data_ok);
+    }
+
+    /* We flush the output buffer at this stage in case we're running slowly so
+     * that the client will see progress. */
+    state->ok = ok  &&  flush_out_buf(connection->file);
+    update_stream_stats(state, start_ns, in_length, *sent_samples);
+}
+
+
+/* Outcome of each step of sending the data stream. */
+enum stream_step {
+    STREAM_CONTINUE,            // Ready for the next step
+    STREAM_WAIT_DATA,           // Waiting for reader event
+    STREAM_WAIT_SOCKET,         // Waiting for socket to take more data
+    STREAM_END,                 // End of stream or connection failed
+};
+
+
+/* Sends the data stream one block at a time until end of stream or there's a
+ * problem with the client connection.  A new block is only taken once the
+ * socket has taken everything sent so far, and once enough of the blocks sent
+ * with zero copy have completed.  Any client connection problem is stored in
+ * the connection. */
+static enum stream_step send_data_step(struct data_capture_state *state)
+{
+    struct data_connection *connection = state->connection;
+    state->ok = state->ok  &&
+        !connection->disconnected  &&  check_buffered_file(connection->file);
+    if (!state->ok)
+        return STREAM_END;
+    else if (get_out_queue_length(connection->file) > 0)
+        return STREAM_WAIT_SOCKET;
+
+    /* Before resynchronising or ending the stream all blocks still in flight
+     * must be retired.  Any overrun of these blocks has to be detected before
+     * the reader is closed, so that it is reported, but when resynchronising
+     * these blocks were sent before the overrun anyway. */
+    bool in_flight_ok = true;
+    if (!retire_zero_copy_blocks(state,
+            state->resyncing  ||  state->ending ? 0 : ZERO_COPY_BLOCKS - 1,
+            state->resyncing ? &in_flight_ok : &state->data_ok))
+        return STREAM_WAIT_SOCKET;
+    else if (state->ending)
+        return STREAM_END;
+    else if (state->resyncing)
+    {
+        state->resyncing = false;
+        state->data_ok = resync_data_stream(state);
+        state->ending = !state->data_ok;
+        return STREAM_CONTINUE;
+    }
+
+    size_t in_length;
+    const void *buffer = NULL;
+    if (state->data_ok)
+    {
+        buffer = get_read_block(connection->reader, NULL, &in_length);
+        if (buffer  &&  in_length == 0)
+            return STREAM_WAIT_DATA;
+    }
+
+    if (buffer)
+        send_capture_block(state, buffer, in_length);
+    else
+    {
+        /* This is either the end of the data or an overrun. */
+        state->resyncing = connection->options.resync;
+        state->ending = !state->resyncing;
+    }
+    return STREAM_CONTINUE;
+}
+
+
+/* Completes the data stream and releases its resources. */
+static void end_data_stream(struct data_capture_state *state)
+{
+    struct data_connection *connection = state->connection;
+    if (state->reducer)
+    {
+        /* Send any final partial bucket. */
+        if (state->ok  &&  state->data_ok  &&
+                state->reducing  &&  state->raw_buffer)
+            state->ok = send_private_samples(state,
+                    flush_sample_reducer(state->reducer, state->raw_buffer),
+                    &state->sent_samples)  &&
+                flush_out_buf(connection->file);
+        destroy_sample_reducer(state->reducer);
+    }
+    if (connection->options.data_format == DATA_FORMAT_COMPRESSED  &&
+            state->compression_input > 0)
+        log_message("Compressed %"PRIu64" bytes to %"PRIu64" (%.1f%%), "
+            "%.1f MB/s",
+            state->compression_input, state->compression_output,
+            100.0 * (double) state->compression_output /
+                (double) state->compression_input,
+            1e-6 * (double) state->compression_input /
+                MAX(state->compression_time, 1e-9));
+    set_stat(&connection->stats.lag_blocks, 0);
+    set_stat(&connection->stats.lag_bytes, 0);
+    set_stat(&connection->stats.end_ns, get_time_ns());
+    free(state->frame_buffer);
+    free(state->raw_buffer);
+    free(state->private_buffer);
+    free(state);
 }
 
 
@@ -629,60 +2093,610 @@ static bool send_data_completion(
     };
     const char *message = status ?
         completions[status] : hw_decode_completion(completion);
+    if (status == READER_STATUS_CLOSED)
+        count_stream_error(&disconnect_count);
+    else if (status == READER_STATUS_OVERRUN)
+        count_stream_error(&overrun_count);
 
-    if (!connection->options.omit_status)
+    if (connection->options.data_format == DATA_FORMAT_ARROW)
+    {
+        char end_of_stream[ARROW_END_OF_STREAM_LENGTH];
+        write_block(connection->file, end_of_stream,
+            arrow_encode_end_of_stream(end_of_stream));
+    }
+    /* With RESYNC the total count of lost samples is also reported. */
+    if (connection->options.omit_status)
+        ;
+    else if (connection->options.resync)
+        write_formatted_string(connection->file,
+            "END %"PRIu64" %"PRIu64" %s\n",
+            sent_samples, lost_samples, message);
+    else
         write_formatted_string(connection->file,
             "END %"PRIu64" %s\n", sent_samples, message);
     log_message("Sent %"PRIu64" (+%"PRIu64") %s",
         sent_samples, lost_samples, message);
+    bool ok = flush_out_buf(connection->file);
+
+    /* If this capture was disarmed record how long it took to tell the client
+     * about it. */
+    LATENCY(
+        uint64_t disarmed = get_stat(&disarm_ns);
+        if (connection->options.data_range == DATA_RANGE_NONE  &&
+                disarmed > get_stat(&arm_ns))
+            record_latency(&connection->stats.latency, LATENCY_END,
+                disarmed, get_latency_time()));
+    return ok;
+}
+
+
+/* Sends only the selected fields, converting the capture if needed. */
+static void apply_projection(
+    struct data_connection *connection, struct captured_fields *fields)
+{
+    struct data_capture *projection = create_projected_capture(
+        fields, connection->description->capture);
+    connection->fields = fields;
+    connection->projected_fields = fields;
+    if (projection_is_identity(projection))
+        free(projection);
+    else
+    {
+        connection->capture = projection;
+        connection->projection = projection;
+    }
+}
+
+
+/* Selects the fields and capture for this experiment, projecting the full
+ * capture if requested.  Fails if the requested fields aren't all captured. */
+static error__t prepare_projection(struct data_connection *connection)
+{
+    free(connection->projected_fields);
+    free(connection->projection);
+    connection->projected_fields = NULL;
+    connection->projection = NULL;
+    const struct capture_description *description = connection->description;
+    connection->fields = description->fields;
+    connection->capture = description->capture;
+
+    struct captured_fields *fields;
+    return IF(connection->options.field_list[0],
+        project_captured_fields(
+            description->fields, connection->options.field_list, &fields)  ?:
+        DO(apply_projection(connection, fields)));
+}
+
+
+/* If the experiment can't be sent to this client it is reported in place of
+ * the header, and the connection is then closed. */
+static bool send_experiment_error(
+    struct data_connection *connection, error__t error)
+{
+    log_message("Unable to send capture: %s", error_format(error));
+    if (!connection->options.omit_status)
+        write_formatted_string(
+            connection->file, "ERR %s\n", error_format(error));
+    error_discard(error);
     return flush_out_buf(connection->file);
 }
 
 
-/* This is the top level handler for a single data client connection.  The
- * connection must open with a format request, after which we will send data
- * capture results while the socket is connected. */
-error__t process_data_socket(int scon)
+/* Ensure we always close the reader, even if sending the stream failed.  Note
+ * that we pick up the completion code before closing the reader, as in
+ * principle it can change immediately after the last reader has closed.  The
+ * connection then waits for the next capture unless we're done. */
+static void finish_capture(
+    struct data_connection *connection,
+    uint64_t sent_samples, uint64_t lost_samples)
 {
-    struct data_connection connection = {
-        .scon = scon,
-        .file = create_buffered_file(scon, IN_BUF_SIZE, OUT_BUF_SIZE),
-    };
+    unsigned int completion = connection->description->completion;
+    enum reader_status status = close_reader(connection->reader);
+    bool ok = send_data_completion(
+        connection, sent_samples, lost_samples, status, completion);
+
+    /* A range of the last experiment is only sent once. */
+    if (!ok  ||  connection->options.one_shot  ||
+            connection->options.data_range != DATA_RANGE_NONE)
+        connection->state = CONNECTION_CLOSING;
+    else
+        connection->state = CONNECTION_CAPTURE;
+}
 
-    if (process_data_request(&connection))
+
+/* Opens the next capture, or the requested range of the last capture, and
+ * starts sending it. */
+static enum connection_wait open_next_capture(
+    struct data_connection *connection)
+{
+    uint64_t lost_samples;
+    size_t skip_bytes;
+    uint64_t send_bytes = UINT64_MAX;
+    bool range = connection->options.data_range != DATA_RANGE_NONE;
+    if (connection->disconnected  ||  !check_buffered_file(connection->file))
+    {
+        connection->state = CONNECTION_CLOSING;
+        return WAIT_NONE;
+    }
+    else if (range)
     {
-        connection.reader = create_reader(data_buffer);
-        uint64_t lost_samples;
-        size_t skip_bytes;
-        bool ok = true;
-        while (ok  &&
-            wait_for_capture(&connection, &lost_samples, &skip_bytes))
+        if (!open_data_range(
+                connection, &lost_samples, &skip_bytes, &send_bytes))
         {
-            if (!connection.options.omit_header)
-                ok = send_data_header(
-                    captured_fields, data_capture,
-                    &connection.options, connection.file, lost_samples);
-
-            uint64_t sent_samples = 0;
-            if (ok)
-                send_data_stream(&connection, skip_bytes, &sent_samples);
-
-            /* Ensure we always close the reader, even if sending the stream
-             * failed.  Note that we pick up the completion code before closing
-             * the reader, as in principle it can change immediately after the
-             * last reader has closed. */
-            unsigned int completion = completion_code;
-            enum reader_status status = close_reader(connection.reader);
-            ok = send_data_completion(
-                &connection, sent_samples, lost_samples, status, completion);
-
-            if (connection.options.one_shot)
-                break;
+            connection->state = CONNECTION_CLOSING;
+            return WAIT_NONE;
+        }
+    }
+    else if (!open_capture(connection, &lost_samples, &skip_bytes))
+        return WAIT_INPUT;
+
+    error__t error = prepare_projection(connection);
+    if (error)
+    {
+        close_reader(connection->reader);
+        send_experiment_error(connection, error);
+        connection->state = CONNECTION_CLOSING;
+        return WAIT_NONE;
+    }
+
+    bool ok = true;
+    if (!connection->options.omit_header)
+        ok = send_data_header(
+            connection->fields, connection->capture,
+            &connection->options, connection->file, lost_samples);
+    if (ok  &&  connection->options.data_format == DATA_FORMAT_ARROW)
+        ok = send_arrow_schema(
+            connection->fields, connection->capture,
+            &connection->options, connection->file, lost_samples);
+
+    if (ok)
+    {
+        connection->stream = start_data_stream(
+            connection, skip_bytes, send_bytes, lost_samples);
+        connection->state = CONNECTION_STREAM;
+    }
+    else
+        finish_capture(connection, 0, lost_samples);
+    return WAIT_NONE;
+}
+
+
+static enum connection_wait send_stream_block(
+    struct data_connection *connection)
+{
+    struct data_capture_state *stream = connection->stream;
+    switch (send_data_step(stream))
+    {
+        case STREAM_CONTINUE:       return WAIT_NONE;
+        case STREAM_WAIT_DATA:      return WAIT_INPUT;
+        case STREAM_WAIT_SOCKET:    return WAIT_OUTPUT;
+        case STREAM_END:
+        default:
+        {
+            uint64_t sent_samples = stream->sent_samples;
+            uint64_t lost_samples = stream->lost_samples;
+            end_data_stream(stream);
+            connection->stream = NULL;
+            finish_capture(connection, sent_samples, lost_samples);
+            return WAIT_NONE;
+        }
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Data connection reactor.
+ *
+ * All data connections are served by a single thread waiting in epoll_wait()
+ * on the non-blocking client sockets and on the wakeup events of the capture
+ * buffer readers.  Each connection advances through its states whenever its
+ * socket or reader lets it make progress: a connection waiting for data is
+ * woken by the capture buffer writer, and a connection sending data only takes
+ * on its next block once its socket has taken everything sent so far.
+ *    Connections ready to run take turns, one step at a time, so that no
+ * connection can hold up the others for more than a single block.
+ *    The reactor itself only looks after the sockets: requests, headers, raw
+ * data sent straight from the capture buffer, and output the sockets couldn't
+ * take at once.  Every other block of a data stream has to be converted, and
+ * if there is a stream pool this is handed to a stream worker so that blocks
+ * for different clients are converted at the same time.  While the worker has
+ * the connection the reactor leaves it alone, and when the worker hands it back
+ * the reactor waits for the socket to take the converted block. */
+
+static pthread_t reactor_thread_id;
+/* Used to wake the reactor when connections are added or on shutdown. */
+static int reactor_event = -1;
+
+/* New connections are handed over to the reactor on this list, and the reactor
+ * is stopped by setting reactor_stopping, both under the reactor mutex. */
+static pthread_mutex_t reactor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(new_connections);
+static bool reactor_running;
+static bool reactor_stopping;
+/* Connections handed back by stream workers, also under the reactor mutex. */
+static LIST_HEAD(stepped_connections);
+
+/* All connections and the queue of connections ready to run, only used by the
+ * reactor thread. */
+static LIST_HEAD(reactor_connections);
+static LIST_HEAD(run_queue);
+/* Set once the reactor has seen that it is stopping. */
+static bool reactor_closing;
+
+
+static void make_runnable(struct data_connection *connection)
+{
+    if (connection->busy)
+        connection->pending = true;
+    else if (!connection->runnable)
+    {
+        list_add_tail(&connection->run_list, &run_queue);
+        connection->runnable = true;
+    }
+}
+
+
+/* We only ask for output events while there is output waiting for the socket,
+ * otherwise we'd be woken continually. */
+static void update_socket_events(struct data_connection *connection)
+{
+    uint32_t events = EPOLLIN | EPOLLRDHUP;
+    if (get_out_queue_length(connection->file) > 0)
+        events |= EPOLLOUT;
+    if (events != connection->socket_events)
+    {
+        struct epoll_event event = {
+            .events = events, .data.ptr = &connection->socket_source, };
+        fail_buffered_file(connection->file,
+            TEST_IO(epoll_ctl(
+                reactor_epoll, EPOLL_CTL_MOD, connection->scon, &event)));
+        connection->socket_events = events;
+    }
+}
+
+
+static void adopt_connection(struct data_connection *connection)
+{
+    connection->socket_source = (struct reactor_source) {
+        .connection = connection, .reader = false, };
+    connection->socket_events = EPOLLIN | EPOLLRDHUP;
+    struct epoll_event event = {
+        .events = connection->socket_events,
+        .data.ptr = &connection->socket_source, };
+    fail_buffered_file(connection->file,
+        TEST_IO(epoll_ctl(
+            reactor_epoll, EPOLL_CTL_ADD, connection->scon, &event)));
+    list_add_tail(&connection->list, &reactor_connections);
+    /* The request may already be waiting for us. */
+    make_runnable(connection);
+}
+
+
+static void destroy_connection(struct data_connection *connection)
+{
+    list_del(&connection->list);
+    IGNORE(epoll_ctl(reactor_epoll, EPOLL_CTL_DEL, connection->scon, NULL));
+    if (connection->reader)
+    {
+        IGNORE(epoll_ctl(reactor_epoll, EPOLL_CTL_DEL,
+            get_reader_event(connection->reader), NULL));
+        remove_client_stats(&connection->stats);
+        destroy_reader(connection->reader);
+    }
+    free(connection->projected_fields);
+    free(connection->projection);
+    connection->closed(
+        connection->context, destroy_buffered_file(connection->file));
+    free(connection);
+}
+
+
+/* Works out what the connection is waiting for after a step.  Once the
+ * connection is closing any remaining output is given the chance to reach the
+ * client, unless the client has gone away. */
+static void complete_step(
+    struct data_connection *connection, enum connection_wait wait)
+{
+    struct buffered_file *file = connection->file;
+    if (connection->state == CONNECTION_CLOSING)
+    {
+        if (connection->disconnected  ||  !send_out_queue(file)  ||
+                get_out_queue_length(file) == 0)
+        {
+            destroy_connection(connection);
+            return;
+        }
+        wait = WAIT_OUTPUT;
+    }
+
+    /* Waiting for the socket is timed from the last time it took anything. */
+    if (wait == WAIT_OUTPUT)
+    {
+        uint64_t sent_bytes, send_ns;
+        get_send_stats(file, &sent_bytes, &send_ns);
+        if (connection->stall_ns == 0  ||
+                sent_bytes != connection->stall_bytes)
+        {
+            connection->stall_ns = get_time_ns();
+            connection->stall_bytes = sent_bytes;
+        }
+    }
+    else
+        connection->stall_ns = 0;
+
+    update_socket_events(connection);
+    if (wait == WAIT_NONE)
+        make_runnable(connection);
+}
+
+
+/* Runs a step of a data stream on a stream worker and hands the connection
+ * back to the reactor. */
+static void run_stream_step(void *context)
+{
+    struct data_connection *connection = context;
+    connection->step_wait = send_stream_block(connection);
+
+    LOCK(reactor_mutex);
+    list_add_tail(&connection->run_list, &stepped_connections);
+    UNLOCK(reactor_mutex);
+    ASSERT_IO(eventfd_write(reactor_event, 1));
+}
+
+
+/* Hands the next block of a data stream to a stream worker.  Until the worker
+ * is done we only want to hear about the first socket event, as we can't clear
+ * socket events while the worker has the connection. */
+static void start_stream_step(struct data_connection *connection)
+{
+    uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    struct epoll_event event = {
+        .events = events, .data.ptr = &connection->socket_source, };
+    fail_buffered_file(connection->file,
+        TEST_IO(epoll_ctl(
+            reactor_epoll, EPOLL_CTL_MOD, connection->scon, &event)));
+    connection->socket_events = events;
+    connection->stall_ns = 0;
+    connection->busy = true;
+    queue_worker_job(stream_pool, run_stream_step, connection);
+}
+
+
+/* Takes back a connection from a stream worker.  If anything happened while
+ * the worker had the connection it runs again straight away. */
+static void end_stream_step(struct data_connection *connection)
+{
+    bool pending = connection->pending  ||  reactor_closing;
+    connection->busy = false;
+    connection->pending = false;
+    if (reactor_closing)
+        connection->disconnected = true;
+    complete_step(connection, pending ? WAIT_NONE : connection->step_wait);
+}
+
+
+/* Runs one step of the connection, unless a stream worker is to do it. */
+static void run_connection(struct data_connection *connection)
+{
+    struct buffered_file *file = connection->file;
+    if (get_out_queue_length(file) > 0)
+        send_out_queue(file);
+
+    enum connection_wait wait = WAIT_NONE;
+    switch (connection->state)
+    {
+        case CONNECTION_REQUEST:
+            wait = read_data_request(connection);
+            break;
+        case CONNECTION_CAPTURE:
+            wait = open_next_capture(connection);
+            break;
+        case CONNECTION_STREAM:
+            if (stream_pool  &&  !connection->stream->passthrough  &&
+                    get_out_queue_length(file) == 0)
+            {
+                start_stream_step(connection);
+                return;
+            }
+            wait = send_stream_block(connection);
+            break;
+        case CONNECTION_CLOSING:
+            break;
+    }
+    complete_step(connection, wait);
+}
+
+
+/* Gives every connection which was ready to run one step.  Connections still
+ * ready afterwards go to the back of the queue for the next round. */
+static void run_connections(void)
+{
+    struct list_head ready;
+    if (list_is_empty(&run_queue))
+        return;
+    __list_add(&ready, run_queue.prev, run_queue.next);
+    init_list_head(&run_queue);
+
+    while (!list_is_empty(&ready))
+    {
+        struct data_connection *connection =
+            container_of(ready.next, struct data_connection, run_list);
+        list_del(&connection->run_list);
+        connection->runnable = false;
+        run_connection(connection);
+    }
+}
+
+
+/* Events on the reactor's own event: takes over any new connections, takes
+ * back connections from stream workers, and on shutdown treats all connections
+ * as disconnected. */
+static void process_reactor_event(void)
+{
+    eventfd_t value;
+    IGNORE(eventfd_read(reactor_event, &value));
+
+    LOCK(reactor_mutex);
+    while (!list_is_empty(&new_connections))
+    {
+        struct data_connection *connection = container_of(
+            new_connections.next, struct data_connection, list);
+        list_del(&connection->list);
+        adopt_connection(connection);
+    }
+    struct list_head stepped;
+    if (list_is_empty(&stepped_connections))
+        init_list_head(&stepped);
+    else
+    {
+        __list_add(&stepped,
+            stepped_connections.prev, stepped_connections.next);
+        init_list_head(&stepped_connections);
+    }
+    bool stopping = reactor_stopping;
+    UNLOCK(reactor_mutex);
+
+    while (!list_is_empty(&stepped))
+    {
+        struct data_connection *connection =
+            container_of(stepped.next, struct data_connection, run_list);
+        list_del(&connection->run_list);
+        end_stream_step(connection);
+    }
+
+    if (stopping  &&  !reactor_closing)
+    {
+        reactor_closing = true;
+        list_for_each_entry(struct data_connection, list,
+            connection, &reactor_connections)
+        {
+            /* A busy connection is closed when it is taken back. */
+            if (!connection->busy)
+                connection->disconnected = true;
+            make_runnable(connection);
+        }
+    }
+}
+
+
+/* An event on a connection's socket or reader just makes the connection ready
+ * to run, but we have to clear the conditions which would otherwise go on being
+ * reported.  Any input after the data request is discarded, and end of input
+ * means that the client has gone away. */
+static void process_connection_event(
+    const struct reactor_source *source, uint32_t events)
+{
+    struct data_connection *connection = source->connection;
+    if (source->reader)
+    {
+        eventfd_t value;
+        IGNORE(eventfd_read(get_reader_event(connection->reader), &value));
+    }
+    else if (connection->busy)
+        /* The socket is left to the worker until it's done. */
+        ;
+    else
+    {
+        if (events & EPOLLERR)
+            check_socket_error(connection->file);
+        if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))  &&
+                connection->state != CONNECTION_REQUEST  &&
+                !check_connection(connection))
+            connection->disconnected = true;
+    }
+    make_runnable(connection);
+}
+
+
+/* Fails connections which have been waiting too long for their socket, and
+ * returns the time in milliseconds until the next connection will time out, or
+ * -1 if no connection is waiting. */
+static int check_stalled_connections(void)
+{
+    uint64_t now = get_time_ns();
+    uint64_t timeout_ns = 1000000000 * (uint64_t) TRANSMIT_TIMEOUT_SECS;
+    uint64_t next_ns = UINT64_MAX;
+    list_for_each_entry(struct data_connection, list,
+        connection, &reactor_connections)
+    {
+        if (connection->stall_ns == 0)
+            ;
+        else if (now - connection->stall_ns >= timeout_ns)
+        {
+            fail_buffered_file(connection->file,
+                FAIL_("Timed out writing to socket"));
+            connection->stall_ns = 0;
+            make_runnable(connection);
+        }
+        else
+            next_ns = MIN(next_ns, connection->stall_ns + timeout_ns - now);
+    }
+    /* Round up so that we don't wake just before the timeout. */
+    return next_ns == UINT64_MAX ? -1 : (int) ((next_ns + 999999) / 1000000);
+}
+
+
+static void *data_reactor_thread(void *context)
+{
+    /* Data connections are served on the same CPUs as the other sessions, clear
+     * of the data capture thread. */
+    error_report(set_session_affinity());
+
+    while (!reactor_closing  ||  !list_is_empty(&reactor_connections))
+    {
+        int timeout = check_stalled_connections();
+        if (!list_is_empty(&run_queue))
+            timeout = 0;
+
+        struct epoll_event events[REACTOR_EVENTS];
+        int count = epoll_wait(reactor_epoll, events, REACTOR_EVENTS, timeout);
+        ASSERT_OK_IO(count >= 0  ||  errno == EINTR);
+        for (int i = 0; i < count; i ++)
+        {
+            if (events[i].data.ptr)
+                process_connection_event(
+                    events[i].data.ptr, events[i].events);
+            else
+                process_reactor_event();
         }
-        destroy_reader(connection.reader);
+        run_connections();
+    }
+    return NULL;
+}
+
+
+error__t add_data_connection(
+    int sock, void (*closed)(void *context, error__t error), void *context)
+{
+    struct data_connection *connection =
+        malloc(sizeof(struct data_connection));
+    *connection = (struct data_connection) {
+        .scon = sock,
+        .file = create_buffered_file(sock, IN_BUF_SIZE, OUT_BUF_SIZE),
+        .state = CONNECTION_REQUEST,
+        .closed = closed,
+        .context = context,
+    };
+
+    error__t error = set_nonblocking(connection->file);
+    if (!error)
+    {
+        LOCK(reactor_mutex);
+        error = TEST_OK_(reactor_running  &&  !reactor_stopping,
+            "Data server not running");
+        if (!error)
+            list_add_tail(&connection->list, &new_connections);
+        UNLOCK(reactor_mutex);
     }
 
-    return destroy_buffered_file(connection.file);
+    if (error)
+    {
+        error_discard(destroy_buffered_file(connection->file));
+        free(connection);
+    }
+    else
+        ASSERT_IO(eventfd_write(reactor_event, 1));
+    return error;
 }
 
 
@@ -690,12 +2704,66 @@ error__t process_data_socket(int scon)
 /* Initialisation and shutdown. */
 
 
-error__t initialise_data_server(void)
+error__t initialise_data_server(
+    unsigned int block_size, unsigned int block_count, bool lock_buffer)
 {
     pwait_initialise(&data_thread_event);
-    log_message("Allocate %dx %d blocks", DATA_BLOCK_COUNT, DATA_BLOCK_SIZE);
-    data_buffer = create_buffer(DATA_BLOCK_SIZE, DATA_BLOCK_COUNT);
-    return ERROR_OK;
+    log_message("Allocate %ux %u byte blocks", block_count, block_size);
+    log_message("Using %s scaled data conversion", scaling_kernel_name());
+    conversion_cache =
+        create_conversion_cache(CACHE_KEY_COUNT, CACHE_SLOT_COUNT);
+    return create_buffer(block_size, block_count, lock_buffer, &data_buffer);
+}
+
+
+void set_conversion_pool(struct worker_pool *pool)
+{
+    conversion_pool = pool;
+    log_message("Using %u threads for data conversion",
+        get_pool_concurrency(pool));
+}
+
+
+void set_stream_pool(struct worker_pool *pool)
+{
+    stream_pool = pool;
+    log_message("Using %u threads for data streams",
+        get_pool_concurrency(pool) - 1);
+}
+
+
+static error__t start_data_reactor(void)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL, };
+    error__t error =
+        TEST_IO(reactor_epoll = epoll_create1(EPOLL_CLOEXEC))  ?:
+        TEST_IO(reactor_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))  ?:
+        TEST_IO(epoll_ctl(
+            reactor_epoll, EPOLL_CTL_ADD, reactor_event, &event))  ?:
+        TEST_PTHREAD(pthread_create(
+            &reactor_thread_id, NULL, data_reactor_thread, NULL));
+    if (!error)
+    {
+        LOCK(reactor_mutex);
+        reactor_running = true;
+        UNLOCK(reactor_mutex);
+    }
+    return error;
+}
+
+
+/* Stops the reactor once all its connections have been closed. */
+static void stop_data_reactor(void)
+{
+    LOCK(reactor_mutex);
+    bool running = reactor_running;
+    reactor_stopping = true;
+    UNLOCK(reactor_mutex);
+    if (running)
+    {
+        ASSERT_IO(eventfd_write(reactor_event, 1));
+        error_report(TEST_PTHREAD(pthread_join(reactor_thread_id, NULL)));
+    }
 }
 
 
@@ -721,6 +2789,8 @@ error__t start_data_server(void)
     CPU_ZERO(&cpu_set);
     CPU_SET(0, &cpu_set);
     return
+        start_recorder(data_buffer)  ?:
+        start_data_reactor()  ?:
         TEST_PTHREAD(pthread_create(
             &data_thread_id, NULL, data_thread, NULL))  ?:
         DO(data_thread_started = true)  ?:
@@ -739,13 +2809,27 @@ void terminate_data_server_early(void)
         stop_data_thread();
         error_report(TEST_PTHREAD(pthread_join(data_thread_id, NULL)));
         shutdown_buffer(data_buffer);
+        terminate_recorder();
     }
+    /* With the buffer shut down every data connection will now close. */
+    stop_data_reactor();
 }
 
 
 void terminate_data_server(void)
 {
     /* Can't do this safely until all our clients have gone. */
+    if (reactor_event >= 0)
+        close(reactor_event);
+    if (reactor_epoll >= 0)
+        close(reactor_epoll);
     if (data_buffer)
         destroy_buffer(data_buffer);
+    if (conversion_cache)
+        destroy_conversion_cache(conversion_cache);
+    for (unsigned int i = 0; i < BUFFER_GENERATIONS; i ++)
+    {
+        free(capture_descriptions[i].fields);
+        free(capture_descriptions[i].capture);
+    }
 }
@@ -1,23 +1,44 @@
 /* Configuration interface. */
 
+struct worker_pool;
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Initialisation and shutdown. */
 
-/* This should be called in a separate thread for each configuration interface
- * socket connection.  This function will run until the given socket closes. */
-error__t process_data_socket(int scon);
+/* Hands a newly accepted data socket connection over to the data server, which
+ * serves all data connections from a single thread.  Once the connection has
+ * finished closed() is called from that thread with any error raised, after
+ * which the caller is responsible for closing the socket.  If an error is
+ * returned the connection was not taken and closed() will not be called. */
+error__t add_data_connection(
+    int sock, void (*closed)(void *context, error__t error), void *context);
 
-/* Data server and processing initialisation. */
-error__t initialise_data_server(void);
+/* Data server and processing initialisation.  The capture buffer is created
+ * with the given geometry and is optionally locked into memory. */
+error__t initialise_data_server(
+    unsigned int block_size, unsigned int block_count, bool lock_buffer);
 
-/* This starts the background data server task.  Must be called after forking to
- * avoid losing the created thread! */
+/* This starts the background data server tasks.  Must be called after forking
+ * to avoid losing the created threads! */
 error__t start_data_server(void);
 
+/* Enables parallel conversion of large blocks for ASCII and scaled data using
+ * the given pool of workers.  Must be called before any data clients connect,
+ * and the pool must remain valid until they have all gone. */
+void set_conversion_pool(struct worker_pool *pool);
+
+/* Moves the processing of data for all data clients except raw data clients
+ * onto the given pool of workers, which must have at least one worker, so that
+ * the data for different clients is converted at the same time.  Otherwise the
+ * thread serving the data sockets converts the data itself.  Must be called
+ * before any data clients connect, and the pool must remain valid until
+ * terminate_data_server_early() has returned. */
+void set_stream_pool(struct worker_pool *pool);
+
 /* Terminating the data server needs to be done in two stages to avoid delays.
- * The _early call ensures that none of the data clients are blocked, and the
- * final call must not be called until the sockets have cleared. */
+ * The _early call closes all data connections, and the final call must not be
+ * called until the remaining sockets have cleared. */
 void terminate_data_server_early(void);
 void terminate_data_server(void);
 
@@ -32,3 +53,38 @@ error__t disarm_capture(void);
 error__t get_capture_status(struct connection_result *result);
 error__t get_capture_count(struct connection_result *result);
 error__t get_capture_completion(struct connection_result *result);
+/* Returns the description of the current experiment, valid until the next
+ * experiment is armed. */
+struct captured_fields;
+struct data_capture;
+void get_capture_description(
+    const struct captured_fields **fields,
+    const struct data_capture **capture);
+
+/* For readers of the capture buffer other than data clients.  The description
+ * of the experiment the reader has open is valid until the reader is closed,
+ * and the completion code once the reader has read all the data. */
+struct reader_state;
+void get_reader_description(
+    struct reader_state *reader,
+    const struct captured_fields **fields,
+    const struct data_capture **capture);
+unsigned int get_reader_completion_code(struct reader_state *reader);
+
+/* Returns conversion cache hit, miss and uncached counts for this capture. */
+error__t get_capture_cache(struct connection_result *result);
+
+/* Returns capture pipeline statistics: hardware reads, buffer occupancy, stream
+ * error counts, and a line for each connected data client. */
+error__t get_capture_stats(struct connection_result *result);
+
+/* Returns latency histograms for the capture thread and each connected data
+ * client, only available when built with LATENCY_STATS. */
+error__t get_capture_latency(struct connection_result *result);
+
+/* Capture buffer geometry, specified as block_size:block_count.  The buffer can
+ * only be resized while data capture is idle. */
+error__t parse_buffer_size(
+    const char **string, unsigned int *block_size, unsigned int *block_count);
+error__t set_capture_buffer(const char *value);
+error__t get_capture_buffer(struct connection_result *result);
@@ -0,0 +1,158 @@
+/* Lossless delta compression of binary sample data. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "error.h"
+
+#include "delta_codec.h"
+
+
+/* Walks down one column of the input, returning the zigzag encoded difference
+ * between each value and the one before. */
+struct column_reader {
+    const void *input;          // Next value to read
+    size_t stride;              // Bytes between samples
+    unsigned int width;         // Width of field in bytes
+    uint64_t previous;          // Previous value read
+};
+
+
+static uint64_t read_next_delta(struct column_reader *reader)
+{
+    uint64_t result;
+    if (reader->width == 4)
+    {
+        uint32_t value;
+        memcpy(&value, reader->input, sizeof(value));
+        uint32_t delta = value - (uint32_t) reader->previous;
+        reader->previous = value;
+        result = (uint32_t) (delta << 1) ^ (uint32_t) ((int32_t) delta >> 31);
+    }
+    else
+    {
+        uint64_t value;
+        memcpy(&value, reader->input, sizeof(value));
+        uint64_t delta = value - reader->previous;
+        reader->previous = value;
+        result = (delta << 1) ^ (uint64_t) ((int64_t) delta >> 63);
+    }
+    reader->input += reader->stride;
+    return result;
+}
+
+
+static unsigned int bit_length(uint64_t value)
+{
+    return value ? 64 - (unsigned int) __builtin_clzll(value) : 0;
+}
+
+
+static void *write_varint(void *output, uint64_t value)
+{
+    uint8_t *out = output;
+    while (value >= 0x80)
+    {
+        *out++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t) value;
+    return out;
+}
+
+
+static void *write_packed(
+    void *output, struct column_reader *reader,
+    unsigned int sample_count, unsigned int bits)
+{
+    uint64_t buffer = 0;
+    unsigned int buffer_bits = 0;
+    for (unsigned int i = 0; i < sample_count; i ++)
+    {
+        uint64_t value = read_next_delta(reader);
+        buffer |= value << buffer_bits;
+        buffer_bits += bits;
+        if (buffer_bits >= 64)
+        {
+            memcpy(output, &buffer, sizeof(buffer));
+            output += sizeof(buffer);
+            buffer_bits -= 64;
+            buffer = buffer_bits ? value >> (bits - buffer_bits) : 0;
+        }
+    }
+    size_t residue = (buffer_bits + 7) / 8;
+    memcpy(output, &buffer, residue);
+    return output + residue;
+}
+
+
+/* Encodes a single column, choosing whichever encoding is shorter. */
+static void *encode_column(
+    void *output, const void *input, size_t stride, unsigned int width,
+    unsigned int sample_count)
+{
+    /* First pass to work out the sizes of the two encodings. */
+    struct column_reader reader = {
+        .input = input, .stride = stride, .width = width, };
+    uint64_t all_bits = 0;
+    size_t varint_length = 0;
+    for (unsigned int i = 0; i < sample_count; i ++)
+    {
+        uint64_t value = read_next_delta(&reader);
+        all_bits |= value;
+        varint_length += 1 + (MAX(bit_length(value), 1U) - 1) / 7;
+    }
+    unsigned int bits = bit_length(all_bits);
+    size_t packed_length = ((size_t) sample_count * bits + 7) / 8;
+
+    bool packed = packed_length <= varint_length;
+    uint32_t length = (uint32_t) (packed ? packed_length : varint_length);
+    uint8_t *header = output;
+    header[0] = packed ? DELTA_ENCODING_PACKED : DELTA_ENCODING_VARINT;
+    header[1] = (uint8_t) (packed ? bits : 0);
+    memcpy(&header[2], &length, sizeof(length));
+    output += DELTA_COLUMN_HEADER_LENGTH;
+
+    /* Second pass to write the encoded column. */
+    reader = (struct column_reader) {
+        .input = input, .stride = stride, .width = width, };
+    if (packed)
+        return write_packed(output, &reader, sample_count, bits);
+    else
+    {
+        for (unsigned int i = 0; i < sample_count; i ++)
+            output = write_varint(output, read_next_delta(&reader));
+        return output;
+    }
+}
+
+
+size_t delta_encode_frame(
+    const unsigned int widths[], unsigned int field_count,
+    unsigned int sample_count, const void *input, void *output)
+{
+    size_t stride = 0;
+    for (unsigned int i = 0; i < field_count; i ++)
+        stride += widths[i];
+
+    void *out = output + DELTA_FRAME_HEADER_LENGTH;
+    for (unsigned int i = 0; i < field_count; i ++)
+    {
+        out = encode_column(out, input, stride, widths[i], sample_count);
+        input += widths[i];
+    }
+
+    uint32_t header[4] = {
+        0,
+        (uint32_t) (out - output),
+        sample_count,
+        field_count,
+    };
+    memcpy(header, "CMP ", 4);
+    memcpy(output, header, sizeof(header));
+    return (size_t) (out - output);
+}
@@ -0,0 +1,47 @@
+/* Lossless delta compression of binary sample data.
+ *
+ * A block of samples is encoded as a single self-describing frame:
+ *
+ *  +-------+-------+-------+-------+---------+---------+-----+
+ *  | "CMP "| frame | sample| field | field 0 | field 1 | ... |
+ *  |       | length| count | count |         |         |     |
+ *  +-------+-------+-------+-------+---------+---------+-----+
+ *
+ * All header values are 32-bit little endian, and the frame length includes the
+ * header.  Each field is stored as a column: the values are replaced by their
+ * differences from the previous sample (the first from zero), taken modulo the
+ * field width, and zigzag encoded so that small negative differences become
+ * small numbers.  Each column is prefixed by a one byte encoding, a one byte bit
+ * width, and a 32-bit length of the encoded column in bytes:
+ *
+ *  DELTA_ENCODING_VARINT   Each value is a little endian base 128 varint, with
+ *                          the top bit of each byte set if more follow.
+ *  DELTA_ENCODING_PACKED   Values are packed into the given number of bits,
+ *                          starting from the least significant bit of the first
+ *                          byte.
+ *
+ * Every frame starts from zero, so frames can be decoded independently. */
+
+enum delta_encoding {
+    DELTA_ENCODING_VARINT,
+    DELTA_ENCODING_PACKED,
+};
+
+#define DELTA_FRAME_HEADER_LENGTH   16
+#define DELTA_COLUMN_HEADER_LENGTH  6
+
+/* Maximum length of a frame of sample_count samples, each sample_length bytes
+ * long and made of field_count fields. */
+#define DELTA_FRAME_MAX_LENGTH(field_count, sample_count, sample_length) \
+    (DELTA_FRAME_HEADER_LENGTH + \
+     (field_count) * DELTA_COLUMN_HEADER_LENGTH + \
+     (sample_count) * (sample_length))
+
+
+/* Encodes sample_count samples, each consisting of field_count fields of the
+ * given widths in bytes, which must each be 4 or 8.  Returns the length of the
+ * frame written to output, which must have room for DELTA_FRAME_MAX_LENGTH
+ * bytes. */
+size_t delta_encode_frame(
+    const unsigned int widths[], unsigned int field_count,
+    unsigned int sample_count, const void *input, void *output);
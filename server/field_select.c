@@ -0,0 +1,110 @@
+/* Selection of captured fields for the FIELDS data option. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "field_select.h"
+
+
+/* Returns the length of the entry at the start of field_list and advances
+ * field_list to the following entry. */
+static size_t next_entry(const char **field_list, const char **entry)
+{
+    *entry = *field_list;
+    const char *end = strchrnul(*field_list, ',');
+    *field_list = *end ? end + 1 : end;
+    return (size_t) (end - *entry);
+}
+
+
+/* An entry matches either by name alone or by name and capture. */
+static bool entry_matches(
+    const char *entry, size_t length, const char *name, const char *capture)
+{
+    size_t name_length = strlen(name);
+    size_t capture_length = strlen(capture);
+    return
+        length >= name_length  &&
+        strncmp(entry, name, name_length) == 0  &&
+        (length == name_length  ||
+         (length == name_length + 1 + capture_length  &&
+          entry[name_length] == '.'  &&
+          strncmp(entry + name_length + 1, capture, capture_length) == 0));
+}
+
+
+bool check_field_list(const char *field_list)
+{
+    /* A trailing comma counts as an empty entry. */
+    bool ok = *field_list != '\0';
+    while (ok  &&  *field_list)
+    {
+        const char *entry;
+        size_t length = next_entry(&field_list, &entry);
+        ok = length > 0  &&  (entry[length] == '\0'  ||  *field_list != '\0');
+    }
+    return ok;
+}
+
+
+unsigned int count_field_entries(const char *field_list)
+{
+    unsigned int count = 0;
+    while (*field_list)
+    {
+        const char *entry;
+        next_entry(&field_list, &entry);
+        count += 1;
+    }
+    return count;
+}
+
+
+bool select_field(
+    const char *field_list, const char *name, const char *capture,
+    bool matched[])
+{
+    bool selected = false;
+    for (unsigned int i = 0; *field_list; i ++)
+    {
+        const char *entry;
+        size_t length = next_entry(&field_list, &entry);
+        if (entry_matches(entry, length, name, capture))
+        {
+            matched[i] = true;
+            selected = true;
+        }
+    }
+    return selected;
+}
+
+
+unsigned int format_unmatched_entries(
+    const char *field_list, const bool matched[],
+    char *result, size_t length)
+{
+    unsigned int count = 0;
+    size_t written = 0;
+    for (unsigned int i = 0; *field_list; i ++)
+    {
+        const char *entry;
+        size_t entry_length = next_entry(&field_list, &entry);
+        if (!matched[i])
+        {
+            /* Copy as much of the entry as will fit, with its separator. */
+            size_t separator = count > 0 ? 1 : 0;
+            if (written + separator + entry_length < length)
+            {
+                if (separator)
+                    result[written] = ',';
+                memcpy(result + written + separator, entry, entry_length);
+                written += separator + entry_length;
+            }
+            count += 1;
+        }
+    }
+    if (length > 0)
+        result[written] = '\0';
+    return count;
+}
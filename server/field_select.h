@@ -0,0 +1,25 @@
+/* Selection of captured fields for the FIELDS data option.
+ *
+ * A field list is a comma separated list of entries, each a field name
+ * optionally followed by a dot and the capture, for example
+ * INENC1.VAL.Value,PCAP.TS_TRIG.  An entry without a capture selects every
+ * capture of the field. */
+
+/* Returns false if any entry in the field list is empty. */
+bool check_field_list(const char *field_list);
+
+/* Returns the number of entries in the field list. */
+unsigned int count_field_entries(const char *field_list);
+
+/* Returns true if the field with the given name and capture is selected by the
+ * field list.  Every entry selecting the field is flagged in matched[], which
+ * must have room for count_field_entries() flags. */
+bool select_field(
+    const char *field_list, const char *name, const char *capture,
+    bool matched[]);
+
+/* Writes the entries not flagged in matched[] to result as a comma separated
+ * list, truncated to fit, and returns the number of these entries. */
+unsigned int format_unmatched_entries(
+    const char *field_list, const bool matched[],
+    char *result, size_t length);
@@ -20,6 +20,7 @@
 
 #ifdef SIM_HARDWARE
 #include "sim_hardware.h"
+#include "replay.h"
 #endif
 
 #include "hardware.h"
@@ -72,6 +73,28 @@ uint32_t hw_read_register(
     return register_map[make_offset(block_base, block_number, reg)];
 }
 
+
+void hw_read_registers(
+    const struct hw_register registers[], unsigned int count,
+    uint32_t values[])
+{
+    for (unsigned int i = 0; i < count; i ++)
+        values[i] = hw_read_register(
+            registers[i].block_base, registers[i].block_number,
+            registers[i].reg);
+}
+
+
+void hw_write_registers(
+    const struct hw_register registers[], unsigned int count,
+    const uint32_t values[])
+{
+    for (unsigned int i = 0; i < count; i ++)
+        hw_write_register(
+            registers[i].block_base, registers[i].block_number,
+            registers[i].reg, values[i]);
+}
+
 #endif
 
 
@@ -148,6 +171,22 @@ static inline uint32_t read_named_register(unsigned int offset)
 }
 
 
+/* Reads count named registers in one batch, the first count-1 reads are all of
+ * the same burst register, the last register is given separately. */
+static void read_named_burst(
+    unsigned int burst_offset, unsigned int last_offset,
+    unsigned int count, uint32_t values[count])
+{
+    struct hw_register registers[count];
+    for (unsigned int i = 0; i < count; i ++)
+        registers[i] = (struct hw_register) {
+            .block_base = REG_BLOCK_BASE,
+            .reg = i + 1 < count ? burst_offset : last_offset,
+        };
+    hw_read_registers(registers, count, values);
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 
@@ -156,10 +195,13 @@ static inline uint32_t read_named_register(unsigned int offset)
  * bottom 16-bits whether the value has changed. */
 void hw_read_bits(bool bits[BIT_BUS_COUNT], bool changes[BIT_BUS_COUNT])
 {
+    uint32_t words[BIT_BUS_COUNT / 16];
     write_named_register(BIT_READ_RST, 1);
+    read_named_burst(
+        BIT_READ_VALUE, BIT_READ_VALUE, BIT_BUS_COUNT / 16, words);
     for (unsigned int i = 0; i < BIT_BUS_COUNT / 16; i ++)
     {
-        uint32_t word = read_named_register(BIT_READ_VALUE);
+        uint32_t word = words[i];
         for (unsigned int j = 0; j < 16; j ++)
         {
             bits[16*i + j] = (word >> (16 + j)) & 1;
@@ -175,10 +217,12 @@ void hw_read_bits(bool bits[BIT_BUS_COUNT], bool changes[BIT_BUS_COUNT])
 void hw_read_positions(
     uint32_t positions[POS_BUS_COUNT], bool changes[POS_BUS_COUNT])
 {
+    uint32_t words[POS_BUS_COUNT + 1];
     write_named_register(POS_READ_RST, 1);
-    for (unsigned int i = 0; i < POS_BUS_COUNT; i ++)
-        positions[i] = read_named_register(POS_READ_VALUE);
-    uint32_t word = read_named_register(POS_READ_CHANGES);
+    read_named_burst(
+        POS_READ_VALUE, POS_READ_CHANGES, POS_BUS_COUNT + 1, words);
+    memcpy(positions, words, sizeof(uint32_t) * POS_BUS_COUNT);
+    uint32_t word = words[POS_BUS_COUNT];
     for (unsigned int i = 0; i < POS_BUS_COUNT; i ++)
         changes[i] = (word >> i) & 1;
 }
@@ -255,6 +299,38 @@ unsigned int hw_read_streamed_completion(void)
     return completion;
 }
 
+#else
+
+/* In simulation a recorded experiment can be replayed in place of the data
+ * stream from the simulated hardware, see replay.h. */
+static bool replaying;
+
+
+size_t hw_read_streamed_data(void *buffer, size_t length, bool *data_end)
+{
+    if (replaying)
+        return replay_read_streamed_data(buffer, length, data_end);
+    else
+        return sim_read_streamed_data(buffer, length, data_end);
+}
+
+
+void hw_write_arm_streamed_data(void)
+{
+    replaying = replay_arm_streamed_data();
+    if (!replaying)
+        sim_write_arm_streamed_data();
+}
+
+
+unsigned int hw_read_streamed_completion(void)
+{
+    if (replaying)
+        return replay_read_streamed_completion();
+    else
+        return sim_read_streamed_completion();
+}
+
 #endif
 
 
@@ -282,7 +358,12 @@ void hw_write_arm(bool enable)
     if (enable)
         write_named_register(PCAP_ARM, 0);
     else
+    {
         write_named_register(PCAP_DISARM, 0);
+#ifdef SIM_HARDWARE
+        replay_disarm();
+#endif
+    }
 }
 
 
@@ -351,19 +432,29 @@ static void destroy_short_table(struct hw_table *table)
 
 
 /* Short tables are written as a burst: first write to the reset register to
- * start the write, then to the fill register. */
+ * start the write, then to the fill register.  The burst is passed down as a
+ * single list so that the simulation can send it in one frame. */
 static void write_short_table(
     struct hw_table *table, unsigned int number, size_t length)
 {
     struct short_table *short_table = &table->short_table;
     const uint32_t *data = table->data[number];
 
-    hw_write_register(table->block_base, number, short_table->reset_reg, 1);
-    for (size_t i = 0; i < length; i ++)
-        hw_write_register(
-            table->block_base, number, short_table->fill_reg, data[i]);
-    hw_write_register(
-        table->block_base, number, short_table->length_reg, (uint32_t) length);
+    unsigned int count = (unsigned int) length + 2;
+    struct hw_register registers[count];
+    uint32_t values[count];
+    for (unsigned int i = 0; i < count; i ++)
+        registers[i] = (struct hw_register) {
+            .block_base = table->block_base,
+            .block_number = number,
+            .reg = short_table->fill_reg,
+        };
+    registers[0].reg = short_table->reset_reg;
+    values[0] = 1;
+    memcpy(&values[1], data, length * sizeof(uint32_t));
+    registers[count - 1].reg = short_table->length_reg;
+    values[count - 1] = (uint32_t) length;
+    hw_write_registers(registers, count, values);
 }
 
 
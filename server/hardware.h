@@ -66,6 +66,24 @@ void hw_write_register(
 uint32_t hw_read_register(
     unsigned int block_base, unsigned int block_number, unsigned int reg);
 
+/* Reads a list of registers, equivalent to calling hw_read_register() for each
+ * register in turn but allowing the simulation to perform the reads in a single
+ * exchange. */
+struct hw_register {
+    unsigned int block_base;
+    unsigned int block_number;
+    unsigned int reg;
+};
+void hw_read_registers(
+    const struct hw_register registers[], unsigned int count,
+    uint32_t values[]);
+
+/* Writes a list of registers in order, equivalent to calling
+ * hw_write_register() for each register in turn. */
+void hw_write_registers(
+    const struct hw_register registers[], unsigned int count,
+    const uint32_t values[]);
+
 /* Read bit values and changes. */
 void hw_read_bits(bool bits[BIT_BUS_COUNT], bool changes[BIT_BUS_COUNT]);
 
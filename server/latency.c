@@ -0,0 +1,113 @@
+/* Latency histograms for the capture data path. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+#include "config_server.h"
+
+#include "latency.h"
+
+
+/* Bucket counts are formatted into a single line, which can be longer than
+ * MAX_RESULT_LENGTH. */
+#define MAX_HISTOGRAM_LENGTH    (128 + 21 * LATENCY_BUCKET_COUNT)
+
+
+uint64_t get_latency_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1000000000 * (uint64_t) now.tv_sec + (uint64_t) now.tv_nsec;
+}
+
+
+/* Histograms have a single writer, so only need atomic stores. */
+static void add_count(uint64_t *count, uint64_t value)
+{
+    __atomic_store_n(count, *count + value, __ATOMIC_RELAXED);
+}
+
+static uint64_t read_count(const uint64_t *count)
+{
+    return __atomic_load_n(count, __ATOMIC_RELAXED);
+}
+
+
+/* Returns the bucket for the given latency: the number of significant bits in
+ * the latency in microseconds. */
+static unsigned int latency_bucket(uint64_t latency_ns)
+{
+    uint64_t latency_us = latency_ns / 1000;
+    unsigned int bucket = latency_us == 0 ?
+        0 : 64 - (unsigned int) __builtin_clzll(latency_us);
+    return MIN(bucket, LATENCY_BUCKET_COUNT - 1U);
+}
+
+
+void record_latency(
+    struct latency_stats *stats, enum latency_stage stage,
+    uint64_t start_ns, uint64_t end_ns)
+{
+    struct latency_histogram *histogram = &stats->stages[stage];
+    /* Guard against timestamps taken in a different order to the stages. */
+    uint64_t latency_ns = end_ns > start_ns ? end_ns - start_ns : 0;
+    add_count(&histogram->count, 1);
+    add_count(&histogram->total_ns, latency_ns);
+    if (latency_ns > histogram->max_ns)
+        __atomic_store_n(&histogram->max_ns, latency_ns, __ATOMIC_RELAXED);
+    add_count(&histogram->buckets[latency_bucket(latency_ns)], 1);
+}
+
+
+static void report_histogram(
+    struct connection_result *result, const char *name, const char *stage,
+    struct latency_histogram *histogram)
+{
+    uint64_t count = read_count(&histogram->count);
+    if (count == 0)
+        return;
+
+    /* Only report buckets up to the last one in use. */
+    uint64_t buckets[LATENCY_BUCKET_COUNT];
+    unsigned int bucket_count = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKET_COUNT; i ++)
+    {
+        buckets[i] = read_count(&histogram->buckets[i]);
+        if (buckets[i] > 0)
+            bucket_count = i + 1;
+    }
+
+    char line[MAX_HISTOGRAM_LENGTH];
+    size_t length = (size_t) snprintf(line, sizeof(line),
+        "%s %s %"PRIu64" %.1f %.1f", name, stage, count,
+        1e-3 * (double) read_count(&histogram->total_ns) / (double) count,
+        1e-3 * (double) read_count(&histogram->max_ns));
+    for (unsigned int i = 0; i < bucket_count; i ++)
+        length += (size_t) snprintf(line + length, sizeof(line) - length,
+            " %"PRIu64, buckets[i]);
+    result->write_many(result->write_context, line);
+}
+
+
+void report_latency_stats(
+    struct connection_result *result, const char *name,
+    struct latency_stats *stats)
+{
+    static const char *stage_names[] = {
+        [LATENCY_HW_READ] = "HW_READ",
+        [LATENCY_PUBLISH] = "PUBLISH",
+        [LATENCY_WAKEUP]  = "WAKEUP",
+        [LATENCY_CONVERT] = "CONVERT",
+        [LATENCY_SEND]    = "SEND",
+        [LATENCY_TOTAL]   = "TOTAL",
+        [LATENCY_ARM]     = "ARM",
+        [LATENCY_END]     = "END",
+    };
+    for (unsigned int i = 0; i < LATENCY_STAGE_COUNT; i ++)
+        report_histogram(result, name, stage_names[i], &stats->stages[i]);
+}
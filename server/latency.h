@@ -0,0 +1,65 @@
+/* Latency histograms for the capture data path.
+ *
+ * Only built into the data path when compiled with LATENCY_STATS defined, see
+ * the LATENCY_STATS option in the server Makefile.  Otherwise none of the
+ * timestamps are taken and *PCAP.LATENCY? reports an error.
+ *
+ * Each histogram counts latencies into power of two buckets of microseconds:
+ * bucket 0 counts latencies under 1us, and bucket n counts latencies from
+ * 2^(n-1) up to 2^n us, with the last bucket counting everything larger. */
+
+/* Wraps statements which are only compiled in with LATENCY_STATS. */
+#ifdef LATENCY_STATS
+#define LATENCY(action...)      action
+#else
+#define LATENCY(action...)
+#endif
+
+
+#define LATENCY_BUCKET_COUNT    32
+
+/* Each histogram is written by a single thread without locking and can be
+ * read at any time. */
+struct latency_histogram {
+    uint64_t count;             // Number of latencies recorded
+    uint64_t total_ns;          // Sum of all latencies
+    uint64_t max_ns;            // Largest latency recorded
+    uint64_t buckets[LATENCY_BUCKET_COUNT];
+};
+
+/* The stages of the data path we time.  The capture thread records the first
+ * two stages, the remaining stages are recorded for each data client. */
+enum latency_stage {
+    LATENCY_HW_READ,        // Time spent in hw_read_streamed_data()
+    LATENCY_PUBLISH,        // Data read from hardware to block published
+    LATENCY_WAKEUP,         // Block published to block returned to reader
+    LATENCY_CONVERT,        // Block processing, not including sending
+    LATENCY_SEND,           // Time writing processed block to socket
+    LATENCY_TOTAL,          // Data read from hardware to processed block sent
+    LATENCY_ARM,            // *PCAP.ARM= to first data sent
+    LATENCY_END,            // *PCAP.DISARM= to END sent
+
+    LATENCY_STAGE_COUNT
+};
+
+struct latency_stats {
+    struct latency_histogram stages[LATENCY_STAGE_COUNT];
+};
+
+
+/* Returns timestamp in nanoseconds for latency measurement.  This is
+ * CLOCK_MONOTONIC, as used for the other capture statistics. */
+uint64_t get_latency_time(void);
+
+/* Adds the interval from start_ns to end_ns to the histogram for the given
+ * stage. */
+void record_latency(
+    struct latency_stats *stats, enum latency_stage stage,
+    uint64_t start_ns, uint64_t end_ns);
+
+/* Adds a line to the result for each stage with any latencies recorded.  Each
+ * line starts with the given name and the stage name. */
+struct connection_result;
+void report_latency_stats(
+    struct connection_result *result, const char *name,
+    struct latency_stats *stats);
@@ -42,9 +42,12 @@ print()
 for name, value, _ in fields:
     print('#define %s %s' % (name, value))
 
-# Now generate offset name table used for checking.
+# Now generate offset name table used for checking.  Simulation backends only
+# need the register offsets and can skip the table.
 print('''
+#ifndef NAMED_REGISTER_DEFINES_ONLY
 static struct named_register named_registers[] = {''')
 for name, _, count in fields:
     print('    [%s] = { "%s", %d, false },' % (name, name, count))
 print('};')
+print('#endif')
@@ -0,0 +1,621 @@
+/* Native simulation hardware interface.
+ *
+ * An alternative to sim_hardware.c which simulates the hardware in process
+ * instead of forwarding register access to an external simulation server.
+ * Registers are held in memory, the bit and position buses carry synthetic
+ * signals derived from the FPGA clock, and the capture engine generates samples
+ * laid out according to the configured capture set at a configurable rate.
+ *
+ * The bus signals are functions of t, the count of FPGA clock ticks since
+ * startup:
+ *
+ *  bit[i] = (t >> (i + BIT_CLOCK_SHIFT)) & 1
+ *  pos[i] = i * t
+ *
+ * The capture engine is configured by the PANDA_SIM_DATA environment variable,
+ * a comma separated list of key=value settings, defaults in brackets:
+ *
+ *  rate        Samples per second, 0 for as fast as possible (1000000)
+ *  samples     Samples per experiment, 0 to capture until disarm (0)
+ *  timeout     DMA block timeout in ms (100)
+ *  block       DMA block size in bytes (2097152)
+ *  blocks      Number of DMA blocks, a greater backlog is an overrun (32)
+ *  completion  Completion code reported after the last sample (0)
+ *
+ * As with the driver, data is returned one DMA block at a time, or on block
+ * timeout if a partial block is available. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "parse.h"
+#include "locking.h"
+#include "config_server.h"
+#include "output.h"
+#include "hardware.h"
+#include "prepare.h"
+#include "panda_device.h"
+
+#include "sim_hardware.h"
+
+#define NAMED_REGISTER_DEFINES_ONLY
+#include "named_registers.h"
+
+
+#define SIM_DATA_ENV        "PANDA_SIM_DATA"
+
+/* Bit i of the bit bus toggles every 2^(i + BIT_CLOCK_SHIFT) ticks. */
+#define BIT_CLOCK_SHIFT     10
+
+/* Capture extension bus indices, as assigned to PCAP in config_d/registers. */
+#define EXT_TS_START        0
+#define EXT_TS_END          2
+#define EXT_TS_CAPTURE      4
+#define EXT_SAMPLES         6
+#define EXT_BITS            8
+
+#define NS_PER_TICK         (NSECS / CLOCK_FREQUENCY)
+
+#define REGISTER_COUNT \
+    (BLOCK_TYPE_COUNT * BLOCK_INSTANCE_COUNT * BLOCK_REGISTER_COUNT)
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Simulated FPGA clock and buses. */
+
+static uint64_t start_ns;
+
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * NSECS + (uint64_t) now.tv_nsec;
+}
+
+
+static uint64_t get_clock_ticks(void)
+{
+    return (get_time_ns() - start_ns) / NS_PER_TICK;
+}
+
+
+static bool read_bit(unsigned int ix, uint64_t ticks)
+{
+    return ix + BIT_CLOCK_SHIFT < 64  &&
+        (ticks >> (ix + BIT_CLOCK_SHIFT)) & 1;
+}
+
+
+static uint32_t read_pos(unsigned int ix, uint64_t ticks)
+{
+    return (uint32_t) (ix * ticks);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Register file. */
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t *registers;
+
+/* Bus snapshots read out by bursts of register reads, together with the values
+ * at the last snapshot for computing change flags. */
+static uint32_t bit_words[BIT_BUS_COUNT / 16];
+static unsigned int bit_word_ix;
+static bool last_bits[BIT_BUS_COUNT];
+
+static uint32_t pos_words[POS_BUS_COUNT + 1];
+static unsigned int pos_word_ix;
+static uint32_t last_pos[POS_BUS_COUNT];
+
+/* Capture set written by hw_write_capture_set(). */
+static unsigned int capture_set[MAX_CAPTURE_COUNT];
+static unsigned int capture_set_count;
+
+
+static unsigned int register_index(
+    unsigned int block_base, unsigned int block_number, unsigned int reg)
+{
+    return
+        ((block_base & (BLOCK_TYPE_COUNT - 1)) * BLOCK_INSTANCE_COUNT +
+         (block_number & (BLOCK_INSTANCE_COUNT - 1))) * BLOCK_REGISTER_COUNT +
+        (reg & (BLOCK_REGISTER_COUNT - 1));
+}
+
+
+/* Packs bit values into the upper 16 bits of each word and change flags into
+ * the lower 16 bits, as read from BIT_READ_VALUE. */
+static void snapshot_bits(void)
+{
+    uint64_t ticks = get_clock_ticks();
+    memset(bit_words, 0, sizeof(bit_words));
+    for (unsigned int i = 0; i < BIT_BUS_COUNT; i ++)
+    {
+        bool bit = read_bit(i, ticks);
+        bit_words[i / 16] |=
+            (uint32_t) bit << (16 + i % 16) |
+            (uint32_t) (bit != last_bits[i]) << (i % 16);
+        last_bits[i] = bit;
+    }
+    bit_word_ix = 0;
+}
+
+
+/* Reads out positions followed by the change flags word. */
+static void snapshot_positions(void)
+{
+    uint64_t ticks = get_clock_ticks();
+    pos_words[POS_BUS_COUNT] = 0;
+    for (unsigned int i = 0; i < POS_BUS_COUNT; i ++)
+    {
+        pos_words[i] = read_pos(i, ticks);
+        pos_words[POS_BUS_COUNT] |=
+            (uint32_t) (pos_words[i] != last_pos[i]) << i;
+        last_pos[i] = pos_words[i];
+    }
+    pos_word_ix = 0;
+}
+
+
+static uint32_t read_burst(
+    const uint32_t words[], unsigned int *ix, unsigned int count)
+{
+    uint32_t result = words[*ix];
+    if (*ix + 1 < count)
+        *ix += 1;
+    return result;
+}
+
+
+static void start_capture(void);
+static void stop_capture(void);
+
+/* Writes to the named registers of the REG block drive the simulation,
+ * everything else just updates the register file. */
+static void write_named_register(unsigned int reg, uint32_t value)
+{
+    switch (reg)
+    {
+        case BIT_READ_RST:      snapshot_bits();                        break;
+        case POS_READ_RST:      snapshot_positions();                   break;
+        case PCAP_START_WRITE:  capture_set_count = 0;                  break;
+        case PCAP_WRITE:
+            if (capture_set_count < MAX_CAPTURE_COUNT)
+                capture_set[capture_set_count++] = value;
+            break;
+        case PCAP_ARM:          start_capture();                        break;
+        case PCAP_DISARM:       stop_capture();                         break;
+    }
+}
+
+
+static uint32_t read_named_register(unsigned int reg, uint32_t value)
+{
+    switch (reg)
+    {
+        case BIT_READ_VALUE:
+            return read_burst(bit_words, &bit_word_ix, ARRAY_SIZE(bit_words));
+        case POS_READ_VALUE:
+            return read_burst(pos_words, &pos_word_ix, POS_BUS_COUNT);
+        case POS_READ_CHANGES:
+            return pos_words[POS_BUS_COUNT];
+        default:
+            return value;
+    }
+}
+
+
+void hw_write_register(
+    unsigned int block_base, unsigned int block_number, unsigned int reg,
+    uint32_t value)
+{
+    LOCK(mutex);
+    registers[register_index(block_base, block_number, reg)] = value;
+    if (block_base == REG_BLOCK_BASE)
+        write_named_register(reg, value);
+    UNLOCK(mutex);
+}
+
+
+uint32_t hw_read_register(
+    unsigned int block_base, unsigned int block_number, unsigned int reg)
+{
+    LOCK(mutex);
+    uint32_t result = registers[register_index(block_base, block_number, reg)];
+    if (block_base == REG_BLOCK_BASE)
+        result = read_named_register(reg, result);
+    UNLOCK(mutex);
+    return result;
+}
+
+
+void hw_read_registers(
+    const struct hw_register addresses[], unsigned int count,
+    uint32_t values[])
+{
+    for (unsigned int i = 0; i < count; i ++)
+        values[i] = hw_read_register(
+            addresses[i].block_base, addresses[i].block_number,
+            addresses[i].reg);
+}
+
+
+void hw_write_registers(
+    const struct hw_register addresses[], unsigned int count,
+    const uint32_t values[])
+{
+    for (unsigned int i = 0; i < count; i ++)
+        hw_write_register(
+            addresses[i].block_base, addresses[i].block_number,
+            addresses[i].reg, values[i]);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Capture engine. */
+
+/* Settings from PANDA_SIM_DATA. */
+static double sample_rate = 1e6;
+static uint64_t sample_limit = 0;
+static unsigned int block_timeout_ms = 100;
+static unsigned int dma_block_size = 2097152;
+static unsigned int dma_block_count = 32;
+static unsigned int final_completion = PANDA_COMPLETION_OK;
+
+/* Every captured word is a linear function of the sample number, so we can
+ * generate samples with one addition per word.  The word is taken from bits
+ * shift..shift+31 of value, which steps on by step for each sample. */
+struct capture_word {
+    uint64_t value;
+    uint64_t step;
+    unsigned int shift;
+};
+
+enum capture_state { CAPTURE_IDLE, CAPTURE_ACTIVE, CAPTURE_ENDED, };
+
+static pthread_cond_t capture_event;
+static enum capture_state capture_state;
+static bool disarmed;
+static unsigned int completion;
+
+static uint64_t arm_ns;             // Time of arm, data starts from here
+static uint64_t disarm_bytes;       // Bytes captured up to disarm
+static uint64_t sent_bytes;         // Bytes returned from the stream so far
+static uint64_t total_bytes;        // Bytes in the whole capture if limited
+
+/* Sample generator state, only touched by the reading thread once armed. */
+static struct capture_word capture_words[MAX_CAPTURE_COUNT];
+static unsigned int word_count;
+static unsigned int word_ix;
+
+
+/* Computes the initial value and step for one captured word.  Samples are
+ * captured every ticks_per_sample clock ticks from arm, and sample n covers the
+ * gate ticks from (n * ticks_per_sample, (n + 1) * ticks_per_sample] after arm.
+ * Timestamps are relative to arm, bus values follow the simulated clock. */
+static struct capture_word make_capture_word(
+    unsigned int capture, uint64_t arm_ticks, uint64_t ticks_per_sample)
+{
+    uint64_t tps = ticks_per_sample;
+    if (capture & (1U << 9))
+    {
+        /* Extension bus. */
+        unsigned int ext_ix = (capture >> 4) & 0xF;
+        switch (ext_ix)
+        {
+            case EXT_TS_START:      case EXT_TS_START + 1:
+                return (struct capture_word) {
+                    .value = 0, .step = tps, .shift = 32 * (ext_ix & 1), };
+            case EXT_TS_END:        case EXT_TS_END + 1:
+            case EXT_TS_CAPTURE:    case EXT_TS_CAPTURE + 1:
+                return (struct capture_word) {
+                    .value = tps, .step = tps, .shift = 32 * (ext_ix & 1), };
+            case EXT_SAMPLES:
+                return (struct capture_word) { .value = tps, };
+            case EXT_BITS:          case EXT_BITS + 1:
+            case EXT_BITS + 2:      case EXT_BITS + 3:
+            {
+                unsigned int shift =
+                    32 * (ext_ix - EXT_BITS) + BIT_CLOCK_SHIFT;
+                if (shift < 64)
+                    return (struct capture_word) {
+                        .value = arm_ticks + tps, .step = tps,
+                        .shift = shift, };
+                else
+                    return (struct capture_word) { };
+            }
+            default:
+                return (struct capture_word) { };
+        }
+    }
+    else
+    {
+        /* Position bus.  We capture the unwrapped ramp i * t, which is only
+         * reduced to 32 bits as each word is emitted. */
+        uint64_t slope = (capture >> 4) & 0x1F;
+        switch (capture & 0x7)
+        {
+            case POS_FIELD_VALUE:
+            case POS_FIELD_MAX:
+                return (struct capture_word) {
+                    .value = slope * (arm_ticks + tps), .step = slope * tps, };
+            case POS_FIELD_MIN:
+                return (struct capture_word) {
+                    .value = slope * (arm_ticks + 1), .step = slope * tps, };
+            case POS_FIELD_DIFF:
+                return (struct capture_word) { .value = slope * tps, };
+            case POS_FIELD_SUM_LOW:
+            case POS_FIELD_SUM_HIGH:
+            {
+                /* Sum of slope * t over the gate. */
+                return (struct capture_word) {
+                    .value = slope * (tps * arm_ticks + tps * (tps + 1) / 2),
+                    .step = slope * tps * tps,
+                    .shift = (capture & 0x7) == POS_FIELD_SUM_HIGH ? 32 : 0, };
+            }
+            default:
+                return (struct capture_word) { };
+        }
+    }
+}
+
+
+/* Called with the mutex held on writing to PCAP_ARM. */
+static void start_capture(void)
+{
+    if (capture_state != CAPTURE_ACTIVE)
+    {
+        uint64_t ticks_per_sample = sample_rate > 0 ?
+            (uint64_t) MAX(CLOCK_FREQUENCY / sample_rate, 1.0) : 1;
+        uint64_t arm_ticks = get_clock_ticks();
+        word_count = capture_set_count;
+        word_ix = 0;
+        for (unsigned int i = 0; i < word_count; i ++)
+            capture_words[i] = make_capture_word(
+                capture_set[i], arm_ticks, ticks_per_sample);
+
+        capture_state = word_count > 0 ? CAPTURE_ACTIVE : CAPTURE_ENDED;
+        completion = PANDA_COMPLETION_OK;
+        disarmed = false;
+        sent_bytes = 0;
+        total_bytes = sample_limit * sizeof(uint32_t) * word_count;
+        arm_ns = get_time_ns();
+        BROADCAST(capture_event);
+    }
+}
+
+
+/* Returns the number of bytes captured by the given time. */
+static uint64_t captured_bytes(uint64_t now)
+{
+    uint64_t captured;
+    if (disarmed)
+        captured = disarm_bytes;
+    else if (sample_rate > 0)
+        captured = (uint64_t) (1e-9 * (double) (now - arm_ns) * sample_rate) *
+            sizeof(uint32_t) * word_count;
+    else
+        /* As fast as possible, a full block is always ready. */
+        captured = sent_bytes + dma_block_size;
+    return sample_limit > 0 ? MIN(captured, total_bytes) : captured;
+}
+
+
+/* Called with the mutex held on writing to PCAP_DISARM.  Data captured so far
+ * is still delivered before the capture completes. */
+static void stop_capture(void)
+{
+    if (capture_state == CAPTURE_ACTIVE  &&  !disarmed)
+    {
+        disarm_bytes = MIN(captured_bytes(get_time_ns()), sent_bytes +
+            (uint64_t) dma_block_size * dma_block_count);
+        disarmed = true;
+        BROADCAST(capture_event);
+    }
+}
+
+
+static void end_capture(unsigned int code)
+{
+    capture_state = CAPTURE_ENDED;
+    completion = code;
+}
+
+
+/* Waits until a DMA block is ready or the block timeout expires, and returns
+ * the number of bytes that can be delivered, or 0 if the capture has ended. */
+static size_t wait_for_data(size_t length)
+{
+    uint64_t max_backlog = (uint64_t) dma_block_size * dma_block_count;
+    uint64_t deadline = get_time_ns() + block_timeout_ms * 1000000ULL;
+    length = MIN(length, dma_block_size) & ~(sizeof(uint32_t) - 1);
+    while (capture_state == CAPTURE_ACTIVE)
+    {
+        uint64_t now = get_time_ns();
+        uint64_t available = captured_bytes(now) - sent_bytes;
+        bool complete =
+            disarmed  ||  (sample_limit > 0  &&  captured_bytes(now) ==
+                total_bytes);
+
+        if (available > max_backlog)
+            end_capture(PANDA_COMPLETION_OVERRUN);
+        else if (available >= length  ||  (available > 0  &&
+                (complete  ||  now >= deadline)))
+            return (size_t) MIN(available, length);
+        else if (complete)
+            end_capture(disarmed ? PANDA_COMPLETION_DISARM : final_completion);
+        else if (now >= deadline)
+            return 0;
+        else
+        {
+            /* Sleep until enough data for the block is expected or timeout. */
+            uint64_t wake = deadline;
+            if (sample_rate > 0)
+            {
+                uint64_t wanted = sent_bytes + length;
+                double sample_bytes = (double) (sizeof(uint32_t) * word_count);
+                uint64_t ready = arm_ns + (uint64_t) (
+                    1e9 * ((double) wanted / sample_bytes + 1) / sample_rate);
+                wake = MIN(wake, ready);
+            }
+            struct timespec timeout = {
+                .tv_sec = (time_t) (wake / NSECS),
+                .tv_nsec = (long) (wake % NSECS), };
+            pwait_deadline(&mutex, &capture_event, &timeout);
+        }
+    }
+    return 0;
+}
+
+
+static void generate_words(uint32_t *buffer, size_t count)
+{
+    for (size_t i = 0; i < count; i ++)
+    {
+        struct capture_word *word = &capture_words[word_ix];
+        buffer[i] = (uint32_t) (word->value >> word->shift);
+        word->value += word->step;
+        word_ix += 1;
+        if (word_ix == word_count)
+            word_ix = 0;
+    }
+}
+
+
+void sim_write_arm_streamed_data(void) { }
+
+
+size_t sim_read_streamed_data(void *buffer, size_t length, bool *data_end)
+{
+    LOCK(mutex);
+    size_t count = wait_for_data(length);
+    *data_end = capture_state != CAPTURE_ACTIVE;
+    sent_bytes += count;
+    UNLOCK(mutex);
+
+    generate_words(buffer, count / sizeof(uint32_t));
+    return count;
+}
+
+
+unsigned int sim_read_streamed_completion(void)
+{
+    LOCK(mutex);
+    unsigned int result = completion;
+    capture_state = CAPTURE_IDLE;
+    UNLOCK(mutex);
+    return result;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Long table support. */
+
+#define MAX_BLOCK_ID        16      // Arbitrary large enough limit
+static void *block_id_table[MAX_BLOCK_ID];
+static unsigned int block_id_count = 0;
+
+
+error__t hw_long_table_allocate(
+    unsigned int block_base, unsigned int number,
+    unsigned int base_reg, unsigned int length_reg,
+    unsigned int order,
+    size_t *block_size, uint32_t **data, int *block_id)
+{
+    return
+        TEST_OK_(block_id_count < MAX_BLOCK_ID,
+            "Too many long table blocks")  ?:
+        DO(
+            *block_size = 4096U << order;
+            *data = malloc(*block_size);
+            *block_id = (int) block_id_count;
+            block_id_table[block_id_count++] = *data;
+        );
+}
+
+
+void hw_long_table_release(int block_id)
+{
+    ASSERT_OK(0 <= block_id  &&  block_id < (int) block_id_count);
+    free(block_id_table[block_id]);
+}
+
+
+/* The table data is already in the allocated block, there is no simulated
+ * table engine to notify. */
+void hw_long_table_write(
+    int block_id, const void *data, size_t length, size_t offset)
+{
+    ASSERT_OK(0 <= block_id  &&  block_id < (int) block_id_count);
+    memcpy(block_id_table[block_id] + offset, data, length);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Initialisation. */
+
+
+static error__t parse_sim_setting(const char **string)
+{
+    char key[MAX_NAME_LENGTH];
+    return
+        parse_alphanum_name(string, key, sizeof(key))  ?:
+        parse_char(string, '=')  ?:
+        IF_ELSE(strcmp(key, "rate") == 0,
+            parse_double(string, &sample_rate),
+        IF_ELSE(strcmp(key, "samples") == 0,
+            parse_uint64(string, &sample_limit),
+        IF_ELSE(strcmp(key, "timeout") == 0,
+            parse_uint(string, &block_timeout_ms),
+        IF_ELSE(strcmp(key, "block") == 0,
+            parse_uint(string, &dma_block_size),
+        IF_ELSE(strcmp(key, "blocks") == 0,
+            parse_uint(string, &dma_block_count)  ?:
+            TEST_OK_(dma_block_count > 0, "Invalid block count"),
+        IF_ELSE(strcmp(key, "completion") == 0,
+            parse_uint(string, &final_completion),
+        //else
+            FAIL_("Unknown setting %s", key)))))));
+}
+
+
+static error__t parse_sim_settings(const char *settings)
+{
+    error__t error = ERROR_OK;
+    if (settings)
+    {
+        error = parse_sim_setting(&settings);
+        while (!error  &&  read_char(&settings, ','))
+            error = parse_sim_setting(&settings);
+        error = error  ?:  parse_eos(&settings);
+        if (error)
+            error_extend(error, "Parsing " SIM_DATA_ENV);
+    }
+    return error;
+}
+
+
+error__t initialise_hardware(void)
+{
+    start_ns = get_time_ns();
+    pwait_initialise(&capture_event);
+    return
+        parse_sim_settings(getenv(SIM_DATA_ENV))  ?:
+        TEST_OK_(dma_block_size >= sizeof(uint32_t), "Invalid block size")  ?:
+        DO(registers = calloc(REGISTER_COUNT, sizeof(uint32_t)));
+}
+
+
+void terminate_hardware(void)
+{
+    free(registers);
+}
@@ -0,0 +1,289 @@
+/* Fast formatting of numbers in ASCII.
+ *
+ * Integers are formatted two digits at a time from a table of digit pairs, and
+ * 64-bit values are split into 32-bit chunks of eight digits so that 32-bit
+ * targets need very few 64-bit divisions.
+ *
+ * Doubles are formatted by scaling the value by an exactly representable power
+ * of ten to bring ten significant digits in front of the decimal point, so that
+ * the value can be rounded and formatted as an integer.  The single rounding
+ * error in this scaling is far too small to matter unless the value lies very
+ * close to a rounding boundary, and in this rare case, and for values outside
+ * the range of the power table, we fall back to sprintf. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "number_format.h"
+
+
+/* Number of significant digits in "%.10g" format. */
+#define PRECISION       10
+
+/* Values with PRECISION digits lie in this range. */
+#define LOWER_BOUND     1e9
+#define UPPER_BOUND     1e10
+
+/* Largest power of ten exactly representable as a double. */
+#define MAX_EXACT_POWER 22
+
+/* If the fractional part of the scaled value is closer than this to one half
+ * we fall back to sprintf to get the rounding right.  The scaling error is less
+ * than 2e-6 for scaled values below UPPER_BOUND. */
+#define ROUNDING_MARGIN 1e-4
+
+
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const double powers_of_ten[MAX_EXACT_POWER + 1] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Integer formatting. */
+
+
+/* Writes the digits of value backwards ending at end, returns pointer to the
+ * first digit written. */
+static char *format_digits_backwards(char *end, uint32_t value)
+{
+    while (value >= 100)
+    {
+        uint32_t pair = value % 100;
+        value /= 100;
+        end -= 2;
+        memcpy(end, &digit_pairs[2 * pair], 2);
+    }
+    if (value >= 10)
+    {
+        end -= 2;
+        memcpy(end, &digit_pairs[2 * value], 2);
+    }
+    else
+        *--end = (char) ('0' + value);
+    return end;
+}
+
+
+/* Writes exactly eight digits of value, which must be less than 10^8. */
+static char *format_eight_digits(char *output, uint32_t value)
+{
+    for (int i = 3; i >= 0; i --)
+    {
+        memcpy(&output[2 * i], &digit_pairs[2 * (value % 100)], 2);
+        value /= 100;
+    }
+    return output + 8;
+}
+
+
+char *format_uint32(char *output, uint32_t value)
+{
+    char digits[10];
+    char *end = digits + sizeof(digits);
+    char *start = format_digits_backwards(end, value);
+    size_t length = (size_t) (end - start);
+    memcpy(output, start, length);
+    return output + length;
+}
+
+
+char *format_int32(char *output, int32_t value)
+{
+    if (value < 0)
+    {
+        *output++ = '-';
+        return format_uint32(output, -(uint32_t) value);
+    }
+    else
+        return format_uint32(output, (uint32_t) value);
+}
+
+
+char *format_uint64(char *output, uint64_t value)
+{
+    if (value <= UINT32_MAX)
+        return format_uint32(output, (uint32_t) value);
+    else
+    {
+        output = format_uint64(output, value / 100000000);
+        return format_eight_digits(output, (uint32_t) (value % 100000000));
+    }
+}
+
+
+char *format_int64(char *output, int64_t value)
+{
+    if (value < 0)
+    {
+        *output++ = '-';
+        return format_uint64(output, -(uint64_t) value);
+    }
+    else
+        return format_uint64(output, (uint64_t) value);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Double formatting. */
+
+
+/* Scales value by 10^power, returns false if the power is out of range. */
+static bool scale_by_power(double value, int power, double *result)
+{
+    if (power > MAX_EXACT_POWER  ||  power < -MAX_EXACT_POWER)
+        return false;
+    else
+    {
+        if (power >= 0)
+            *result = value * powers_of_ten[power];
+        else
+            *result = value / powers_of_ten[-power];
+        return true;
+    }
+}
+
+
+/* Computes the PRECISION significant digits of value, which must be positive
+ * and finite, returning them as an integer together with the decimal exponent
+ * of the first digit.  Returns false if the digits can't be computed reliably
+ * in this way. */
+static bool compute_digits(double value, uint64_t *digits, int *exponent)
+{
+    /* Estimate the exponent from the binary exponent, then correct it.  The
+     * estimate is never out by more than one. */
+    int binary_exponent;
+    frexp(value, &binary_exponent);
+    int estimate = (int) floor((binary_exponent - 1) * 0.30102999566398120);
+
+    double scaled;
+    if (!scale_by_power(value, PRECISION - 1 - estimate, &scaled))
+        return false;
+    if (scaled >= UPPER_BOUND)
+    {
+        estimate += 1;
+        if (!scale_by_power(value, PRECISION - 1 - estimate, &scaled))
+            return false;
+    }
+    else if (scaled < LOWER_BOUND)
+    {
+        estimate -= 1;
+        if (!scale_by_power(value, PRECISION - 1 - estimate, &scaled))
+            return false;
+    }
+    if (scaled < LOWER_BOUND  ||  scaled >= UPPER_BOUND)
+        return false;
+
+    uint64_t result = (uint64_t) scaled;
+    double fraction = scaled - (double) result;
+    if (fabs(fraction - 0.5) < ROUNDING_MARGIN)
+        return false;
+    else if (fraction > 0.5)
+        result += 1;
+
+    /* Rounding up can carry into another digit. */
+    if (result >= (uint64_t) UPPER_BOUND)
+    {
+        result /= 10;
+        estimate += 1;
+    }
+    *digits = result;
+    *exponent = estimate;
+    return true;
+}
+
+
+/* Writes n characters of s. */
+static char *copy_chars(char *output, const char *s, size_t n)
+{
+    memcpy(output, s, n);
+    return output + n;
+}
+
+
+/* Formats digits and exponent following the rules for %g: if the exponent is
+ * less than -4 or not less than the precision then exponential format is used,
+ * otherwise fixed point, and in either case trailing zeros are removed. */
+static char *format_g_digits(char *output, uint64_t value, int exponent)
+{
+    char digits[PRECISION];
+    format_digits_backwards(
+        digits + 2, (uint32_t) (value / 100000000));
+    format_eight_digits(digits + 2, (uint32_t) (value % 100000000));
+
+    size_t length = PRECISION;
+    while (length > 1  &&  digits[length - 1] == '0')
+        length -= 1;
+
+    if (exponent >= PRECISION  ||  exponent < -4)
+    {
+        *output++ = digits[0];
+        if (length > 1)
+        {
+            *output++ = '.';
+            output = copy_chars(output, &digits[1], length - 1);
+        }
+        *output++ = 'e';
+        *output++ = exponent < 0 ? '-' : '+';
+        unsigned int magnitude =
+            (unsigned int) (exponent < 0 ? -exponent : exponent);
+        if (magnitude < 10)
+            *output++ = '0';
+        output = format_uint32(output, magnitude);
+    }
+    else if (exponent >= 0)
+    {
+        size_t integer = (size_t) exponent + 1;
+        output = copy_chars(output, digits, integer);
+        if (length > integer)
+        {
+            *output++ = '.';
+            output = copy_chars(output, &digits[integer], length - integer);
+        }
+    }
+    else
+    {
+        *output++ = '0';
+        *output++ = '.';
+        for (int i = -1; i > exponent; i --)
+            *output++ = '0';
+        output = copy_chars(output, digits, length);
+    }
+    return output;
+}
+
+
+char *format_double_g10(char *output, double value)
+{
+    double magnitude = fabs(value);
+    uint64_t digits;
+    int exponent;
+    if (!isfinite(value))
+        return output + sprintf(output, "%.10g", value);
+    else if (signbit(value))
+        *output++ = '-';
+
+    if (magnitude < UPPER_BOUND  &&
+        magnitude == (double) (uint64_t) magnitude)
+        /* Integers with no more than PRECISION digits are written exactly. */
+        return format_uint64(output, (uint64_t) magnitude);
+    else if (compute_digits(magnitude, &digits, &exponent))
+        return format_g_digits(output, digits, exponent);
+    else
+        return output + sprintf(output, "%.10g", magnitude);
+}
@@ -0,0 +1,16 @@
+/* Fast formatting of numbers in ASCII.
+ *
+ * Each function writes the formatted number to output without a trailing null
+ * and returns a pointer to the character following the number. */
+
+/* Longest possible result from any of these functions. */
+#define MAX_NUMBER_LENGTH   24
+
+
+char *format_uint32(char *output, uint32_t value);
+char *format_int32(char *output, int32_t value);
+char *format_uint64(char *output, uint64_t value);
+char *format_int64(char *output, int64_t value);
+
+/* Produces exactly the same result as sprintf(output, "%.10g", value). */
+char *format_double_g10(char *output, double value);
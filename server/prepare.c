@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 
 #include "error.h"
@@ -18,6 +19,8 @@
 #include "hardware.h"
 #include "capture.h"
 #include "ext_out.h"
+#include "arrow_ipc.h"
+#include "field_select.h"
 
 #include "prepare.h"
 
@@ -26,8 +29,76 @@
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Data capture request parsing. */
 
+/* Default watermarks for adaptive reduction, in percent of the buffer. */
+#define ADAPTIVE_HIGH_WATERMARK     75
+#define ADAPTIVE_LOW_WATERMARK      50
+
+
+/* Parses the optional =count for a reduction option. */
+static error__t parse_reduction(
+    const char **line, enum data_reduction reduction,
+    struct data_options *options)
+{
+    options->data_reduction = reduction;
+    return
+        IF(read_char(line, '='),
+            parse_uint(line, &options->reduction_count)  ?:
+            TEST_OK_(options->reduction_count > 0, "Invalid sample count"));
+}
+
+
+/* Parses the optional =high:low watermarks for adaptive reduction. */
+static error__t parse_adaptive(
+    const char **line, struct data_options *options)
+{
+    options->adaptive = true;
+    return
+        IF(read_char(line, '='),
+            parse_uint(line, &options->adaptive_high)  ?:
+            parse_char(line, ':')  ?:
+            parse_uint(line, &options->adaptive_low)  ?:
+            TEST_OK_(options->adaptive_high < 100  &&
+                options->adaptive_low < options->adaptive_high,
+                "Invalid watermarks"));
+}
+
+
+/* Parses RANGE=start[:count], where the count defaults to the rest of the
+ * experiment. */
+static error__t parse_range(const char **line, struct data_options *options)
+{
+    options->data_range = DATA_RANGE_START;
+    options->range_count = UINT64_MAX;
+    return
+        parse_char(line, '=')  ?:
+        parse_uint64(line, &options->range_start)  ?:
+        IF(read_char(line, ':'),
+            parse_uint64(line, &options->range_count));
+}
+
+
+/* The field list runs to the next whitespace.  Only its syntax can be checked
+ * here, the fields are checked against the capture when each experiment
+ * starts. */
+static error__t parse_field_list(
+    const char **line, struct data_options *options)
+{
+    const char *start = *line;
+    while (**line  &&  !isspace((unsigned char) **line))
+        *line += 1;
+    size_t length = (size_t) (*line - start);
+    return
+        TEST_OK_(length > 0, "No fields specified")  ?:
+        TEST_OK_(length < sizeof(options->field_list), "Field list too long")  ?:
+        DO(
+            memcpy(options->field_list, start, length);
+            options->field_list[length] = '\0')  ?:
+        TEST_OK_(check_field_list(options->field_list), "Empty field name");
+}
+
+
 static error__t parse_one_option(
-    const char *option, struct data_options *options)
+    const char *option, const char **line, struct data_options *options)
 {
     /* Data formatting options. */
     if (strcmp(option, "UNFRAMED") == 0)
@@ -38,6 +109,12 @@ static error__t parse_one_option(
         options->data_format = DATA_FORMAT_BASE64;
     else if (strcmp(option, "ASCII") == 0)
         options->data_format = DATA_FORMAT_ASCII;
+    else if (strcmp(option, "COMPRESSED") == 0)
+        options->data_format = DATA_FORMAT_COMPRESSED;
+    else if (strcmp(option, "COLUMNAR") == 0)
+        options->data_format = DATA_FORMAT_COLUMNAR;
+    else if (strcmp(option, "ARROW") == 0)
+        options->data_format = DATA_FORMAT_ARROW;
 
     /* Data processing options. */
     else if (strcmp(option, "RAW") == 0)
@@ -54,10 +131,40 @@ static error__t parse_one_option(
         options->omit_status = true;
     else if (strcmp(option, "ONE_SHOT") == 0)
         options->one_shot = true;
+    else if (strcmp(option, "RESYNC") == 0)
+        options->resync = true;
 
     else if (strcmp(option, "XML") == 0)
         options->xml_header = true;
 
+    /* Data rate reduction options. */
+    else if (strcmp(option, "DECIMATE") == 0)
+        return parse_reduction(line, DATA_REDUCTION_DECIMATE, options);
+    else if (strcmp(option, "AVERAGE") == 0)
+        return parse_reduction(line, DATA_REDUCTION_AVERAGE, options);
+    else if (strcmp(option, "RATE") == 0)
+        return
+            parse_char(line, '=')  ?:
+            parse_uint(line, &options->reduction_rate)  ?:
+            TEST_OK_(options->reduction_rate > 0, "Invalid rate");
+    else if (strcmp(option, "ADAPTIVE") == 0)
+        return parse_adaptive(line, options);
+
+    /* Retrieval of the last completed experiment. */
+    else if (strcmp(option, "RANGE") == 0)
+        return parse_range(line, options);
+    else if (strcmp(option, "LAST") == 0)
+        return
+            DO(options->data_range = DATA_RANGE_LAST)  ?:
+            parse_char(line, '=')  ?:
+            parse_uint64(line, &options->range_count);
+
+    /* Field selection. */
+    else if (strcmp(option, "FIELDS") == 0)
+        return
+            parse_char(line, '=')  ?:
+            parse_field_list(line, options);
+
     /* Some compound options. */
     else if (strcmp(option, "BARE") == 0)
         *options = (struct data_options) {
@@ -66,11 +173,17 @@ static error__t parse_one_option(
             .omit_header = true,
             .omit_status = true,
             .one_shot = true,
+            .reduction_count = 1,
+            .adaptive_high = ADAPTIVE_HIGH_WATERMARK,
+            .adaptive_low = ADAPTIVE_LOW_WATERMARK,
         };
     else if (strcmp(option, "DEFAULT") == 0)
         *options = (struct data_options) {
             .data_format = DATA_FORMAT_ASCII,
             .data_process = DATA_PROCESS_SCALED,
+            .reduction_count = 1,
+            .adaptive_high = ADAPTIVE_HIGH_WATERMARK,
+            .adaptive_low = ADAPTIVE_LOW_WATERMARK,
         };
 
     else
@@ -84,6 +197,9 @@ error__t parse_data_options(const char *line, struct data_options *options)
     *options = (struct data_options) {
         .data_format = DATA_FORMAT_ASCII,
         .data_process = DATA_PROCESS_SCALED,
+        .reduction_count = 1,
+        .adaptive_high = ADAPTIVE_HIGH_WATERMARK,
+        .adaptive_low = ADAPTIVE_LOW_WATERMARK,
     };
 
     char option[MAX_NAME_LENGTH];
@@ -92,10 +208,16 @@ error__t parse_data_options(const char *line, struct data_options *options)
         error =
             DO(line = skip_whitespace(line))  ?:
             parse_alphanum_name(&line, option, sizeof(option))  ?:
-            parse_one_option(option, options);
+            parse_one_option(option, &line, options);
+    if (!error  &&  options->reduction_rate > 0  &&
+            options->data_reduction == DATA_REDUCTION_NONE)
+        options->data_reduction = DATA_REDUCTION_DECIMATE;
     return
         error  ?:
-        parse_eos(&line);
+        parse_eos(&line)  ?:
+        TEST_OK_(!options->adaptive  ||
+            options->data_reduction != DATA_REDUCTION_NONE,
+            "ADAPTIVE needs DECIMATE, AVERAGE or RATE");
 }
 
 
@@ -236,6 +358,13 @@ static void end_element(struct xml_element *element)
 /* Header formatting. */
 
 
+static const char *data_process_strings[] = {
+    [DATA_PROCESS_RAW]      = "Raw",
+    [DATA_PROCESS_UNSCALED] = "Unscaled",
+    [DATA_PROCESS_SCALED]   = "Scaled",
+};
+
+
 /* Returns string specifying formatting of given field. */
 static const char *field_type_name(
     const struct capture_info *field, const struct data_options *options)
@@ -272,15 +401,13 @@ static void send_capture_info(
     uint64_t missed_samples)
 {
     static const char *data_format_strings[] = {
-        [DATA_FORMAT_UNFRAMED] = "Unframed",
-        [DATA_FORMAT_FRAMED]   = "Framed",
-        [DATA_FORMAT_BASE64]   = "Base64",
-        [DATA_FORMAT_ASCII]    = "ASCII",
-    };
-    static const char *data_process_strings[] = {
-        [DATA_PROCESS_RAW]      = "Raw",
-        [DATA_PROCESS_UNSCALED] = "Unscaled",
-        [DATA_PROCESS_SCALED]   = "Scaled",
+        [DATA_FORMAT_UNFRAMED]   = "Unframed",
+        [DATA_FORMAT_FRAMED]     = "Framed",
+        [DATA_FORMAT_BASE64]     = "Base64",
+        [DATA_FORMAT_ASCII]      = "ASCII",
+        [DATA_FORMAT_COMPRESSED] = "Compressed",
+        [DATA_FORMAT_COLUMNAR]   = "Columnar",
+        [DATA_FORMAT_ARROW]      = "Arrow",
     };
     const char *data_format = data_format_strings[options->data_format];
     const char *data_process = data_process_strings[options->data_process];
@@ -293,6 +420,22 @@ static void send_capture_info(
     if (options->data_format != DATA_FORMAT_ASCII)
         format_attribute(&element, "sample_bytes", "%zu",
             get_binary_sample_length(capture, options));
+    if (options->data_format == DATA_FORMAT_COMPRESSED)
+        format_attribute(&element, "codec", "%s", "DeltaZigzag");
+    if (options->data_reduction != DATA_REDUCTION_NONE)
+    {
+        format_attribute(&element, "reduction", "%s",
+            options->data_reduction == DATA_REDUCTION_AVERAGE ?
+                "Average" : "Decimate");
+        if (options->reduction_rate > 0)
+            format_attribute(&element, "rate", "%u", options->reduction_rate);
+        else
+            format_attribute(&element,
+                "bucket", "%u", options->reduction_count);
+        if (options->adaptive)
+            format_attribute(&element, "adaptive", "%u:%u",
+                options->adaptive_high, options->adaptive_low);
+    }
     end_element(&element);
 }
 
@@ -369,68 +512,230 @@ bool send_data_header(
 }
 
 
+/* An Arrow schema field together with the storage for its metadata: the field
+ * name, capture and type, followed by the scaling for scaled fields. */
+struct arrow_field_info {
+    char name[2 * MAX_NAME_LENGTH];
+    char scale[32];
+    char offset[32];
+    struct arrow_key_value metadata[6];
+};
+
+
+static struct arrow_field prepare_arrow_field(
+    struct arrow_field_info *info, const struct data_options *options,
+    const struct capture_info *field, enum field_type type)
+{
+    snprintf(info->name, sizeof(info->name), "%s.%s",
+        field->field_name, field->capture_string);
+    struct arrow_key_value *metadata = info->metadata;
+    unsigned int count = 0;
+    metadata[count++] = (struct arrow_key_value) {
+        "name", field->field_name };
+    metadata[count++] = (struct arrow_key_value) {
+        "capture", field->capture_string };
+    metadata[count++] = (struct arrow_key_value) {
+        "type", field_type_name(field, options) };
+    if (field->capture_mode != CAPTURE_MODE_UNSCALED)
+    {
+        snprintf(info->scale, sizeof(info->scale), "%.12g", field->scale);
+        snprintf(info->offset, sizeof(info->offset), "%.12g", field->offset);
+        metadata[count++] = (struct arrow_key_value) { "scale", info->scale };
+        metadata[count++] = (struct arrow_key_value) { "offset", info->offset };
+        metadata[count++] = (struct arrow_key_value) { "units", field->units };
+    }
+    return (struct arrow_field) {
+        .name = info->name,
+        .type = type,
+        .metadata_count = count,
+        .metadata = metadata,
+    };
+}
+
+
+static void list_group_fields(
+    const struct capture_info *list[], unsigned int *count,
+    const struct capture_group *group)
+{
+    for (unsigned int i = 0; i < group->count; i ++)
+        list[(*count)++] = group->outputs[i];
+}
+
+
+bool send_arrow_schema(
+    const struct captured_fields *fields,
+    const struct data_capture *capture,
+    const struct data_options *options,
+    struct buffered_file *file, uint64_t missed_samples)
+{
+    /* Gather the fields in the same order as send_data_header. */
+    const struct capture_info *list[MAX_CAPTURE_COUNT + 1];
+    unsigned int count = 0;
+    if (sample_count_is_anonymous(capture)  &&
+        options->data_process == DATA_PROCESS_RAW)
+        list[count++] = fields->sample_count;
+    list_group_fields(list, &count, &fields->unscaled);
+    list_group_fields(list, &count, &fields->scaled32);
+    list_group_fields(list, &count, &fields->scaled64);
+    list_group_fields(list, &count, &fields->averaged);
+
+    enum field_type types[MAX_CAPTURE_COUNT + 1];
+    ASSERT_OK(get_binary_field_types(capture, options, types) == count);
+
+    struct arrow_field_info *info = malloc(count * sizeof(*info));
+    struct arrow_field arrow_fields[count];
+    for (unsigned int i = 0; i < count; i ++)
+        arrow_fields[i] =
+            prepare_arrow_field(&info[i], options, list[i], types[i]);
+
+    char missed[32];
+    snprintf(missed, sizeof(missed), "%"PRIu64, missed_samples);
+    struct arrow_key_value metadata[] = {
+        { "missed", missed },
+        { "process", data_process_strings[options->data_process] },
+    };
+
+    void *schema = malloc(arrow_schema_max_length(
+        arrow_fields, count, metadata, ARRAY_SIZE(metadata)));
+    size_t length = arrow_encode_schema(
+        arrow_fields, count, metadata, ARRAY_SIZE(metadata), schema);
+    bool ok = write_block(file, schema, length);
+    free(schema);
+    free(info);
+    return ok;
+}
+
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Output preparation. */
 
 
-/* This structure is updated by calling prepare_captured_fields and is consumed
- * by prepare_data_capture() in capture.c.  We pre-allocate enough space for all
- * fields to be full, which cannot happen, but the numbers involved are not
- * extravagant. */
-static struct captured_fields captured_fields = {
-    .sample_count = (struct capture_info[1]) { },
-    .unscaled = { .outputs = (struct capture_info *[MAX_CAPTURE_COUNT]) { } },
-    .scaled32 = { .outputs = (struct capture_info *[MAX_CAPTURE_COUNT]) { } },
-    .scaled64 = { .outputs = (struct capture_info *[MAX_CAPTURE_COUNT]) { } },
-    .averaged = { .outputs = (struct capture_info *[MAX_CAPTURE_COUNT]) { } },
+/* The captured fields are allocated in a single block with room for all fields
+ * to be full, which cannot happen, but the numbers involved are not
+ * extravagant.  The output lists for the four groups and the capture info for
+ * each field follow the structure. */
+struct captured_fields_block {
+    struct captured_fields fields;
+    struct capture_info *outputs[4][MAX_CAPTURE_COUNT];
+    struct capture_info sample_count;
+    struct capture_info capture_info[MAX_CAPTURE_COUNT];
 };
 
-/* Capture info for each field is held in this area. */
-static struct capture_info capture_info_buffer[MAX_CAPTURE_COUNT];
-
 
-static struct capture_group *get_capture_group(enum capture_mode capture_mode)
+static struct capture_group *get_capture_group(
+    struct captured_fields *fields, enum capture_mode capture_mode)
 {
     switch (capture_mode)
     {
         case CAPTURE_MODE_SCALED32:
-             return &captured_fields.scaled32;
+             return &fields->scaled32;
         case CAPTURE_MODE_SCALED64:
-             return &captured_fields.scaled64;
+             return &fields->scaled64;
         case CAPTURE_MODE_AVERAGE:
-             return &captured_fields.averaged;
+             return &fields->averaged;
         case CAPTURE_MODE_UNSCALED:
-             return &captured_fields.unscaled;
+             return &fields->unscaled;
         default:
             ASSERT_FAIL();
     }
 }
 
 
-const struct captured_fields *prepare_captured_fields(void)
+static void project_capture_group(
+    const struct capture_group *group, const char *field_list,
+    bool matched[], struct capture_group *projection)
 {
-    captured_fields.unscaled.count = 0;
-    captured_fields.scaled32.count = 0;
-    captured_fields.scaled64.count = 0;
-    captured_fields.averaged.count = 0;
+    projection->count = 0;
+    for (unsigned int i = 0; i < group->count; i ++)
+    {
+        const struct capture_info *field = group->outputs[i];
+        if (select_field(field_list,
+                field->field_name, field->capture_string, matched))
+            projection->outputs[projection->count++] = group->outputs[i];
+    }
+}
+
+
+/* Every entry in the field list must select a captured field, so that a
+ * mistyped field name is reported rather than quietly ignored. */
+static error__t check_unmatched_fields(
+    const char *field_list, const bool matched[])
+{
+    char unmatched[MAX_FIELD_LIST_LENGTH];
+    return TEST_OK_(
+        format_unmatched_entries(
+            field_list, matched, unmatched, sizeof(unmatched)) == 0,
+        "Fields not captured: %s", unmatched);
+}
+
+
+error__t project_captured_fields(
+    const struct captured_fields *fields, const char *field_list,
+    struct captured_fields **result)
+{
+    /* The output lists for the four groups follow the structure. */
+    struct captured_fields *projection = malloc(
+        sizeof(struct captured_fields) +
+        4 * MAX_CAPTURE_COUNT * sizeof(struct capture_info *));
+    struct capture_info **outputs = (void *) &projection[1];
+    *projection = (struct captured_fields) {
+        .sample_count = fields->sample_count,
+        .unscaled = { .outputs = outputs },
+        .scaled32 = { .outputs = outputs + MAX_CAPTURE_COUNT },
+        .scaled64 = { .outputs = outputs + 2 * MAX_CAPTURE_COUNT },
+        .averaged = { .outputs = outputs + 3 * MAX_CAPTURE_COUNT },
+    };
+
+    bool matched[count_field_entries(field_list)];
+    memset(matched, 0, sizeof(matched));
+    project_capture_group(
+        &fields->unscaled, field_list, matched, &projection->unscaled);
+    project_capture_group(
+        &fields->scaled32, field_list, matched, &projection->scaled32);
+    project_capture_group(
+        &fields->scaled64, field_list, matched, &projection->scaled64);
+    project_capture_group(
+        &fields->averaged, field_list, matched, &projection->averaged);
+
+    error__t error = check_unmatched_fields(field_list, matched);
+    if (error)
+        free(projection);
+    else
+        *result = projection;
+    return error;
+}
+
+
+struct captured_fields *prepare_captured_fields(void)
+{
+    struct captured_fields_block *block =
+        malloc(sizeof(struct captured_fields_block));
+    struct captured_fields *fields = &block->fields;
+    *fields = (struct captured_fields) {
+        .sample_count = &block->sample_count,
+        .unscaled = { .outputs = block->outputs[0] },
+        .scaled32 = { .outputs = block->outputs[1] },
+        .scaled64 = { .outputs = block->outputs[2] },
+        .averaged = { .outputs = block->outputs[3] },
+    };
 
-    get_samples_capture_info(captured_fields.sample_count);
+    get_samples_capture_info(fields->sample_count);
 
     /* Walk the list of outputs and gather them into their groups. */
     unsigned int ix = 0;
     unsigned int captured;
-    struct capture_info *capture_info = capture_info_buffer;
+    struct capture_info *capture_info = block->capture_info;
     while (iterate_captured_values(&ix, &captured, capture_info))
     {
         for (unsigned int i = 0; i < captured; i ++)
         {
             struct capture_group *capture =
-                get_capture_group(capture_info->capture_mode);
+                get_capture_group(fields, capture_info->capture_mode);
             capture->outputs[capture->count++] = capture_info;
             capture_info += 1;
         }
     }
 
-    return &captured_fields;
+    return fields;
 }
@@ -9,6 +9,9 @@ enum data_format {
     DATA_FORMAT_FRAMED,     // Framed binary data
     DATA_FORMAT_BASE64,     // Base 64 formatted data
     DATA_FORMAT_ASCII,      // ASCII numerical data
+    DATA_FORMAT_COMPRESSED, // Delta compressed binary frames
+    DATA_FORMAT_COLUMNAR,   // Binary frames with one column per field
+    DATA_FORMAT_ARROW,      // Arrow IPC stream
 };
 
 enum data_process {
@@ -17,14 +20,45 @@ enum data_process {
     DATA_PROCESS_SCALED,    // Floating point scaled numbers
 };
 
+enum data_reduction {
+    DATA_REDUCTION_NONE,        // Every sample is sent
+    DATA_REDUCTION_DECIMATE,    // First sample of each bucket is sent
+    DATA_REDUCTION_AVERAGE,     // Each bucket is combined into one sample
+};
+
+enum data_range {
+    DATA_RANGE_NONE,        // Data is taken from the next experiment
+    DATA_RANGE_START,       // Samples from range_start of the last experiment
+    DATA_RANGE_LAST,        // The last range_count samples of the experiment
+};
+
+/* Maximum length of the list of selected fields. */
+#define MAX_FIELD_LIST_LENGTH   1024
+
 /* Data capture and processing options. */
 struct data_options {
     enum data_format data_format;   // How data is transported to the client
     enum data_process data_process; // How data is processed
+    enum data_reduction data_reduction; // How the data rate is reduced
+    unsigned int reduction_count;   // Number of samples in each bucket
+    unsigned int reduction_rate;    // Target sample rate in Hz, or 0 if fixed
+    /* With adaptive reduction the reduction is only applied while the client
+     * lags behind the capture by more than adaptive_high percent of the
+     * buffer, until it has caught up to adaptive_low percent. */
+    bool adaptive;
+    unsigned int adaptive_high;
+    unsigned int adaptive_low;
     bool omit_header;       // With this option the header will be omitted
     bool omit_status;       // This option will omit *all* status reports
     bool one_shot;          // Connection is closed after one experiment
     bool xml_header;        // Header is sent in XML format
+    bool resync;            // Streaming continues after buffer overrun
+    /* Range of samples to retrieve from the last completed experiment. */
+    enum data_range data_range;
+    uint64_t range_start;   // First sample for DATA_RANGE_START
+    uint64_t range_count;   // Maximum number of samples to send
+    /* Comma separated list of fields to send, empty if all are sent. */
+    char field_list[MAX_FIELD_LIST_LENGTH];
 };
 
 
@@ -48,6 +82,14 @@ bool send_data_header(
     const struct data_options *options,
     struct buffered_file *file, uint64_t lost_samples);
 
+/* Sends the Arrow IPC schema message describing the captured fields.  Returns
+ * false if writing to the connection fails. */
+bool send_arrow_schema(
+    const struct captured_fields *fields,
+    const struct data_capture *capture,
+    const struct data_options *options,
+    struct buffered_file *file, uint64_t missed_samples);
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Data preparation. */
@@ -80,5 +122,15 @@ struct captured_fields {
 };
 
 
-/* Call to extract set of captured fields, then call prepare_data_capture. */
-const struct captured_fields *prepare_captured_fields(void);
+/* Call to extract set of captured fields, then call prepare_data_capture.  The
+ * result must be released with free(). */
+struct captured_fields *prepare_captured_fields(void);
+
+/* Returns the subset of the captured fields selected by field_list, which is a
+ * comma separated list of field names, each optionally followed by a dot and
+ * the capture, for example INENC1.VAL.Value.  Fails, naming the entries, if
+ * any entry doesn't select a captured field.  The result must be released with
+ * free(). */
+error__t project_captured_fields(
+    const struct captured_fields *fields, const char *field_list,
+    struct captured_fields **projection);
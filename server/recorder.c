@@ -0,0 +1,495 @@
+/* Background recording of captured data to local disk. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "buffered_file.h"
+#include "parse.h"
+#include "config_server.h"
+#include "hardware.h"
+#include "buffer.h"
+#include "prepare.h"
+#include "capture.h"
+#include "data_server.h"
+#include "locking.h"
+
+#include "recorder.h"
+
+
+/* Recorded data is staged and written to disk in chunks of this size, aligned
+ * as required for O_DIRECT transfers. */
+#define RECORD_WRITE_SIZE       (1U << 20)
+#define RECORD_ALIGNMENT        4096U
+
+/* Interval for checking whether recording has been disabled while waiting for
+ * data. */
+#define RECORD_POLL_SECS        1
+#define RECORD_POLL_NSECS       0
+
+/* Header file buffer sizes. */
+#define HEADER_BUF_SIZE         4096
+
+/* Leave room in each path for the recording file names. */
+#define MAX_DIRECTORY_LENGTH    (PATH_MAX - 64)
+#define MAX_STEM_LENGTH         (PATH_MAX - 8)
+
+
+static pthread_mutex_t recorder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recorder_event;
+
+static struct capture_buffer *record_buffer;
+static pthread_t recorder_thread_id;
+static bool recorder_started = false;
+static volatile bool recorder_running = true;
+
+/* Recording directory, empty if recording is disabled. */
+static char record_directory[MAX_DIRECTORY_LENGTH];
+
+/* Recording statistics, all protected by recorder_mutex. */
+static struct record_stats {
+    enum record_state {
+        RECORD_STATE_IDLE,          // Waiting for the next experiment
+        RECORD_STATE_RECORDING,     // Experiment being recorded
+        RECORD_STATE_FAILED,        // Last recording failed
+    } state;
+    unsigned int experiments;       // Number of experiments recorded
+    uint64_t bytes;                 // Bytes in current or last recording
+    double rate;                    // Recording rate in MB/s
+    unsigned int queue_depth;       // Blocks waiting in the capture buffer
+    unsigned int max_queue_depth;   // Largest queue depth this experiment
+} record_stats;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Recording files. */
+
+struct recording {
+    int data_fd;                // Raw data, opened with O_DIRECT if possible
+    FILE *index;                // Block index
+    void *buffer;               // Aligned staging buffer for data
+    size_t buffered;            // Bytes waiting in staging buffer
+    uint64_t length;            // Bytes of valid data recorded so far
+    bool ok;                    // Cleared on any write failure
+};
+
+
+/* Opens the raw data file.  O_DIRECT is not supported by every file system,
+ * in which case we fall back to ordinary writes. */
+static error__t open_data_file(const char *path, int *fd)
+{
+    *fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (*fd == -1  &&  errno == EINVAL)
+        *fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return TEST_IO_(*fd, "Unable to create %s", path);
+}
+
+
+static error__t open_recording(
+    const char *stem, struct recording *recording, void *buffer)
+{
+    char path[PATH_MAX];
+    *recording = (struct recording) {
+        .data_fd = -1,
+        .buffer = buffer,
+        .ok = true,
+    };
+    return
+        DO(snprintf(path, sizeof(path), "%s.raw", stem))  ?:
+        open_data_file(path, &recording->data_fd)  ?:
+        DO(snprintf(path, sizeof(path), "%s.idx", stem))  ?:
+        TEST_OK_IO_(recording->index = fopen(path, "w"),
+            "Unable to create %s", path);
+}
+
+
+/* Writes out the staging buffer, which must either be full or be the final
+ * part of the recording.  O_DIRECT writes must be whole aligned blocks, so the
+ * final write is padded and the file truncated afterwards. */
+static void flush_recording(struct recording *recording)
+{
+    size_t length = (recording->buffered + RECORD_ALIGNMENT - 1) &
+        ~(size_t) (RECORD_ALIGNMENT - 1);
+    memset(recording->buffer + recording->buffered, 0,
+        length - recording->buffered);
+    if (recording->ok  &&  length > 0)
+        recording->ok = !error_report(
+            TEST_OK_IO_(write(recording->data_fd, recording->buffer, length)
+                == (ssize_t) length, "Error writing recorded data"));
+    recording->buffered = 0;
+}
+
+
+/* Appends a block of captured data to the recording.  The data is only counted
+ * once record_blocks() has checked that the block was not overwritten. */
+static void write_block_data(
+    struct recording *recording, const void *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t to_copy = MIN(length, RECORD_WRITE_SIZE - recording->buffered);
+        memcpy(recording->buffer + recording->buffered, data, to_copy);
+        recording->buffered += to_copy;
+        data += to_copy;
+        length -= to_copy;
+        if (recording->buffered == RECORD_WRITE_SIZE)
+            flush_recording(recording);
+    }
+}
+
+
+static void write_index_entry(
+    struct recording *recording, uint64_t offset, uint64_t timestamp)
+{
+    uint64_t entry[2] = { offset, timestamp, };
+    if (recording->ok)
+        recording->ok = !error_report(
+            TEST_OK_IO_(fwrite(entry, sizeof(entry), 1, recording->index) == 1,
+                "Error writing recording index"));
+}
+
+
+/* Writes any remaining data and trims the data file to the valid length, thus
+ * discarding both the final padding and any overrun block. */
+static void close_recording(struct recording *recording)
+{
+    flush_recording(recording);
+    if (recording->data_fd != -1)
+    {
+        if (recording->ok)
+            recording->ok = !error_report(TEST_IO(
+                ftruncate(recording->data_fd, (off_t) recording->length)));
+        close(recording->data_fd);
+    }
+    if (recording->index)
+        fclose(recording->index);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Experiment recording. */
+
+
+static bool recording_enabled(void)
+{
+    LOCK(recorder_mutex);
+    bool enabled = record_directory[0] != '\0';
+    UNLOCK(recorder_mutex);
+    return enabled;
+}
+
+
+static double elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) +
+        1e-9 * (double) (now.tv_nsec - start->tv_nsec);
+}
+
+
+static void update_record_stats(
+    struct reader_state *reader, uint64_t bytes, const struct timespec *start)
+{
+    unsigned int queue_depth = read_block_backlog(reader);
+    double elapsed = elapsed_seconds(start);
+    LOCK(recorder_mutex);
+    record_stats.bytes = bytes;
+    record_stats.rate = elapsed > 0 ? 1e-6 * (double) bytes / elapsed : 0;
+    record_stats.queue_depth = queue_depth;
+    record_stats.max_queue_depth =
+        MAX(record_stats.max_queue_depth, queue_depth);
+    UNLOCK(recorder_mutex);
+}
+
+
+/* Copies every block of the experiment to the recording until all data has
+ * been read, the buffer overruns, writing fails, or recording is disabled. */
+static void record_blocks(
+    struct reader_state *reader, struct recording *recording,
+    size_t skip_bytes)
+{
+    const struct timespec timeout = {
+        .tv_sec  = RECORD_POLL_SECS,
+        .tv_nsec = RECORD_POLL_NSECS, };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (recording->ok  &&  recording_enabled())
+    {
+        size_t length;
+        const void *block = get_read_block(reader, &timeout, &length);
+        if (block == NULL)
+            break;
+        uint64_t timestamp = (uint64_t) (1e9 * elapsed_seconds(&start));
+
+        size_t skipped = MIN(skip_bytes, length);
+        skip_bytes -= skipped;
+        length -= skipped;
+        if (length > 0)
+        {
+            write_block_data(recording, block + skipped, length);
+            if (!check_read_block(reader))
+                break;
+            write_index_entry(recording, recording->length, timestamp);
+            recording->length += length;
+            update_record_stats(reader, recording->length, &start);
+        }
+    }
+}
+
+
+/* Writes the data header as seen by a RAW data client. */
+static void write_record_header(
+    struct reader_state *reader, struct buffered_file *header,
+    unsigned int experiment, const struct tm *start, uint64_t missed_samples)
+{
+    char start_time[64];
+    strftime(start_time, sizeof(start_time), "%Y-%m-%dT%H:%M:%S", start);
+    write_formatted_string(header, "experiment: %u\n", experiment);
+    write_formatted_string(header, "start: %s\n", start_time);
+
+    const struct captured_fields *fields;
+    const struct data_capture *capture;
+    get_reader_description(reader, &fields, &capture);
+    struct data_options options = {
+        .data_format = DATA_FORMAT_UNFRAMED,
+        .data_process = DATA_PROCESS_RAW,
+        .reduction_count = 1,
+    };
+    send_data_header(fields, capture, &options, header, missed_samples);
+}
+
+
+/* Records a single experiment from the opened reader. */
+static void record_experiment(
+    struct reader_state *reader, const char *directory,
+    uint64_t lost_bytes, void *buffer, unsigned int experiment)
+{
+    /* Convert lost bytes into missed samples and skip any partial sample, as
+     * for data clients. */
+    const struct captured_fields *fields;
+    const struct data_capture *capture;
+    get_reader_description(reader, &fields, &capture);
+    size_t sample_length = get_raw_sample_length(capture);
+    uint64_t missed_samples = (lost_bytes + sample_length - 1) / sample_length;
+    uint64_t extra_bytes = lost_bytes % sample_length;
+    size_t skip_bytes =
+        extra_bytes > 0 ? sample_length - (size_t) extra_bytes : 0;
+
+    time_t now = time(NULL);
+    struct tm start;
+    localtime_r(&now, &start);
+    char stem[MAX_STEM_LENGTH];
+    char start_time[32];
+    strftime(start_time, sizeof(start_time), "%Y%m%d-%H%M%S", &start);
+    snprintf(stem, sizeof(stem), "%s/pcap-%s-%u",
+        directory, start_time, experiment);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.hdr", stem);
+
+    struct recording recording;
+    int header_fd = -1;
+    error__t error =
+        open_recording(stem, &recording, buffer)  ?:
+        TEST_IO_(header_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+            "Unable to create %s", path);
+    struct buffered_file *header = NULL;
+    if (!error)
+    {
+        log_message("Recording experiment to %s", stem);
+        header = create_buffered_file(header_fd, 0, HEADER_BUF_SIZE);
+        write_record_header(
+            reader, header, experiment, &start, missed_samples);
+        record_blocks(reader, &recording, skip_bytes);
+    }
+    close_recording(&recording);
+    unsigned int completion = get_reader_completion_code(reader);
+    enum reader_status status = close_reader(reader);
+
+    /* Complete the header with a summary of the recording. */
+    static const char *status_strings[] = {
+        [READER_STATUS_ALL_READ] = "Ok",
+        [READER_STATUS_CLOSED]   = "Abandoned",
+        [READER_STATUS_OVERRUN]  = "Data overrun",
+    };
+    bool ok = !error  &&  recording.ok;
+    if (header)
+    {
+        if (status == READER_STATUS_ALL_READ)
+            write_formatted_string(header, "completion: %s\n",
+                hw_decode_completion(completion));
+        write_formatted_string(header, "status: %s\n",
+            ok ? status_strings[status] : "Write error");
+        write_formatted_string(header, "lost_bytes: %"PRIu64"\n", lost_bytes);
+        write_formatted_string(header,
+            "recorded_bytes: %"PRIu64"\n", recording.length);
+        write_formatted_string(header, "samples: %"PRIu64"\n",
+            recording.length / sample_length);
+        ok = flush_out_buf(header)  &&  ok;
+        error_report(destroy_buffered_file(header));
+    }
+    if (header_fd != -1)
+        close(header_fd);
+    error_report(error);
+
+    log_message("Recorded %"PRIu64" bytes (+%"PRIu64" lost) %s",
+        recording.length, lost_bytes, status_strings[status]);
+    LOCK(recorder_mutex);
+    record_stats.state = ok ? RECORD_STATE_IDLE : RECORD_STATE_FAILED;
+    record_stats.queue_depth = 0;
+    UNLOCK(recorder_mutex);
+}
+
+
+/* Waits for recording to be enabled and returns the directory to record into,
+ * or returns false on shutdown. */
+static bool wait_for_recording(char directory[])
+{
+    LOCK(recorder_mutex);
+    while (recorder_running  &&  record_directory[0] == '\0')
+        WAIT(recorder_mutex, recorder_event);
+    strcpy(directory, record_directory);
+    UNLOCK(recorder_mutex);
+    return recorder_running;
+}
+
+
+static void *recorder_thread(void *context)
+{
+    struct reader_state *reader = NULL;
+    void *buffer = context;
+    const struct timespec timeout = {
+        .tv_sec  = RECORD_POLL_SECS,
+        .tv_nsec = RECORD_POLL_NSECS, };
+
+    char directory[MAX_DIRECTORY_LENGTH];
+    while (wait_for_recording(directory))
+    {
+        /* Our reader only exists while recording is enabled, as every reader
+         * counts as an active client for each capture. */
+        if (reader == NULL)
+            reader = create_reader(record_buffer);
+        if (reader == NULL)
+        {
+            /* All readers are taken by data clients, try again later. */
+            nanosleep(&timeout, NULL);
+            continue;
+        }
+
+        size_t block_size, block_count;
+        get_buffer_size(record_buffer, &block_size, &block_count);
+        uint64_t lost_bytes;
+        if (open_reader(reader, (unsigned int) block_count / 4,
+                &timeout, &lost_bytes))
+        {
+            LOCK(recorder_mutex);
+            unsigned int experiment = ++ record_stats.experiments;
+            record_stats.state = RECORD_STATE_RECORDING;
+            record_stats.bytes = 0;
+            record_stats.rate = 0;
+            record_stats.max_queue_depth = 0;
+            UNLOCK(recorder_mutex);
+
+            record_experiment(
+                reader, directory, lost_bytes, buffer, experiment);
+        }
+
+        if (!recording_enabled())
+        {
+            destroy_reader(reader);
+            reader = NULL;
+        }
+    }
+
+    if (reader)
+        destroy_reader(reader);
+    free(buffer);
+    return NULL;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* User interface and control. */
+
+
+error__t set_record_directory(const char *value)
+{
+    return
+        TEST_OK_(strlen(value) < MAX_DIRECTORY_LENGTH,
+            "Directory name too long")  ?:
+        IF(*value,
+            TEST_OK_(access(value, W_OK) == 0,
+                "Cannot write to %s", value))  ?:
+        WITH_LOCK(recorder_mutex,
+            DO(strcpy(record_directory, value);
+               SIGNAL(recorder_event)));
+}
+
+
+error__t get_record_directory(struct connection_result *result)
+{
+    return WITH_LOCK(recorder_mutex,
+        format_one_result(result, "%s", record_directory));
+}
+
+
+error__t get_record_status(struct connection_result *result)
+{
+    static const char *state_strings[] = {
+        [RECORD_STATE_IDLE]      = "Idle",
+        [RECORD_STATE_RECORDING] = "Recording",
+        [RECORD_STATE_FAILED]    = "Failed",
+    };
+    return WITH_LOCK(recorder_mutex,
+        format_one_result(result, "%s %u %"PRIu64" %.1f %u %u",
+            record_directory[0]  ||
+                record_stats.state == RECORD_STATE_RECORDING ?
+                state_strings[record_stats.state] : "Disabled",
+            record_stats.experiments, record_stats.bytes, record_stats.rate,
+            record_stats.queue_depth, record_stats.max_queue_depth));
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Initialisation and shutdown. */
+
+
+error__t start_recorder(struct capture_buffer *buffer)
+{
+    void *staging = NULL;
+    record_buffer = buffer;
+    pwait_initialise(&recorder_event);
+    return
+        TEST_OK_(posix_memalign(
+            &staging, RECORD_ALIGNMENT, RECORD_WRITE_SIZE) == 0,
+            "Unable to allocate recording buffer")  ?:
+        TEST_PTHREAD(pthread_create(
+            &recorder_thread_id, NULL, recorder_thread, staging))  ?:
+        DO(recorder_started = true);
+}
+
+
+void terminate_recorder(void)
+{
+    if (recorder_started)
+    {
+        LOCK(recorder_mutex);
+        recorder_running = false;
+        record_directory[0] = '\0';
+        SIGNAL(recorder_event);
+        UNLOCK(recorder_mutex);
+        error_report(TEST_PTHREAD(pthread_join(recorder_thread_id, NULL)));
+    }
+}
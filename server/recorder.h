@@ -0,0 +1,35 @@
+/* Background recording of captured data to local disk.
+ *
+ * When a recording directory is configured every experiment is read from the
+ * capture buffer by a dedicated reader and written to three files in the
+ * directory, all named after the experiment:
+ *
+ *  .raw    The raw captured data, as sent to RAW UNFRAMED data clients.
+ *  .idx    An index of 16 byte entries, one for each capture buffer block: the
+ *          offset of the block in the .raw file and its arrival time in ns
+ *          since the start of recording, both as 64-bit numbers.
+ *  .hdr    The data header as sent to RAW data clients, followed by a summary
+ *          of the recording once the experiment is complete. */
+
+struct capture_buffer;
+struct connection_result;
+
+/* Starts the recorder thread reading from the given buffer.  Must be called
+ * after forking. */
+error__t start_recorder(struct capture_buffer *buffer);
+
+/* Stops the recorder thread.  Must be called after shutdown_buffer() so that
+ * any recording in progress is abandoned. */
+void terminate_recorder(void);
+
+/* *PCAP.RECORD=directory enables recording into the given directory, an empty
+ * value disables recording.  Disabling recording abandons any recording in
+ * progress. */
+error__t set_record_directory(const char *value);
+error__t get_record_directory(struct connection_result *result);
+
+/* *PCAP.RECORD_STATUS? returns recorder state, number of experiments recorded,
+ * bytes recorded and recording rate in MB/s for the current or most recent
+ * experiment, and the current and maximum number of blocks waiting for the
+ * recorder in the capture buffer. */
+error__t get_record_status(struct connection_result *result);
@@ -160,6 +160,28 @@ static uint32_t read_register(struct base_state *state, unsigned int number)
 }
 
 
+/* Reads the register for all count instances, for hardware registers this is
+ * done as a single batch. */
+static void read_registers(
+    struct base_state *state, unsigned int count, uint32_t values[])
+{
+    if (state->extension)
+        for (unsigned int i = 0; i < count; i ++)
+            values[i] = extension_read_register(state->extension, i);
+    else
+    {
+        struct hw_register registers[count];
+        for (unsigned int i = 0; i < count; i ++)
+            registers[i] = (struct hw_register) {
+                .block_base = state->block_base,
+                .block_number = i,
+                .reg = state->field_register,
+            };
+        hw_read_registers(registers, count, values);
+    }
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Shared implementation for param and read classes, in particular param and
  * read classes share the same state. */
@@ -314,16 +336,25 @@ const struct class_methods param_class_methods = {
 /* These are very similar to parameter registers, but reading and change_set
  * control are somewhat different. */
 
-/* This must be called under a lock. */
-static uint32_t unlocked_read_read(
-    struct simple_state *state, unsigned int number)
+/* Records a freshly read register value, updating its change index if it has
+ * changed.  Must also be called under the lock. */
+static void update_read_value(
+    struct simple_state *state, unsigned int number, uint32_t result)
 {
-    uint32_t result = read_register(&state->base, number);
     if (result != state->values[number].value)
     {
         state->values[number].value = result;
         state->values[number].update_index = get_change_index();
     }
+}
+
+
+/* This must be called under a lock. */
+static uint32_t unlocked_read_read(
+    struct simple_state *state, unsigned int number)
+{
+    uint32_t result = read_register(&state->base, number);
+    update_read_value(state, number, result);
     return result;
 }
 
@@ -342,10 +373,12 @@ static void read_change_set(
     void *class_data, const uint64_t report_index, bool changes[])
 {
     struct simple_state *state = class_data;
+    uint32_t values[state->count];
     LOCK(state->mutex);
+    read_registers(&state->base, state->count, values);
     for (unsigned int i = 0; i < state->count; i ++)
     {
-        unlocked_read_read(state, i);
+        update_read_value(state, i, values[i]);
         changes[i] = state->values[i].update_index > report_index;
     }
     UNLOCK(state->mutex);
@@ -0,0 +1,355 @@
+/* Replay of recorded experiments in simulation builds. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "panda_device.h"
+
+#include "error.h"
+#include "buffered_file.h"
+#include "parse.h"
+#include "config_server.h"
+#include "hardware.h"
+#include "capture.h"
+#include "data_server.h"
+#include "locking.h"
+
+#include "replay.h"
+
+
+/* Longest wait for the next block before returning an empty read, as for the
+ * hardware read timeout. */
+#define REPLAY_TIMEOUT_NS       100000000   // 100ms
+
+/* Leave room in the stem for the recording file extensions. */
+#define MAX_STEM_LENGTH         (PATH_MAX - 8)
+
+/* Header line buffer size. */
+#define HEADER_LINE_SIZE        256
+
+
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Recording to replay, empty if replay is disabled, and replay speed. */
+static char replay_stem[MAX_STEM_LENGTH];
+static double replay_speed = 1;
+
+/* Set by replay_disarm() to end the replay in progress. */
+static bool replay_disarmed;
+
+
+/* An index entry is written by the recorder for each recorded block. */
+struct index_entry {
+    uint64_t offset;            // Offset of block in .raw file
+    uint64_t timestamp;         // Arrival time in ns from start of recording
+};
+
+/* State of the replay in progress.  This is set up on arm and is then only
+ * accessed by the data capture thread. */
+static struct replay {
+    int data_fd;                // Recorded data
+    uint64_t data_length;       // Length of recorded data
+    struct index_entry *index;  // Recorded blocks
+    size_t block_count;
+    size_t block;               // Block being replayed
+    uint64_t offset;            // Offset of next data to replay
+    uint64_t start_ns;          // Time replay was armed
+    double speed;
+    unsigned int completion;    // Completion code to report at end of replay
+} replay = { .data_fd = -1, };
+
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1000000000 * (uint64_t) now.tv_sec + (uint64_t) now.tv_nsec;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Loading the recording. */
+
+
+/* Converts the recorded completion string back into a completion code. */
+static unsigned int parse_completion(const char *completion)
+{
+    static const unsigned int completion_codes[] = {
+        PANDA_COMPLETION_DMA,
+        PANDA_COMPLETION_OVERRUN,
+        PANDA_COMPLETION_FRAMING,
+        PANDA_COMPLETION_DISARM,
+    };
+    for (unsigned int i = 0; i < ARRAY_SIZE(completion_codes); i ++)
+        if (strcmp(completion, hw_decode_completion(completion_codes[i])) == 0)
+            return completion_codes[i];
+    return 0;
+}
+
+
+/* Reads the sample length and completion code from the recording header.  The
+ * completion is only present if the recording was completed. */
+static error__t load_header(const char *path, size_t *sample_length)
+{
+    FILE *header;
+    error__t error = TEST_OK_IO_(header = fopen(path, "r"),
+        "Unable to open %s", path);
+    *sample_length = 0;
+    char line[HEADER_LINE_SIZE];
+    while (!error  &&  fgets(line, sizeof(line), header))
+    {
+        line[strcspn(line, "\n")] = '\0';
+        const char *string = line;
+        unsigned int length;
+        if (read_string(&string, "sample_bytes: "))
+            error =
+                parse_uint(&string, &length)  ?:
+                parse_eos(&string)  ?:
+                DO(*sample_length = length);
+        else if (read_string(&string, "completion: "))
+            replay.completion = parse_completion(string);
+    }
+    if (header)
+        fclose(header);
+    return
+        error  ?:
+        TEST_OK_(*sample_length > 0, "No sample length in %s", path);
+}
+
+
+static error__t load_index(const char *path)
+{
+    struct stat st;
+    FILE *index;
+    error__t error =
+        TEST_OK_IO_(index = fopen(path, "r"), "Unable to open %s", path)  ?:
+        TEST_IO(fstat(fileno(index), &st))  ?:
+        DO(
+            replay.block_count =
+                (size_t) st.st_size / sizeof(struct index_entry);
+            replay.index =
+                calloc(replay.block_count + 1, sizeof(struct index_entry)))  ?:
+        TEST_OK_IO_(
+            fread(replay.index, sizeof(struct index_entry),
+                replay.block_count, index) == replay.block_count,
+            "Error reading %s", path);
+    if (index)
+        fclose(index);
+    return error;
+}
+
+
+static error__t load_data(const char *path)
+{
+    struct stat st;
+    return
+        TEST_IO_(replay.data_fd = open(path, O_RDONLY),
+            "Unable to open %s", path)  ?:
+        TEST_IO(fstat(replay.data_fd, &st))  ?:
+        DO(replay.data_length = (uint64_t) st.st_size);
+}
+
+
+/* The recording can only be replayed if the capture has the same sample length,
+ * otherwise the data cannot be interpreted. */
+static error__t check_sample_length(size_t sample_length)
+{
+    const struct captured_fields *fields;
+    const struct data_capture *capture;
+    get_capture_description(&fields, &capture);
+    size_t capture_length = get_raw_sample_length(capture);
+    return TEST_OK_(sample_length == capture_length,
+        "Recorded sample length %zu does not match capture length %zu",
+        sample_length, capture_length);
+}
+
+
+static error__t load_recording(const char *stem)
+{
+    char path[PATH_MAX];
+    size_t sample_length;
+    return
+        DO(snprintf(path, sizeof(path), "%s.hdr", stem))  ?:
+        load_header(path, &sample_length)  ?:
+        check_sample_length(sample_length)  ?:
+        DO(snprintf(path, sizeof(path), "%s.idx", stem))  ?:
+        load_index(path)  ?:
+        DO(snprintf(path, sizeof(path), "%s.raw", stem))  ?:
+        load_data(path);
+}
+
+
+static void close_recording(void)
+{
+    if (replay.data_fd != -1)
+        close(replay.data_fd);
+    free(replay.index);
+    replay = (struct replay) { .data_fd = -1, };
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Simulated hardware interface. */
+
+
+bool replay_arm_streamed_data(void)
+{
+    char stem[MAX_STEM_LENGTH];
+    LOCK(replay_mutex);
+    strcpy(stem, replay_stem);
+    double speed = replay_speed;
+    replay_disarmed = false;
+    UNLOCK(replay_mutex);
+
+    if (*stem)
+    {
+        close_recording();
+        log_message("Replaying %s", stem);
+        if (ERROR_REPORT(load_recording(stem), "Unable to replay %s", stem))
+        {
+            /* Report a failed replay in the same way as a capture which could
+             * not be interpreted. */
+            close_recording();
+            replay.completion = PANDA_COMPLETION_FRAMING;
+        }
+        replay.speed = speed;
+        replay.start_ns = get_time_ns();
+    }
+    return *stem;
+}
+
+
+/* Waits until the current block is due, but for no longer than the hardware
+ * read timeout.  Returns false if the block is not yet due. */
+static bool wait_for_block(void)
+{
+    if (replay.speed > 0)
+    {
+        uint64_t due = replay.start_ns + (uint64_t) (
+            (double) replay.index[replay.block].timestamp / replay.speed);
+        uint64_t now = get_time_ns();
+        if (due > now)
+        {
+            uint64_t delay = MIN(due - now, (uint64_t) REPLAY_TIMEOUT_NS);
+            struct timespec interval = {
+                .tv_sec = (time_t) (delay / NSECS),
+                .tv_nsec = (long) (delay % NSECS),
+            };
+            nanosleep(&interval, NULL);
+            return delay == due - now;
+        }
+    }
+    return true;
+}
+
+
+/* Each call returns at most the rest of the current block, so the capture path
+ * sees the recorded block boundaries. */
+size_t replay_read_streamed_data(void *buffer, size_t length, bool *data_end)
+{
+    LOCK(replay_mutex);
+    bool disarmed = replay_disarmed;
+    UNLOCK(replay_mutex);
+
+    *data_end = false;
+    if (disarmed)
+    {
+        replay.completion = PANDA_COMPLETION_DISARM;
+        *data_end = true;
+    }
+    else if (replay.data_fd == -1  ||  replay.offset >= replay.data_length)
+        *data_end = true;
+    else if (wait_for_block())
+    {
+        uint64_t block_end = replay.block + 1 < replay.block_count ?
+            replay.index[replay.block + 1].offset : replay.data_length;
+        size_t to_read = (size_t) MIN((uint64_t) length,
+            block_end - replay.offset);
+        ssize_t count = pread(
+            replay.data_fd, buffer, to_read, (off_t) replay.offset);
+        if (ERROR_REPORT(
+                TEST_OK_IO_(count == (ssize_t) to_read,
+                    "Error reading recorded data"),
+                "Replay failed"))
+        {
+            replay.completion = PANDA_COMPLETION_DMA;
+            *data_end = true;
+        }
+        else
+        {
+            replay.offset += to_read;
+            if (replay.offset >= block_end)
+                replay.block += 1;
+            return to_read;
+        }
+    }
+    return 0;
+}
+
+
+unsigned int replay_read_streamed_completion(void)
+{
+    unsigned int completion = replay.completion;
+    close_recording();
+    return completion;
+}
+
+
+void replay_disarm(void)
+{
+    LOCK(replay_mutex);
+    replay_disarmed = true;
+    UNLOCK(replay_mutex);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* User interface. */
+
+
+error__t set_replay_file(const char *value)
+{
+    char path[PATH_MAX];
+    return
+        TEST_OK_(sim_hardware(), "Replay only supported in simulation")  ?:
+        TEST_OK_(strlen(value) < MAX_STEM_LENGTH, "File name too long")  ?:
+        IF(*value,
+            DO(snprintf(path, sizeof(path), "%s.raw", value))  ?:
+            TEST_OK_(access(path, R_OK) == 0, "Cannot read %s", path))  ?:
+        WITH_LOCK(replay_mutex, DO(strcpy(replay_stem, value)));
+}
+
+
+error__t get_replay_file(struct connection_result *result)
+{
+    return WITH_LOCK(replay_mutex,
+        format_one_result(result, "%s", replay_stem));
+}
+
+
+error__t set_replay_speed(const char *value)
+{
+    double speed;
+    return
+        parse_double(&value, &speed)  ?:
+        parse_eos(&value)  ?:
+        TEST_OK_(speed >= 0, "Invalid replay speed")  ?:
+        WITH_LOCK(replay_mutex, DO(replay_speed = speed));
+}
+
+
+error__t get_replay_speed(struct connection_result *result)
+{
+    return WITH_LOCK(replay_mutex,
+        format_one_result(result, "%g", replay_speed));
+}
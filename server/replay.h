@@ -0,0 +1,39 @@
+/* Replay of recorded experiments in simulation builds.
+ *
+ * When a recording made by the recorder (see recorder.h) is selected every
+ * subsequent experiment replays the recorded data in place of the data stream
+ * from the simulated hardware.  The data is returned in the recorded blocks,
+ * each released at its recorded arrival time scaled by the replay speed, and
+ * then passes through the normal capture path.  The capture must be configured
+ * with the same fields as the recording, and the replay ends with the recorded
+ * completion code unless disarmed first. */
+
+struct connection_result;
+
+/* *PCAP.REPLAY=stem selects the recording to replay, where stem is the path of
+ * the recorded files without the .raw .idx .hdr extension.  An empty value
+ * disables replay.  Only supported in simulation builds. */
+error__t set_replay_file(const char *value);
+error__t get_replay_file(struct connection_result *result);
+
+/* *PCAP.REPLAY_SPEED=speed sets the replay speed as a multiple of real time,
+ * zero replays the data as fast as possible.  The default speed is 1. */
+error__t set_replay_speed(const char *value);
+error__t get_replay_speed(struct connection_result *result);
+
+
+/* Simulated hardware interface.  These are used in place of the corresponding
+ * hw_..._streamed_... functions in hardware.h while replaying. */
+
+/* Called on arm, returns true if a recording is replayed for this
+ * experiment. */
+bool replay_arm_streamed_data(void);
+
+/* Returns the next part of the recorded data stream. */
+size_t replay_read_streamed_data(void *buffer, size_t length, bool *data_end);
+
+/* Returns the completion code once replay is complete. */
+unsigned int replay_read_streamed_completion(void);
+
+/* Ends any replay in progress with a disarm completion. */
+void replay_disarm(void);
@@ -0,0 +1,460 @@
+/* Vectorised conversion of scaled capture fields.
+ *
+ * Samples are converted in groups as wide as the vector unit allows, with each
+ * vector holding the same field from consecutive samples.  Thus the scale and
+ * offset for a field are broadcast once for the group of samples, and the
+ * sample count reciprocals for averaging are computed a vector at a time.  Any
+ * samples left over are converted by narrower vectors and finally scalar code.
+ *
+ * All kernels perform exactly the same floating point operations in the same
+ * order, so all kernels produce identical results.  This relies on this file
+ * being compiled with -ffp-contract=off, as otherwise the compiler is free to
+ * fuse the scalar multiply and add into a single rounding operation where the
+ * target has one.
+ *
+ * On x86 we use SSE2, and AVX2 if the processor supports it.  On 64-bit ARM we
+ * use NEON, but 32-bit ARM NEON has no double precision support, so we fall
+ * back to scalar code there.  Define SCALING_NO_SIMD to force scalar code. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)  &&  !defined(SCALING_NO_SIMD)
+#define SCALING_SSE2
+#include <immintrin.h>
+#elif defined(__aarch64__)  &&  !defined(SCALING_NO_SIMD)
+#define SCALING_NEON
+#include <arm_neon.h>
+#endif
+
+#include "scaling.h"
+
+
+/* Fields are addressed by word index within a raw sample.  64-bit fields need
+ * not be 64-bit aligned. */
+static inline int32_t field32(const uint32_t input[], size_t index)
+{
+    return (int32_t) input[index];
+}
+
+static inline int64_t field64(const uint32_t input[], size_t index)
+{
+    const int64_t *value = (const void *) &input[index];
+    return *value;
+}
+
+
+/* Returns the sample count for averaging as a double, treating a zero sample
+ * count as one. */
+static inline double averaging_count(
+    const struct scaled_layout *layout, const uint32_t input[])
+{
+    uint32_t count = input[layout->sample_count_index];
+    return count == 0 ? 1 : count;
+}
+
+
+/* Returns the address of the first scaled value in the given output sample. */
+static inline double *output_values(
+    const struct scaled_layout *layout, void *output, unsigned int sample)
+{
+    return output + sample * layout->output_length + layout->output_offset;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Scalar conversion of a single sample. */
+
+static void convert_sample_scalar(
+    const struct scaled_layout *layout, const uint32_t input[], double output[])
+{
+    const struct scaled_group *scaled32 = &layout->scaled32;
+    for (size_t i = 0; i < scaled32->count; i ++)
+        output[i] =
+            scaled32->scale[i] * field32(input, scaled32->index + i) +
+            scaled32->offset[i];
+    output += scaled32->count;
+
+    const struct scaled_group *scaled64 = &layout->scaled64;
+    for (size_t i = 0; i < scaled64->count; i ++)
+        output[i] =
+            scaled64->scale[i] *
+                (double) field64(input, scaled64->index + 2 * i) +
+            scaled64->offset[i];
+    output += scaled64->count;
+
+    const struct scaled_group *averaged = &layout->averaged;
+    if (averaged->count > 0)
+    {
+        double reciprocal = 1.0 / averaging_count(layout, input);
+        for (size_t i = 0; i < averaged->count; i ++)
+            output[i] =
+                averaged->scale[i] *
+                    (double) field64(input, averaged->index + 2 * i) *
+                    reciprocal +
+                averaged->offset[i];
+    }
+}
+
+
+/* Converts samples from first to sample_count one at a time. */
+static void convert_scalar(
+    const struct scaled_layout *layout, unsigned int first,
+    unsigned int sample_count, const uint32_t input[], void *output)
+{
+    for (unsigned int s = first; s < sample_count; s ++)
+        convert_sample_scalar(layout,
+            &input[s * layout->raw_sample_words],
+            output_values(layout, output, s));
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* SSE2 and AVX2 conversion.  Each function converts as many samples as it can
+ * starting from sample first and returns the index of the first unconverted
+ * sample. */
+
+#if defined(SCALING_SSE2)
+
+/* Stores the two halves of a vector to two output samples. */
+static inline void store_sse2(double *output[2], size_t i, __m128d value)
+{
+    _mm_storel_pd(&output[0][i], value);
+    _mm_storeh_pd(&output[1][i], value);
+}
+
+
+/* Returns scale * value + offset for field i of the group. */
+static inline __m128d scale_sse2(
+    const struct scaled_group *group, size_t i, __m128d value)
+{
+    return _mm_add_pd(
+        _mm_mul_pd(_mm_set1_pd(group->scale[i]), value),
+        _mm_set1_pd(group->offset[i]));
+}
+
+
+/* Converts two samples starting at input, one field at a time. */
+static inline void convert_pair_sse2(
+    const struct scaled_layout *layout, const uint32_t input0[],
+    double *output[2])
+{
+    const uint32_t *input1 = input0 + layout->raw_sample_words;
+
+    const struct scaled_group *scaled32 = &layout->scaled32;
+    for (size_t i = 0; i < scaled32->count; i ++)
+    {
+        size_t index = scaled32->index + i;
+        __m128d value = _mm_cvtepi32_pd(_mm_setr_epi32(
+            field32(input0, index), field32(input1, index), 0, 0));
+        store_sse2(output, i, scale_sse2(scaled32, i, value));
+    }
+    size_t out = scaled32->count;
+
+    /* There is no vector conversion from 64-bit integers before AVX-512. */
+    const struct scaled_group *scaled64 = &layout->scaled64;
+    for (size_t i = 0; i < scaled64->count; i ++)
+    {
+        size_t index = scaled64->index + 2 * i;
+        __m128d value = _mm_setr_pd(
+            (double) field64(input0, index), (double) field64(input1, index));
+        store_sse2(output, out + i, scale_sse2(scaled64, i, value));
+    }
+    out += scaled64->count;
+
+    const struct scaled_group *averaged = &layout->averaged;
+    if (averaged->count > 0)
+    {
+        __m128d reciprocals = _mm_div_pd(_mm_set1_pd(1.0), _mm_setr_pd(
+            averaging_count(layout, input0), averaging_count(layout, input1)));
+        for (size_t i = 0; i < averaged->count; i ++)
+        {
+            size_t index = averaged->index + 2 * i;
+            __m128d value = _mm_setr_pd(
+                (double) field64(input0, index),
+                (double) field64(input1, index));
+            __m128d scaled = _mm_mul_pd(
+                _mm_mul_pd(_mm_set1_pd(averaged->scale[i]), value),
+                reciprocals);
+            store_sse2(output, out + i,
+                _mm_add_pd(scaled, _mm_set1_pd(averaged->offset[i])));
+        }
+    }
+}
+
+
+static inline unsigned int convert_sse2(
+    const struct scaled_layout *layout, unsigned int first,
+    unsigned int sample_count, const uint32_t input[], void *output)
+{
+    unsigned int s = first;
+    for (; s + 2 <= sample_count; s += 2)
+    {
+        double *values[2] = {
+            output_values(layout, output, s),
+            output_values(layout, output, s + 1),
+        };
+        convert_pair_sse2(
+            layout, &input[s * layout->raw_sample_words], values);
+    }
+    return s;
+}
+
+
+#define AVX2 __attribute__((target("avx2")))
+
+/* Stores the four quarters of a vector to four output samples. */
+static inline AVX2 void store_avx2(
+    double *output[4], size_t i, __m256d value)
+{
+    __m128d low = _mm256_castpd256_pd128(value);
+    __m128d high = _mm256_extractf128_pd(value, 1);
+    _mm_storel_pd(&output[0][i], low);
+    _mm_storeh_pd(&output[1][i], low);
+    _mm_storel_pd(&output[2][i], high);
+    _mm_storeh_pd(&output[3][i], high);
+}
+
+
+static inline AVX2 __m256d scale_avx2(
+    const struct scaled_group *group, size_t i, __m256d value)
+{
+    return _mm256_add_pd(
+        _mm256_mul_pd(_mm256_set1_pd(group->scale[i]), value),
+        _mm256_set1_pd(group->offset[i]));
+}
+
+
+/* Loads a 64-bit field from four samples and converts to double. */
+static inline AVX2 __m256d load64_avx2(
+    const uint32_t input[], size_t words, size_t index)
+{
+    return _mm256_setr_pd(
+        (double) field64(input, index),
+        (double) field64(input, words + index),
+        (double) field64(input, 2 * words + index),
+        (double) field64(input, 3 * words + index));
+}
+
+
+/* Converts four samples starting at input, one field at a time.  We don't use
+ * the AVX2 gather instructions, as on many processors these are slower than
+ * separate loads. */
+static inline AVX2 void convert_quad_avx2(
+    const struct scaled_layout *layout, const uint32_t input[],
+    double *output[4])
+{
+    size_t words = layout->raw_sample_words;
+
+    const struct scaled_group *scaled32 = &layout->scaled32;
+    for (size_t i = 0; i < scaled32->count; i ++)
+    {
+        size_t index = scaled32->index + i;
+        __m256d value = _mm256_cvtepi32_pd(_mm_setr_epi32(
+            field32(input, index),
+            field32(input, words + index),
+            field32(input, 2 * words + index),
+            field32(input, 3 * words + index)));
+        store_avx2(output, i, scale_avx2(scaled32, i, value));
+    }
+    size_t out = scaled32->count;
+
+    const struct scaled_group *scaled64 = &layout->scaled64;
+    for (size_t i = 0; i < scaled64->count; i ++)
+    {
+        __m256d value = load64_avx2(input, words, scaled64->index + 2 * i);
+        store_avx2(output, out + i, scale_avx2(scaled64, i, value));
+    }
+    out += scaled64->count;
+
+    const struct scaled_group *averaged = &layout->averaged;
+    if (averaged->count > 0)
+    {
+        __m256d reciprocals = _mm256_div_pd(_mm256_set1_pd(1.0),
+            _mm256_setr_pd(
+                averaging_count(layout, input),
+                averaging_count(layout, input + words),
+                averaging_count(layout, input + 2 * words),
+                averaging_count(layout, input + 3 * words)));
+        for (size_t i = 0; i < averaged->count; i ++)
+        {
+            __m256d value =
+                load64_avx2(input, words, averaged->index + 2 * i);
+            __m256d scaled = _mm256_mul_pd(
+                _mm256_mul_pd(_mm256_set1_pd(averaged->scale[i]), value),
+                reciprocals);
+            store_avx2(output, out + i,
+                _mm256_add_pd(scaled, _mm256_set1_pd(averaged->offset[i])));
+        }
+    }
+}
+
+
+static inline AVX2 unsigned int convert_avx2(
+    const struct scaled_layout *layout, unsigned int first,
+    unsigned int sample_count, const uint32_t input[], void *output)
+{
+    unsigned int s = first;
+    for (; s + 4 <= sample_count; s += 4)
+    {
+        double *values[4] = {
+            output_values(layout, output, s),
+            output_values(layout, output, s + 1),
+            output_values(layout, output, s + 2),
+            output_values(layout, output, s + 3),
+        };
+        convert_quad_avx2(
+            layout, &input[s * layout->raw_sample_words], values);
+    }
+    return s;
+}
+
+#endif
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* NEON conversion for 64-bit ARM. */
+
+#if defined(SCALING_NEON)
+
+static inline void store_neon(double *output[2], size_t i, float64x2_t value)
+{
+    vst1q_lane_f64(&output[0][i], value, 0);
+    vst1q_lane_f64(&output[1][i], value, 1);
+}
+
+
+static inline float64x2_t scale_neon(
+    const struct scaled_group *group, size_t i, float64x2_t value)
+{
+    return vaddq_f64(
+        vmulq_f64(vdupq_n_f64(group->scale[i]), value),
+        vdupq_n_f64(group->offset[i]));
+}
+
+
+/* Loads a 64-bit field from two samples and converts to double. */
+static inline float64x2_t load64_neon(
+    const uint32_t input0[], const uint32_t input1[], size_t index)
+{
+    int64x2_t value = vdupq_n_s64(field64(input0, index));
+    return vcvtq_f64_s64(vsetq_lane_s64(field64(input1, index), value, 1));
+}
+
+
+/* Converts two samples starting at input, one field at a time. */
+static inline void convert_pair_neon(
+    const struct scaled_layout *layout, const uint32_t input0[],
+    double *output[2])
+{
+    const uint32_t *input1 = input0 + layout->raw_sample_words;
+
+    const struct scaled_group *scaled32 = &layout->scaled32;
+    for (size_t i = 0; i < scaled32->count; i ++)
+    {
+        size_t index = scaled32->index + i;
+        int32x2_t value = vset_lane_s32(field32(input1, index),
+            vdup_n_s32(field32(input0, index)), 1);
+        store_neon(output, i,
+            scale_neon(scaled32, i, vcvtq_f64_s64(vmovl_s32(value))));
+    }
+    size_t out = scaled32->count;
+
+    const struct scaled_group *scaled64 = &layout->scaled64;
+    for (size_t i = 0; i < scaled64->count; i ++)
+    {
+        float64x2_t value =
+            load64_neon(input0, input1, scaled64->index + 2 * i);
+        store_neon(output, out + i, scale_neon(scaled64, i, value));
+    }
+    out += scaled64->count;
+
+    const struct scaled_group *averaged = &layout->averaged;
+    if (averaged->count > 0)
+    {
+        float64x2_t counts = vsetq_lane_f64(averaging_count(layout, input1),
+            vdupq_n_f64(averaging_count(layout, input0)), 1);
+        float64x2_t reciprocals = vdivq_f64(vdupq_n_f64(1.0), counts);
+        for (size_t i = 0; i < averaged->count; i ++)
+        {
+            float64x2_t value =
+                load64_neon(input0, input1, averaged->index + 2 * i);
+            float64x2_t scaled = vmulq_f64(
+                vmulq_f64(vdupq_n_f64(averaged->scale[i]), value),
+                reciprocals);
+            store_neon(output, out + i,
+                vaddq_f64(scaled, vdupq_n_f64(averaged->offset[i])));
+        }
+    }
+}
+
+
+static unsigned int convert_neon(
+    const struct scaled_layout *layout, unsigned int first,
+    unsigned int sample_count, const uint32_t input[], void *output)
+{
+    unsigned int s = first;
+    for (; s + 2 <= sample_count; s += 2)
+    {
+        double *values[2] = {
+            output_values(layout, output, s),
+            output_values(layout, output, s + 1),
+        };
+        convert_pair_neon(
+            layout, &input[s * layout->raw_sample_words], values);
+    }
+    return s;
+}
+
+#endif
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#if defined(SCALING_SSE2)
+static AVX2 void convert_scaled_avx2(
+    const struct scaled_layout *layout,
+    unsigned int sample_count, const uint32_t input[], void *output)
+{
+    convert_scalar(layout,
+        convert_sse2(layout,
+            convert_avx2(layout, 0, sample_count, input, output),
+            sample_count, input, output),
+        sample_count, input, output);
+}
+#endif
+
+
+void convert_scaled_samples(
+    const struct scaled_layout *layout,
+    unsigned int sample_count, const uint32_t input[], void *output)
+{
+#if defined(SCALING_SSE2)
+    if (__builtin_cpu_supports("avx2"))
+        convert_scaled_avx2(layout, sample_count, input, output);
+    else
+        convert_scalar(layout,
+            convert_sse2(layout, 0, sample_count, input, output),
+            sample_count, input, output);
+#elif defined(SCALING_NEON)
+    convert_scalar(layout,
+        convert_neon(layout, 0, sample_count, input, output),
+        sample_count, input, output);
+#else
+    convert_scalar(layout, 0, sample_count, input, output);
+#endif
+}
+
+
+const char *scaling_kernel_name(void)
+{
+#if defined(SCALING_SSE2)
+    return __builtin_cpu_supports("avx2") ? "AVX2" : "SSE2";
+#elif defined(SCALING_NEON)
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,34 @@
+/* Vectorised conversion of scaled capture fields. */
+
+/* Describes where the scaled fields are found in a raw sample and where the
+ * converted values are written in an output sample.  Field indexes are in
+ * 32-bit words, counts are in fields.  The scale and offset constants for each
+ * group are held in separate arrays so that they can be loaded directly into
+ * vector registers. */
+struct scaled_layout {
+    size_t raw_sample_words;    // Input sample length in 32-bit words
+    size_t output_length;       // Output sample length in bytes
+    size_t output_offset;       // Offset in output sample of scaled values
+    size_t sample_count_index;  // Word index of sample count for averaging
+
+    struct scaled_group {
+        size_t index;           // Word index of first field
+        size_t count;           // Number of fields in this group
+        const double *scale;    // Scaling for each field
+        const double *offset;   // Offset for each field
+    } scaled32, scaled64, averaged;
+};
+
+
+/* Converts sample_count samples of scaled fields, writing scaled32, scaled64
+ * and averaged values as consecutive doubles at output_offset in each output
+ * sample.  Averaged values are multiplied by a reciprocal of the sample count
+ * computed once per sample, so will differ from true division by at most a
+ * couple of units in the last place.  Output words before output_offset are not
+ * touched. */
+void convert_scaled_samples(
+    const struct scaled_layout *layout,
+    unsigned int sample_count, const uint32_t input[], void *output);
+
+/* Returns the name of the conversion kernel which will be used. */
+const char *scaling_kernel_name(void);
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <signal.h>
 #include <ctype.h>
+#include <sched.h>
 
 #include "error.h"
 #include "hardware.h"
@@ -27,6 +28,7 @@
 #include "metadata.h"
 #include "extension.h"
 #include "mac_address.h"
+#include "worker_pool.h"
 
 
 static unsigned int config_port = 8888;
@@ -43,6 +45,27 @@ static unsigned int persistence_poll = 20;
 static unsigned int persistence_holdoff = 30;
 static unsigned int persistence_backoff = 60;
 
+/* Capture buffer geometry.  The default block size matches the driver block
+ * size, and we choose a reasonably large number of 2MB blocks. */
+static unsigned int buffer_block_size = 1U << 21;
+static unsigned int buffer_block_count = 128;
+static bool lock_buffer = false;
+
+/* CPUs for socket session threads, by default CPU1 to keep them away from the
+ * data capture thread. */
+static cpu_set_t session_cpus;
+
+/* Optional pool of data conversion workers, optionally restricted to a set of
+ * CPUs. */
+static unsigned int conversion_workers = 0;
+static cpu_set_t worker_cpus;
+static bool worker_cpus_set = false;
+static struct worker_pool *conversion_pool;
+
+/* Data streams for data clients are processed by one worker for each session
+ * CPU. */
+static struct worker_pool *stream_pool;
+
 /* Option for loading MAC addresses at startup. */
 static const char *mac_address_filename = NULL;
 
@@ -75,6 +98,33 @@ static error__t parse_persistence_times(const char *arg)
         parse_eos(&arg);
 }
 
+/* Parses capture buffer geometry in the form block_size:block_count. */
+static error__t parse_buffer_option(const char *arg)
+{
+    return
+        parse_buffer_size(&arg, &buffer_block_size, &buffer_block_count)  ?:
+        parse_eos(&arg);
+}
+
+/* Parses list of CPUs for session threads. */
+static error__t parse_session_cpus(const char *arg)
+{
+    return
+        parse_cpu_list(&arg, &session_cpus)  ?:
+        parse_eos(&arg);
+}
+
+/* Parses conversion worker configuration in the form count[:cpus]. */
+static error__t parse_workers_option(const char *arg)
+{
+    return
+        parse_uint(&arg, &conversion_workers)  ?:
+        IF(read_char(&arg, ':'),
+            parse_cpu_list(&arg, &worker_cpus)  ?:
+            DO(worker_cpus_set = true))  ?:
+        parse_eos(&arg);
+}
+
 /* Parses unsigned integer. */
 static error__t parse_port(const char *arg, unsigned int *port)
 {
@@ -105,7 +155,12 @@ static void usage(const char *argv0)
 "   -M: Load MAC addresses from specified file\n"
 "   -X: Use extension server on specified port\n"
 "   -r: Specify rootfs version to report via *IDN? command\n"
-        , argv0, config_port, data_port);
+"   -b: Specify capture buffer as block_size:block_count (default %u:%u)\n"
+"   -L  Lock capture buffer into memory\n"
+"   -A: Specify CPUs for client session threads (default 1)\n"
+"   -W: Specify count[:cpus] data conversion workers, optionally given CPUs\n"
+        , argv0, config_port, data_port,
+        buffer_block_size, buffer_block_count);
 }
 
 
@@ -115,7 +170,7 @@ static error__t process_options(int argc, char *const argv[])
     error__t error = ERROR_OK;
     while (!error)
     {
-        switch (getopt(argc, argv, "+hp:d:Rc:f:t:DP:TM:X:r:"))
+        switch (getopt(argc, argv, "+hp:d:Rc:f:t:DP:TM:X:r:b:LA:W:"))
         {
             case 'h':   usage(argv0);                                   exit(0);
             case 'p':   error = parse_port(optarg, &config_port);       break;
@@ -130,6 +185,10 @@ static error__t process_options(int argc, char *const argv[])
             case 'M':   mac_address_filename = optarg;                  break;
             case 'X':   error = parse_port(optarg, &extension_port);    break;
             case 'r':   rootfs_version = optarg;                        break;
+            case 'b':   error = parse_buffer_option(optarg);            break;
+            case 'L':   lock_buffer = true;                             break;
+            case 'A':   error = parse_session_cpus(optarg);             break;
+            case 'W':   error = parse_workers_option(optarg);           break;
             default:
                 return FAIL_("Try `%s -h` for usage", argv0);
             case -1:
@@ -216,6 +275,8 @@ int main(int argc, char *const argv[])
         "Starting %s server version %s built %s",
         server_name, server_version, server_build_date);
     initialise_base64();
+    CPU_ZERO(&session_cpus);
+    CPU_SET(1, &session_cpus);
 
     error__t error =
         process_options(argc, argv)  ?:
@@ -238,8 +299,10 @@ int main(int argc, char *const argv[])
                 persistence_poll, persistence_holdoff, persistence_backoff))  ?:
         IF(mac_address_filename,
             load_mac_address_file(mac_address_filename))  ?:
-        initialise_data_server()  ?:
-        initialise_socket_server(config_port, data_port, reuse_addr)  ?:
+        initialise_data_server(
+            buffer_block_size, buffer_block_count, lock_buffer)  ?:
+        initialise_socket_server(
+            config_port, data_port, reuse_addr, &session_cpus)  ?:
 
         maybe_daemonise();
 
@@ -251,6 +314,14 @@ int main(int argc, char *const argv[])
         error =
             IF(persistence_file, start_persistence())  ?:
             start_data_server()  ?:
+            create_worker_pool(
+                (unsigned int) CPU_COUNT(&session_cpus), &session_cpus,
+                &stream_pool)  ?:
+            DO(set_stream_pool(stream_pool))  ?:
+            IF(conversion_workers > 0,
+                create_worker_pool(conversion_workers,
+                    worker_cpus_set ? &worker_cpus : NULL, &conversion_pool)  ?:
+                DO(set_conversion_pool(conversion_pool)))  ?:
             run_socket_server();
         ERROR_REPORT(error, "Server shutting down");
     }
@@ -262,6 +333,10 @@ int main(int argc, char *const argv[])
      * to cope with being called even if it was never initialised. */
     terminate_data_server_early();
     terminate_socket_server();
+    if (conversion_pool)
+        destroy_worker_pool(conversion_pool);
+    if (stream_pool)
+        destroy_worker_pool(stream_pool);
     terminate_extension_server();
     terminate_persistence();
 
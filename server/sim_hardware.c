@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
@@ -12,11 +13,15 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "error.h"
 #include "socket_server.h"
 #include "locking.h"
+#include "list.h"
 #include "hardware.h"
 
 #include "sim_hardware.h"
@@ -25,13 +30,56 @@
 #define SERVER_PORT     9999
 
 
+/* The simulation protocol consists of commands each starting with a four byte
+ * header (command, block base, block number, register) followed by arguments.
+ * Version 0 of the protocol consists of the following commands, each of which
+ * is completed before the next command is sent:
+ *
+ *  R   Read register, returns the uint32_t register value.
+ *  W   uint32_t value: writes register, no response.
+ *  T   uint32_t count, count words: writes long table, no response.
+ *  D   uint32_t length: reads data stream, returns int32_t length (or -1 for
+ *      end of data) followed by length bytes of data.
+ *
+ * Servers supporting version 1 of the protocol return their version number on
+ * reading the register VERSION_REGISTER in block VERSION_REGISTER number
+ * VERSION_REGISTER, older servers return 0 for this register.  Version 1 adds
+ * two commands:
+ *
+ *  M   uint32_t count, count register addresses each of four bytes (block
+ *      base, block number, register, 0): reads all registers in a single
+ *      exchange, returns count uint32_t values.
+ *  Q   uint32_t id, R M or D command: tagged request.  The response is the
+ *      uint32_t id, an int32_t length, and length bytes of response; for D a
+ *      length of -1 marks the end of data.
+ *
+ * When using version 1 every command expecting a response is sent as a tagged
+ * request.  Responses are returned in order and are collected by a separate
+ * thread so that requests from several threads can be in flight together.
+ *
+ * Version 2 adds one further command:
+ *
+ *  N   uint32_t count, count register addresses (as for M) each followed by a
+ *      uint32_t value: writes all registers in order, no response. */
+#define PROTOCOL_VERSION    2
+#define VERSION_REGISTER    255
+
+/* Time to wait for a response before declaring the server dead, and interval
+ * between checks while waiting. */
+#define RESPONSE_TIMEOUT    1       // Seconds
+#define POLL_INTERVAL       100     // Milliseconds
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Support functions. */
 
 static int sock = -1;
 static bool socket_ok = true;
+static unsigned int protocol_version = 0;
 
-/* Need to make sure our communications are atomic. */
+/* Need to make sure our communications are atomic.  For protocol version 0
+ * this mutex covers the complete exchange, for version 1 it only covers
+ * sending commands. */
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
@@ -67,17 +115,24 @@ static error__t read_all(void *data, size_t length)
 }
 
 
-static error__t write_command(
-    char command,
+/* Formats four byte command header, returns length of header. */
+static size_t format_command(
+    unsigned char string[4], char command,
     unsigned int block_base, unsigned int block_number, unsigned int reg)
 {
-    unsigned char string[4] = {
-        (unsigned char) command,
-        (unsigned char) block_base,
-        (unsigned char) block_number,
-        (unsigned char) reg
-    };
-    return write_all(string, sizeof(string));
+    string[0] = (unsigned char) command;
+    string[1] = (unsigned char) block_base;
+    string[2] = (unsigned char) block_number;
+    string[3] = (unsigned char) reg;
+    return 4;
+}
+
+
+/* Formats integer argument, returns length of argument. */
+static size_t format_int(unsigned char string[4], uint32_t arg)
+{
+    memcpy(string, &arg, sizeof(arg));
+    return 4;
 }
 
 
@@ -86,14 +141,11 @@ static error__t write_command_int(
     unsigned int block_base, unsigned int block_number, unsigned int reg,
     uint32_t arg)
 {
-    unsigned char string[8] = {
-        (unsigned char) command,
-        (unsigned char) block_base,
-        (unsigned char) block_number,
-        (unsigned char) reg
-    };
-    *CAST_FROM_TO(unsigned char *, uint32_t *, &string[4]) = (uint32_t) arg;
-    return write_all(string, sizeof(string));
+    unsigned char string[8];
+    size_t length = format_command(
+        string, command, block_base, block_number, reg);
+    length += format_int(string + length, arg);
+    return write_all(string, length);
 }
 
 
@@ -102,8 +154,10 @@ static bool handle_error(error__t error)
     /* This flag will be reset on the first error, which will cause all
      * subsequent access attempts to silently fail. */
     static bool running = true;
+    static pthread_mutex_t error_mutex = PTHREAD_MUTEX_INITIALIZER;
     if (error)
     {
+        LOCK(error_mutex);
         socket_ok = false;
         if (running)
         {
@@ -114,11 +168,234 @@ static bool handle_error(error__t error)
         else
             /* Quietly discard subsequent error messages. */
             error_discard(error);
+        UNLOCK(error_mutex);
+    }
+    return error;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Tagged requests. */
+
+/* Each tagged request is queued until its response arrives. */
+struct request {
+    struct list_head list;
+    uint32_t id;
+    uint64_t deadline;          // Time in ns by which response is expected
+    void *result;               // Response is written here
+    size_t length;              // Maximum length of response
+    bool exact;                 // Set if response must be exactly length
+    int32_t received;           // Actual length of response
+    bool done;                  // Set when response received or failed
+    bool failed;
+};
+
+static pthread_mutex_t request_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_event;
+static LIST_HEAD(request_queue);
+static uint32_t next_request_id = 0;
+
+/* The response thread runs until the connection fails or is shut down. */
+static pthread_t response_thread_id;
+static bool response_thread_running = false;
+static bool terminating = false;
+
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * NSECS + (uint64_t) now.tv_nsec;
+}
+
+
+/* Returns the oldest outstanding request, or NULL if there is none.  Must be
+ * called with the request_mutex held. */
+static struct request *first_request(void)
+{
+    if (list_is_empty(&request_queue))
+        return NULL;
+    else
+        return container_of(request_queue.next, struct request, list);
+}
+
+
+/* Waits for the next response to arrive.  While we wait we check whether the
+ * oldest outstanding request has been waiting for too long. */
+static error__t wait_response(void)
+{
+    struct pollfd pollfd = { .fd = sock, .events = POLLIN, };
+    int ready = 0;
+    error__t error = ERROR_OK;
+    while (!error  &&  ready == 0)
+    {
+        error = TEST_IO(ready = poll(&pollfd, 1, POLL_INTERVAL));
+        if (!error  &&  ready == 0)
+        {
+            LOCK(request_mutex);
+            struct request *request = first_request();
+            bool overdue = request  &&  get_time_ns() > request->deadline;
+            UNLOCK(request_mutex);
+            error = TEST_OK_(!overdue, "Simulation server not responding");
+        }
     }
     return error;
 }
 
 
+/* Reads one response and completes the matching request.  The response payload
+ * is read directly into the waiting caller's buffer; this is safe because the
+ * request stays queued until we mark it done. */
+static error__t read_response(void)
+{
+    struct { uint32_t id; int32_t length; } response;
+    struct request *request = NULL;
+    return
+        wait_response()  ?:
+        read_all(&response, sizeof(response))  ?:
+        DO(
+            LOCK(request_mutex);
+            request = first_request();
+            UNLOCK(request_mutex))  ?:
+        TEST_OK_(request  &&  request->id == response.id,
+            "Unexpected response %u", response.id)  ?:
+        TEST_OK_(!request->exact  ||
+                (size_t) response.length == request->length,
+            "Unexpected response length")  ?:
+        IF(response.length > 0,
+            TEST_OK_((size_t) response.length <= request->length,
+                "Response too long")  ?:
+            read_all(request->result, (size_t) response.length))  ?:
+        DO(
+            LOCK(request_mutex);
+            list_del(&request->list);
+            request->received = response.length;
+            request->done = true;
+            BROADCAST(request_event);
+            UNLOCK(request_mutex));
+}
+
+
+static void *response_thread(void *context)
+{
+    error__t error = ERROR_OK;
+    while (!error)
+        error = read_response();
+    if (terminating)
+        error_discard(error);
+    else
+        handle_error(error);
+
+    /* Fail all outstanding requests, and any new requests will fail. */
+    LOCK(request_mutex);
+    response_thread_running = false;
+    while (!list_is_empty(&request_queue))
+    {
+        struct request *request = first_request();
+        list_del(&request->list);
+        request->failed = true;
+        request->done = true;
+    }
+    BROADCAST(request_event);
+    UNLOCK(request_mutex);
+    return NULL;
+}
+
+
+/* Sends the given command as a tagged request and waits for its response.
+ * Any errors from the response thread have already been reported, so a failed
+ * request is a quiet failure. */
+static bool tagged_exchange(
+    const void *command, size_t command_length, bool data_request,
+    void *result, size_t length, int32_t *received)
+{
+    struct request request = {
+        .deadline = get_time_ns() + RESPONSE_TIMEOUT * (uint64_t) NSECS,
+        .result = result,
+        .length = length,
+        .exact = !data_request,
+    };
+    unsigned char header[8];
+
+    LOCK(mutex);
+    LOCK(request_mutex);
+    bool queued = response_thread_running;
+    if (queued)
+    {
+        request.id = next_request_id++;
+        list_add_tail(&request.list, &request_queue);
+    }
+    UNLOCK(request_mutex);
+
+    bool failed = !queued;
+    if (queued)
+    {
+        size_t header_length = format_command(header, 'Q', 0, 0, 0);
+        header_length += format_int(header + header_length, request.id);
+        failed = handle_error(
+            write_all(header, header_length)  ?:
+            write_all(command, command_length));
+        if (failed)
+            /* Wake the response thread so that it fails our request. */
+            shutdown(sock, SHUT_RDWR);
+    }
+    UNLOCK(mutex);
+
+    if (queued)
+    {
+        LOCK(request_mutex);
+        while (!request.done)
+            WAIT(request_mutex, request_event);
+        UNLOCK(request_mutex);
+        failed = failed  ||  request.failed;
+    }
+    *received = request.received;
+    return failed;
+}
+
+
+/* Sends command and reads the response.  For data requests the response is
+ * prefixed by its length, otherwise exactly length bytes are expected.  Returns
+ * true if the exchange failed, with the error already reported. */
+static bool exchange(
+    const void *command, size_t command_length, bool data_request,
+    void *result, size_t length, int32_t *received)
+{
+    if (protocol_version > 0)
+        return tagged_exchange(
+            command, command_length, data_request, result, length, received);
+    else
+    {
+        *received = (int32_t) length;
+        LOCK(mutex);
+        bool failed = handle_error(
+            write_all(command, command_length)  ?:
+            IF_ELSE(data_request,
+                read_all(received, sizeof(*received))  ?:
+                IF(*received > 0,
+                    TEST_OK((size_t) *received <= length)  ?:
+                    read_all(result, (size_t) *received)),
+            // else
+                read_all(result, length)));
+        UNLOCK(mutex);
+        return failed;
+    }
+}
+
+
+/* Reads a single register, returns true if the read failed. */
+static bool read_one_register(
+    unsigned int block_base, unsigned int block_number, unsigned int reg,
+    uint32_t *result)
+{
+    unsigned char command[4];
+    size_t length = format_command(
+        command, 'R', block_base, block_number, reg);
+    int32_t received;
+    return exchange(command, length, false, result, 4, &received);
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Hardware simulation methods. */
 
@@ -137,31 +414,82 @@ void hw_write_register(
 uint32_t hw_read_register(
     unsigned int block_base, unsigned int block_number, unsigned int reg)
 {
-    LOCK(mutex);
     uint32_t result = 0;
-    handle_error(
-        write_command('R', block_base, block_number, reg)  ?:
-        read_all(&result, 4));
-    UNLOCK(mutex);
-
+    read_one_register(block_base, block_number, reg, &result);
     return result;
 }
 
 
+void hw_read_registers(
+    const struct hw_register registers[], unsigned int count,
+    uint32_t values[])
+{
+    if (protocol_version > 0)
+    {
+        unsigned char command[8 + 4 * count];
+        size_t length = format_command(command, 'M', 0, 0, 0);
+        length += format_int(command + length, count);
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            const struct hw_register *reg = &registers[i];
+            length += format_command(command + length,
+                (char) reg->block_base, reg->block_number, reg->reg, 0);
+        }
+
+        int32_t received;
+        if (exchange(command, length, false,
+                values, sizeof(uint32_t) * count, &received))
+            memset(values, 0, sizeof(uint32_t) * count);
+    }
+    else
+        for (unsigned int i = 0; i < count; i ++)
+            values[i] = hw_read_register(
+                registers[i].block_base, registers[i].block_number,
+                registers[i].reg);
+}
+
+
+void hw_write_registers(
+    const struct hw_register registers[], unsigned int count,
+    const uint32_t values[])
+{
+    if (protocol_version > 1)
+    {
+        unsigned char command[8 + 8 * count];
+        size_t length = format_command(command, 'N', 0, 0, 0);
+        length += format_int(command + length, count);
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            const struct hw_register *reg = &registers[i];
+            length += format_command(command + length,
+                (char) reg->block_base, reg->block_number, reg->reg, 0);
+            length += format_int(command + length, values[i]);
+        }
+
+        LOCK(mutex);
+        handle_error(write_all(command, length));
+        UNLOCK(mutex);
+    }
+    else
+        for (unsigned int i = 0; i < count; i ++)
+            hw_write_register(
+                registers[i].block_base, registers[i].block_number,
+                registers[i].reg, values[i]);
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Data streaming. */
 
-size_t hw_read_streamed_data(void *buffer, size_t length, bool *data_end)
+size_t sim_read_streamed_data(void *buffer, size_t length, bool *data_end)
 {
+    unsigned char command[8];
+    size_t command_length = format_command(command, 'D', 0, 0, 0);
+    command_length += format_int(command + command_length, (uint32_t) length);
+
     int32_t result = -1;
-    LOCK(mutex);
-    bool failed = handle_error(
-        write_command_int('D', 0, 0, 0, (uint32_t) length)  ?:
-        read_all(&result, 4)  ?:
-        IF(result > 0,
-            TEST_OK((size_t) result <= length)  ?:
-            read_all(buffer, (size_t) result)));
-    UNLOCK(mutex);
+    bool failed = exchange(
+        command, command_length, true, buffer, length, &result);
 
     if (failed  ||  result < 0)
     {
@@ -180,8 +508,8 @@ size_t hw_read_streamed_data(void *buffer, size_t length, bool *data_end)
 }
 
 
-void hw_write_arm_streamed_data(void) { }
-uint32_t hw_read_streamed_completion(void) { return 0; }
+void sim_write_arm_streamed_data(void) { }
+unsigned int sim_read_streamed_completion(void) { return 0; }
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -253,6 +581,31 @@ void hw_long_table_write(
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Initialisation. */
 
+/* Asks the server for its protocol version and starts the response thread if
+ * tagged requests are supported. */
+static error__t negotiate_protocol(void)
+{
+    unsigned char command[4];
+    size_t length = format_command(command, 'R',
+        VERSION_REGISTER, VERSION_REGISTER, VERSION_REGISTER);
+    uint32_t version = 0;
+    error__t error =
+        write_all(command, length)  ?:
+        read_all(&version, sizeof(version));
+    if (!error  &&  version > 0)
+    {
+        protocol_version = MIN(version, (uint32_t) PROTOCOL_VERSION);
+        pwait_initialise(&request_event);
+        response_thread_running = true;
+        error = TEST_PTHREAD(pthread_create(
+            &response_thread_id, NULL, response_thread, NULL));
+        if (error)
+            response_thread_running = false;
+    }
+    return error;
+}
+
+
 error__t initialise_hardware(void)
 {
     struct sockaddr_in s_in = {
@@ -266,13 +619,22 @@ error__t initialise_hardware(void)
         TEST_IO_(connect(sock, (struct sockaddr *) &s_in, sizeof(s_in)),
             "Unable to connect to simulation server")  ?:
         set_timeout(sock, SO_SNDTIMEO, 1)  ?:
-        set_timeout(sock, SO_RCVTIMEO, 1)  ?:
-        TEST_IO(setsockopt(sock, SOL_TCP, TCP_NODELAY, &one, sizeof(one)));
+        set_timeout(sock, SO_RCVTIMEO, RESPONSE_TIMEOUT)  ?:
+        TEST_IO(setsockopt(sock, SOL_TCP, TCP_NODELAY, &one, sizeof(one)))  ?:
+        negotiate_protocol();
 }
 
 
 void terminate_hardware(void)
 {
     if (sock >= 0)
+    {
+        if (response_thread_running)
+        {
+            terminating = true;
+            shutdown(sock, SHUT_RDWR);
+            pthread_join(response_thread_id, NULL);
+        }
         close(sock);
+    }
 }
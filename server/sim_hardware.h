@@ -1,5 +1,12 @@
 /* Hardware simulation support. */
 
+/* Streamed data from the simulated hardware.  These implement the corresponding
+ * hw_..._streamed_... functions in hardware.h unless a recording is being
+ * replayed. */
+size_t sim_read_streamed_data(void *buffer, size_t length, bool *data_end);
+void sim_write_arm_streamed_data(void);
+unsigned int sim_read_streamed_completion(void);
+
 /* Special support for long tables. */
 
 /* Allocates a block of physically mappable memory of the specified size. */
@@ -12,6 +12,7 @@
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sched.h>
 #include <pthread.h>
 
 #include "error.h"
@@ -37,14 +38,24 @@
 struct listen_socket {
     int sock;                   // Listening socket
     const char *name;           // Config or Data, for logging
-    error__t (*process)(int sock); // Function for processing socket session
+    /* Connections are either processed by a dedicated session thread calling
+     * process(), or are handed over with add() and closed() is called when the
+     * connection has finished. */
+    error__t (*process)(int sock);
+    error__t (*add)(
+        int sock, void (*closed)(void *context, error__t error), void *context);
 };
 
+/* Session threads are restricted to these CPUs so that they run on different
+ * CPUs to the data capture thread. */
+static cpu_set_t session_cpus;
+static bool session_cpus_set;
+
 /* Listening sockets for configuration and data connections. */
 static struct listen_socket config_socket = {
     .sock = -1, .name = "config", .process = process_config_socket };
 static struct listen_socket data_socket = {
-    .sock = -1, .name = "data",   .process = process_data_socket };
+    .sock = -1, .name = "data",   .add = add_data_connection };
 
 
 
@@ -57,7 +68,7 @@ struct session {
     const struct listen_socket *parent;   // Parent structure
     int sock;                       // Socket for connection
     pthread_t thread;               // Thread id of connection thread
-    char name[64];                  // Name of connected client
+    char name[CLIENT_NAME_LENGTH];  // Name of connected client
 
     /* We may need to hang onto a session instance longer than its natural
      * lifetime while generating usage reports, this reference count is used to
@@ -159,7 +170,9 @@ static void join_sessions(struct list_head *list)
     while (entry != &work_list)
     {
         struct session *session = container_of(entry, struct session, list);
-        error_report(TEST_PTHREAD(pthread_join(session->thread, NULL)));
+        /* Only sessions with their own thread need joining. */
+        if (session->parent->process)
+            error_report(TEST_PTHREAD(pthread_join(session->thread, NULL)));
         entry = entry->next;
         destroy_session(session);
     }
@@ -247,8 +260,7 @@ void kill_socket_server(void)
 }
 
 
-/* Converts connected socket to a printable identification string. */
-static error__t get_client_name(int sock, char client_name[])
+error__t get_client_name(int sock, char client_name[])
 {
     struct sockaddr_in name;
     socklen_t namelen = sizeof(name);
@@ -274,46 +286,68 @@ error__t set_timeout(int sock, int timeout, int seconds)
 }
 
 
-static void *session_thread(void *context)
+error__t set_session_affinity(void)
 {
-    struct session *session = context;
-
-    log_message("Client %s %s connected", session->parent->name, session->name);
+    return IF(session_cpus_set,
+        TEST_PTHREAD(pthread_setaffinity_np(
+            pthread_self(), sizeof(cpu_set_t), &session_cpus)));
+}
 
-    error__t error = session->parent->process(session->sock);
 
+static void end_session(void *context, error__t error)
+{
+    struct session *session = context;
     if (error)
         ERROR_REPORT(error, "Client %s %s raised error",
             session->parent->name, session->name);
     log_message("Client %s %s closed", session->parent->name, session->name);
 
     close_session(session);
+}
+
+
+static void *session_thread(void *context)
+{
+    struct session *session = context;
+
+    log_message("Client %s %s connected", session->parent->name, session->name);
+
+    end_session(session, session->parent->process(session->sock));
     return NULL;
 }
 
 
+/* Starts a thread to process a new session, or hands the session over. */
+static error__t start_session(struct session *session)
+{
+    const struct listen_socket *parent = session->parent;
+    return IF_ELSE(parent->process,
+        /* Set the transmit timeout so that the server won't be stuck if the
+         * client stops accepting data. */
+        set_timeout(session->sock, SO_SNDTIMEO, TRANSMIT_TIMEOUT)  ?:
+        TEST_PTHREAD(pthread_create(
+            &session->thread, NULL, session_thread, session)) ?:
+        TEST_PTHREAD(pthread_setaffinity_np(
+            session->thread, sizeof(cpu_set_t), &session_cpus)),
+    //else
+        DO(log_message("Client %s %s connected",
+            parent->name, session->name))  ?:
+        /* Note that the session may be closed as soon as it is added. */
+        parent->add(session->sock, end_session, session));
+}
+
+
 static error__t process_session(const struct listen_socket *listen_socket)
 {
     struct session *session = create_session();
     session->parent = listen_socket;
-    /* Pin this thread to CPU1, so it is on a different CPU to data capture
-     * thread */
-    cpu_set_t cpu_set;
-    CPU_ZERO(&cpu_set);
-    CPU_SET(1, &cpu_set);
     return
         TRY_CATCH(
             TEST_IO_(session->sock = accept(listen_socket->sock, NULL, NULL),
                 "Socket accept failed")  ?:
             TRY_CATCH(
-                /* Set the transmit timeout so that the server won't be stuck if
-                 * the client stops accepting data. */
-                set_timeout(session->sock, SO_SNDTIMEO, TRANSMIT_TIMEOUT)  ?:
                 get_client_name(session->sock, session->name)  ?:
-                TEST_PTHREAD(pthread_create(
-                    &session->thread, NULL, session_thread, session)) ?:
-                TEST_PTHREAD(pthread_setaffinity_np(
-                    session->thread, sizeof(cpu_set_t), &cpu_set)),
+                start_session(session),
 
             //catch
                 /* If thread session fails we have to close the socket. */
@@ -393,8 +427,11 @@ static error__t create_and_listen(
 
 
 error__t initialise_socket_server(
-    unsigned int config_port, unsigned int data_port, bool reuse_addr)
+    unsigned int config_port, unsigned int data_port, bool reuse_addr,
+    const cpu_set_t *cpus)
 {
+    session_cpus = *cpus;
+    session_cpus_set = true;
     return
         TEST_OK_(running, "Socket server already killed!")  ?:
         create_and_listen(&config_socket, config_port, reuse_addr)  ?:
@@ -3,9 +3,15 @@
 struct config_connection;
 struct connection_result;
 
-/* Initialises the socket server but doesn't run the server yet. */
+/* Initialises the socket server but doesn't run the server yet.  Session
+ * threads will run on the given CPUs.  Requires <sched.h>. */
 error__t initialise_socket_server(
-    unsigned int config_port, unsigned int data_port, bool reuse_addr);
+    unsigned int config_port, unsigned int data_port, bool reuse_addr,
+    const cpu_set_t *cpus);
+
+/* Restricts the calling thread to the session CPUs, if the socket server has
+ * been initialised. */
+error__t set_session_affinity(void);
 
 /* Ensures all connections are terminated and releases any resources. */
 void terminate_socket_server(void);
@@ -19,6 +25,12 @@ error__t run_socket_server(void);
  * been called.  Note that this function is signal safe. */
 void kill_socket_server(void);
 
+/* Maximum length of a client name returned by get_client_name(). */
+#define CLIENT_NAME_LENGTH  64
+
+/* Converts connected socket to a printable identification string. */
+error__t get_client_name(int sock, char client_name[]);
+
 /* Sets socket timeout. */
 error__t set_timeout(int sock, int timeout, int seconds);
 
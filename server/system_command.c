@@ -10,6 +10,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <sched.h>
 
 #include "error.h"
 #include "hashtable.h"
@@ -18,6 +19,8 @@
 #include "socket_server.h"
 #include "config_server.h"
 #include "data_server.h"
+#include "recorder.h"
+#include "replay.h"
 #include "config_command.h"
 #include "prepare.h"
 #include "attributes.h"
@@ -367,22 +370,43 @@ static error__t get_enums(const char *command, struct connection_result *result)
  *
  * *PCAP.ARM=
  * *PCAP.DISARM=
+ * *PCAP.BUFFER=block_size:block_count
+ * *PCAP.RECORD=directory
+ * *PCAP.REPLAY=stem
+ * *PCAP.REPLAY_SPEED=speed
  * *PCAP.STATUS?
  * *PCAP.CAPTURED?
  * *PCAP.COMPLETION?
+ * *PCAP.BUFFER?
+ * *PCAP.CACHE?
+ * *PCAP.RECORD?
+ * *PCAP.RECORD_STATUS?
+ * *PCAP.REPLAY?
+ * *PCAP.REPLAY_SPEED?
+ * *PCAP.STATS?
+ * *PCAP.LATENCY?
  *
  * Manages and interrogates capture interface. */
 
-static error__t lookup_pcap_put_action(const char *name)
+static error__t lookup_pcap_put_action(const char *name, const char *value)
 {
     return
         IF_ELSE(strcmp(name, "ARM") == 0,
-            arm_capture(),
+            parse_eos(&value)  ?:  arm_capture(),
         //else
         IF_ELSE(strcmp(name, "DISARM") == 0,
-            disarm_capture(),
+            parse_eos(&value)  ?:  disarm_capture(),
         //else
-            FAIL_("Invalid *PCAP field")));
+        IF_ELSE(strcmp(name, "BUFFER") == 0,
+            set_capture_buffer(value),
+        IF_ELSE(strcmp(name, "RECORD") == 0,
+            set_record_directory(value),
+        IF_ELSE(strcmp(name, "REPLAY") == 0,
+            set_replay_file(value),
+        IF_ELSE(strcmp(name, "REPLAY_SPEED") == 0,
+            set_replay_speed(value),
+        //else
+            FAIL_("Invalid *PCAP field")))))));
 }
 
 static error__t put_pcap(
@@ -393,9 +417,8 @@ static error__t put_pcap(
     return
         parse_char(&command, '.')  ?:
         parse_name(&command, action_name, sizeof(action_name))  ?:
-        parse_eos(&value)  ?:
 
-        lookup_pcap_put_action(action_name);
+        lookup_pcap_put_action(action_name, value);
 }
 
 
@@ -409,8 +432,24 @@ static error__t lookup_pcap_get_action(
             get_capture_count(result),
         IF_ELSE(strcmp(name, "COMPLETION") == 0,
             get_capture_completion(result),
+        IF_ELSE(strcmp(name, "BUFFER") == 0,
+            get_capture_buffer(result),
+        IF_ELSE(strcmp(name, "CACHE") == 0,
+            get_capture_cache(result),
+        IF_ELSE(strcmp(name, "RECORD") == 0,
+            get_record_directory(result),
+        IF_ELSE(strcmp(name, "RECORD_STATUS") == 0,
+            get_record_status(result),
+        IF_ELSE(strcmp(name, "REPLAY") == 0,
+            get_replay_file(result),
+        IF_ELSE(strcmp(name, "REPLAY_SPEED") == 0,
+            get_replay_speed(result),
+        IF_ELSE(strcmp(name, "STATS") == 0,
+            get_capture_stats(result),
+        IF_ELSE(strcmp(name, "LATENCY") == 0,
+            get_capture_latency(result),
         //else
-            FAIL_("Invalid *PCAP field"))));
+            FAIL_("Invalid *PCAP field"))))))))))));
 }
 
 static error__t get_pcap(const char *command, struct connection_result *result)
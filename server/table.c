@@ -18,6 +18,7 @@
 #include "fields.h"
 #include "enums.h"
 #include "base64.h"
+#include "number_format.h"
 #include "locking.h"
 #include "hashtable.h"
 
@@ -273,7 +274,10 @@ static error__t write_ascii(
     struct table_block *block, struct connection_result *result)
 {
     for (unsigned int i = 0; i < block->length; i ++)
-        format_many_result(result, "%u", block->data[i]);
+    {
+        *format_uint32(result->string, block->data[i]) = '\0';
+        result->write_many(result->write_context, result->string);
+    }
     return ERROR_OK;
 }
 
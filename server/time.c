@@ -146,12 +146,12 @@ static error__t write_time_value(
     if (!error)
     {
         LOCK(state->mutex);
-        hw_write_register(
-            state->block_base, number, state->low_register,
-            (uint32_t) value);
-        hw_write_register(
-            state->block_base, number, state->high_register,
-            (uint32_t) (value >> 32));
+        struct hw_register registers[] = {
+            { state->block_base, number, state->low_register, },
+            { state->block_base, number, state->high_register, },
+        };
+        uint32_t values[] = { (uint32_t) value, (uint32_t) (value >> 32), };
+        hw_write_registers(registers, ARRAY_SIZE(registers), values);
 
         struct time_field *field = &state->values[number];
         field->value = value;
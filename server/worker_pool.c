@@ -0,0 +1,222 @@
+/* Pool of worker threads for parallel data conversion. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "parse.h"
+#include "locking.h"
+#include "list.h"
+
+#include "worker_pool.h"
+
+
+/* Each call to run_worker_jobs() queues a batch of jobs, which lives on the
+ * caller's stack until all its jobs are complete. */
+struct worker_batch {
+    struct list_head list;          // Entry on pool queue while jobs remain
+    void (*job)(void *context, unsigned int index);
+    void *context;
+    unsigned int job_count;         // Number of jobs in this batch
+    unsigned int next_job;          // Index of next job to start
+    unsigned int completed;         // Number of jobs completed
+};
+
+/* Each call to queue_worker_job() queues a single job which the caller doesn't
+ * wait for. */
+struct worker_task {
+    struct list_head list;          // Entry on pool queue until started
+    void (*job)(void *context);
+    void *context;
+};
+
+struct worker_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t work_signal;     // Signalled when new jobs are available
+    pthread_cond_t done_signal;     // Signalled when any batch completes
+
+    /* Batches with jobs still to be started, shared round robin between the
+     * workers so that concurrent callers all make progress. */
+    struct list_head batches;
+    /* Queued jobs, started in order.  Batches come first as their callers are
+     * waiting for them. */
+    struct list_head tasks;
+
+    bool shutdown;                  // Set to stop all workers
+    unsigned int worker_count;
+    pthread_t workers[];
+};
+
+
+error__t parse_cpu_list(const char **string, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    error__t error = ERROR_OK;
+    do {
+        unsigned int first = 0, last = 0;
+        error =
+            parse_uint(string, &first)  ?:
+            IF_ELSE(read_char(string, '-'),
+                parse_uint(string, &last),
+            // else
+                DO(last = first))  ?:
+            TEST_OK_(first <= last  &&  last < CPU_SETSIZE,
+                "Invalid CPU range")  ?:
+            DO(
+                for (unsigned int cpu = first; cpu <= last; cpu ++)
+                    CPU_SET(cpu, cpus));
+    } while (!error  &&  read_char(string, ','));
+    return error;
+}
+
+
+/* Takes the next job from the given batch and runs it.  Called with the pool
+ * lock held, and the batch must be on the queue. */
+static void run_one_job(struct worker_pool *pool, struct worker_batch *batch)
+{
+    unsigned int index = batch->next_job++;
+    /* Once all its jobs have started the batch leaves the queue, otherwise it
+     * goes to the back so that other batches get their turn. */
+    list_del(&batch->list);
+    if (batch->next_job < batch->job_count)
+        list_add_tail(&batch->list, &pool->batches);
+
+    UNLOCK(pool->mutex);
+    batch->job(batch->context, index);
+    LOCK(pool->mutex);
+
+    batch->completed += 1;
+    if (batch->completed == batch->job_count)
+        BROADCAST(pool->done_signal);
+}
+
+
+/* Takes the first queued job and runs it.  Called with the pool lock held. */
+static void run_one_task(struct worker_pool *pool)
+{
+    struct worker_task *task =
+        container_of(pool->tasks.next, struct worker_task, list);
+    list_del(&task->list);
+
+    UNLOCK(pool->mutex);
+    task->job(task->context);
+    free(task);
+    LOCK(pool->mutex);
+}
+
+
+static void *worker_thread(void *context)
+{
+    struct worker_pool *pool = context;
+    LOCK(pool->mutex);
+    while (!pool->shutdown)
+        if (!list_is_empty(&pool->batches))
+            run_one_job(pool,
+                container_of(pool->batches.next, struct worker_batch, list));
+        else if (!list_is_empty(&pool->tasks))
+            run_one_task(pool);
+        else
+            WAIT(pool->mutex, pool->work_signal);
+    UNLOCK(pool->mutex);
+    return NULL;
+}
+
+
+void run_worker_jobs(
+    struct worker_pool *pool, unsigned int job_count,
+    void (*job)(void *context, unsigned int index), void *context)
+{
+    struct worker_batch batch = {
+        .job = job,
+        .context = context,
+        .job_count = job_count,
+    };
+    if (job_count == 0)
+        return;
+
+    LOCK(pool->mutex);
+    list_add_tail(&batch.list, &pool->batches);
+    BROADCAST(pool->work_signal);
+
+    /* Work through our own jobs, then wait for any still running on workers.
+     * The workers may be busy with other batches, in which case we end up
+     * doing all our own work. */
+    while (batch.next_job < batch.job_count)
+        run_one_job(pool, &batch);
+    while (batch.completed < batch.job_count)
+        WAIT(pool->mutex, pool->done_signal);
+    UNLOCK(pool->mutex);
+}
+
+
+void queue_worker_job(
+    struct worker_pool *pool, void (*job)(void *context), void *context)
+{
+    struct worker_task *task = malloc(sizeof(struct worker_task));
+    *task = (struct worker_task) { .job = job, .context = context, };
+
+    LOCK(pool->mutex);
+    list_add_tail(&task->list, &pool->tasks);
+    SIGNAL(pool->work_signal);
+    UNLOCK(pool->mutex);
+}
+
+
+unsigned int get_pool_concurrency(const struct worker_pool *pool)
+{
+    return pool->worker_count + 1;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+error__t create_worker_pool(
+    unsigned int worker_count, const cpu_set_t *cpus,
+    struct worker_pool **pool_)
+{
+    struct worker_pool *pool = calloc(1,
+        sizeof(struct worker_pool) + worker_count * sizeof(pthread_t));
+    pool->mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    init_list_head(&pool->batches);
+    init_list_head(&pool->tasks);
+    pwait_initialise(&pool->work_signal);
+    pwait_initialise(&pool->done_signal);
+    *pool_ = pool;
+
+    error__t error = ERROR_OK;
+    for (unsigned int i = 0; !error  &&  i < worker_count; i ++)
+    {
+        error = TEST_PTHREAD(pthread_create(
+            &pool->workers[i], NULL, worker_thread, pool));
+        if (!error)
+        {
+            pool->worker_count += 1;
+            if (cpus)
+                error = TEST_PTHREAD(pthread_setaffinity_np(
+                    pool->workers[i], sizeof(cpu_set_t), cpus));
+        }
+    }
+    return error;
+}
+
+
+void destroy_worker_pool(struct worker_pool *pool)
+{
+    LOCK(pool->mutex);
+    pool->shutdown = true;
+    BROADCAST(pool->work_signal);
+    UNLOCK(pool->mutex);
+
+    for (unsigned int i = 0; i < pool->worker_count; i ++)
+        pthread_join(pool->workers[i], NULL);
+    pthread_cond_destroy(&pool->work_signal);
+    pthread_cond_destroy(&pool->done_signal);
+    free(pool);
+}
@@ -0,0 +1,38 @@
+/* Pool of worker threads for parallel data conversion.
+ *
+ * This header requires <sched.h> for cpu_set_t. */
+
+struct worker_pool;
+
+
+/* Parses a list of CPUs in the form n[-m][,...] into cpus. */
+error__t parse_cpu_list(const char **string, cpu_set_t *cpus);
+
+
+/* Creates pool of worker_count threads.  If cpus is not NULL the workers are
+ * restricted to the given set of CPUs. */
+error__t create_worker_pool(
+    unsigned int worker_count, const cpu_set_t *cpus,
+    struct worker_pool **pool);
+
+/* Stops all workers and releases all resources. */
+void destroy_worker_pool(struct worker_pool *pool);
+
+/* Returns the number of jobs that can usefully run at once, namely the number
+ * of workers plus the calling thread. */
+unsigned int get_pool_concurrency(const struct worker_pool *pool);
+
+/* Runs job(context, index) for each index from 0 to job_count-1, sharing the
+ * jobs between the workers and the calling thread, and returns when all jobs
+ * are complete.  Jobs run in any order.  Calls from different threads run
+ * concurrently, with the workers shared between them. */
+void run_worker_jobs(
+    struct worker_pool *pool, unsigned int job_count,
+    void (*job)(void *context, unsigned int index), void *context);
+
+/* Queues job(context) to be run by the next free worker and returns without
+ * waiting for it.  Jobs may themselves call run_worker_jobs().  The pool must
+ * have at least one worker, and all queued jobs must have completed before the
+ * pool is destroyed. */
+void queue_worker_job(
+    struct worker_pool *pool, void (*job)(void *context), void *context);
@@ -0,0 +1,137 @@
+/* Golden file test for the Arrow IPC stream.  A fixed stream is generated and
+ * compared byte for byte with the golden file given on the command line, which
+ * has been checked by reading it with pyarrow.  On failure the generated
+ * stream is written to arrow_ipc_test.out for inspection. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "error.h"
+#include "buffered_file.h"
+#include "capture.h"
+#include "arrow_ipc.h"
+
+
+#define SAMPLE_COUNT    5
+#define SAMPLE_LENGTH   24
+#define FIELD_COUNT     4
+#define MAX_STREAM      4096
+
+
+static const struct arrow_key_value position_metadata[] = {
+    { "name", "INENC1.VAL" },
+    { "capture", "Value" },
+    { "type", "int32" },
+    { "scale", "0.001" },
+    { "offset", "0" },
+    { "units", "mm" },
+};
+
+static const struct arrow_key_value timestamp_metadata[] = {
+    { "name", "PCAP.TS_TRIG" },
+    { "capture", "Value" },
+    { "type", "double" },
+    { "scale", "8e-09" },
+    { "offset", "0" },
+    { "units", "s" },
+};
+
+static const struct arrow_key_value schema_metadata[] = {
+    { "missed", "0" },
+    { "process", "Scaled" },
+};
+
+static const struct arrow_field fields[FIELD_COUNT] = {
+    { "PCAP.SAMPLES.Value", FIELD_TYPE_UINT32, 0, NULL, },
+    { "INENC1.VAL.Value", FIELD_TYPE_INT32,
+      ARRAY_SIZE(position_metadata), position_metadata, },
+    { "PCAP.TS_TRIG.Value", FIELD_TYPE_DOUBLE,
+      ARRAY_SIZE(timestamp_metadata), timestamp_metadata, },
+    { "COUNTER1.OUT.Sum", FIELD_TYPE_INT64, 0, NULL, },
+};
+
+
+static void fill_samples(uint8_t *samples)
+{
+    for (unsigned int i = 0; i < SAMPLE_COUNT; i ++)
+    {
+        uint32_t count = i + 1;
+        int32_t position = -1000 * (int32_t) i;
+        double timestamp = 1e-3 * i;
+        int64_t sum = (int64_t) 1 << (32 + i);
+
+        uint8_t *sample = samples + i * SAMPLE_LENGTH;
+        memcpy(sample, &count, 4);
+        memcpy(sample + 4, &position, 4);
+        memcpy(sample + 8, &timestamp, 8);
+        memcpy(sample + 16, &sum, 8);
+    }
+}
+
+
+/* Generates the stream: schema, a batch of all samples, an empty batch, a
+ * batch of the first two samples, and the end of stream marker. */
+static size_t generate_stream(uint8_t *stream)
+{
+    static const enum field_type types[FIELD_COUNT] = {
+        FIELD_TYPE_UINT32, FIELD_TYPE_INT32,
+        FIELD_TYPE_DOUBLE, FIELD_TYPE_INT64, };
+    uint8_t samples[SAMPLE_COUNT * SAMPLE_LENGTH];
+    fill_samples(samples);
+
+    size_t length = arrow_encode_schema(
+        fields, FIELD_COUNT, schema_metadata, ARRAY_SIZE(schema_metadata),
+        stream);
+    if (length > arrow_schema_max_length(
+            fields, FIELD_COUNT, schema_metadata, ARRAY_SIZE(schema_metadata)))
+        printf("Schema length %zu exceeds maximum\n", length);
+
+    unsigned int batches[] = { SAMPLE_COUNT, 0, 2, };
+    for (unsigned int i = 0; i < ARRAY_SIZE(batches); i ++)
+    {
+        size_t batch_length = arrow_encode_record_batch(
+            types, FIELD_COUNT, batches[i], samples, stream + length);
+        if (batch_length > ARROW_BATCH_MAX_LENGTH(
+                FIELD_COUNT, batches[i], SAMPLE_LENGTH))
+            printf("Batch length %zu exceeds maximum\n", batch_length);
+        length += batch_length;
+    }
+    return length + arrow_encode_end_of_stream(stream + length);
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        printf("Usage: %s <golden file>\n", argv[0]);
+        return 1;
+    }
+
+    static uint64_t stream[MAX_STREAM / 8];
+    static uint8_t golden[MAX_STREAM];
+    size_t length = generate_stream((uint8_t *) stream);
+
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    size_t golden_length = fread(golden, 1, sizeof(golden), file);
+    fclose(file);
+
+    bool ok = golden_length == length  &&  memcmp(golden, stream, length) == 0;
+    if (!ok)
+    {
+        printf("Stream does not match %s\n", argv[1]);
+        file = fopen("arrow_ipc_test.out", "wb");
+        fwrite(stream, 1, length, file);
+        fclose(file);
+    }
+    return ok ? 0 : 1;
+}
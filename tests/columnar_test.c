@@ -0,0 +1,84 @@
+/* Test for columnar framing: every frame is checked against the samples. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "error.h"
+#include "buffered_file.h"
+#include "capture.h"
+#include "columnar.h"
+
+
+#define MAX_SAMPLES     1000
+#define MAX_FIELDS      20
+
+
+static bool check_frame(
+    const uint8_t *frame, size_t frame_length,
+    const enum field_type types[], unsigned int field_count,
+    unsigned int sample_count, const uint8_t *samples, size_t stride)
+{
+    uint32_t header[4];
+    memcpy(header, frame, sizeof(header));
+    if (memcmp(frame, "COL ", 4) != 0  ||  header[1] != frame_length  ||
+        header[2] != sample_count  ||  header[3] != field_count)
+        return false;
+
+    size_t field_offset = 0;
+    for (unsigned int i = 0; i < field_count; i ++)
+    {
+        uint32_t entry[4];
+        memcpy(entry, frame + 16 + 16 * i, sizeof(entry));
+        unsigned int width = FIELD_TYPE_WIDTH(types[i]);
+        if (entry[0] != i  ||  entry[1] != types[i]  ||
+            entry[2] != sample_count  ||  entry[3] % 8 != 0  ||
+            entry[3] + sample_count * width > frame_length)
+            return false;
+
+        for (unsigned int j = 0; j < sample_count; j ++)
+            if (memcmp(frame + entry[3] + j * width,
+                    samples + j * stride + field_offset, width) != 0)
+                return false;
+        field_offset += width;
+    }
+    return true;
+}
+
+
+int main(void)
+{
+    static uint8_t samples[MAX_SAMPLES * MAX_FIELDS * 8];
+    static uint64_t frame[COLUMNAR_FRAME_MAX_LENGTH(
+        MAX_FIELDS, MAX_SAMPLES, MAX_FIELDS * 8) / 8];
+    for (size_t i = 0; i < sizeof(samples); i ++)
+        samples[i] = (uint8_t) rand();
+
+    bool ok = true;
+    for (unsigned int test = 0; ok  &&  test < 1000; test ++)
+    {
+        unsigned int field_count = 1 + (unsigned int) rand() % MAX_FIELDS;
+        unsigned int sample_count = (unsigned int) rand() % MAX_SAMPLES;
+        enum field_type types[MAX_FIELDS];
+        size_t stride = 0;
+        for (unsigned int i = 0; i < field_count; i ++)
+        {
+            types[i] = (enum field_type) (rand() % 4);
+            stride += FIELD_TYPE_WIDTH(types[i]);
+        }
+
+        size_t length = columnar_encode_frame(
+            types, field_count, sample_count, samples, frame);
+        ok = length <= COLUMNAR_FRAME_MAX_LENGTH(
+                field_count, sample_count, stride)  &&
+            check_frame((const uint8_t *) frame, length,
+                types, field_count, sample_count, samples, stride);
+        if (!ok)
+            printf("Frame check failed: %u fields, %u samples\n",
+                field_count, sample_count);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+/* Round trip test for delta compression. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "delta_codec.h"
+
+
+#define MAX_SAMPLES     4096
+#define FIELD_COUNT     5
+
+static const unsigned int widths[FIELD_COUNT] = { 4, 8, 4, 8, 4 };
+#define SAMPLE_LENGTH   28
+
+
+static uint64_t random_uint64(void)
+{
+    uint64_t result = 0;
+    for (int i = 0; i < 4; i ++)
+        result = result << 16 ^ (uint64_t) (rand() & 0xFFFF);
+    return result;
+}
+
+
+/* Fills the samples with a mixture of slowly changing and random fields,
+ * including full range jumps to exercise wrap around. */
+static void fill_samples(uint8_t *samples, unsigned int count, int step)
+{
+    uint64_t position = random_uint64();
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        position += (uint64_t) (rand() % (2 * step + 1) - step);
+        uint32_t counter = (uint32_t) i;
+        uint64_t noise = random_uint64();
+        uint32_t extreme = rand() & 1 ? 0x80000000 : 0x7FFFFFFF;
+        uint64_t timestamp = 1000 * (uint64_t) i;
+
+        uint8_t *sample = samples + i * SAMPLE_LENGTH;
+        uint32_t position32 = (uint32_t) position;
+        memcpy(sample, &position32, 4);
+        memcpy(sample + 4, &noise, 8);
+        memcpy(sample + 12, &counter, 4);
+        memcpy(sample + 16, &timestamp, 8);
+        memcpy(sample + 24, &extreme, 4);
+    }
+}
+
+
+static uint64_t unzigzag(uint64_t value)
+{
+    return (value >> 1) ^ -(value & 1);
+}
+
+
+/* Independent decoder following the format description. */
+static bool decode_frame(
+    const uint8_t *frame, size_t frame_length, uint8_t *samples)
+{
+    uint32_t header[4];
+    memcpy(header, frame, sizeof(header));
+    if (memcmp(frame, "CMP ", 4) != 0  ||  header[1] != frame_length  ||
+        header[3] != FIELD_COUNT)
+        return false;
+    unsigned int sample_count = header[2];
+
+    const uint8_t *column = frame + DELTA_FRAME_HEADER_LENGTH;
+    size_t offset = 0;
+    for (unsigned int field = 0; field < FIELD_COUNT; field ++)
+    {
+        unsigned int encoding = column[0];
+        unsigned int bits = column[1];
+        uint32_t length;
+        memcpy(&length, column + 2, 4);
+        const uint8_t *data = column + DELTA_COLUMN_HEADER_LENGTH;
+
+        uint64_t value = 0;
+        size_t bit = 0;
+        for (unsigned int i = 0; i < sample_count; i ++)
+        {
+            uint64_t delta = 0;
+            if (encoding == DELTA_ENCODING_VARINT)
+            {
+                unsigned int shift = 0;
+                uint8_t byte;
+                do {
+                    byte = *data++;
+                    delta |= (uint64_t) (byte & 0x7F) << shift;
+                    shift += 7;
+                } while (byte & 0x80);
+            }
+            else
+                for (unsigned int j = 0; j < bits; j ++, bit ++)
+                    delta |= (uint64_t) ((data[bit / 8] >> (bit % 8)) & 1) << j;
+            value += unzigzag(delta);
+            memcpy(samples + i * SAMPLE_LENGTH + offset,
+                &value, widths[field]);
+        }
+        column += DELTA_COLUMN_HEADER_LENGTH + length;
+        offset += widths[field];
+    }
+    return (size_t) (column - frame) == frame_length;
+}
+
+
+static bool test_round_trip(unsigned int count, int step, double *ratio)
+{
+    static uint8_t samples[MAX_SAMPLES * SAMPLE_LENGTH];
+    static uint8_t decoded[MAX_SAMPLES * SAMPLE_LENGTH];
+    static uint8_t frame[DELTA_FRAME_MAX_LENGTH(
+        FIELD_COUNT, MAX_SAMPLES, SAMPLE_LENGTH)];
+
+    fill_samples(samples, count, step);
+    size_t length = delta_encode_frame(
+        widths, FIELD_COUNT, count, samples, frame);
+    *ratio = (double) length / (count * SAMPLE_LENGTH + 1);
+    return
+        length <= DELTA_FRAME_MAX_LENGTH(FIELD_COUNT, count, SAMPLE_LENGTH)  &&
+        decode_frame(frame, length, decoded)  &&
+        memcmp(samples, decoded, count * SAMPLE_LENGTH) == 0;
+}
+
+
+int main(void)
+{
+    bool ok = true;
+    double ratio;
+    for (unsigned int i = 0; ok  &&  i < 1000; i ++)
+    {
+        unsigned int count = (unsigned int) rand() % MAX_SAMPLES;
+        int step = 1 << (rand() % 20);
+        ok = test_round_trip(count, step, &ratio);
+        if (!ok)
+            printf("Round trip failed: %u samples, step %d\n", count, step);
+    }
+
+    if (ok)
+    {
+        ok = test_round_trip(MAX_SAMPLES, 16, &ratio);
+        printf("Compressed to %.1f%%\n", 100 * ratio);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/* Test for field selection: a small captured field set is checked against a
+ * variety of field lists, including lists naming fields which aren't
+ * captured. */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "field_select.h"
+
+
+#define MAX_ENTRIES     16
+
+
+/* The captured fields, as field name and capture. */
+static const char *captured[][2] = {
+    { "INENC1.VAL", "Value", },
+    { "INENC1.VAL", "Diff", },
+    { "PCAP.TS_TRIG", "Value", },
+    { "PCAP.SAMPLES", "Value", },
+    { "COUNTER1.OUT", "Max", },
+};
+#define CAPTURED_COUNT  (sizeof(captured) / sizeof(captured[0]))
+
+
+/* Checks that the field list is accepted or rejected as expected, that it
+ * selects the expected fields, given as a string of 0 and 1 flags, and that
+ * the unmatched entries are reported. */
+static bool test_field_list(
+    const char *field_list, bool valid,
+    const char *expected, const char *expected_unmatched)
+{
+    if (check_field_list(field_list) != valid)
+    {
+        printf("\"%s\" should be %s\n",
+            field_list, valid ? "valid" : "invalid");
+        return false;
+    }
+    else if (!valid)
+        return true;
+
+    bool matched[MAX_ENTRIES] = { false, };
+    char selected[CAPTURED_COUNT + 1];
+    for (unsigned int i = 0; i < CAPTURED_COUNT; i ++)
+        selected[i] = select_field(
+            field_list, captured[i][0], captured[i][1], matched) ? '1' : '0';
+    selected[CAPTURED_COUNT] = '\0';
+
+    char unmatched[64];
+    unsigned int unmatched_count = format_unmatched_entries(
+        field_list, matched, unmatched, sizeof(unmatched));
+    bool ok =
+        strcmp(selected, expected) == 0  &&
+        strcmp(unmatched, expected_unmatched) == 0  &&
+        (unmatched_count == 0) == (*expected_unmatched == '\0');
+    if (!ok)
+        printf("\"%s\": selected %s unmatched \"%s\" (%u), "
+            "expected %s \"%s\"\n", field_list, selected,
+            unmatched, unmatched_count, expected, expected_unmatched);
+    return ok;
+}
+
+
+int main(void)
+{
+    bool ok = true;
+
+    /* Selection by name and by name and capture. */
+    ok = test_field_list("INENC1.VAL", true, "11000", "")  &&  ok;
+    ok = test_field_list("INENC1.VAL.Diff", true, "01000", "")  &&  ok;
+    ok = test_field_list(
+        "PCAP.TS_TRIG,INENC1.VAL.Value", true, "10100", "")  &&  ok;
+    ok = test_field_list(
+        "COUNTER1.OUT.Max,PCAP.SAMPLES,INENC1.VAL", true, "11011", "")  &&  ok;
+
+    /* Names which are prefixes of other names don't match. */
+    ok = test_field_list("INENC1", true, "00000", "INENC1")  &&  ok;
+    ok = test_field_list("PCAP.TS", true, "00000", "PCAP.TS")  &&  ok;
+    ok = test_field_list("INENC1.VAL.Val", true, "00000", "INENC1.VAL.Val")  &&
+        ok;
+
+    /* Misspelt and uncaptured fields are reported, in order. */
+    ok = test_field_list(
+        "INENC1.VAL,INENC2.VAL,PCAP.TS_TRIGG", true,
+        "11000", "INENC2.VAL,PCAP.TS_TRIGG")  &&  ok;
+    ok = test_field_list(
+        "COUNTER1.OUT.Min", true, "00000", "COUNTER1.OUT.Min")  &&  ok;
+
+    /* Entries matching the same field are all counted as matched. */
+    ok = test_field_list(
+        "INENC1.VAL,INENC1.VAL.Value", true, "11000", "")  &&  ok;
+
+    /* Empty entries are rejected. */
+    ok = test_field_list("", false, "", "")  &&  ok;
+    ok = test_field_list(",INENC1.VAL", false, "", "")  &&  ok;
+    ok = test_field_list("INENC1.VAL,", false, "", "")  &&  ok;
+    ok = test_field_list("INENC1.VAL,,PCAP.SAMPLES", false, "", "")  &&  ok;
+
+    /* Check counting of entries. */
+    ok = count_field_entries("A,B.C,D") == 3  &&  ok;
+
+    /* A long list of unmatched entries is truncated. */
+    char unmatched[8];
+    bool matched[MAX_ENTRIES] = { false, };
+    ok = format_unmatched_entries(
+        "ABC,DEF,GHI", matched, unmatched, sizeof(unmatched)) == 3  &&
+        strcmp(unmatched, "ABC,DEF") == 0  &&  ok;
+
+    return ok ? 0 : 1;
+}
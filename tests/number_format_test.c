@@ -0,0 +1,116 @@
+/* Simple tester for number formatting. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "number_format.h"
+
+
+#define TEST_COUNT      200000
+
+
+static uint64_t random_uint64(void)
+{
+    uint64_t result = 0;
+    for (int i = 0; i < 4; i ++)
+        result = result << 16 ^ (uint64_t) (rand() & 0xFFFF);
+    return result;
+}
+
+
+/* Compares the given formatted string with the expected result. */
+static bool check_result(
+    const char *expected, const char *start, const char *end)
+{
+    size_t length = (size_t) (end - start);
+    if (length != strlen(expected)  ||  memcmp(expected, start, length) != 0)
+    {
+        printf("\"%.*s\" != \"%s\"\n", (int) length, start, expected);
+        return false;
+    }
+    else
+        return true;
+}
+
+
+static bool test_integers(uint64_t value)
+{
+    char expected[MAX_NUMBER_LENGTH];
+    char result[MAX_NUMBER_LENGTH];
+    bool ok = true;
+
+    sprintf(expected, "%"PRIu32, (uint32_t) value);
+    ok = check_result(expected, result,
+        format_uint32(result, (uint32_t) value))  &&  ok;
+    sprintf(expected, "%"PRIi32, (int32_t) value);
+    ok = check_result(expected, result,
+        format_int32(result, (int32_t) value))  &&  ok;
+    sprintf(expected, "%"PRIu64, value);
+    ok = check_result(expected, result, format_uint64(result, value))  &&  ok;
+    sprintf(expected, "%"PRIi64, (int64_t) value);
+    ok = check_result(expected, result,
+        format_int64(result, (int64_t) value))  &&  ok;
+    return ok;
+}
+
+
+static bool test_double(double value)
+{
+    char expected[MAX_NUMBER_LENGTH];
+    char result[MAX_NUMBER_LENGTH];
+    sprintf(expected, "%.10g", value);
+    return check_result(expected, result, format_double_g10(result, value));
+}
+
+
+int main(int argc, const char **argv)
+{
+    srand(argc > 1 ? (unsigned int) atoi(argv[1]) : 1);
+    bool ok = true;
+
+    /* Integer edge cases and random values of all sizes. */
+    uint64_t edges[] = {
+        0, 1, 9, 10, 99, 100, 4294967295U, 4294967296U,
+        99999999, 100000000, 9999999999, 10000000000,
+        INT64_MAX, (uint64_t) INT64_MIN, UINT64_MAX, };
+    for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i ++)
+        ok = test_integers(edges[i])  &&  test_integers(-edges[i])  &&  ok;
+    for (int i = 0; i < TEST_COUNT; i ++)
+        ok = test_integers(random_uint64() >> (rand() % 64))  &&  ok;
+
+    /* Double edge cases. */
+    double doubles[] = {
+        0, -0.0, 1, -1, 0.5, 0.1, 1e-4, 1e-5, 9.9999999995e-5, 123456789,
+        1234567890, 12345678901, 9999999999.5, 9999999999.4, 1e10, 1e100,
+        1e-100, 0.12345678905, 2.5e-308, 4.9e-324, 1.7976931348623157e308,
+        INFINITY, -INFINITY, NAN, 8e-9, 123.0 * 3 + 0.5, };
+    for (size_t i = 0; i < sizeof(doubles) / sizeof(doubles[0]); i ++)
+        ok = test_double(doubles[i])  &&  test_double(-doubles[i])  &&  ok;
+
+    for (int i = 0; i < TEST_COUNT; i ++)
+    {
+        /* Arbitrary bit patterns cover the whole range of doubles. */
+        uint64_t bits = random_uint64();
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        ok = test_double(value)  &&  ok;
+
+        /* Typical scaled capture values. */
+        int64_t integer = (int64_t) random_uint64() >> (rand() % 64);
+        ok = test_double((double) integer * 8e-9)  &&  ok;
+        ok = test_double((double) integer / (1 + rand() % 1000) + 0.5)  &&  ok;
+        ok = test_double((double) (integer % 100000000))  &&  ok;
+
+        /* Values with exactly ten and eleven significant digits exercise
+         * rounding and halfway cases. */
+        double digits = (double) (random_uint64() % 90000000000U + 10000000000U);
+        ok = test_double(digits * pow(10, rand() % 40 - 25))  &&  ok;
+        ok = test_double(digits / 10 * pow(10, rand() % 40 - 25))  &&  ok;
+    }
+    return ok ? 0 : 1;
+}
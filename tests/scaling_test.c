@@ -0,0 +1,195 @@
+/* Simple tester for scaled data conversion. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "scaling.h"
+
+
+#define MAX_FIELDS      12
+#define MAX_SAMPLES     9
+#define TEST_COUNT      2000
+
+/* Marker written to the output buffer to detect overwriting. */
+#define GUARD           0xA5
+
+
+static uint32_t random_word(void)
+{
+    return (uint32_t) rand() ^ ((uint32_t) rand() << 16);
+}
+
+static int64_t random_int64(void)
+{
+    return (int64_t) ((uint64_t) random_word() << 32 | random_word());
+}
+
+static double random_double(void)
+{
+    return (double) rand() / RAND_MAX * 200.0 - 100.0;
+}
+
+
+/* Reads a possibly misaligned value from a raw sample. */
+static int32_t read_int32(const uint32_t *input, size_t index)
+{
+    return (int32_t) input[index];
+}
+
+static int64_t read_int64(const uint32_t *input, size_t index)
+{
+    int64_t result;
+    memcpy(&result, &input[index], sizeof(result));
+    return result;
+}
+
+static double read_double(const char *output, size_t offset)
+{
+    double result;
+    memcpy(&result, output + offset, sizeof(result));
+    return result;
+}
+
+
+/* Checks a single randomly generated layout against the reference formulae,
+ * which are the formulae originally used by the capture conversion. */
+static bool run_test(int test)
+{
+    size_t unscaled = (size_t) rand() % 3;
+    size_t count32 = (size_t) rand() % MAX_FIELDS;
+    size_t count64 = (size_t) rand() % MAX_FIELDS;
+    size_t averaged = (size_t) rand() % MAX_FIELDS;
+    unsigned int sample_count = (unsigned int) rand() % MAX_SAMPLES;
+
+    /* Sample count goes in a hidden field at the start when averaging. */
+    size_t hidden = averaged > 0 ? 1 : 0;
+    size_t scaled32_index = hidden + unscaled;
+    size_t scaled64_index = scaled32_index + count32;
+    size_t averaged_index = scaled64_index + 2 * count64;
+    size_t raw_sample_words = averaged_index + 2 * averaged;
+    size_t output_offset = sizeof(uint32_t) * unscaled;
+    size_t output_length =
+        output_offset + sizeof(double) * (count32 + count64 + averaged);
+
+    double scale[3 * MAX_FIELDS];
+    double offset[3 * MAX_FIELDS];
+    for (size_t i = 0; i < 3 * MAX_FIELDS; i ++)
+    {
+        scale[i] = random_double();
+        offset[i] = random_double();
+    }
+
+    struct scaled_layout layout = {
+        .raw_sample_words = raw_sample_words,
+        .output_length = output_length,
+        .output_offset = output_offset,
+        .sample_count_index = 0,
+        .scaled32 = { scaled32_index, count32, &scale[0], &offset[0], },
+        .scaled64 = {
+            scaled64_index, count64,
+            &scale[MAX_FIELDS], &offset[MAX_FIELDS], },
+        .averaged = {
+            averaged_index, averaged,
+            &scale[2 * MAX_FIELDS], &offset[2 * MAX_FIELDS], },
+    };
+
+    uint32_t input[MAX_SAMPLES * (1 + 2 + 5 * MAX_FIELDS)];
+    for (size_t i = 0; i < sample_count * raw_sample_words; i ++)
+        input[i] = random_word();
+    for (unsigned int s = 0; s < sample_count; s ++)
+    {
+        uint32_t *sample = &input[s * raw_sample_words];
+        if (hidden)
+            /* Include zero sample counts, which are treated as one. */
+            sample[0] = (uint32_t) rand() % 4 == 0 ? 0 : random_word() >> 8;
+        for (size_t i = 0; i < averaged; i ++)
+        {
+            /* Keep the sums in a realistic range. */
+            int64_t sum = random_int64() >> 16;
+            memcpy(&sample[averaged_index + 2 * i], &sum, sizeof(sum));
+        }
+    }
+
+    char output[MAX_SAMPLES * 3 * MAX_FIELDS * sizeof(double) + 16];
+    memset(output, GUARD, sizeof(output));
+    convert_scaled_samples(&layout, sample_count, input, output);
+
+    bool ok = true;
+    for (unsigned int s = 0; s < sample_count; s ++)
+    {
+        const uint32_t *sample = &input[s * raw_sample_words];
+        const char *result = &output[s * output_length];
+
+        for (size_t i = 0; i < output_offset; i ++)
+            if ((unsigned char) result[i] != GUARD)
+                ok = false;
+
+        size_t out = output_offset;
+        for (size_t i = 0; i < count32; i ++, out += sizeof(double))
+        {
+            double expected =
+                scale[i] * read_int32(sample, scaled32_index + i) + offset[i];
+            if (read_double(result, out) != expected)
+                ok = false;
+        }
+        for (size_t i = 0; i < count64; i ++, out += sizeof(double))
+        {
+            double expected =
+                scale[MAX_FIELDS + i] *
+                    (double) read_int64(sample, scaled64_index + 2 * i) +
+                offset[MAX_FIELDS + i];
+            if (read_double(result, out) != expected)
+                ok = false;
+        }
+
+        uint32_t samples = sample[0] == 0 ? 1 : sample[0];
+        for (size_t i = 0; i < averaged; i ++, out += sizeof(double))
+        {
+            double scaled =
+                scale[2 * MAX_FIELDS + i] *
+                (double) read_int64(sample, averaged_index + 2 * i) / samples;
+            double expected = scaled + offset[2 * MAX_FIELDS + i];
+            /* Multiplying by the reciprocal is allowed to differ from true
+             * division by a few units in the last place. */
+            double tolerance =
+                4 * DBL_EPSILON *
+                (fabs(scaled) + fabs(offset[2 * MAX_FIELDS + i]));
+            if (fabs(read_double(result, out) - expected) > tolerance)
+                ok = false;
+            /* All kernels must agree exactly with the documented reciprocal
+             * calculation. */
+            double exact =
+                scale[2 * MAX_FIELDS + i] *
+                    (double) read_int64(sample, averaged_index + 2 * i) *
+                    (1.0 / samples) +
+                offset[2 * MAX_FIELDS + i];
+            if (read_double(result, out) != exact)
+                ok = false;
+        }
+    }
+    for (size_t i = sample_count * output_length; i < sizeof(output); i ++)
+        if ((unsigned char) output[i] != GUARD)
+            ok = false;
+
+    if (!ok)
+        printf("Test %d: %zu %zu %zu %zu x %u samples failed\n",
+            test, unscaled, count32, count64, averaged, sample_count);
+    return ok;
+}
+
+
+int main(int argc, const char **argv)
+{
+    srand(argc > 1 ? (unsigned int) atoi(argv[1]) : 1);
+    bool ok = true;
+    for (int i = 0; i < TEST_COUNT; i ++)
+        ok = run_test(i)  &&  ok;
+    printf("Scaling kernel: %s\n", scaling_kernel_name());
+    return ok ? 0 : 1;
+}